@@ -41,6 +41,8 @@
 
 #include "mate-settings-manager.h"
 #include "mate-settings-profile.h"
+#include "mate-settings-watchdog.h"
+#include "mate-settings-event-router.h"
 
 #include <libmate-desktop/mate-gsettings.h>
 
@@ -59,6 +61,9 @@ static gboolean   no_daemon    = TRUE;
 static gboolean   replace      = FALSE;
 static gboolean   debug        = FALSE;
 static gboolean   do_timed_exit = FALSE;
+static int        stall_threshold = 250;
+static gboolean   log_stalls   = FALSE;
+static gboolean   sample_stalls = FALSE;
 static int        term_signal_pipe_fds[2];
 
 static GOptionEntry entries[] = {
@@ -66,6 +71,9 @@ static GOptionEntry entries[] = {
         { "replace", 0, 0, G_OPTION_ARG_NONE, &replace, N_("Replace the current daemon"), NULL },
         { "no-daemon", 0, G_OPTION_FLAG_HIDDEN, G_OPTION_ARG_NONE, &no_daemon, N_("Don't become a daemon"), NULL },
         { "timed-exit", 0, 0, G_OPTION_ARG_NONE, &do_timed_exit, N_("Exit after a time (for debugging)"), NULL },
+        { "stall-threshold", 0, 0, G_OPTION_ARG_INT, &stall_threshold, N_("Report main loop iterations longer than this many milliseconds (0 to disable)"), N_("MS") },
+        { "log-stalls", 0, 0, G_OPTION_ARG_NONE, &log_stalls, N_("Write main loop stalls to the system log"), NULL },
+        { "sample-stalls", 0, 0, G_OPTION_ARG_NONE, &sample_stalls, N_("Interrupt a stalled main loop to find the source and stack responsible (for debugging)"), NULL },
         { NULL }
 };
 
@@ -499,6 +507,8 @@ main (int argc, char *argv[])
 
         g_log_set_default_handler (msd_log_default_handler, NULL);
 
+        mate_settings_watchdog_start (MAX (stall_threshold, 0), log_stalls, sample_stalls);
+
         bus = get_session_bus ();
         if (bus == NULL) {
                 g_warning ("Could not get a connection to the bus");
@@ -566,6 +576,9 @@ main (int argc, char *argv[])
                 g_object_unref (debug_settings);
         }
 
+        mate_settings_event_router_dump_stats ();
+        mate_settings_watchdog_stop ();
+
 #ifdef HAVE_LIBNOTIFY
         if (notify_is_initted ())
             notify_uninit ();
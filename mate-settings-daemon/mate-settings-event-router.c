@@ -0,0 +1,343 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*-
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+/* Plugins used to install their own GDK filters, so every X event went
+ * through every plugin's filter just to be thrown away by a type check.
+ * The router installs a single filter and hands each event only to the
+ * subscribers registered for its type, XKB subtype, XI2 event or
+ * window, counting what each subscriber received.
+ */
+
+#include "config.h"
+
+#include <gdk/gdkx.h>
+#include <X11/Xlib.h>
+
+#ifdef HAVE_X11_EXTENSIONS_XKB_H
+#include <X11/XKBlib.h>
+#endif
+
+#include "mate-settings-event-router.h"
+
+typedef struct {
+        guint                   id;
+        MateSettingsEventClass  klass;
+        int                     type;
+        Window                  window;
+        MateSettingsEventFunc   func;   /* NULL once removed */
+        gpointer                user_data;
+        char                   *name;
+        guint64                 n_delivered;
+        guint64                 n_consumed;
+} Subscription;
+
+static GHashTable *subscriptions = NULL;        /* id -> Subscription */
+static GHashTable *by_type = NULL;              /* (class, type) -> GPtrArray */
+static GHashTable *by_window = NULL;            /* Window -> GPtrArray */
+static guint       next_id = 1;
+
+/* Removal while dispatching only marks the subscription; the arrays
+ * are swept once the outermost dispatch returns */
+static guint       dispatch_depth = 0;
+static gboolean    need_sweep = FALSE;
+
+static int         xkb_event_base = -1;
+static int         xi_opcode = -1;
+
+static guint64     n_events = 0;
+static guint64     n_routed = 0;
+
+static gpointer
+pack_key (MateSettingsEventClass klass,
+          int                    type)
+{
+        return GUINT_TO_POINTER (((guint) klass << 16) | ((guint) type & 0xffff));
+}
+
+static void
+subscription_free (Subscription *sub)
+{
+        g_debug ("Event router: '%s' received %" G_GUINT64_FORMAT " events, consumed %" G_GUINT64_FORMAT,
+                 sub->name, sub->n_delivered, sub->n_consumed);
+
+        g_free (sub->name);
+        g_free (sub);
+}
+
+/* Any-type subscriptions for one window are indexed by the window,
+ * everything else by class and type */
+static GHashTable *
+subscription_table (Subscription *sub,
+                    gpointer     *key)
+{
+        if (sub->klass == MATE_SETTINGS_EVENT_X &&
+            sub->type == MATE_SETTINGS_EVENT_ANY_TYPE &&
+            sub->window != None) {
+                *key = GUINT_TO_POINTER (sub->window);
+                return by_window;
+        }
+
+        *key = pack_key (sub->klass, sub->type);
+        return by_type;
+}
+
+static void
+sweep_table (GHashTable *table)
+{
+        GHashTableIter iter;
+        GPtrArray     *array;
+        guint          i;
+
+        g_hash_table_iter_init (&iter, table);
+        while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &array)) {
+                for (i = 0; i < array->len; ) {
+                        Subscription *sub = g_ptr_array_index (array, i);
+
+                        if (sub->func == NULL) {
+                                g_ptr_array_remove_index (array, i);
+                                subscription_free (sub);
+                        } else {
+                                i++;
+                        }
+                }
+
+                if (array->len == 0)
+                        g_hash_table_iter_remove (&iter);
+        }
+}
+
+static GdkFilterReturn
+deliver (GPtrArray *array,
+         XEvent    *xev,
+         gboolean  *routed)
+{
+        GdkFilterReturn ret;
+        guint           i;
+
+        if (array == NULL)
+                return GDK_FILTER_CONTINUE;
+
+        /* Subscribers may add to the array from their callback, so
+         * check the length on every pass */
+        for (i = 0; i < array->len; i++) {
+                Subscription *sub = g_ptr_array_index (array, i);
+
+                if (sub->func == NULL)
+                        continue;
+
+                if (sub->klass == MATE_SETTINGS_EVENT_X &&
+                    sub->window != None &&
+                    sub->window != xev->xany.window)
+                        continue;
+
+                *routed = TRUE;
+                sub->n_delivered++;
+
+                ret = sub->func (xev, sub->user_data);
+                if (ret != GDK_FILTER_CONTINUE) {
+                        sub->n_consumed++;
+                        return ret;
+                }
+        }
+
+        return GDK_FILTER_CONTINUE;
+}
+
+static GdkFilterReturn
+deliver_class (MateSettingsEventClass  klass,
+               int                     type,
+               XEvent                 *xev,
+               gboolean               *routed)
+{
+        GdkFilterReturn ret;
+
+        ret = deliver (g_hash_table_lookup (by_type, pack_key (klass, type)), xev, routed);
+        if (ret == GDK_FILTER_CONTINUE)
+                ret = deliver (g_hash_table_lookup (by_type, pack_key (klass, MATE_SETTINGS_EVENT_ANY_TYPE)), xev, routed);
+
+        return ret;
+}
+
+static GdkFilterReturn
+router_filter (GdkXEvent *xevent,
+               GdkEvent  *event,
+               gpointer   data)
+{
+        XEvent         *xev = (XEvent *) xevent;
+        GdkFilterReturn ret;
+        gboolean        routed = FALSE;
+
+        if (g_hash_table_size (subscriptions) == 0)
+                return GDK_FILTER_CONTINUE;
+
+        n_events++;
+        dispatch_depth++;
+
+        ret = deliver_class (MATE_SETTINGS_EVENT_X, xev->type, xev, &routed);
+
+        if (ret == GDK_FILTER_CONTINUE && g_hash_table_size (by_window) > 0)
+                ret = deliver (g_hash_table_lookup (by_window, GUINT_TO_POINTER (xev->xany.window)),
+                               xev, &routed);
+
+#ifdef HAVE_X11_EXTENSIONS_XKB_H
+        if (ret == GDK_FILTER_CONTINUE && xev->type == xkb_event_base)
+                ret = deliver_class (MATE_SETTINGS_EVENT_XKB, ((XkbAnyEvent *) xev)->xkb_type,
+                                     xev, &routed);
+#endif
+
+        /* GDK has already fetched the cookie data before running filters */
+        if (ret == GDK_FILTER_CONTINUE &&
+            xev->type == GenericEvent &&
+            xev->xcookie.extension == xi_opcode)
+                ret = deliver_class (MATE_SETTINGS_EVENT_XI2, xev->xcookie.evtype, xev, &routed);
+
+        if (routed)
+                n_routed++;
+
+        if (--dispatch_depth == 0 && need_sweep) {
+                sweep_table (by_type);
+                sweep_table (by_window);
+                need_sweep = FALSE;
+        }
+
+        return ret;
+}
+
+static void
+router_init (void)
+{
+        Display *display;
+        int      opcode, event, error;
+
+        subscriptions = g_hash_table_new (g_direct_hash, g_direct_equal);
+        by_type = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+                                         NULL, (GDestroyNotify) g_ptr_array_unref);
+        by_window = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+                                           NULL, (GDestroyNotify) g_ptr_array_unref);
+
+        display = gdk_x11_get_default_xdisplay ();
+
+        if (XQueryExtension (display, "XKEYBOARD", &opcode, &event, &error))
+                xkb_event_base = event;
+        if (XQueryExtension (display, "XInputExtension", &opcode, &event, &error))
+                xi_opcode = opcode;
+
+        gdk_window_add_filter (NULL, router_filter, NULL);
+}
+
+/**
+ * mate_settings_event_router_add:
+ * @klass: how @type is to be interpreted
+ * @type: the event type, or MATE_SETTINGS_EVENT_ANY_TYPE
+ * @window: only deliver events for this window, or None for any; only
+ *   honoured for MATE_SETTINGS_EVENT_X
+ * @func: called with each matching event
+ * @user_data: passed to @func
+ * @name: label used in the statistics
+ *
+ * Returns: an id for mate_settings_event_router_remove()
+ */
+guint
+mate_settings_event_router_add (MateSettingsEventClass  klass,
+                                int                     type,
+                                Window                  window,
+                                MateSettingsEventFunc   func,
+                                gpointer                user_data,
+                                const char             *name)
+{
+        Subscription *sub;
+        GHashTable   *table;
+        gpointer      key;
+        GPtrArray    *array;
+
+        g_return_val_if_fail (func != NULL, 0);
+
+        if (subscriptions == NULL)
+                router_init ();
+
+        sub = g_new0 (Subscription, 1);
+        sub->id = next_id++;
+        sub->klass = klass;
+        sub->type = type;
+        sub->window = klass == MATE_SETTINGS_EVENT_X ? window : None;
+        sub->func = func;
+        sub->user_data = user_data;
+        sub->name = g_strdup (name ? name : "unnamed");
+
+        table = subscription_table (sub, &key);
+        array = g_hash_table_lookup (table, key);
+        if (array == NULL) {
+                array = g_ptr_array_new ();
+                g_hash_table_insert (table, key, array);
+        }
+        g_ptr_array_add (array, sub);
+        g_hash_table_insert (subscriptions, GUINT_TO_POINTER (sub->id), sub);
+
+        return sub->id;
+}
+
+void
+mate_settings_event_router_remove (guint id)
+{
+        Subscription *sub;
+        GHashTable   *table;
+        gpointer      key;
+        GPtrArray    *array;
+
+        if (subscriptions == NULL || id == 0)
+                return;
+
+        sub = g_hash_table_lookup (subscriptions, GUINT_TO_POINTER (id));
+        if (sub == NULL)
+                return;
+
+        g_hash_table_remove (subscriptions, GUINT_TO_POINTER (id));
+
+        if (dispatch_depth > 0) {
+                sub->func = NULL;
+                need_sweep = TRUE;
+                return;
+        }
+
+        table = subscription_table (sub, &key);
+        array = g_hash_table_lookup (table, key);
+        g_ptr_array_remove (array, sub);
+        if (array->len == 0)
+                g_hash_table_remove (table, key);
+
+        subscription_free (sub);
+}
+
+void
+mate_settings_event_router_dump_stats (void)
+{
+        GHashTableIter iter;
+        Subscription  *sub;
+
+        if (subscriptions == NULL)
+                return;
+
+        g_debug ("Event router: %" G_GUINT64_FORMAT " events, %" G_GUINT64_FORMAT " routed to a subscriber",
+                 n_events, n_routed);
+
+        g_hash_table_iter_init (&iter, subscriptions);
+        while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &sub)) {
+                g_debug ("Event router:   '%s' received %" G_GUINT64_FORMAT " events, consumed %" G_GUINT64_FORMAT,
+                         sub->name, sub->n_delivered, sub->n_consumed);
+        }
+}
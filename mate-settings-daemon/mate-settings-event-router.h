@@ -0,0 +1,56 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*-
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+#ifndef __MATE_SETTINGS_EVENT_ROUTER_H
+#define __MATE_SETTINGS_EVENT_ROUTER_H
+
+#include <glib.h>
+#include <gdk/gdk.h>
+#include <X11/Xlib.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum {
+        MATE_SETTINGS_EVENT_X,          /* XEvent type, core or extension */
+        MATE_SETTINGS_EVENT_XKB,        /* XkbAnyEvent xkb_type */
+        MATE_SETTINGS_EVENT_XI2         /* XGenericEventCookie evtype */
+} MateSettingsEventClass;
+
+/* Matches every type of the class.  With MATE_SETTINGS_EVENT_X and a
+ * window this subscribes to everything delivered to that window. */
+#define MATE_SETTINGS_EVENT_ANY_TYPE (-1)
+
+typedef GdkFilterReturn (* MateSettingsEventFunc) (XEvent   *xevent,
+                                                   gpointer  user_data);
+
+guint           mate_settings_event_router_add         (MateSettingsEventClass  klass,
+                                                        int                     type,
+                                                        Window                  window,
+                                                        MateSettingsEventFunc   func,
+                                                        gpointer                user_data,
+                                                        const char             *name);
+void            mate_settings_event_router_remove      (guint                   id);
+void            mate_settings_event_router_dump_stats  (void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __MATE_SETTINGS_EVENT_ROUTER_H */
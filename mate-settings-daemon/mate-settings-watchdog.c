@@ -0,0 +1,647 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*-
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+/* Every plugin runs on the default main context, so one blocking
+ * callback freezes all of them.  The watchdog wraps the context's poll
+ * function to learn when each main loop iteration starts and ends: the
+ * time between leaving poll() and entering it again is what the
+ * iteration spent in prepare/check/dispatch.  Those durations feed a
+ * histogram.  A helper thread, asleep while the loop is idle, wakes once
+ * an iteration has been running for longer than the threshold and
+ * records the stall.
+ *
+ * Telling which source is responsible means interrupting the main
+ * thread with a signal, which can make a plugin's poll() or sleep return
+ * early with EINTR.  That is only done when asked for, with
+ * --sample-stalls.
+ */
+
+#include "config.h"
+
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#ifdef HAVE_EXECINFO_H
+#include <execinfo.h>
+#endif
+
+#include <glib.h>
+#include <gio/gio.h>
+
+#include "mate-settings-watchdog.h"
+
+#define MSD_DBUS_NAME "org.mate.SettingsDaemon"
+#define MSD_DBUS_PATH "/org/mate/SettingsDaemon"
+
+#define MSD_WATCHDOG_DBUS_NAME MSD_DBUS_NAME ".Watchdog"
+#define MSD_WATCHDOG_DBUS_PATH MSD_DBUS_PATH "/Watchdog"
+
+/* Dispatch times are bucketed by powers of two: <1ms, <2ms ... <1024ms,
+ * and everything longer in the last bucket */
+#define N_BUCKETS  12
+#define N_STALLS   16
+#define MAX_FRAMES 32
+
+/* Used to interrupt the main thread for a sample; ignored by default,
+ * so a late delivery is harmless */
+#define STALL_SIGNAL SIGURG
+
+#define SOURCE_NAME_LEN 64
+
+static const gchar introspection_xml[] =
+"<node>"
+"  <interface name='org.mate.SettingsDaemon.Watchdog'>"
+"    <property name='StallThreshold' type='u' access='read'/>"
+"    <property name='StallCount' type='u' access='read'/>"
+"    <method name='GetDispatchHistogram'>"
+"      <arg name='bounds' direction='out' type='au'/>"
+"      <arg name='counts' direction='out' type='at'/>"
+"    </method>"
+"    <method name='GetStalls'>"
+"      <arg name='stalls' direction='out' type='a(xussss)'/>"
+"    </method>"
+"    <signal name='Stalled'>"
+"      <arg name='timestamp' type='x'/>"
+"      <arg name='duration' type='u'/>"
+"      <arg name='source' type='s'/>"
+"      <arg name='plugin' type='s'/>"
+"      <arg name='function' type='s'/>"
+"      <arg name='frames' type='s'/>"
+"    </signal>"
+"  </interface>"
+"</node>";
+
+typedef struct {
+        gint64   timestamp;     /* wall clock, µs */
+        guint    duration;      /* ms, 0 while still running */
+        char    *source;        /* the GSource being dispatched */
+        char    *plugin;
+        char    *function;
+        char    *frames;
+        guint64  generation;
+} StallRecord;
+
+typedef struct {
+        GMutex           lock;
+        GCond            cond;
+        GThread         *thread;
+        pthread_t        main_thread;
+        gboolean         running;
+        gboolean         waiting;
+
+        /* Start of the current main loop iteration, 0 while in poll() */
+        gint64           dispatch_start;
+        guint64          generation;
+        gint64           threshold;
+        gboolean         log_stalls;
+        gboolean         sample_stalls;
+        GPollFunc        poll_func;
+
+        guint64          histogram[N_BUCKETS];
+        StallRecord      stalls[N_STALLS];
+        guint            n_stalls;
+
+        GDBusNodeInfo   *introspection_data;
+        GDBusConnection *connection;
+        GCancellable    *cancellable;
+        guint            name_id;
+} Watchdog;
+
+static Watchdog *watchdog = NULL;
+
+/* Filled in by the signal handler on the main thread */
+static void                  *sample_frames[MAX_FRAMES];
+static volatile sig_atomic_t  sample_n_frames;
+static char                   sample_source_name[SOURCE_NAME_LEN];
+static guint                  sample_source_id;
+static volatile gint          sample_done;
+
+/* Only plain memory reads here: the source being dispatched is looked up
+ * through per-thread state primed in mate_settings_watchdog_start(), and
+ * its name and id are read from the struct rather than through getters
+ * that take the context lock.  backtrace() has been called once already,
+ * so it no longer needs to load anything. */
+static void
+stall_signal_handler (int signum)
+{
+        GSource    *source;
+        const char *name;
+        guint       i;
+
+        source = g_main_current_source ();
+        name = source != NULL ? source->name : NULL;
+        sample_source_id = source != NULL ? source->source_id : 0;
+
+        for (i = 0; name != NULL && name[i] != '\0' && i < SOURCE_NAME_LEN - 1; i++)
+                sample_source_name[i] = name[i];
+        sample_source_name[i] = '\0';
+
+#ifdef HAVE_EXECINFO_H
+        sample_n_frames = backtrace (sample_frames, MAX_FRAMES);
+#else
+        sample_n_frames = 0;
+#endif
+        g_atomic_int_set (&sample_done, 1);
+}
+
+static void
+stall_record_clear (StallRecord *record)
+{
+        g_free (record->source);
+        g_free (record->plugin);
+        g_free (record->function);
+        g_free (record->frames);
+        memset (record, 0, sizeof (StallRecord));
+}
+
+/* "/usr/lib/mate-settings-daemon/libmedia-keys.so(func+0x1a) [0x...]" */
+static void
+parse_frame (const char  *symbol,
+             char       **plugin,
+             char       **function)
+{
+        const char *base;
+        const char *paren;
+        const char *end;
+
+        paren = strchr (symbol, '(');
+        if (paren == NULL)
+                return;
+
+        base = g_strrstr_len (symbol, paren - symbol, "/");
+        base = base ? base + 1 : symbol;
+
+        if (g_str_has_prefix (symbol, MATE_SETTINGS_PLUGINDIR "/") &&
+            g_str_has_prefix (base, "lib")) {
+                end = strstr (base, ".so");
+                if (end != NULL && end < paren)
+                        *plugin = g_strndup (base + 3, end - base - 3);
+        }
+
+        end = strpbrk (paren, "+)");
+        if (end != NULL && end > paren + 1)
+                *function = g_strndup (paren + 1, end - paren - 1);
+}
+
+/* Runs on the watchdog thread while the main thread is stuck */
+static void
+capture_stall (StallRecord *record)
+{
+        int i;
+
+        record->timestamp = g_get_real_time ();
+
+        if (!watchdog->sample_stalls)
+                goto out;
+
+        g_atomic_int_set (&sample_done, 0);
+        sample_n_frames = 0;
+        pthread_kill (watchdog->main_thread, STALL_SIGNAL);
+
+        for (i = 0; i < 100 && !g_atomic_int_get (&sample_done); i++)
+                g_usleep (1000);
+
+        if (!g_atomic_int_get (&sample_done))
+                goto out;
+
+        /* Unnamed sources are still told apart by their id */
+        if (sample_source_name[0] != '\0')
+                record->source = g_strdup (sample_source_name);
+        else if (sample_source_id != 0)
+                record->source = g_strdup_printf ("source %u", sample_source_id);
+
+#ifdef HAVE_EXECINFO_H
+        if (sample_n_frames > 2) {
+                GString *frames;
+                char   **symbols;
+
+                symbols = backtrace_symbols (sample_frames, sample_n_frames);
+                frames = g_string_new (NULL);
+
+                /* Skip the signal handler and the kernel trampoline */
+                for (i = 2; symbols != NULL && i < sample_n_frames; i++) {
+                        char *plugin = NULL;
+                        char *function = NULL;
+
+                        parse_frame (symbols[i], &plugin, &function);
+
+                        /* The innermost plugin frame names the culprit */
+                        if (record->plugin == NULL && plugin != NULL) {
+                                record->plugin = plugin;
+                                plugin = NULL;
+                                if (function != NULL) {
+                                        g_free (record->function);
+                                        record->function = function;
+                                        function = NULL;
+                                }
+                        } else if (record->function == NULL && function != NULL) {
+                                record->function = function;
+                                function = NULL;
+                        }
+
+                        g_free (plugin);
+                        g_free (function);
+
+                        if (frames->len > 0)
+                                g_string_append_c (frames, '\n');
+                        g_string_append (frames, symbols[i]);
+                }
+
+                free (symbols);
+                record->frames = g_string_free (frames, FALSE);
+        }
+#endif
+
+out:
+        if (record->source == NULL)
+                record->source = g_strdup ("");
+        if (record->plugin == NULL)
+                record->plugin = g_strdup ("");
+        if (record->function == NULL)
+                record->function = g_strdup ("");
+        if (record->frames == NULL)
+                record->frames = g_strdup ("");
+}
+
+static gpointer
+watchdog_thread (gpointer data)
+{
+        g_mutex_lock (&watchdog->lock);
+
+        while (watchdog->running) {
+                StallRecord record = { 0 };
+                guint64     generation;
+                gint64      deadline;
+
+                if (watchdog->dispatch_start == 0) {
+                        watchdog->waiting = TRUE;
+                        g_cond_wait (&watchdog->cond, &watchdog->lock);
+                        watchdog->waiting = FALSE;
+                        continue;
+                }
+
+                generation = watchdog->generation;
+                deadline = watchdog->dispatch_start + watchdog->threshold;
+
+                if (g_cond_wait_until (&watchdog->cond, &watchdog->lock, deadline) ||
+                    !watchdog->running ||
+                    watchdog->generation != generation ||
+                    watchdog->dispatch_start == 0)
+                        continue;
+
+                g_mutex_unlock (&watchdog->lock);
+                capture_stall (&record);
+                g_mutex_lock (&watchdog->lock);
+
+                record.generation = generation;
+                stall_record_clear (&watchdog->stalls[watchdog->n_stalls % N_STALLS]);
+                watchdog->stalls[watchdog->n_stalls % N_STALLS] = record;
+                watchdog->n_stalls++;
+
+                /* Report each stuck iteration only once */
+                while (watchdog->running && watchdog->generation == generation) {
+                        watchdog->waiting = TRUE;
+                        g_cond_wait (&watchdog->cond, &watchdog->lock);
+                        watchdog->waiting = FALSE;
+                }
+        }
+
+        g_mutex_unlock (&watchdog->lock);
+
+        return NULL;
+}
+
+static void
+report_stall (const StallRecord *record)
+{
+        if (watchdog->log_stalls) {
+                char *duration;
+
+                /* MESSAGE has to come last: only it takes a format */
+                duration = g_strdup_printf ("%u", record->duration);
+                g_log_structured (G_LOG_DOMAIN, G_LOG_LEVEL_WARNING,
+                                  "MSD_STALL_DURATION_MS", duration,
+                                  "MSD_STALL_SOURCE", record->source,
+                                  "MSD_STALL_PLUGIN", record->plugin,
+                                  "MSD_STALL_FUNCTION", record->function,
+                                  "MSD_STALL_FRAMES", record->frames,
+                                  "MESSAGE", "Main loop stalled for %u ms in %s%s%s%s%s",
+                                  record->duration,
+                                  *record->plugin ? record->plugin : "the daemon",
+                                  *record->source ? " (" : "",
+                                  record->source,
+                                  *record->source ? ")" : "",
+                                  *record->function ? ": " : "",
+                                  record->function);
+                g_free (duration);
+        }
+
+        if (watchdog->connection != NULL) {
+                g_dbus_connection_emit_signal (watchdog->connection,
+                                               NULL,
+                                               MSD_WATCHDOG_DBUS_PATH,
+                                               MSD_WATCHDOG_DBUS_NAME,
+                                               "Stalled",
+                                               g_variant_new ("(xussss)",
+                                                              record->timestamp,
+                                                              record->duration,
+                                                              record->source,
+                                                              record->plugin,
+                                                              record->function,
+                                                              record->frames),
+                                               NULL);
+        }
+}
+
+static guint
+histogram_bucket (gint64 usec)
+{
+        guint bucket;
+        gint64 ms;
+
+        ms = usec / 1000;
+        for (bucket = 0; bucket < N_BUCKETS - 1 && ms >= (1 << bucket); bucket++)
+                ;
+
+        return bucket;
+}
+
+static gint
+watchdog_poll (GPollFD *ufds,
+               guint    nfds,
+               gint     timeout)
+{
+        StallRecord  finished = { 0 };
+        gboolean     stalled = FALSE;
+        gint64       now;
+        gint         ret;
+
+        now = g_get_monotonic_time ();
+
+        g_mutex_lock (&watchdog->lock);
+        if (watchdog->dispatch_start != 0) {
+                gint64 elapsed = now - watchdog->dispatch_start;
+
+                watchdog->histogram[histogram_bucket (elapsed)]++;
+
+                if (watchdog->n_stalls > 0) {
+                        StallRecord *last = &watchdog->stalls[(watchdog->n_stalls - 1) % N_STALLS];
+
+                        if (last->generation == watchdog->generation && last->duration == 0) {
+                                last->duration = MAX (elapsed / 1000, 1);
+                                finished = *last;
+                                finished.source = g_strdup (last->source);
+                                finished.plugin = g_strdup (last->plugin);
+                                finished.function = g_strdup (last->function);
+                                finished.frames = g_strdup (last->frames);
+                                stalled = TRUE;
+                        }
+                }
+        }
+        watchdog->dispatch_start = 0;
+        g_mutex_unlock (&watchdog->lock);
+
+        if (stalled) {
+                report_stall (&finished);
+                stall_record_clear (&finished);
+        }
+
+        ret = watchdog->poll_func (ufds, nfds, timeout);
+
+        g_mutex_lock (&watchdog->lock);
+        watchdog->dispatch_start = g_get_monotonic_time ();
+        watchdog->generation++;
+        if (watchdog->waiting)
+                g_cond_signal (&watchdog->cond);
+        g_mutex_unlock (&watchdog->lock);
+
+        return ret;
+}
+
+static void
+handle_method_call (GDBusConnection       *connection,
+                    const gchar           *sender,
+                    const gchar           *object_path,
+                    const gchar           *interface_name,
+                    const gchar           *method_name,
+                    GVariant              *parameters,
+                    GDBusMethodInvocation *invocation,
+                    gpointer               user_data)
+{
+        GVariantBuilder builder;
+        guint i;
+
+        if (g_strcmp0 (method_name, "GetDispatchHistogram") == 0) {
+                GVariantBuilder counts;
+
+                g_variant_builder_init (&builder, G_VARIANT_TYPE ("au"));
+                g_variant_builder_init (&counts, G_VARIANT_TYPE ("at"));
+
+                g_mutex_lock (&watchdog->lock);
+                for (i = 0; i < N_BUCKETS; i++) {
+                        /* Upper bound in ms; 0 for the open-ended bucket */
+                        g_variant_builder_add (&builder, "u", i < N_BUCKETS - 1 ? 1u << i : 0);
+                        g_variant_builder_add (&counts, "t", watchdog->histogram[i]);
+                }
+                g_mutex_unlock (&watchdog->lock);
+
+                g_dbus_method_invocation_return_value (invocation,
+                                                       g_variant_new ("(auat)", &builder, &counts));
+        } else if (g_strcmp0 (method_name, "GetStalls") == 0) {
+                guint first;
+
+                g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(xussss)"));
+
+                g_mutex_lock (&watchdog->lock);
+                first = watchdog->n_stalls > N_STALLS ? watchdog->n_stalls - N_STALLS : 0;
+                for (i = first; i < watchdog->n_stalls; i++) {
+                        StallRecord *record = &watchdog->stalls[i % N_STALLS];
+
+                        g_variant_builder_add (&builder, "(xussss)",
+                                               record->timestamp,
+                                               record->duration,
+                                               record->source,
+                                               record->plugin,
+                                               record->function,
+                                               record->frames);
+                }
+                g_mutex_unlock (&watchdog->lock);
+
+                g_dbus_method_invocation_return_value (invocation,
+                                                       g_variant_new ("(a(xussss))", &builder));
+        }
+}
+
+static GVariant *
+handle_get_property (GDBusConnection *connection,
+                     const gchar     *sender,
+                     const gchar     *object_path,
+                     const gchar     *interface_name,
+                     const gchar     *property_name,
+                     GError         **error,
+                     gpointer         user_data)
+{
+        if (g_strcmp0 (property_name, "StallThreshold") == 0)
+                return g_variant_new_uint32 (watchdog->threshold / 1000);
+
+        if (g_strcmp0 (property_name, "StallCount") == 0) {
+                guint n_stalls;
+
+                g_mutex_lock (&watchdog->lock);
+                n_stalls = watchdog->n_stalls;
+                g_mutex_unlock (&watchdog->lock);
+
+                return g_variant_new_uint32 (n_stalls);
+        }
+
+        return NULL;
+}
+
+static const GDBusInterfaceVTable interface_vtable =
+{
+        handle_method_call,
+        handle_get_property,
+        NULL
+};
+
+static void
+on_bus_gotten (GObject      *source_object,
+               GAsyncResult *res,
+               gpointer      user_data)
+{
+        GDBusConnection *connection;
+        GError *error = NULL;
+
+        connection = g_bus_get_finish (res, &error);
+        if (connection == NULL) {
+                if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+                        g_warning ("Could not get session bus: %s", error->message);
+                g_error_free (error);
+                return;
+        }
+        watchdog->connection = connection;
+
+        g_dbus_connection_register_object (connection,
+                                           MSD_WATCHDOG_DBUS_PATH,
+                                           watchdog->introspection_data->interfaces[0],
+                                           &interface_vtable,
+                                           NULL,
+                                           NULL,
+                                           NULL);
+
+        watchdog->name_id = g_bus_own_name_on_connection (connection,
+                                                          MSD_WATCHDOG_DBUS_NAME,
+                                                          G_BUS_NAME_OWNER_FLAGS_NONE,
+                                                          NULL,
+                                                          NULL,
+                                                          NULL,
+                                                          NULL);
+}
+
+void
+mate_settings_watchdog_start (guint    threshold_ms,
+                              gboolean log_stalls,
+                              gboolean sample_stalls)
+{
+        struct sigaction sa;
+        GMainContext *context;
+
+        if (watchdog != NULL || threshold_ms == 0)
+                return;
+
+        watchdog = g_new0 (Watchdog, 1);
+        g_mutex_init (&watchdog->lock);
+        g_cond_init (&watchdog->cond);
+        watchdog->main_thread = pthread_self ();
+        watchdog->threshold = (gint64) threshold_ms * 1000;
+        watchdog->log_stalls = log_stalls;
+        watchdog->sample_stalls = sample_stalls;
+        watchdog->running = TRUE;
+
+        if (sample_stalls) {
+#ifdef HAVE_EXECINFO_H
+                /* The first call may load libgcc; get that out of the way
+                 * here rather than in the signal handler */
+                sample_n_frames = backtrace (sample_frames, MAX_FRAMES);
+#endif
+                /* Sets up the per-thread dispatch state the handler reads */
+                g_main_current_source ();
+
+                memset (&sa, 0, sizeof (sa));
+                sa.sa_handler = stall_signal_handler;
+                sa.sa_flags = SA_RESTART;
+                sigemptyset (&sa.sa_mask);
+                sigaction (STALL_SIGNAL, &sa, NULL);
+        }
+
+        context = g_main_context_default ();
+        watchdog->poll_func = g_main_context_get_poll_func (context);
+        g_main_context_set_poll_func (context, watchdog_poll);
+
+        watchdog->thread = g_thread_new ("msd-watchdog", watchdog_thread, NULL);
+
+        watchdog->introspection_data = g_dbus_node_info_new_for_xml (introspection_xml, NULL);
+        g_assert (watchdog->introspection_data != NULL);
+
+        watchdog->cancellable = g_cancellable_new ();
+        g_bus_get (G_BUS_TYPE_SESSION,
+                   watchdog->cancellable,
+                   on_bus_gotten,
+                   NULL);
+}
+
+void
+mate_settings_watchdog_stop (void)
+{
+        guint i;
+
+        if (watchdog == NULL)
+                return;
+
+        g_main_context_set_poll_func (g_main_context_default (), watchdog->poll_func);
+
+        g_mutex_lock (&watchdog->lock);
+        watchdog->running = FALSE;
+        g_cond_signal (&watchdog->cond);
+        g_mutex_unlock (&watchdog->lock);
+        g_thread_join (watchdog->thread);
+
+        if (watchdog->sample_stalls)
+                signal (STALL_SIGNAL, SIG_IGN);
+
+        if (watchdog->name_id != 0)
+                g_bus_unown_name (watchdog->name_id);
+
+        if (watchdog->cancellable) {
+                g_cancellable_cancel (watchdog->cancellable);
+                g_object_unref (watchdog->cancellable);
+        }
+
+        g_clear_object (&watchdog->connection);
+        g_clear_pointer (&watchdog->introspection_data, g_dbus_node_info_unref);
+
+        for (i = 0; i < N_STALLS; i++)
+                stall_record_clear (&watchdog->stalls[i]);
+
+        g_mutex_clear (&watchdog->lock);
+        g_cond_clear (&watchdog->cond);
+        g_free (watchdog);
+        watchdog = NULL;
+}
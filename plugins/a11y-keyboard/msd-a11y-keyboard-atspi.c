@@ -28,6 +28,9 @@
 struct _MsdA11yKeyboardAtspi
 {
         GObject              parent;
+#ifdef HAVE_ATSPI_DEVICE
+        AtspiDevice         *device;
+#endif
         AtspiDeviceListener *listener;
         gboolean             listening;
 };
@@ -39,6 +42,9 @@ msd_a11y_keyboard_atspi_finalize (GObject *obj)
 {
         MsdA11yKeyboardAtspi *self = MSD_A11Y_KEYBOARD_ATSPI (obj);
 
+#ifdef HAVE_ATSPI_DEVICE
+        g_clear_object (&self->device);
+#endif
         g_clear_object (&self->listener);
         self->listening = FALSE;
 
@@ -53,6 +59,7 @@ msd_a11y_keyboard_atspi_class_init (MsdA11yKeyboardAtspiClass *klass)
         object_class->finalize = msd_a11y_keyboard_atspi_finalize;
 }
 
+#ifndef HAVE_ATSPI_DEVICE
 static gboolean
 on_key_press_event (const AtspiDeviceEvent *event,
                     void                   *user_data G_GNUC_UNUSED)
@@ -66,6 +73,26 @@ on_key_press_event (const AtspiDeviceEvent *event,
 
         return FALSE;
 }
+#else
+static void
+on_key_watcher_event (AtspiDevice *device G_GNUC_UNUSED,
+                      gboolean     pressed,
+                      guint        keycode G_GNUC_UNUSED,
+                      guint        keysym,
+                      guint        modifiers,
+                      const gchar *keystring G_GNUC_UNUSED,
+                      void        *user_data G_GNUC_UNUSED)
+{
+        /* the watcher sees every key, filter on capslock ourselves */
+        if (!pressed || !(modifiers & (1 << ATSPI_MODIFIER_SHIFTLOCK)))
+                return;
+
+        if (keysym == GDK_KEY_Caps_Lock)
+                return;
+
+        gdk_display_beep (gdk_display_get_default ());
+}
+#endif
 
 static void
 msd_a11y_keyboard_atspi_init (MsdA11yKeyboardAtspi *self)
@@ -73,7 +100,7 @@ msd_a11y_keyboard_atspi_init (MsdA11yKeyboardAtspi *self)
         self->listener = NULL;
         self->listening = FALSE;
 
-#ifndef DESTROYING_ATSPI_LISTENER_DOES_NOT_CRASH
+#if !defined (HAVE_ATSPI_DEVICE) && !defined (DESTROYING_ATSPI_LISTENER_DOES_NOT_CRASH)
         /* init AT-SPI if needed */
         atspi_init ();
 
@@ -86,6 +113,7 @@ msd_a11y_keyboard_atspi_init (MsdA11yKeyboardAtspi *self)
 #endif
 }
 
+#ifndef HAVE_ATSPI_DEVICE
 static void
 register_deregister_events (MsdA11yKeyboardAtspi *self,
                             gboolean              do_register)
@@ -93,7 +121,10 @@ register_deregister_events (MsdA11yKeyboardAtspi *self,
         g_return_if_fail (MSD_IS_A11Y_KEYBOARD_ATSPI (self));
         g_return_if_fail (ATSPI_IS_DEVICE_LISTENER (self->listener));
 
-        /* register listeners for all keys with CAPS_LOCK modifier */
+        /* register listeners for all keys with CAPS_LOCK modifier.  That
+         * is one listener for each of the 128 masks that include it;
+         * only libatspi 2.50 and later can watch every key with one
+         * AtspiDevice key watcher instead. */
         for (AtspiKeyMaskType mod_mask = 0; mod_mask < 256; mod_mask++)
         {
                 if (! (mod_mask & (1 << ATSPI_MODIFIER_SHIFTLOCK)))
@@ -114,6 +145,7 @@ register_deregister_events (MsdA11yKeyboardAtspi *self,
                                                              NULL);
         }
 }
+#endif /* HAVE_ATSPI_DEVICE */
 
 void
 msd_a11y_keyboard_atspi_start (MsdA11yKeyboardAtspi *self)
@@ -123,6 +155,16 @@ msd_a11y_keyboard_atspi_start (MsdA11yKeyboardAtspi *self)
         if (self->listening)
                 return;
 
+#ifdef HAVE_ATSPI_DEVICE
+        /* init AT-SPI if needed */
+        atspi_init ();
+
+        /* a single watcher for all keys, instead of one keystroke
+         * listener per modifier combination */
+        self->device = atspi_device_new ();
+        atspi_device_add_key_watcher (self->device, on_key_watcher_event,
+                                      self, NULL);
+#else
 #ifdef DESTROYING_ATSPI_LISTENER_DOES_NOT_CRASH
         /* init AT-SPI if needed */
         atspi_init ();
@@ -131,6 +173,7 @@ msd_a11y_keyboard_atspi_start (MsdA11yKeyboardAtspi *self)
                                                     self, NULL);
 #endif
         register_deregister_events (self, TRUE);
+#endif
         self->listening = TRUE;
 }
 
@@ -142,7 +185,9 @@ msd_a11y_keyboard_atspi_stop (MsdA11yKeyboardAtspi *self)
         if (! self->listening)
                 return;
 
-#ifdef DESTROYING_ATSPI_LISTENER_DOES_NOT_CRASH
+#ifdef HAVE_ATSPI_DEVICE
+        g_clear_object (&self->device);
+#elif defined (DESTROYING_ATSPI_LISTENER_DOES_NOT_CRASH)
         g_clear_object (&self->listener);
 #else
         register_deregister_events (self, FALSE);
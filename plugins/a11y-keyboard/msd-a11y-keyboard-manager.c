@@ -48,6 +48,8 @@
 #endif /* HAVE_LIBNOTIFY */
 
 #include "mate-settings-profile.h"
+#include "mate-settings-event-router.h"
+#include "msd-input-helper.h"
 #include "msd-a11y-keyboard-manager.h"
 #ifdef HAVE_LIBATSPI
 # include "msd-a11y-keyboard-atspi.h"
@@ -70,6 +72,12 @@ struct MsdA11yKeyboardManagerPrivate
         GtkWidget *preferences_dialog;
         GtkStatusIcon *status_icon;
         XkbDescRec *original_xkb_desc;
+        /* Controls as last sent to / reported by the server; only
+         * desc->ctrls is filled in, the keymap is never fetched */
+        XkbDescRec *xkb_desc;
+        guint       server_update_id;
+        guint       devicepresence_id;
+        guint       xkb_event_ids[3];
 #ifdef HAVE_LIBATSPI
         MsdA11yKeyboardAtspi *capslock_beep;
 #endif
@@ -91,7 +99,8 @@ typedef enum
 
 static void     msd_a11y_keyboard_manager_finalize (GObject *object);
 static void     msd_a11y_keyboard_manager_ensure_status_icon (MsdA11yKeyboardManager *manager);
-static void     set_server_from_settings (MsdA11yKeyboardManager *manager);
+static void     set_server_from_settings (MsdA11yKeyboardManager *manager,
+                                          gboolean                force);
 
 G_DEFINE_TYPE_WITH_PRIVATE (MsdA11yKeyboardManager, msd_a11y_keyboard_manager, G_TYPE_OBJECT)
 
@@ -106,45 +115,25 @@ togglekeys_backend_enabled (MsdA11yKeyboardManager *manager,
 }
 
 static GdkFilterReturn
-devicepresence_filter (GdkXEvent *xevent,
-                       GdkEvent  *event,
-                       gpointer   data)
+devicepresence_filter (XEvent   *xev,
+                       gpointer  data)
 {
-        XEvent *xev = (XEvent *) xevent;
-        G_GNUC_UNUSED XEventClass class_presence;
-        int xi_presence;
-
-        DevicePresence (gdk_x11_get_default_xdisplay (), xi_presence, class_presence);
+        XDevicePresenceNotifyEvent *dpn = (XDevicePresenceNotifyEvent *) xev;
 
-        if (xev->type == xi_presence)
-        {
-            XDevicePresenceNotifyEvent *dpn = (XDevicePresenceNotifyEvent *) xev;
-            if (dpn->devchange == DeviceEnabled) {
-                set_server_from_settings (data);
-	    }
+        if (dpn->devchange == DeviceEnabled) {
+                /* the new device has none of our controls yet */
+                set_server_from_settings (data, TRUE);
         }
         return GDK_FILTER_CONTINUE;
 }
 
-static gboolean
-supports_xinput_devices (void)
-{
-        gint op_code, event, error;
-
-        return XQueryExtension (GDK_DISPLAY_XDISPLAY(gdk_display_get_default()),
-                                "XInputExtension",
-                                &op_code,
-                                &event,
-                                &error);
-}
-
 static void
 set_devicepresence_handler (MsdA11yKeyboardManager *manager)
 {
         Display *display;
         GdkDisplay *gdk_display;
         XEventClass class_presence;
-        G_GNUC_UNUSED int xi_presence;
+        int xi_presence;
 
         if (!supports_xinput_devices ())
                 return;
@@ -165,7 +154,10 @@ set_devicepresence_handler (MsdA11yKeyboardManager *manager)
 
         gdk_display_flush (gdk_display);
         if (!gdk_x11_display_error_trap_pop (gdk_display))
-                gdk_window_add_filter (NULL, devicepresence_filter, manager);
+                manager->priv->devicepresence_id =
+                        mate_settings_event_router_add (MATE_SETTINGS_EVENT_X, xi_presence, None,
+                                                        devicepresence_filter, manager,
+                                                        "a11y-keyboard: device presence");
 }
 
 static gboolean
@@ -186,29 +178,96 @@ xkb_enabled (MsdA11yKeyboardManager *manager)
 }
 
 static XkbDescRec *
-get_xkb_desc_rec (MsdA11yKeyboardManager *manager)
+fetch_xkb_controls (void)
 {
         GdkDisplay *display;
         XkbDescRec *desc;
-        Status      status = Success;
+        Status      status = BadAlloc;
 
         display = gdk_display_get_default ();
 
+        desc = XkbAllocKeyboard ();
+        g_return_val_if_fail (desc != NULL, NULL);
+
         gdk_x11_display_error_trap_push (display);
-        desc = XkbGetMap (GDK_DISPLAY_XDISPLAY(display), XkbAllMapComponentsMask, XkbUseCoreKbd);
-        if (desc != NULL) {
-                desc->ctrls = NULL;
-                status = XkbGetControls (GDK_DISPLAY_XDISPLAY(display), XkbAllControlsMask, desc);
-        }
+        status = XkbGetControls (GDK_DISPLAY_XDISPLAY(display), XkbAllControlsMask, desc);
         gdk_x11_display_error_trap_pop_ignored (display);
 
-        g_return_val_if_fail (desc != NULL, NULL);
-        g_return_val_if_fail (desc->ctrls != NULL, NULL);
-        g_return_val_if_fail (status == Success, NULL);
+        if (status != Success || desc->ctrls == NULL) {
+                g_warning ("Could not get the XKB controls");
+                XkbFreeKeyboard (desc, XkbAllComponentsMask, True);
+                return NULL;
+        }
 
         return desc;
 }
 
+static XkbDescRec *
+get_xkb_desc_rec (MsdA11yKeyboardManager *manager)
+{
+        if (manager->priv->xkb_desc == NULL)
+                manager->priv->xkb_desc = fetch_xkb_controls ();
+
+        return manager->priv->xkb_desc;
+}
+
+/* Keeps the cached controls in sync with a XkbControlsNotify, only going
+ * back to the server when more than the enabled controls changed. */
+static void
+update_xkb_desc_rec (MsdA11yKeyboardManager *manager,
+                     XkbControlsNotifyEvent *event)
+{
+        GdkDisplay   *display;
+        XkbDescRec   *desc = manager->priv->xkb_desc;
+        unsigned int  which;
+
+        if (desc == NULL)
+                return;
+
+        which = event->changed_ctrls & XkbAllControlsMask & ~XkbControlsEnabledMask;
+        if (which != 0) {
+                display = gdk_display_get_default ();
+
+                gdk_x11_display_error_trap_push (display);
+                XkbGetControls (GDK_DISPLAY_XDISPLAY(display), which, desc);
+                gdk_x11_display_error_trap_pop_ignored (display);
+        }
+
+        desc->ctrls->enabled_ctrls = event->enabled_ctrls;
+}
+
+/* Returns the XkbSetControls() mask covering the fields that differ */
+static unsigned int
+get_changed_controls (XkbControlsRec *old,
+                      XkbControlsRec *new)
+{
+        unsigned int which = 0;
+
+        if (old->enabled_ctrls != new->enabled_ctrls)
+                which |= XkbControlsEnabledMask;
+        if (old->slow_keys_delay != new->slow_keys_delay)
+                which |= XkbSlowKeysMask;
+        if (old->debounce_delay != new->debounce_delay)
+                which |= XkbBounceKeysMask;
+        if (old->mk_delay != new->mk_delay ||
+            old->mk_interval != new->mk_interval ||
+            old->mk_time_to_max != new->mk_time_to_max ||
+            old->mk_max_speed != new->mk_max_speed ||
+            old->mk_curve != new->mk_curve)
+                which |= XkbMouseKeysAccelMask;
+        if (old->ax_timeout != new->ax_timeout ||
+            old->axt_ctrls_mask != new->axt_ctrls_mask ||
+            old->axt_ctrls_values != new->axt_ctrls_values ||
+            old->axt_opts_mask != new->axt_opts_mask ||
+            old->axt_opts_values != new->axt_opts_values)
+                which |= XkbAccessXTimeoutMask;
+        /* ax_options is split between these on the server side */
+        if (old->ax_options != new->ax_options)
+                which |= XkbStickyKeysMask | XkbAccessXKeysMask | XkbAccessXFeedbackMask;
+
+        return which;
+}
+
 static int
 get_int (GSettings  *settings,
          char const *key)
@@ -276,9 +335,12 @@ set_ctrl_from_settings (XkbDescRec   *desc,
 }
 
 static void
-set_server_from_settings (MsdA11yKeyboardManager *manager)
+set_server_from_settings (MsdA11yKeyboardManager *manager,
+                          gboolean                force)
 {
         XkbDescRec      *desc;
+        XkbControlsRec   old_ctrls;
+        unsigned int     which;
         gboolean         enable_accessX;
         GdkDisplay      *display;
 
@@ -286,9 +348,12 @@ set_server_from_settings (MsdA11yKeyboardManager *manager)
 
         desc = get_xkb_desc_rec (manager);
         if (!desc) {
+                mate_settings_profile_end (NULL);
                 return;
         }
 
+        old_ctrls = *desc->ctrls;
+
         /* general */
         enable_accessX = g_settings_get_boolean (manager->priv->settings, "enable");
 
@@ -394,11 +459,8 @@ set_server_from_settings (MsdA11yKeyboardManager *manager)
         g_debug ("CHANGE to : 0x%x (2)", desc->ctrls->ax_options);
         */
 
-        display = gdk_display_get_default ();
-
-        gdk_x11_display_error_trap_push (display);
-        XkbSetControls (GDK_DISPLAY_XDISPLAY(display),
-                        XkbSlowKeysMask         |
+        if (force) {
+                which = XkbSlowKeysMask         |
                         XkbBounceKeysMask       |
                         XkbStickyKeysMask       |
                         XkbMouseKeysMask        |
@@ -406,17 +468,40 @@ set_server_from_settings (MsdA11yKeyboardManager *manager)
                         XkbAccessXKeysMask      |
                         XkbAccessXTimeoutMask   |
                         XkbAccessXFeedbackMask  |
-                        XkbControlsEnabledMask,
-                        desc);
+                        XkbControlsEnabledMask;
+        } else {
+                which = get_changed_controls (&old_ctrls, desc->ctrls);
+        }
 
-        XkbFreeKeyboard (desc, XkbAllComponentsMask, True);
+        if (which == 0) {
+                mate_settings_profile_end (NULL);
+                return;
+        }
+
+        display = gdk_display_get_default ();
+
+        gdk_x11_display_error_trap_push (display);
+        XkbSetControls (GDK_DISPLAY_XDISPLAY(display), which, desc);
 
         XSync (GDK_DISPLAY_XDISPLAY(display), FALSE);
-        gdk_x11_display_error_trap_pop_ignored (display);
+        if (gdk_x11_display_error_trap_pop (display)) {
+                /* the server kept (some of) its old values, refetch next time */
+                XkbFreeKeyboard (desc, XkbAllComponentsMask, True);
+                manager->priv->xkb_desc = NULL;
+        }
 
         mate_settings_profile_end (NULL);
 }
 
+static gboolean
+set_server_from_settings_idle_cb (MsdA11yKeyboardManager *manager)
+{
+        manager->priv->server_update_id = 0;
+        set_server_from_settings (manager, FALSE);
+
+        return FALSE;
+}
+
 static gboolean
 ax_response_callback (MsdA11yKeyboardManager *manager,
                       GtkWindow              *parent,
@@ -443,7 +528,7 @@ ax_response_callback (MsdA11yKeyboardManager *manager,
                                                "slowkeys-enable",
                                                !enabled);
                 }
-                set_server_from_settings (manager);
+                set_server_from_settings (manager, FALSE);
 
                 break;
 
@@ -964,8 +1049,6 @@ set_settings_from_server (MsdA11yKeyboardManager *manager)
                 }
         }
 
-        XkbFreeKeyboard (desc, XkbAllComponentsMask, True);
-
         changed |= (stickykeys_changed | slowkeys_changed);
 
         if (changed) {
@@ -1025,20 +1108,18 @@ beep_sequence (MsdA11yKeyboardManager  *manager,
         }
 }
 
+/* Only gets the XKB events subscribed to in start_a11y_keyboard_idle_cb() */
 static GdkFilterReturn
-cb_xkb_event_filter (GdkXEvent              *xevent,
-                     GdkEvent               *ignored1,
+cb_xkb_event_filter (XEvent                 *xev,
                      MsdA11yKeyboardManager *manager)
 {
-        XEvent   *xev   = (XEvent *) xevent;
-        XkbEvent *xkbEv = (XkbEvent *) xevent;
+        XkbEvent *xkbEv = (XkbEvent *) xev;
 
-        if (xev->xany.type == (manager->priv->xkbEventBase + XkbEventCode) &&
-            xkbEv->any.xkb_type == XkbControlsNotify) {
+        if (xkbEv->any.xkb_type == XkbControlsNotify) {
                 g_debug ("XKB state changed");
+                update_xkb_desc_rec (manager, &xkbEv->ctrls);
                 set_settings_from_server (manager);
-        } else if (xev->xany.type == (manager->priv->xkbEventBase + XkbEventCode) &&
-                   xkbEv->any.xkb_type == XkbAccessXNotify) {
+        } else if (xkbEv->any.xkb_type == XkbAccessXNotify) {
                 if (xkbEv->accessx.detail == XkbAXN_AXKWarning) {
                         g_debug ("About to turn on an AccessX feature from the keyboard!");
                         /*
@@ -1047,8 +1128,7 @@ cb_xkb_event_filter (GdkXEvent              *xevent,
                          * set_settings_from_server().
                          */
                 }
-        } else if (xev->xany.type == (manager->priv->xkbEventBase + XkbEventCode) &&
-                   xkbEv->any.xkb_type == XkbIndicatorStateNotify &&
+        } else if (xkbEv->any.xkb_type == XkbIndicatorStateNotify &&
                    togglekeys_backend_enabled (manager, TOGGLEKEYS_BACKEND_INTERNAL)) {
                 GdkDisplay *display = gdk_x11_lookup_xdisplay (xkbEv->any.display);
                 gint beep_count;
@@ -1072,7 +1152,12 @@ keyboard_callback (GSettings              *settings G_GNUC_UNUSED,
                    gchar                  *key G_GNUC_UNUSED,
                    MsdA11yKeyboardManager *manager)
 {
-        set_server_from_settings (manager);
+        /* Keys written together (e.g. by the preferences dialog or by
+         * set_settings_from_server) end up in a single XkbSetControls */
+        if (manager->priv->server_update_id == 0)
+                manager->priv->server_update_id =
+                        g_idle_add ((GSourceFunc) set_server_from_settings_idle_cb, manager);
+
         maybe_show_status_icon (manager);
 }
 
@@ -1116,7 +1201,7 @@ start_a11y_keyboard_idle_cb (MsdA11yKeyboardManager *manager)
 
         /* Save current xkb state so we can restore it on exit
          */
-        manager->priv->original_xkb_desc = get_xkb_desc_rec (manager);
+        manager->priv->original_xkb_desc = fetch_xkb_controls ();
 
         event_mask = XkbControlsNotifyMask;
         event_mask |= XkbIndicatorStateNotifyMask;
@@ -1125,16 +1210,27 @@ start_a11y_keyboard_idle_cb (MsdA11yKeyboardManager *manager)
 #endif /* MATE_ENABLE_DEBUG */
 
         /* be sure to init before starting to monitor the server */
-        set_server_from_settings (manager);
+        set_server_from_settings (manager, FALSE);
 
         XkbSelectEvents (GDK_DISPLAY_XDISPLAY(gdk_display_get_default()),
                          XkbUseCoreKbd,
                          event_mask,
                          event_mask);
 
-        gdk_window_add_filter (NULL,
-                               (GdkFilterFunc) cb_xkb_event_filter,
-                               manager);
+        manager->priv->xkb_event_ids[0] =
+                mate_settings_event_router_add (MATE_SETTINGS_EVENT_XKB, XkbControlsNotify, None,
+                                                (MateSettingsEventFunc) cb_xkb_event_filter, manager,
+                                                "a11y-keyboard: controls");
+        manager->priv->xkb_event_ids[1] =
+                mate_settings_event_router_add (MATE_SETTINGS_EVENT_XKB, XkbIndicatorStateNotify, None,
+                                                (MateSettingsEventFunc) cb_xkb_event_filter, manager,
+                                                "a11y-keyboard: indicators");
+#ifdef MATE_ENABLE_DEBUG
+        manager->priv->xkb_event_ids[2] =
+                mate_settings_event_router_add (MATE_SETTINGS_EVENT_XKB, XkbAccessXNotify, None,
+                                                (MateSettingsEventFunc) cb_xkb_event_filter, manager,
+                                                "a11y-keyboard: accessx");
+#endif /* MATE_ENABLE_DEBUG */
 
         maybe_show_status_icon (manager);
 
@@ -1167,6 +1263,9 @@ restore_server_xkb_config (MsdA11yKeyboardManager *manager)
 {
         GdkDisplay      *display;
 
+        if (manager->priv->original_xkb_desc == NULL)
+                return;
+
         display = gdk_display_get_default ();
         gdk_x11_display_error_trap_push (display);
         XkbSetControls (GDK_DISPLAY_XDISPLAY(display),
@@ -1194,10 +1293,12 @@ void
 msd_a11y_keyboard_manager_stop (MsdA11yKeyboardManager *manager)
 {
         MsdA11yKeyboardManagerPrivate *p = manager->priv;
+        guint i;
 
         g_debug ("Stopping a11y_keyboard manager");
 
-        gdk_window_remove_filter (NULL, devicepresence_filter, manager);
+        mate_settings_event_router_remove (p->devicepresence_id);
+        p->devicepresence_id = 0;
 
         if (p->status_icon)
                 gtk_status_icon_set_visible (p->status_icon, FALSE);
@@ -1207,14 +1308,25 @@ msd_a11y_keyboard_manager_stop (MsdA11yKeyboardManager *manager)
                 p->settings = NULL;
         }
 
-        gdk_window_remove_filter (NULL,
-                                  (GdkFilterFunc) cb_xkb_event_filter,
-                                  manager);
+        for (i = 0; i < G_N_ELEMENTS (p->xkb_event_ids); i++) {
+                mate_settings_event_router_remove (p->xkb_event_ids[i]);
+                p->xkb_event_ids[i] = 0;
+        }
+
+        if (p->server_update_id != 0) {
+                g_source_remove (p->server_update_id);
+                p->server_update_id = 0;
+        }
 
         /* Disable all the AccessX bits
          */
         restore_server_xkb_config (manager);
 
+        if (p->xkb_desc != NULL) {
+                XkbFreeKeyboard (p->xkb_desc, XkbAllComponentsMask, True);
+                p->xkb_desc = NULL;
+        }
+
         if (p->slowkeys_alert != NULL)
                 gtk_widget_destroy (p->slowkeys_alert);
 
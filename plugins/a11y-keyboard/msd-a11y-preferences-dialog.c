@@ -36,6 +36,7 @@
 #include <gio/gio.h>
 
 #include "msd-a11y-preferences-dialog.h"
+#include "msd-display-metrics.h"
 
 #define SM_DBUS_NAME      "org.gnome.SessionManager"
 #define SM_DBUS_PATH      "/org/gnome/SessionManager"
@@ -59,19 +60,6 @@
 #define FONT_RENDER_SCHEMA        "org.mate.font-rendering"
 #define KEY_FONT_DPI              "dpi"
 
-/* X servers sometimes lie about the screen's physical dimensions, so we cannot
- * compute an accurate DPI value.  When this happens, the user gets fonts that
- * are too huge or too tiny.  So, we see what the server returns:  if it reports
- * something outside of the range [DPI_LOW_REASONABLE_VALUE,
- * DPI_HIGH_REASONABLE_VALUE], then we assume that it is lying and we use
- * DPI_FALLBACK instead.
- *
- * See get_dpi_from_gsettings_or_server() below, and also
- * https://bugzilla.novell.com/show_bug.cgi?id=217790
- */
-#define DPI_LOW_REASONABLE_VALUE 50
-#define DPI_HIGH_REASONABLE_VALUE 500
-
 #define DPI_FACTOR_LARGE   1.25
 #define DPI_FACTOR_LARGER  1.5
 #define DPI_FACTOR_LARGEST 2.0
@@ -151,56 +139,10 @@ config_get_bool (GSettings  *settings,
         return enabled;
 }
 
-static double
-dpi_from_pixels_and_mm (int pixels,
-                        int mm)
-{
-        double dpi;
-
-        if (mm >= 1) {
-                dpi = pixels / (mm / 25.4);
-        } else {
-                dpi = 0;
-        }
-
-        return dpi;
-}
-
 static double
 get_dpi_from_x_server (void)
 {
-        GdkScreen *screen;
-        double     dpi;
-        int        scale;
-
-        screen = gdk_screen_get_default ();
-        if (screen != NULL) {
-                double width_dpi;
-                double height_dpi;
-
-                Screen *xscreen = gdk_x11_screen_get_xscreen (screen);
-
-                scale = gdk_window_get_scale_factor (gdk_screen_get_root_window (screen));
-                width_dpi = dpi_from_pixels_and_mm (WidthOfScreen (xscreen), WidthMMOfScreen (xscreen));
-                height_dpi = dpi_from_pixels_and_mm (HeightOfScreen (xscreen), HeightMMOfScreen (xscreen));
-
-                if (width_dpi < DPI_LOW_REASONABLE_VALUE
-                    || width_dpi > DPI_HIGH_REASONABLE_VALUE
-                    || height_dpi < DPI_LOW_REASONABLE_VALUE
-                    || height_dpi > DPI_HIGH_REASONABLE_VALUE) {
-                        dpi = DPI_DEFAULT;
-                } else {
-                        dpi = (width_dpi + height_dpi) / 2.0;
-                }
-
-                dpi *= scale;
-
-        } else {
-                /* Huh!?  No screen? */
-                dpi = DPI_DEFAULT;
-        }
-
-        return dpi;
+        return msd_display_metrics_get_x_dpi () * msd_display_metrics_get_screen_scale ();
 }
 
 static gboolean
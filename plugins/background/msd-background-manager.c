@@ -32,12 +32,16 @@
 #include <errno.h>
 
 #include <locale.h>
+#include <sys/stat.h>
+#include <time.h>
 
 #include <glib.h>
 #include <glib/gi18n.h>
 #include <gdk/gdk.h>
 #include <gdk/gdkx.h>
 #include <gio/gio.h>
+#include <glib/gstdio.h>
+#include <cairo-xlib.h>
 
 #define MATE_DESKTOP_USE_UNSTABLE_API
 #include <libmate-desktop/mate-bg.h>
@@ -49,13 +53,91 @@
 #define MATE_SESSION_MANAGER_DBUS_NAME "org.gnome.SessionManager"
 #define MATE_SESSION_MANAGER_DBUS_PATH "/org/gnome/SessionManager"
 
+/* Rendered wallpapers kept around, so that going back to a known
+ * monitor layout (docking, undocking) does not decode the image again.
+ * They stay resident for as long as the daemon runs, so the cache is
+ * bounded by size as well: that is one 4K render or a few smaller ones,
+ * and a render too large for it is not kept at all. */
+#define RENDER_CACHE_SIZE       3
+#define RENDER_CACHE_MAX_BYTES  (40 * 1024 * 1024)
+
+/* Slideshow transitions are drawn from a frame clock of at most
+ * 1000 / TRANSITION_FRAME_INTERVAL frames per second.  A frame that takes
+ * longer than TRANSITION_FRAME_BUDGET makes the following ticks skip,
+ * as does a tick that arrives a whole interval late. */
+#define TRANSITION_FRAME_INTERVAL 100   /* ms */
+#define TRANSITION_FRAME_BUDGET    40   /* ms */
+
+/* Same pace as MateBGCrossfade */
+#define FADE_DURATION             750   /* ms */
+#define FADE_FRAME_INTERVAL        16   /* ms */
+
+/* Renders are uploaded to the root pixmap this many rows at a time, so
+ * the image surface cairo converts the pixbuf into stays small */
+#define UPLOAD_ROWS                64
+
+typedef struct {
+	char      *key;
+	GdkPixbuf *pixbuf;
+} RenderCacheEntry;
+
+/* Everything a render needs; the worker thread owns it until the task
+ * completes, and the main thread does not look at it meanwhile.  The
+ * wallpaper settings are plain copies: the MateBG drawing them is only
+ * created on the worker, see render_thread(). */
+typedef struct {
+	char            *filename;
+	MateBGPlacement  placement;
+	MateBGColorType  color_type;
+	GdkRGBA          primary;
+	GdkRGBA          secondary;
+	MateBG          *bg;            /* released on the main thread */
+	GdkScreen       *screen;        /* only handed back to MateBG, never queried */
+	char            *key;
+	gint             width;         /* in device pixels */
+	gint             height;
+	gint             scale;
+	gboolean         spanned;
+	GArray          *monitors;      /* GdkRectangle, device pixels */
+	gsize            bytes;         /* of the pixbuf being rendered */
+	gboolean         do_fade;
+	guint            serial;
+} RenderJob;
+
 struct MsdBackgroundManagerPrivate {
 	GSettings       *settings;
 	MateBG          *bg;
+	/* The root pixmaps: the one on screen, and the next one while it
+	 * is being faded in.  The fade paints the back buffer over the
+	 * front one in place and then publishes the back buffer. */
 	cairo_surface_t *surface;
-	MateBGCrossfade *fade;
+	cairo_surface_t *back_surface;
+	guint            fade_id;
+	gint64           fade_start;
+	gdouble          fade_progress;
+
+	/* Full-size buffers: root pixmaps we hold, pixbufs being rendered,
+	 * and (render_cache_bytes) the cached renders; the peak of their
+	 * sum, transient copies included, is kept per change */
+	gsize            pixmap_bytes;
+	gsize            render_bytes;
+	gsize            peak_bytes;
 	GList           *scr_sizes;
 
+	GQueue          *render_cache;  /* RenderCacheEntry, most recent first */
+	gsize            render_cache_bytes;
+	GCancellable    *render_cancellable;
+	guint            render_serial;
+
+	guint            transition_id;         /* frame clock */
+	gboolean         transition_pending;    /* MateBG has a new step */
+	gint64           transition_last_tick;
+	guint            transition_skip;       /* ticks left to skip */
+	guint            n_transition_frames;
+	guint            n_transition_skipped;
+	gint64           transition_cpu_time;   /* us */
+	gint64           transition_max_frame;  /* us */
+
 	gboolean         msd_can_draw;
 	gboolean         caja_can_draw;
 	gboolean         do_fade;
@@ -151,21 +233,84 @@ caja_is_drawing_bg (MsdBackgroundManager *manager)
 	return running;
 }
 
+static gsize
+surface_bytes (cairo_surface_t *surface)
+{
+	return (gsize) cairo_xlib_surface_get_width (surface) *
+	       (gsize) cairo_xlib_surface_get_height (surface) * 4;
+}
+
+/* What GdkPixbuf allocates for an RGB image */
+static gsize
+pixbuf_bytes (gint width,
+	      gint height)
+{
+	return (gsize) ((width * 3 + 3) & ~3) * (gsize) height;
+}
+
+static gsize
+held_bytes (MsdBackgroundManager *manager)
+{
+	MsdBackgroundManagerPrivate *p = manager->priv;
+
+	return p->pixmap_bytes + p->render_bytes + p->render_cache_bytes;
+}
+
+/* Folds the buffers held right now, plus @transient bytes that are
+ * about to be freed again, into the peak */
 static void
-free_fade (MsdBackgroundManager *manager)
+note_bytes (MsdBackgroundManager *manager,
+	    gsize                 transient)
 {
-	if (manager->priv->fade != NULL) {
-		g_object_unref (manager->priv->fade);
-		manager->priv->fade = NULL;
-	}
+	MsdBackgroundManagerPrivate *p = manager->priv;
+
+	p->peak_bytes = MAX (p->peak_bytes, held_bytes (manager) + transient);
+}
+
+static void
+track_surface (MsdBackgroundManager *manager,
+	       cairo_surface_t      *surface)
+{
+	manager->priv->pixmap_bytes += surface_bytes (surface);
+	note_bytes (manager, 0);
+}
+
+/* Drops our handle; the pixmap itself stays, as the root background */
+static void
+release_surface (MsdBackgroundManager *manager,
+		 cairo_surface_t      *surface)
+{
+	manager->priv->pixmap_bytes -= surface_bytes (surface);
+	cairo_surface_destroy (surface);
 }
 
 static void
 free_bg_surface (MsdBackgroundManager *manager)
 {
-	if (manager->priv->surface != NULL) {
-		cairo_surface_destroy (manager->priv->surface);
-		manager->priv->surface = NULL;
+	MsdBackgroundManagerPrivate *p = manager->priv;
+
+	if (p->fade_id != 0) {
+		g_source_remove (p->fade_id);
+		p->fade_id = 0;
+	}
+
+	/* Never published, so nobody else would free it: the pixmap
+	 * belongs to a RetainPermanent client of its own */
+	if (p->back_surface != NULL) {
+		GdkDisplay *display = gdk_display_get_default ();
+
+		gdk_x11_display_error_trap_push (display);
+		XKillClient (GDK_DISPLAY_XDISPLAY (display),
+			     cairo_xlib_surface_get_drawable (p->back_surface));
+		gdk_x11_display_error_trap_pop_ignored (display);
+
+		release_surface (manager, p->back_surface);
+		p->back_surface = NULL;
+	}
+
+	if (p->surface != NULL) {
+		release_surface (manager, p->surface);
+		p->surface = NULL;
 	}
 }
 
@@ -179,6 +324,483 @@ free_scr_sizes (MsdBackgroundManager *manager)
 	}
 }
 
+static void
+render_cache_entry_free (RenderCacheEntry *entry)
+{
+	g_free (entry->key);
+	g_object_unref (entry->pixbuf);
+	g_free (entry);
+}
+
+static void
+render_cache_drop_oldest (MsdBackgroundManager *manager)
+{
+	MsdBackgroundManagerPrivate *p = manager->priv;
+	RenderCacheEntry *entry;
+
+	entry = g_queue_pop_tail (p->render_cache);
+	p->render_cache_bytes -= gdk_pixbuf_get_byte_length (entry->pixbuf);
+	render_cache_entry_free (entry);
+}
+
+static void
+free_render_cache (MsdBackgroundManager *manager)
+{
+	MsdBackgroundManagerPrivate *p = manager->priv;
+
+	if (p->render_cancellable != NULL) {
+		g_cancellable_cancel (p->render_cancellable);
+		g_clear_object (&p->render_cancellable);
+	}
+
+	if (p->render_cache != NULL) {
+		g_queue_free_full (p->render_cache, (GDestroyNotify) render_cache_entry_free);
+		p->render_cache = NULL;
+	}
+	p->render_cache_bytes = 0;
+}
+
+static GdkPixbuf *
+render_cache_lookup (MsdBackgroundManager *manager,
+		     const char           *key)
+{
+	MsdBackgroundManagerPrivate *p = manager->priv;
+	GList *l;
+
+	if (p->render_cache == NULL)
+		return NULL;
+
+	for (l = p->render_cache->head; l != NULL; l = l->next) {
+		RenderCacheEntry *entry = l->data;
+
+		if (strcmp (entry->key, key) == 0) {
+			g_queue_unlink (p->render_cache, l);
+			g_queue_push_head_link (p->render_cache, l);
+			return entry->pixbuf;
+		}
+	}
+
+	return NULL;
+}
+
+/* Returns whether @pixbuf is now held by the cache */
+static gboolean
+render_cache_insert (MsdBackgroundManager *manager,
+		     const char           *key,
+		     GdkPixbuf            *pixbuf)
+{
+	MsdBackgroundManagerPrivate *p = manager->priv;
+	RenderCacheEntry *entry;
+	gsize bytes;
+
+	if (render_cache_lookup (manager, key) != NULL)
+		return FALSE;
+
+	bytes = gdk_pixbuf_get_byte_length (pixbuf);
+	if (bytes > RENDER_CACHE_MAX_BYTES)
+		return FALSE;
+
+	if (p->render_cache == NULL)
+		p->render_cache = g_queue_new ();
+
+	while (g_queue_get_length (p->render_cache) >= RENDER_CACHE_SIZE ||
+	       (p->render_cache_bytes + bytes > RENDER_CACHE_MAX_BYTES &&
+		!g_queue_is_empty (p->render_cache)))
+		render_cache_drop_oldest (manager);
+
+	entry = g_new (RenderCacheEntry, 1);
+	entry->key = g_strdup (key);
+	entry->pixbuf = g_object_ref (pixbuf);
+	g_queue_push_head (p->render_cache, entry);
+	p->render_cache_bytes += bytes;
+	note_bytes (manager, 0);
+
+	return TRUE;
+}
+
+static void
+render_job_free (RenderJob *job)
+{
+	/* render_done_cb() has already released it on the main thread,
+	 * unless the task never ran */
+	if (job->bg != NULL)
+		g_object_unref (job->bg);
+	g_free (job->filename);
+	g_free (job->key);
+	g_array_unref (job->monitors);
+	g_free (job);
+}
+
+/* Snapshot of what the wallpaper looks like and where it goes; two
+ * renders with the same key produce the same pixels */
+static char *
+render_key (MateBG    *bg,
+	    RenderJob *job)
+{
+	MateBGColorType  type;
+	GdkRGBA          primary, secondary;
+	const char      *filename;
+	char            *primary_str, *secondary_str;
+	GString         *key;
+	GStatBuf         st;
+	guint            i;
+
+	filename = mate_bg_get_filename (bg);
+	mate_bg_get_color (bg, &type, &primary, &secondary);
+	primary_str = gdk_rgba_to_string (&primary);
+	secondary_str = gdk_rgba_to_string (&secondary);
+
+	key = g_string_new (NULL);
+	g_string_append_printf (key, "%s:%" G_GINT64_FORMAT ":%d:%d:%s:%s:%dx%d@%d",
+				filename ? filename : "",
+				(filename && g_stat (filename, &st) == 0) ? (gint64) st.st_mtime : (gint64) 0,
+				mate_bg_get_placement (bg), type, primary_str, secondary_str,
+				job->width, job->height, job->scale);
+
+	for (i = 0; i < job->monitors->len; i++) {
+		GdkRectangle *rect = &g_array_index (job->monitors, GdkRectangle, i);
+
+		g_string_append_printf (key, ":%d,%d,%dx%d", rect->x, rect->y, rect->width, rect->height);
+	}
+
+	g_free (primary_str);
+	g_free (secondary_str);
+
+	return g_string_free (key, FALSE);
+}
+
+static void
+copy_bg_settings (MateBG    *bg,
+		  RenderJob *job)
+{
+	job->filename = g_strdup (mate_bg_get_filename (bg));
+	job->placement = mate_bg_get_placement (bg);
+	mate_bg_get_color (bg, &job->color_type, &job->primary, &job->secondary);
+}
+
+/* Worker thread.  Setting the filename makes MateBG monitor the file;
+ * created under a context of our own that nobody iterates, the monitor
+ * can never fire on the main thread and reload the image while it is
+ * being drawn here.  The context lives on for as long as the monitor
+ * holds it.
+ *
+ * Each setter also queues a "changed" emission, on the global default
+ * context whatever the thread.  That one does run on the main thread,
+ * so it is told to stay silent, the same way caja skips a change it
+ * has already drawn; nothing is connected to this MateBG either, and
+ * render_done_cb() drops it, and the pending source with it, on the
+ * main thread. */
+static MateBG *
+create_job_bg (RenderJob *job)
+{
+	GMainContext *context;
+	MateBG       *bg;
+
+	context = g_main_context_new ();
+	g_main_context_push_thread_default (context);
+
+	bg = mate_bg_new ();
+	mate_bg_set_color (bg, job->color_type, &job->primary, &job->secondary);
+	mate_bg_set_placement (bg, job->placement);
+	mate_bg_set_filename (bg, job->filename);
+	g_object_set_data (G_OBJECT (bg), "ignore-pending-change", GINT_TO_POINTER (TRUE));
+
+	g_main_context_pop_thread_default (context);
+	g_main_context_unref (context);
+
+	return bg;
+}
+
+/* Worker thread: decode, scale and place the image for every monitor.
+ * Only the job's own MateBG and the pixbuf are touched here. */
+static void
+render_thread (GTask        *task,
+	       gpointer      source_object G_GNUC_UNUSED,
+	       gpointer      task_data,
+	       GCancellable *cancellable)
+{
+	RenderJob *job = task_data;
+	GdkPixbuf *pixbuf;
+	gint64     start;
+	guint      i;
+
+	start = g_get_monotonic_time ();
+
+	job->bg = create_job_bg (job);
+
+	pixbuf = gdk_pixbuf_new (GDK_COLORSPACE_RGB, FALSE, 8, job->width, job->height);
+	if (pixbuf == NULL) {
+		g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_NO_SPACE,
+					 "Could not allocate a %dx%d background", job->width, job->height);
+		return;
+	}
+	gdk_pixbuf_fill (pixbuf, 0x000000ff);
+
+	if (job->spanned || job->monitors->len == 0) {
+		mate_bg_draw (job->bg, pixbuf, job->screen, FALSE);
+	} else {
+		for (i = 0; i < job->monitors->len; i++) {
+			GdkRectangle *rect = &g_array_index (job->monitors, GdkRectangle, i);
+			GdkPixbuf    *area;
+
+			if (g_cancellable_is_cancelled (cancellable))
+				break;
+
+			area = gdk_pixbuf_new_subpixbuf (pixbuf, rect->x, rect->y, rect->width, rect->height);
+			mate_bg_draw (job->bg, area, job->screen, FALSE);
+			g_object_unref (area);
+		}
+	}
+
+	if (g_task_return_error_if_cancelled (task)) {
+		g_object_unref (pixbuf);
+		return;
+	}
+
+	g_debug ("Background rendered in %" G_GINT64_FORMAT " ms", (g_get_monotonic_time () - start) / 1000);
+
+	g_task_return_pointer (task, pixbuf, g_object_unref);
+}
+
+/* The root pixmap is created on its own connection and kept with
+ * RetainPermanent, so that it outlives us as setting it as the root
+ * background requires; this is what mate_bg_create_surface() does */
+static cairo_surface_t *
+create_root_surface (GdkScreen *screen,
+		     gint       width,
+		     gint       height,
+		     gint       scale)
+{
+	Display         *display;
+	Pixmap           pixmap;
+	cairo_surface_t *surface;
+	int              screen_num;
+	int              depth;
+
+	display = XOpenDisplay (gdk_display_get_name (gdk_screen_get_display (screen)));
+	if (display == NULL) {
+		g_warning ("Unable to open display '%s' for the background",
+			   gdk_display_get_name (gdk_screen_get_display (screen)));
+		return NULL;
+	}
+
+	screen_num = gdk_x11_screen_get_screen_number (screen);
+	depth = DefaultDepth (display, screen_num);
+
+	pixmap = XCreatePixmap (display, RootWindow (display, screen_num),
+				width * scale, height * scale, depth);
+
+	XFlush (display);
+	XSetCloseDownMode (display, RetainPermanent);
+	XCloseDisplay (display);
+
+	surface = cairo_xlib_surface_create (GDK_SCREEN_XDISPLAY (screen), pixmap,
+					     GDK_VISUAL_XVISUAL (gdk_screen_get_system_visual (screen)),
+					     width * scale, height * scale);
+	cairo_surface_set_device_scale (surface, scale, scale);
+
+	return surface;
+}
+
+/* Whether @surface is still the root background; anyone may have set
+ * another one since, which kills ours */
+static gboolean
+surface_is_root_pixmap (GdkScreen       *screen,
+			cairo_surface_t *surface)
+{
+	Display       *display = GDK_SCREEN_XDISPLAY (screen);
+	Atom           type;
+	int            format;
+	unsigned long  nitems, after;
+	unsigned char *data = NULL;
+	gboolean       ret = FALSE;
+
+	if (XGetWindowProperty (display, gdk_x11_window_get_xid (gdk_screen_get_root_window (screen)),
+				gdk_x11_get_xatom_by_name ("_XROOTPMAP_ID"), 0, 1, False,
+				XA_PIXMAP, &type, &format, &nitems, &after, &data) == Success &&
+	    data != NULL) {
+		if (type == XA_PIXMAP && format == 32 && nitems == 1)
+			ret = *(Pixmap *) data == cairo_xlib_surface_get_drawable (surface);
+		XFree (data);
+	}
+
+	return ret;
+}
+
+static void
+show_back_surface (MsdBackgroundManager *manager,
+		   GdkScreen            *screen)
+{
+	MsdBackgroundManagerPrivate *p = manager->priv;
+
+	/* This kills the previous root pixmap, our front buffer included */
+	mate_bg_set_surface_as_root (screen, p->back_surface);
+
+	if (p->surface != NULL)
+		release_surface (manager, p->surface);
+	p->surface = p->back_surface;
+	p->back_surface = NULL;
+
+	g_debug ("Background set; peak of %" G_GSIZE_FORMAT " KiB in full-size buffers, "
+		 "now %" G_GSIZE_FORMAT " KiB in root pixmaps and %" G_GSIZE_FORMAT " KiB in cached renders",
+		 p->peak_bytes / 1024, p->pixmap_bytes / 1024, p->render_cache_bytes / 1024);
+}
+
+static gboolean
+fade_step (MsdBackgroundManager *manager)
+{
+	MsdBackgroundManagerPrivate *p = manager->priv;
+	GdkScreen *screen = gdk_display_get_default_screen (gdk_display_get_default ());
+	gdouble    progress;
+	gdouble    alpha;
+	cairo_t   *cr;
+
+	progress = (g_get_monotonic_time () - p->fade_start) / (FADE_DURATION * 1000.0);
+	progress = CLAMP (progress, 0.0, 1.0);
+
+	/* Painting the new image over what is on screen with this alpha
+	 * gives old * (1 - progress) + new * progress */
+	alpha = (progress - p->fade_progress) / (1.0 - p->fade_progress);
+	p->fade_progress = progress;
+
+	cr = cairo_create (p->surface);
+	cairo_set_source_surface (cr, p->back_surface, 0, 0);
+	cairo_paint_with_alpha (cr, alpha);
+	cairo_destroy (cr);
+	cairo_surface_flush (p->surface);
+
+	XClearArea (GDK_SCREEN_XDISPLAY (screen),
+		    gdk_x11_window_get_xid (gdk_screen_get_root_window (screen)),
+		    0, 0, 0, 0, False);
+
+	if (progress < 1.0)
+		return G_SOURCE_CONTINUE;
+
+	p->fade_id = 0;
+	show_back_surface (manager, screen);
+
+	return G_SOURCE_REMOVE;
+}
+
+/* Takes ownership of @surface, a new root pixmap with the finished
+ * image, and puts it on screen */
+static void
+set_root_surface (MsdBackgroundManager *manager,
+		  GdkScreen            *screen,
+		  cairo_surface_t      *surface,
+		  gboolean              do_fade)
+{
+	MsdBackgroundManagerPrivate *p = manager->priv;
+
+	if (surface == NULL)
+		return;
+
+	/* A fade still running is cut short */
+	if (p->fade_id != 0) {
+		g_source_remove (p->fade_id);
+		p->fade_id = 0;
+		show_back_surface (manager, screen);
+	}
+
+	p->back_surface = surface;
+	track_surface (manager, surface);
+
+	if (do_fade &&
+	    p->surface != NULL &&
+	    cairo_xlib_surface_get_width (p->surface) == cairo_xlib_surface_get_width (surface) &&
+	    cairo_xlib_surface_get_height (p->surface) == cairo_xlib_surface_get_height (surface) &&
+	    surface_is_root_pixmap (screen, p->surface))
+	{
+		p->fade_start = g_get_monotonic_time ();
+		p->fade_progress = 0.0;
+		p->fade_id = g_timeout_add (FADE_FRAME_INTERVAL, (GSourceFunc) fade_step, manager);
+	}
+	else
+	{
+		show_back_surface (manager, screen);
+	}
+}
+
+/* @unowned_bytes is what @pixbuf weighs if nothing else accounts for
+ * it, that is if the render cache did not keep it */
+static void
+set_root_from_pixbuf (MsdBackgroundManager *manager,
+		      GdkScreen            *screen,
+		      GdkPixbuf            *pixbuf,
+		      gint                  scale,
+		      gboolean              do_fade,
+		      gsize                 unowned_bytes)
+{
+	cairo_surface_t *surface;
+	cairo_t *cr;
+	gint width = gdk_pixbuf_get_width (pixbuf);
+	gint height = gdk_pixbuf_get_height (pixbuf);
+	gint y;
+
+	surface = create_root_surface (screen, width / scale, height / scale, scale);
+	if (surface == NULL)
+		return;
+
+	note_bytes (manager, unowned_bytes + surface_bytes (surface) +
+			     (gsize) width * MIN (height, UPLOAD_ROWS) * 4);
+
+	/* The pixbuf is in device pixels; a band at a time, so that there
+	 * is never a full-size image surface next to it and the pixmap */
+	cr = cairo_create (surface);
+	cairo_scale (cr, 1.0 / scale, 1.0 / scale);
+	cairo_set_operator (cr, CAIRO_OPERATOR_SOURCE);
+	for (y = 0; y < height; y += UPLOAD_ROWS) {
+		gint       rows = MIN (UPLOAD_ROWS, height - y);
+		GdkPixbuf *band = gdk_pixbuf_new_subpixbuf (pixbuf, 0, y, width, rows);
+
+		gdk_cairo_set_source_pixbuf (cr, band, 0, y);
+		cairo_rectangle (cr, 0, y, width, rows);
+		cairo_fill (cr);
+		g_object_unref (band);
+	}
+	cairo_destroy (cr);
+
+	set_root_surface (manager, screen, surface, do_fade);
+}
+
+static void
+render_done_cb (GObject      *source_object,
+		GAsyncResult *result,
+		gpointer      user_data G_GNUC_UNUSED)
+{
+	MsdBackgroundManager *manager = MSD_BACKGROUND_MANAGER (source_object);
+	MsdBackgroundManagerPrivate *p = manager->priv;
+	RenderJob *job = g_task_get_task_data (G_TASK (result));
+	GdkPixbuf *pixbuf;
+	GError    *error = NULL;
+	gboolean   cached;
+
+	/* The task may be finalized on the worker; MateBG's own sources
+	 * belong to this thread, so let go of it here */
+	g_clear_object (&job->bg);
+
+	/* From here on the pixbuf is either cached or ours to account */
+	p->render_bytes -= job->bytes;
+
+	pixbuf = g_task_propagate_pointer (G_TASK (result), &error);
+	if (pixbuf == NULL) {
+		if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+			g_warning ("Could not render background: %s", error->message);
+		g_error_free (error);
+		return;
+	}
+
+	cached = render_cache_insert (manager, job->key, pixbuf);
+
+	/* A newer request superseded this one while it was rendering */
+	if (job->serial == p->render_serial && p->bg != NULL)
+		set_root_from_pixbuf (manager, gdk_display_get_default_screen (gdk_display_get_default ()),
+				      pixbuf, job->scale, job->do_fade,
+				      cached ? 0 : gdk_pixbuf_get_byte_length (pixbuf));
+
+	g_object_unref (pixbuf);
+}
+
 static void
 real_draw_bg (MsdBackgroundManager *manager,
 	      GdkScreen		   *screen)
@@ -188,21 +810,84 @@ real_draw_bg (MsdBackgroundManager *manager,
 	gint scale   = gdk_window_get_scale_factor (window);
 	gint width   = WidthOfScreen (gdk_x11_screen_get_xscreen (screen)) / scale;
 	gint height  = HeightOfScreen (gdk_x11_screen_get_xscreen (screen)) / scale;
+	GdkDisplay *display = gdk_screen_get_display (screen);
+	GdkRectangle root = { 0, 0, width * scale, height * scale };
+	RenderJob *job;
+	GdkPixbuf *cached;
+	GTask *task;
+	gint i;
 
-	free_bg_surface (manager);
-	p->surface = mate_bg_create_surface_scale (p->bg, window, width, height, scale, TRUE);
-
-	if (p->do_fade)
+	p->scr_sizes = g_list_prepend (p->scr_sizes, g_strdup_printf ("%dx%d", width, height));
+	p->render_serial++;
+	p->peak_bytes = held_bytes (manager);
+
+	/* Slideshows are redrawn on every transition step; MateBG keeps the
+	 * frames it needs, so they stay on the synchronous path.  It draws
+	 * into a root-size pixbuf and goes through a full-size image
+	 * surface to get that into the new pixmap. */
+	if (mate_bg_changes_with_time (p->bg))
 	{
-		free_fade (manager);
-		p->fade = mate_bg_set_surface_as_root_with_crossfade (screen, p->surface);
-		g_signal_connect_swapped (p->fade, "finished", G_CALLBACK (free_fade), manager);
+		note_bytes (manager, pixbuf_bytes (width * scale, height * scale) +
+				     (gsize) width * scale * height * scale * 4 * 2);
+		set_root_surface (manager, screen,
+				  mate_bg_create_surface_scale (p->bg, window, width, height, scale, TRUE),
+				  p->do_fade);
+		return;
 	}
-	else
+
+	job = g_new0 (RenderJob, 1);
+	job->screen = screen;
+	job->width = width * scale;
+	job->height = height * scale;
+	job->scale = scale;
+	job->spanned = mate_bg_get_placement (p->bg) == MATE_BG_PLACEMENT_SPANNED;
+	job->do_fade = p->do_fade;
+	job->serial = p->render_serial;
+	job->monitors = g_array_new (FALSE, FALSE, sizeof (GdkRectangle));
+
+	for (i = 0; i < gdk_display_get_n_monitors (display); i++) {
+		GdkRectangle rect;
+
+		gdk_monitor_get_geometry (gdk_display_get_monitor (display, i), &rect);
+		rect.x *= scale;
+		rect.y *= scale;
+		rect.width *= scale;
+		rect.height *= scale;
+
+		if (gdk_rectangle_intersect (&rect, &root, &rect))
+			g_array_append_val (job->monitors, rect);
+	}
+
+	job->key = render_key (p->bg, job);
+
+	cached = render_cache_lookup (manager, job->key);
+	if (cached != NULL)
 	{
-		mate_bg_set_surface_as_root (screen, p->surface);
+		g_debug ("Reusing rendered background %s", job->key);
+		set_root_from_pixbuf (manager, screen, cached, scale, p->do_fade, 0);
+		g_array_unref (job->monitors);
+		g_free (job->key);
+		g_free (job);
+		return;
 	}
-	p->scr_sizes = g_list_prepend (p->scr_sizes, g_strdup_printf ("%dx%d", width, height));
+
+	copy_bg_settings (p->bg, job);
+
+	if (p->render_cancellable != NULL) {
+		g_cancellable_cancel (p->render_cancellable);
+		g_object_unref (p->render_cancellable);
+	}
+	p->render_cancellable = g_cancellable_new ();
+
+	/* Until render_done_cb(), the worker's pixbuf */
+	job->bytes = pixbuf_bytes (job->width, job->height);
+	p->render_bytes += job->bytes;
+	note_bytes (manager, 0);
+
+	task = g_task_new (manager, p->render_cancellable, render_done_cb, NULL);
+	g_task_set_task_data (task, job, (GDestroyNotify) render_job_free);
+	g_task_run_in_thread (task, render_thread);
+	g_object_unref (task);
 }
 
 static void
@@ -236,15 +921,123 @@ on_bg_changed (MateBG               *bg G_GNUC_UNUSED,
 	       MsdBackgroundManager *manager)
 {
 	g_debug ("Background changed");
+	manager->priv->transition_pending = FALSE;
 	draw_background (manager, TRUE);
 }
 
+static gint64
+thread_cpu_time (void)
+{
+	struct timespec ts;
+
+	if (clock_gettime (CLOCK_THREAD_CPUTIME_ID, &ts) != 0)
+		return 0;
+
+	return (gint64) ts.tv_sec * G_USEC_PER_SEC + ts.tv_nsec / 1000;
+}
+
+static void
+report_transition (MsdBackgroundManager *manager)
+{
+	MsdBackgroundManagerPrivate *p = manager->priv;
+
+	mate_settings_profile_msg ("background transition: %u frames drawn, %u skipped, "
+				   "%" G_GINT64_FORMAT " ms CPU, %" G_GINT64_FORMAT " ms worst frame",
+				   p->n_transition_frames, p->n_transition_skipped,
+				   p->transition_cpu_time / 1000, p->transition_max_frame / 1000);
+	g_debug ("Background transition done: %u frames drawn, %u skipped, "
+		 "%" G_GINT64_FORMAT " ms CPU, %" G_GINT64_FORMAT " ms worst frame",
+		 p->n_transition_frames, p->n_transition_skipped,
+		 p->transition_cpu_time / 1000, p->transition_max_frame / 1000);
+}
+
+static void
+stop_transition (MsdBackgroundManager *manager)
+{
+	MsdBackgroundManagerPrivate *p = manager->priv;
+
+	if (p->transition_id == 0)
+		return;
+
+	g_source_remove (p->transition_id);
+	p->transition_id = 0;
+	p->transition_pending = FALSE;
+
+	report_transition (manager);
+}
+
+static gboolean
+transition_tick (MsdBackgroundManager *manager)
+{
+	MsdBackgroundManagerPrivate *p = manager->priv;
+	gint64 now, late, cpu, cost;
+
+	/* MateBG has stopped sending steps: the transition is over */
+	if (!p->transition_pending) {
+		p->transition_id = 0;
+		report_transition (manager);
+		return G_SOURCE_REMOVE;
+	}
+
+	/* How long the main loop kept us waiting past the interval */
+	now = g_get_monotonic_time ();
+	late = now - p->transition_last_tick - TRANSITION_FRAME_INTERVAL * 1000;
+	p->transition_last_tick = now;
+
+	if (p->transition_skip > 0 || late > TRANSITION_FRAME_INTERVAL * 1000) {
+		if (p->transition_skip > 0)
+			p->transition_skip--;
+		p->n_transition_skipped++;
+		return G_SOURCE_CONTINUE;
+	}
+
+	p->transition_pending = FALSE;
+
+	mate_settings_profile_start ("frame %u", p->n_transition_frames);
+	cpu = thread_cpu_time ();
+
+	draw_background (manager, FALSE);
+
+	cost = g_get_monotonic_time () - now;
+	p->transition_cpu_time += thread_cpu_time () - cpu;
+	p->transition_max_frame = MAX (p->transition_max_frame, cost);
+	p->n_transition_frames++;
+	p->transition_last_tick += cost;
+	mate_settings_profile_end ("frame %u", p->n_transition_frames - 1);
+
+	if (cost > TRANSITION_FRAME_BUDGET * 1000)
+		p->transition_skip = MAX (1, cost / (TRANSITION_FRAME_INTERVAL * 1000));
+
+	return G_SOURCE_CONTINUE;
+}
+
+/* Each transition step used to redraw the root right away, however
+ * often MateBG asked; the steps now only mark a frame as wanted and
+ * the frame clock draws the latest one when the budget allows */
 static void
 on_bg_transitioned (MateBG               *bg G_GNUC_UNUSED,
 		    MsdBackgroundManager *manager)
 {
-	g_debug ("Background transitioned");
-	draw_background (manager, FALSE);
+	MsdBackgroundManagerPrivate *p = manager->priv;
+
+	p->transition_pending = TRUE;
+
+	if (p->transition_id != 0)
+		return;
+
+	g_debug ("Background transition started");
+
+	p->transition_last_tick = g_get_monotonic_time ();
+	p->transition_skip = 0;
+	p->n_transition_frames = 0;
+	p->n_transition_skipped = 0;
+	p->transition_cpu_time = 0;
+	p->transition_max_frame = 0;
+
+	/* Draw the first step now, the rest on the clock */
+	p->transition_id = g_timeout_add (TRANSITION_FRAME_INTERVAL,
+					  (GSourceFunc) transition_tick, manager);
+	transition_tick (manager);
 }
 
 static void
@@ -356,6 +1149,7 @@ remove_background (MsdBackgroundManager *manager)
 	MsdBackgroundManagerPrivate *p = manager->priv;
 
 	disconnect_screen_signals (manager);
+	stop_transition (manager);
 
 	g_signal_handlers_disconnect_by_func (p->settings, settings_change_event_cb, manager);
 
@@ -370,8 +1164,8 @@ remove_background (MsdBackgroundManager *manager)
 	}
 
 	free_scr_sizes (manager);
+	free_render_cache (manager);
 	free_bg_surface (manager);
-	free_fade (manager);
 }
 
 static void
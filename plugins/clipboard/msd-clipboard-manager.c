@@ -44,6 +44,7 @@
 #include "list.h"
 
 #include "mate-settings-profile.h"
+#include "mate-settings-event-router.h"
 #include "msd-clipboard-manager.h"
 
 struct MsdClipboardManagerPrivate
@@ -58,6 +59,9 @@ struct MsdClipboardManagerPrivate
         Window   requestor;
         Atom     property;
         Time     time;
+
+        /* Window -> event router subscription */
+        GHashTable *watches;
 };
 
 typedef struct
@@ -808,11 +812,10 @@ clipboard_manager_process_event (MsdClipboardManager *manager,
 }
 
 static GdkFilterReturn
-clipboard_manager_event_filter (GdkXEvent           *xevent,
-                                GdkEvent            *event,
+clipboard_manager_event_filter (XEvent              *xevent,
                                 MsdClipboardManager *manager)
 {
-        if (clipboard_manager_process_event (manager, (XEvent *)xevent)) {
+        if (clipboard_manager_process_event (manager, xevent)) {
                 return GDK_FILTER_REMOVE;
         } else {
                 return GDK_FILTER_CONTINUE;
@@ -826,30 +829,32 @@ clipboard_manager_watch_cb (MsdClipboardManager *manager,
                             long                 mask,
                             void                *cb_data)
 {
-        GdkWindow  *gdkwin;
-        GdkDisplay *display;
+        guint id;
 
-        display = gdk_display_get_default ();
-        gdkwin = gdk_x11_window_lookup_for_display (display, window);
+        id = GPOINTER_TO_UINT (g_hash_table_lookup (manager->priv->watches,
+                                                    GUINT_TO_POINTER (window)));
 
         if (is_start) {
-                if (gdkwin == NULL) {
-                        gdkwin = gdk_x11_window_foreign_new_for_display (display, window);
-                } else {
-                        g_object_ref (gdkwin);
+                if (id != 0) {
+                        return;
                 }
 
-                gdk_window_add_filter (gdkwin,
-                                       (GdkFilterFunc)clipboard_manager_event_filter,
-                                       manager);
+                id = mate_settings_event_router_add (MATE_SETTINGS_EVENT_X,
+                                                     MATE_SETTINGS_EVENT_ANY_TYPE,
+                                                     window,
+                                                     (MateSettingsEventFunc) clipboard_manager_event_filter,
+                                                     manager,
+                                                     "clipboard");
+                g_hash_table_insert (manager->priv->watches,
+                                     GUINT_TO_POINTER (window),
+                                     GUINT_TO_POINTER (id));
         } else {
-                if (gdkwin == NULL) {
+                if (id == 0) {
                         return;
                 }
-                gdk_window_remove_filter (gdkwin,
-                                          (GdkFilterFunc)clipboard_manager_event_filter,
-                                          manager);
-                g_object_unref (gdkwin);
+                mate_settings_event_router_remove (id);
+                g_hash_table_remove (manager->priv->watches,
+                                     GUINT_TO_POINTER (window));
         }
 }
 
@@ -974,6 +979,7 @@ msd_clipboard_manager_init (MsdClipboardManager *manager)
         manager->priv = msd_clipboard_manager_get_instance_private (manager);
 
         manager->priv->display = GDK_DISPLAY_XDISPLAY (gdk_display_get_default ());
+        manager->priv->watches = g_hash_table_new (g_direct_hash, g_direct_equal);
 
 }
 
@@ -989,6 +995,8 @@ msd_clipboard_manager_finalize (GObject *object)
 
         g_return_if_fail (clipboard_manager->priv != NULL);
 
+        g_hash_table_destroy (clipboard_manager->priv->watches);
+
         G_OBJECT_CLASS (msd_clipboard_manager_parent_class)->finalize (object);
 }
 
@@ -0,0 +1,246 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*-
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+/* Physical DPI and scale of the default screen.  They are worked out
+ * from X the first time they are asked for and kept until GDK reports
+ * that the screen size or the monitor layout (RandR) has changed. */
+
+#include "config.h"
+
+#include <gdk/gdk.h>
+#include <gdk/gdkx.h>
+
+#include "msd-display-metrics.h"
+
+/* X servers sometimes lie about the screen's physical dimensions, so we cannot
+ * compute an accurate DPI value.  When this happens, the user gets fonts that
+ * are too huge or too tiny.  So, we see what the server returns:  if it reports
+ * something outside of the range [DPI_LOW_REASONABLE_VALUE,
+ * DPI_HIGH_REASONABLE_VALUE], then we assume that it is lying and we use
+ * DPI_FALLBACK instead.
+ *
+ * See https://bugzilla.novell.com/show_bug.cgi?id=217790
+ */
+#define DPI_FALLBACK 96
+#define DPI_LOW_REASONABLE_VALUE 50
+#define DPI_HIGH_REASONABLE_VALUE 500
+
+/* The minimum resolution at which we turn on a window-scale of 2 */
+#define HIDPI_LIMIT (DPI_FALLBACK * 2)
+
+/* The minimum screen height at which we turn on a window-scale of 2;
+ * below this there just isn't enough vertical real estate for GNOME
+ * apps to work, and it's better to just be tiny */
+#define HIDPI_MIN_HEIGHT 1500
+
+typedef struct {
+        gboolean   valid;
+        double     x_dpi;
+        int        screen_scale;
+        int        auto_window_scale;
+
+        GdkScreen *screen;
+        GHookList  watches;
+} DisplayMetrics;
+
+static DisplayMetrics metrics;
+
+static double
+dpi_from_pixels_and_mm (int pixels,
+                        int mm)
+{
+        double dpi;
+
+        if (mm >= 1)
+                dpi = pixels / (mm / 25.4);
+        else
+                dpi = 0;
+
+        return dpi;
+}
+
+static double
+compute_x_dpi (GdkScreen *screen)
+{
+        Screen *xscreen;
+        double  width_dpi, height_dpi;
+
+        xscreen = gdk_x11_screen_get_xscreen (screen);
+
+        width_dpi = dpi_from_pixels_and_mm (WidthOfScreen (xscreen), WidthMMOfScreen (xscreen));
+        height_dpi = dpi_from_pixels_and_mm (HeightOfScreen (xscreen), HeightMMOfScreen (xscreen));
+
+        if (width_dpi < DPI_LOW_REASONABLE_VALUE || width_dpi > DPI_HIGH_REASONABLE_VALUE
+            || height_dpi < DPI_LOW_REASONABLE_VALUE || height_dpi > DPI_HIGH_REASONABLE_VALUE)
+                return DPI_FALLBACK;
+
+        return (width_dpi + height_dpi) / 2.0;
+}
+
+/* Auto-detect the most appropriate scale factor for the primary monitor.
+ * A lot of this code is shamelessly copied and adapted from Linux Mint/Cinnamon.
+ */
+static int
+compute_auto_window_scale (GdkScreen *screen)
+{
+        GdkMonitor   *monitor;
+        GdkRectangle  rect;
+        int width_mm, height_mm;
+        int monitor_scale;
+
+        monitor = gdk_display_get_primary_monitor (gdk_screen_get_display (screen));
+        if (monitor == NULL)
+                return 1;
+
+        gdk_monitor_get_geometry (monitor, &rect);
+        width_mm = gdk_monitor_get_width_mm (monitor);
+        height_mm = gdk_monitor_get_height_mm (monitor);
+        monitor_scale = gdk_monitor_get_scale_factor (monitor);
+
+        if (rect.height * monitor_scale < HIDPI_MIN_HEIGHT)
+                return 1;
+
+        /* Some monitors/TV encode the aspect ratio (16/9 or 16/10) instead of the physical size */
+        if ((width_mm == 160 && height_mm == 90) ||
+            (width_mm == 160 && height_mm == 100) ||
+            (width_mm == 16 && height_mm == 9) ||
+            (width_mm == 16 && height_mm == 10))
+                return 1;
+
+        if (width_mm > 0 && height_mm > 0) {
+                double dpi_x, dpi_y;
+
+                dpi_x = (double)rect.width * monitor_scale / (width_mm / 25.4);
+                dpi_y = (double)rect.height * monitor_scale / (height_mm / 25.4);
+                /* We don't completely trust these values so both must be high, and never pick
+                 * higher ratio than 2 automatically */
+                if (dpi_x > HIDPI_LIMIT && dpi_y > HIDPI_LIMIT)
+                        return 2;
+        }
+
+        return 1;
+}
+
+static void
+screen_changed_cb (GdkScreen *screen,
+                   gpointer   data)
+{
+        metrics.valid = FALSE;
+
+        g_hook_list_invoke (&metrics.watches, FALSE);
+}
+
+static void
+metrics_init (void)
+{
+        if (metrics.screen != NULL)
+                return;
+
+        metrics.screen = gdk_screen_get_default ();
+        g_hook_list_init (&metrics.watches, sizeof (GHook));
+
+        if (metrics.screen != NULL) {
+                g_signal_connect (metrics.screen, "size-changed",
+                                  G_CALLBACK (screen_changed_cb), NULL);
+                g_signal_connect (metrics.screen, "monitors-changed",
+                                  G_CALLBACK (screen_changed_cb), NULL);
+        }
+}
+
+static void
+metrics_update (void)
+{
+        metrics_init ();
+
+        if (metrics.valid)
+                return;
+
+        if (metrics.screen != NULL) {
+                metrics.x_dpi = compute_x_dpi (metrics.screen);
+                metrics.screen_scale = gdk_window_get_scale_factor (gdk_screen_get_root_window (metrics.screen));
+                metrics.auto_window_scale = compute_auto_window_scale (metrics.screen);
+        } else {
+                /* Huh!?  No screen? */
+                metrics.x_dpi = DPI_FALLBACK;
+                metrics.screen_scale = 1;
+                metrics.auto_window_scale = 1;
+        }
+
+        metrics.valid = TRUE;
+
+        g_debug ("Display metrics: x-dpi=%f screen-scale=%d auto-window-scale=%d",
+                 metrics.x_dpi, metrics.screen_scale, metrics.auto_window_scale);
+}
+
+/* DPI reported by the X server, unscaled, or DPI_FALLBACK when the
+ * reported size is implausible */
+double
+msd_display_metrics_get_x_dpi (void)
+{
+        metrics_update ();
+
+        return metrics.x_dpi;
+}
+
+/* Scale factor GDK currently applies to the root window */
+int
+msd_display_metrics_get_screen_scale (void)
+{
+        metrics_update ();
+
+        return metrics.screen_scale;
+}
+
+/* Window scale to use when the user has not picked one: 2 on a large
+ * enough HiDPI primary monitor, 1 otherwise */
+int
+msd_display_metrics_get_auto_window_scale (void)
+{
+        metrics_update ();
+
+        return metrics.auto_window_scale;
+}
+
+/* Consumers watch this rather than the GdkScreen signals so that the
+ * cache has been dropped by the time they re-read it */
+guint
+msd_display_metrics_add_watch (MsdDisplayMetricsFunc func,
+                               gpointer              user_data)
+{
+        GHook *hook;
+
+        g_return_val_if_fail (func != NULL, 0);
+
+        metrics_init ();
+
+        hook = g_hook_alloc (&metrics.watches);
+        hook->func = func;
+        hook->data = user_data;
+        g_hook_append (&metrics.watches, hook);
+
+        return hook->hook_id;
+}
+
+void
+msd_display_metrics_remove_watch (guint id)
+{
+        if (id == 0 || !metrics.watches.is_setup)
+                return;
+
+        g_hook_destroy (&metrics.watches, id);
+}
@@ -0,0 +1,40 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*-
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+#ifndef __MSD_DISPLAY_METRICS_H
+#define __MSD_DISPLAY_METRICS_H
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* Called once the cached values have been dropped because the screen
+ * or its monitors changed */
+typedef void (* MsdDisplayMetricsFunc) (gpointer user_data);
+
+double  msd_display_metrics_get_x_dpi              (void);
+int     msd_display_metrics_get_screen_scale       (void);
+int     msd_display_metrics_get_auto_window_scale  (void);
+
+guint   msd_display_metrics_add_watch              (MsdDisplayMetricsFunc func,
+                                                    gpointer              user_data);
+void    msd_display_metrics_remove_watch           (guint                 id);
+
+G_END_DECLS
+
+#endif /* __MSD_DISPLAY_METRICS_H */
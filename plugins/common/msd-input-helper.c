@@ -26,72 +26,218 @@
 #include <sys/types.h>
 #include <X11/Xatom.h>
 
+#include "mate-settings-event-router.h"
 #include "msd-input-helper.h"
 
-gboolean
-supports_xinput_devices (void)
+/* What probing a device told us, kept until the XInput device
+ * hierarchy changes.  The name and type are checked on every lookup
+ * as well, in case an id was reused before the presence event that
+ * should have cleared the cache came in. */
+typedef struct {
+        char           *name;
+        Atom            type;
+        Atom           *props;
+        int             n_props;
+        gboolean        is_touchpad;
+        MsdInputDriver  driver;
+} DeviceCaps;
+
+static GHashTable *device_caps = NULL;          /* XID -> DeviceCaps */
+
+static void
+device_caps_free (DeviceCaps *caps)
 {
-        gint op_code, event, error;
+        g_free (caps->name);
+        if (caps->props != NULL)
+                XFree (caps->props);
+        g_free (caps);
+}
+
+static GdkFilterReturn
+devicepresence_filter (XEvent   *xev,
+                       gpointer  data)
+{
+        g_hash_table_remove_all (device_caps);
+
+        return GDK_FILTER_CONTINUE;
+}
+
+static void
+device_caps_init (void)
+{
+        GdkDisplay *gdk_display;
+        Display *display;
+        XEventClass class_presence;
+        int xi_presence;
+
+        device_caps = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+                                             NULL, (GDestroyNotify) device_caps_free);
+
+        gdk_display = gdk_display_get_default ();
+        display = GDK_DISPLAY_XDISPLAY (gdk_display);
+
+        gdk_x11_display_error_trap_push (gdk_display);
+        DevicePresence (display, xi_presence, class_presence);
+        XSelectExtensionEvent (display,
+                               RootWindow (display, DefaultScreen (display)),
+                               &class_presence, 1);
+
+        gdk_display_flush (gdk_display);
+        if (!gdk_x11_display_error_trap_pop (gdk_display))
+                mate_settings_event_router_add (MATE_SETTINGS_EVENT_X, xi_presence, None,
+                                                devicepresence_filter, NULL,
+                                                "input-helper: device presence");
+}
+
+static gboolean
+caps_has_atom (DeviceCaps *caps,
+               Atom        prop)
+{
+        int i;
+
+        if (prop == None)
+                return FALSE;
+
+        for (i = 0; i < caps->n_props; i++) {
+                if (caps->props[i] == prop)
+                        return TRUE;
+        }
 
-        return XQueryExtension (GDK_DISPLAY_XDISPLAY (gdk_display_get_default ()),
-                                "XInputExtension",
-                                &op_code,
-                                &event,
-                                &error);
+        return FALSE;
 }
 
 static gboolean
-device_has_property (XDevice    *device,
-                     const char *property_name)
+caps_has_property (DeviceCaps *caps,
+                   const char *property_name)
+{
+        Atom prop;
+
+        prop = XInternAtom (GDK_DISPLAY_XDISPLAY (gdk_display_get_default ()), property_name, True);
+
+        return caps_has_atom (caps, prop);
+}
+
+/* One XListDeviceProperties answers every later "does it have this
+ * property" question for the device */
+static DeviceCaps *
+device_caps_probe (XDeviceInfo *deviceinfo)
 {
         GdkDisplay *display;
-        Atom realtype, prop;
-        int realformat;
-        unsigned long nitems, bytes_after;
-        unsigned char *data;
+        DeviceCaps *caps;
+        XDevice *device;
 
         display = gdk_display_get_default ();
 
-        prop = XInternAtom (GDK_DISPLAY_XDISPLAY (display), property_name, True);
-        if (!prop)
-                return FALSE;
+        caps = g_new0 (DeviceCaps, 1);
+        caps->name = g_strdup (deviceinfo->name);
+        caps->type = deviceinfo->type;
+        caps->driver = MSD_INPUT_DRIVER_UNKNOWN;
 
+        /* Master devices and the like cannot be opened; they keep an
+         * empty property list */
         gdk_x11_display_error_trap_push (display);
-        if ((XGetDeviceProperty (GDK_DISPLAY_XDISPLAY (display), device, prop, 0, 1, False,
-                                XA_INTEGER, &realtype, &realformat, &nitems,
-                                &bytes_after, &data) == Success) && (realtype != None)) {
-                gdk_x11_display_error_trap_pop_ignored (display);
-                XFree (data);
-                return TRUE;
+        device = XOpenDevice (GDK_DISPLAY_XDISPLAY (display), deviceinfo->id);
+        if (gdk_x11_display_error_trap_pop (display) || (device == NULL))
+                return caps;
+
+        gdk_x11_display_error_trap_push (display);
+        caps->props = XListDeviceProperties (GDK_DISPLAY_XDISPLAY (display), device, &caps->n_props);
+        XCloseDevice (GDK_DISPLAY_XDISPLAY (display), device);
+        if (gdk_x11_display_error_trap_pop (display) && caps->props != NULL) {
+                XFree (caps->props);
+                caps->props = NULL;
+                caps->n_props = 0;
         }
 
-        gdk_x11_display_error_trap_pop_ignored (display);
-        return FALSE;
+        if (caps_has_property (caps, "libinput Send Events Modes Available"))
+                caps->driver = MSD_INPUT_DRIVER_LIBINPUT;
+        else if (caps_has_property (caps, "Synaptics Off"))
+                caps->driver = MSD_INPUT_DRIVER_SYNAPTICS;
+        else if (caps_has_property (caps, "Evdev Axis Inversion"))
+                caps->driver = MSD_INPUT_DRIVER_EVDEV;
+
+        caps->is_touchpad =
+                deviceinfo->type == XInternAtom (GDK_DISPLAY_XDISPLAY (display), XI_TOUCHPAD, True) &&
+                (caps_has_property (caps, "libinput Tapping Enabled") ||
+                 caps_has_property (caps, "Synaptics Off"));
+
+        return caps;
+}
+
+static DeviceCaps *
+get_device_caps (XDeviceInfo *deviceinfo)
+{
+        DeviceCaps *caps;
+
+        if (device_caps == NULL)
+                device_caps_init ();
+
+        caps = g_hash_table_lookup (device_caps, GUINT_TO_POINTER (deviceinfo->id));
+        if (caps != NULL &&
+            caps->type == deviceinfo->type &&
+            g_strcmp0 (caps->name, deviceinfo->name) == 0)
+                return caps;
+
+        caps = device_caps_probe (deviceinfo);
+        g_hash_table_replace (device_caps, GUINT_TO_POINTER (deviceinfo->id), caps);
+
+        return caps;
 }
 
+gboolean
+supports_xinput_devices (void)
+{
+        static gint supported = -1;
+        gint op_code, event, error;
+
+        if (supported < 0)
+                supported = XQueryExtension (GDK_DISPLAY_XDISPLAY (gdk_display_get_default ()),
+                                             "XInputExtension",
+                                             &op_code,
+                                             &event,
+                                             &error);
+
+        return supported;
+}
+
+gboolean
+device_info_is_touchpad (XDeviceInfo *deviceinfo)
+{
+        return get_device_caps (deviceinfo)->is_touchpad;
+}
+
+gboolean
+device_info_has_property (XDeviceInfo *deviceinfo,
+                          const char  *property_name)
+{
+        return caps_has_property (get_device_caps (deviceinfo), property_name);
+}
+
+MsdInputDriver
+device_info_get_driver (XDeviceInfo *deviceinfo)
+{
+        return get_device_caps (deviceinfo)->driver;
+}
+
+/* Callers want the touchpad open, so only that part still goes to
+ * the server */
 XDevice*
 device_is_touchpad (XDeviceInfo *deviceinfo)
 {
         GdkDisplay *display;
         XDevice *device;
 
-        display = gdk_display_get_default ();
-
-        if (deviceinfo->type != XInternAtom (GDK_DISPLAY_XDISPLAY (display), XI_TOUCHPAD, True))
+        if (!device_info_is_touchpad (deviceinfo))
                 return NULL;
 
+        display = gdk_display_get_default ();
+
         gdk_x11_display_error_trap_push (display);
         device = XOpenDevice (GDK_DISPLAY_XDISPLAY (display), deviceinfo->id);
         if (gdk_x11_display_error_trap_pop (display) || (device == NULL))
                 return NULL;
 
-        if (device_has_property (device, "libinput Tapping Enabled") ||
-            device_has_property (device, "Synaptics Off")) {
-                return device;
-        }
-
-        XCloseDevice (GDK_DISPLAY_XDISPLAY (display), device);
-        return NULL;
+        return device;
 }
 
 gboolean
@@ -112,10 +258,7 @@ touchpad_is_present (void)
                 return FALSE;
 
         for (i = 0; i < n_devices; i++) {
-                XDevice *device;
-
-                device = device_is_touchpad (&device_info[i]);
-                if (device != NULL) {
+                if (device_info_is_touchpad (&device_info[i])) {
                         retval = TRUE;
                         break;
                 }
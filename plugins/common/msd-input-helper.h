@@ -27,9 +27,20 @@ G_BEGIN_DECLS
 #include <X11/extensions/XInput.h>
 #include <X11/extensions/XIproto.h>
 
-gboolean  supports_xinput_devices (void);
-XDevice  *device_is_touchpad      (XDeviceInfo *deviceinfo);
-gboolean  touchpad_is_present     (void);
+typedef enum {
+        MSD_INPUT_DRIVER_UNKNOWN,
+        MSD_INPUT_DRIVER_EVDEV,
+        MSD_INPUT_DRIVER_SYNAPTICS,
+        MSD_INPUT_DRIVER_LIBINPUT
+} MsdInputDriver;
+
+gboolean        supports_xinput_devices  (void);
+XDevice        *device_is_touchpad       (XDeviceInfo *deviceinfo);
+gboolean        device_info_is_touchpad  (XDeviceInfo *deviceinfo);
+gboolean        device_info_has_property (XDeviceInfo *deviceinfo,
+                                          const char  *property_name);
+MsdInputDriver  device_info_get_driver   (XDeviceInfo *deviceinfo);
+gboolean        touchpad_is_present      (void);
 
 G_END_DECLS
 
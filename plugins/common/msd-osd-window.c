@@ -45,6 +45,14 @@
 
 #define BG_ALPHA 0.75
 
+/* Draw timing counters, in microseconds, logged when the window hides */
+typedef struct {
+        guint  n_frames;
+        guint  n_content_renders;
+        gint64 total_frame_time;
+        gint64 max_frame_time;
+} MsdOsdWindowFrameStats;
+
 struct MsdOsdWindowPrivate
 {
         guint                    is_composited : 1;
@@ -52,6 +60,15 @@ struct MsdOsdWindowPrivate
         guint                    fade_timeout_id;
         double                   fade_out_alpha;
         gint                     scale_factor;
+
+        /* Background, frame and subclass drawing, kept between frames so
+         * that fading and re-exposing only need to composite it again */
+        cairo_surface_t         *content;
+        guint                    content_dirty : 1;
+        int                      content_width;
+        int                      content_height;
+
+        MsdOsdWindowFrameStats   stats;
 };
 
 enum {
@@ -63,6 +80,21 @@ static guint signals[LAST_SIGNAL] = { 0 };
 
 G_DEFINE_TYPE_WITH_PRIVATE (MsdOsdWindow, msd_osd_window, GTK_TYPE_WINDOW)
 
+static void
+log_frame_stats (MsdOsdWindow *window)
+{
+        MsdOsdWindowFrameStats *stats = &window->priv->stats;
+
+        if (stats->n_frames == 0)
+                return;
+
+        g_debug ("OSD frames: %u drawn, %u content renders, avg %.3f ms, max %.3f ms",
+                 stats->n_frames,
+                 stats->n_content_renders,
+                 stats->total_frame_time / (stats->n_frames * 1000.0),
+                 stats->max_frame_time / 1000.0);
+}
+
 static gboolean
 fade_timeout (MsdOsdWindow *window)
 {
@@ -81,6 +113,8 @@ fade_timeout (MsdOsdWindow *window)
 
                 window->priv->fade_out_alpha -= 0.10;
 
+                /* Only the alpha changes, the retained content is
+                 * composited again without being re-rendered */
                 rect.x = 0;
                 rect.y = 0;
                 gtk_widget_get_allocation (win, &allocation);
@@ -139,40 +173,35 @@ add_hide_timeout (MsdOsdWindow *window)
                                                        window);
 }
 
-/* This is our draw-event handler when the window is in a compositing manager.
- * We draw everything by hand, using Cairo, so that we can have a nice
- * transparent/rounded look.
- */
-static void
-draw_when_composited (GtkWidget *widget, cairo_t *orig_cr)
+static gboolean
+render_content (MsdOsdWindow *window,
+                cairo_t      *orig_cr,
+                int           width,
+                int           height)
 {
-        MsdOsdWindow    *window;
-        cairo_t         *cr;
-        cairo_surface_t *surface;
-        int              width;
-        int              height;
         GtkStyleContext *context;
+        cairo_t         *cr;
 
-        window = MSD_OSD_WINDOW (widget);
+        g_clear_pointer (&window->priv->content, cairo_surface_destroy);
 
-        context = gtk_widget_get_style_context (widget);
-        cairo_set_operator (orig_cr, CAIRO_OPERATOR_SOURCE);
-        gtk_window_get_size (GTK_WINDOW (widget), &width, &height);
+        window->priv->content = cairo_surface_create_similar (cairo_get_target (orig_cr),
+                                                              CAIRO_CONTENT_COLOR_ALPHA,
+                                                              width,
+                                                              height);
 
-        surface = cairo_surface_create_similar (cairo_get_target (orig_cr),
-                                                CAIRO_CONTENT_COLOR_ALPHA,
-                                                width,
-                                                height);
-
-        if (cairo_surface_status (surface) != CAIRO_STATUS_SUCCESS) {
-                goto done;
+        if (cairo_surface_status (window->priv->content) != CAIRO_STATUS_SUCCESS) {
+                g_clear_pointer (&window->priv->content, cairo_surface_destroy);
+                return FALSE;
         }
 
-        cr = cairo_create (surface);
+        cr = cairo_create (window->priv->content);
         if (cairo_status (cr) != CAIRO_STATUS_SUCCESS) {
-                goto done;
+                cairo_destroy (cr);
+                g_clear_pointer (&window->priv->content, cairo_surface_destroy);
+                return FALSE;
         }
 
+        context = gtk_widget_get_style_context (GTK_WIDGET (window));
         gtk_render_background (context, cr, 0, 0, width, height);
         gtk_render_frame (context, cr, 0, 0, width, height);
 
@@ -180,18 +209,46 @@ draw_when_composited (GtkWidget *widget, cairo_t *orig_cr)
 
         cairo_destroy (cr);
 
+        window->priv->content_width = width;
+        window->priv->content_height = height;
+        window->priv->content_dirty = FALSE;
+        window->priv->stats.n_content_renders++;
+
+        return TRUE;
+}
+
+/* This is our draw-event handler when the window is in a compositing manager.
+ * We draw everything by hand, using Cairo, so that we can have a nice
+ * transparent/rounded look.  The result is retained in priv->content and
+ * only rendered again once the window has been marked dirty or resized.
+ */
+static void
+draw_when_composited (GtkWidget *widget, cairo_t *orig_cr)
+{
+        MsdOsdWindow    *window;
+        int              width;
+        int              height;
+
+        window = MSD_OSD_WINDOW (widget);
+
+        cairo_set_operator (orig_cr, CAIRO_OPERATOR_SOURCE);
+        gtk_window_get_size (GTK_WINDOW (widget), &width, &height);
+
+        if (window->priv->content == NULL ||
+            window->priv->content_dirty ||
+            window->priv->content_width != width ||
+            window->priv->content_height != height) {
+                if (!render_content (window, orig_cr, width, height))
+                        return;
+        }
+
         /* Make sure we have a transparent background */
         cairo_rectangle (orig_cr, 0, 0, width, height);
         cairo_set_source_rgba (orig_cr, 0.0, 0.0, 0.0, 0.0);
         cairo_fill (orig_cr);
 
-        cairo_set_source_surface (orig_cr, surface, 0, 0);
+        cairo_set_source_surface (orig_cr, window->priv->content, 0, 0);
         cairo_paint_with_alpha (orig_cr, window->priv->fade_out_alpha);
-
-done:
-        if (surface != NULL) {
-                cairo_surface_destroy (surface);
-        }
 }
 
 /* This is our draw-event handler when the window is *not* in a compositing manager.
@@ -226,9 +283,13 @@ msd_osd_window_draw (GtkWidget *widget,
 {
 	MsdOsdWindow *window;
 	GtkWidget *child;
+	gint64 start_time;
+	gint64 frame_time;
 
 	window = MSD_OSD_WINDOW (widget);
 
+	start_time = g_get_monotonic_time ();
+
 	if (window->priv->is_composited)
 		draw_when_composited (widget, cr);
 	else
@@ -238,6 +299,11 @@ msd_osd_window_draw (GtkWidget *widget,
 	if (child)
 		gtk_container_propagate_draw (GTK_CONTAINER (window), child, cr);
 
+	frame_time = g_get_monotonic_time () - start_time;
+	window->priv->stats.n_frames++;
+	window->priv->stats.total_frame_time += frame_time;
+	window->priv->stats.max_frame_time = MAX (window->priv->stats.max_frame_time, frame_time);
+
 	return FALSE;
 }
 
@@ -266,6 +332,7 @@ msd_osd_window_real_hide (GtkWidget *widget)
 
         window = MSD_OSD_WINDOW (widget);
         remove_hide_timeout (window);
+        log_frame_stats (window);
 }
 
 static void
@@ -294,6 +361,16 @@ msd_osd_window_real_realize (GtkWidget *widget)
         cairo_region_destroy (region);
 }
 
+static void
+msd_osd_window_real_unrealize (GtkWidget *widget)
+{
+        MsdOsdWindow *window = MSD_OSD_WINDOW (widget);
+
+        g_clear_pointer (&window->priv->content, cairo_surface_destroy);
+
+        GTK_WIDGET_CLASS (msd_osd_window_parent_class)->unrealize (widget);
+}
+
 static void
 msd_osd_window_style_updated (GtkWidget *widget)
 {
@@ -302,6 +379,8 @@ msd_osd_window_style_updated (GtkWidget *widget)
 
         GTK_WIDGET_CLASS (msd_osd_window_parent_class)->style_updated (widget);
 
+        MSD_OSD_WINDOW (widget)->priv->content_dirty = TRUE;
+
         /* We set our border width to 12 (per the MATE standard), plus the
          * padding of the frame that we draw in our expose/draw handler.  This will
          * make our child be 12 pixels away from the frame.
@@ -385,6 +464,7 @@ msd_osd_window_class_init (MsdOsdWindowClass *klass)
         widget_class->show = msd_osd_window_real_show;
         widget_class->hide = msd_osd_window_real_hide;
         widget_class->realize = msd_osd_window_real_realize;
+        widget_class->unrealize = msd_osd_window_real_unrealize;
         widget_class->style_updated = msd_osd_window_style_updated;
         widget_class->get_preferred_width = msd_osd_window_get_preferred_width;
         widget_class->get_preferred_height = msd_osd_window_get_preferred_height;
@@ -478,6 +558,8 @@ msd_osd_window_new (void)
  * @window: a #MsdOsdWindow
  *
  * Queues the @window for immediate drawing, and queues a timer to hide the window.
+ * The composited content is only rendered again if it was invalidated with
+ * msd_osd_window_invalidate_content().
  */
 void
 msd_osd_window_update_and_hide (MsdOsdWindow *window)
@@ -489,3 +571,18 @@ msd_osd_window_update_and_hide (MsdOsdWindow *window)
                 gtk_widget_queue_draw (GTK_WIDGET (window));
         }
 }
+
+/**
+ * msd_osd_window_invalidate_content:
+ * @window: a #MsdOsdWindow
+ *
+ * Marks the composited content as out of date, so that the next draw
+ * renders it again.  Call this when what the window shows has changed.
+ */
+void
+msd_osd_window_invalidate_content (MsdOsdWindow *window)
+{
+        g_return_if_fail (MSD_IS_OSD_WINDOW (window));
+
+        window->priv->content_dirty = TRUE;
+}
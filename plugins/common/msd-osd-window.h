@@ -79,6 +79,7 @@ GtkWidget *           msd_osd_window_new               (void);
 gboolean              msd_osd_window_is_composited     (MsdOsdWindow      *window);
 gboolean              msd_osd_window_is_valid          (MsdOsdWindow      *window);
 void                  msd_osd_window_update_and_hide   (MsdOsdWindow      *window);
+void                  msd_osd_window_invalidate_content (MsdOsdWindow      *window);
 
 #ifdef __cplusplus
 }
@@ -44,9 +44,25 @@
 #include "msd-datetime-mechanism.h"
 #include "msd-datetime-mechanism-glue.h"
 
+#define SETTIME_ACTION          "org.mate.settingsdaemon.datetimemechanism.settime"
+#define SETTIMEZONE_ACTION      "org.mate.settingsdaemon.datetimemechanism.settimezone"
+#define CONFIGUREHWCLOCK_ACTION "org.mate.settingsdaemon.datetimemechanism.configurehwclock"
+
+/* How long a positive polkit answer is reused for the same caller */
+#define AUTH_CACHE_TTL (10 * G_USEC_PER_SEC)
+
+/* Operations (polkit checks, queued time changes, hwclock runs, timezone
+ * writes) still in flight; the killtimer must not fire while any remain. */
+static guint n_pending_ops = 0;
+
 static gboolean
 do_exit (gpointer user_data)
 {
+        if (n_pending_ops > 0) {
+                g_debug ("Not exiting, %u operations still pending", n_pending_ops);
+                return TRUE;
+        }
+
         g_debug ("Exiting due to inactivity");
         exit (1);
         return FALSE;
@@ -64,11 +80,67 @@ reset_killtimer (void)
         timer_id = g_timeout_add_seconds (30, do_exit, NULL);
 }
 
+static void
+hold_killtimer (void)
+{
+        n_pending_ops++;
+}
+
+static void
+release_killtimer (void)
+{
+        g_assert (n_pending_ops > 0);
+
+        n_pending_ops--;
+        reset_killtimer ();
+}
+
+/* Called once the caller has been authorized; @data is then owned by
+ * the callback.  If authorization fails the error is returned on
+ * @context and @data is released with the waiter's destroy notify. */
+typedef void (*AuthorizedFunc) (MsdDatetimeMechanism  *mechanism,
+                                DBusGMethodInvocation *context,
+                                gpointer               data);
+
+typedef struct
+{
+        DBusGMethodInvocation *context;
+        AuthorizedFunc         func;
+        gpointer               data;
+        GDestroyNotify         destroy;
+} AuthWaiter;
+
+/* One polkit round-trip shared by every request from the same sender
+ * for the same action that arrives while it is outstanding. */
+typedef struct
+{
+        MsdDatetimeMechanism *mechanism;
+        char                 *key;
+        char                 *action;
+        GSList               *waiters;
+} AuthCheck;
+
+typedef struct
+{
+        DBusGMethodInvocation *context;
+        gboolean               relative;
+        gint64                 seconds;
+} TimeRequest;
+
 struct MsdDatetimeMechanismPrivate
 {
         DBusGConnection *system_bus_connection;
         DBusGProxy      *system_bus_proxy;
         PolkitAuthority *auth;
+
+        GHashTable      *auth_cache;    /* "sender action" -> gint64 expiry */
+        GHashTable      *auth_checks;   /* "sender action" -> AuthCheck */
+
+        GQueue           time_requests;
+        guint            time_apply_id;
+
+        GPid             hwclock_pid;
+        gboolean         hwclock_pending;
 };
 
 static void     msd_datetime_mechanism_finalize    (GObject     *object);
@@ -148,6 +220,10 @@ msd_datetime_mechanism_init (MsdDatetimeMechanism *mechanism)
 {
         mechanism->priv = msd_datetime_mechanism_get_instance_private (mechanism);
 
+        mechanism->priv->auth_cache = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                             g_free, g_free);
+        mechanism->priv->auth_checks = g_hash_table_new (g_str_hash, g_str_equal);
+        g_queue_init (&mechanism->priv->time_requests);
 }
 
 static void
@@ -164,6 +240,12 @@ msd_datetime_mechanism_finalize (GObject *object)
 
         g_object_unref (mechanism->priv->system_bus_proxy);
 
+        g_hash_table_destroy (mechanism->priv->auth_cache);
+        g_hash_table_destroy (mechanism->priv->auth_checks);
+
+        if (mechanism->priv->time_apply_id != 0)
+                g_source_remove (mechanism->priv->time_apply_id);
+
         G_OBJECT_CLASS (msd_datetime_mechanism_parent_class)->finalize (object);
 }
 
@@ -224,102 +306,328 @@ msd_datetime_mechanism_new (void)
         return MSD_DATETIME_MECHANISM (object);
 }
 
+static char *
+auth_cache_key (const char *sender,
+                const char *action)
+{
+        return g_strdup_printf ("%s %s", sender, action);
+}
+
 static gboolean
-_check_polkit_for_action (MsdDatetimeMechanism *mechanism, DBusGMethodInvocation *context, const char *action)
+auth_cache_expired (gpointer key,
+                    gpointer value,
+                    gpointer user_data)
 {
-        const char *sender;
-        GError *error;
-        PolkitSubject *subject;
+        return *(gint64 *) value <= *(gint64 *) user_data;
+}
+
+static gboolean
+auth_cache_lookup (MsdDatetimeMechanism *mechanism,
+                   const char           *key)
+{
+        gint64 *expires;
+
+        expires = g_hash_table_lookup (mechanism->priv->auth_cache, key);
+        if (expires == NULL)
+                return FALSE;
+
+        if (*expires <= g_get_monotonic_time ()) {
+                g_hash_table_remove (mechanism->priv->auth_cache, key);
+                return FALSE;
+        }
+
+        return TRUE;
+}
+
+static void
+auth_cache_insert (MsdDatetimeMechanism *mechanism,
+                   const char           *key)
+{
+        gint64 now;
+        gint64 *expires;
+
+        /* Callers are short-lived; drop whatever has gone stale so the
+         * table never grows beyond the set of recent callers. */
+        now = g_get_monotonic_time ();
+        g_hash_table_foreach_remove (mechanism->priv->auth_cache, auth_cache_expired, &now);
+
+        expires = g_new (gint64, 1);
+        *expires = now + AUTH_CACHE_TTL;
+        g_hash_table_replace (mechanism->priv->auth_cache, g_strdup (key), expires);
+}
+
+static void
+check_authorization_cb (GObject      *source,
+                        GAsyncResult *res,
+                        gpointer      user_data)
+{
+        AuthCheck *check = user_data;
+        MsdDatetimeMechanism *mechanism = check->mechanism;
         PolkitAuthorizationResult *result;
+        GError *error;
+        GSList *l;
 
         error = NULL;
+        result = polkit_authority_check_authorization_finish (POLKIT_AUTHORITY (source), res, &error);
+
+        g_hash_table_remove (mechanism->priv->auth_checks, check->key);
+
+        if (result != NULL) {
+                if (polkit_authorization_result_get_is_authorized (result))
+                        auth_cache_insert (mechanism, check->key);
+                else
+                        error = g_error_new (MSD_DATETIME_MECHANISM_ERROR,
+                                             MSD_DATETIME_MECHANISM_ERROR_NOT_PRIVILEGED,
+                                             "Not Authorized for action %s", check->action);
+                g_object_unref (result);
+        }
+
+        for (l = check->waiters; l != NULL; l = l->next) {
+                AuthWaiter *waiter = l->data;
+
+                if (error != NULL) {
+                        dbus_g_method_return_error (waiter->context, error);
+                        if (waiter->destroy != NULL)
+                                waiter->destroy (waiter->data);
+                } else {
+                        waiter->func (mechanism, waiter->context, waiter->data);
+                }
+                g_free (waiter);
+        }
+
+        if (error != NULL)
+                g_error_free (error);
+
+        g_slist_free (check->waiters);
+        g_free (check->key);
+        g_free (check->action);
+        g_object_unref (check->mechanism);
+        g_free (check);
+
+        release_killtimer ();
+}
+
+static void
+_check_polkit_for_action (MsdDatetimeMechanism  *mechanism,
+                          DBusGMethodInvocation *context,
+                          const char            *action,
+                          AuthorizedFunc         func,
+                          gpointer               data,
+                          GDestroyNotify         destroy)
+{
+        char *sender;
+        char *key;
+        AuthWaiter *waiter;
+        AuthCheck *check;
+        PolkitSubject *subject;
 
         /* Check that caller is privileged */
         sender = dbus_g_method_get_sender (context);
-        subject = polkit_system_bus_name_new (sender);
+        key = auth_cache_key (sender, action);
+
+        if (auth_cache_lookup (mechanism, key)) {
+                g_debug ("Using cached authorization for %s", key);
+                g_free (key);
+                g_free (sender);
+                func (mechanism, context, data);
+                return;
+        }
+
+        waiter = g_new0 (AuthWaiter, 1);
+        waiter->context = context;
+        waiter->func = func;
+        waiter->data = data;
+        waiter->destroy = destroy;
+
+        check = g_hash_table_lookup (mechanism->priv->auth_checks, key);
+        if (check != NULL) {
+                check->waiters = g_slist_append (check->waiters, waiter);
+                g_free (key);
+                g_free (sender);
+                return;
+        }
 
-        result = polkit_authority_check_authorization_sync (mechanism->priv->auth,
-                                                            subject,
-                                                            action,
-                                                            NULL,
-                                                            POLKIT_CHECK_AUTHORIZATION_FLAGS_ALLOW_USER_INTERACTION,
-                                                            NULL, &error);
+        check = g_new0 (AuthCheck, 1);
+        check->mechanism = g_object_ref (mechanism);
+        check->key = key;
+        check->action = g_strdup (action);
+        check->waiters = g_slist_append (NULL, waiter);
+        g_hash_table_insert (mechanism->priv->auth_checks, check->key, check);
+
+        hold_killtimer ();
+
+        subject = polkit_system_bus_name_new (sender);
+        polkit_authority_check_authorization (mechanism->priv->auth,
+                                              subject,
+                                              action,
+                                              NULL,
+                                              POLKIT_CHECK_AUTHORIZATION_FLAGS_ALLOW_USER_INTERACTION,
+                                              NULL,
+                                              check_authorization_cb,
+                                              check);
         g_object_unref (subject);
+        g_free (sender);
+}
 
-        if (error) {
-                dbus_g_method_return_error (context, error);
+static void _sync_hwclock (MsdDatetimeMechanism *mechanism);
+
+static void
+hwclock_exited_cb (GPid     pid,
+                   gint     status,
+                   gpointer user_data)
+{
+        MsdDatetimeMechanism *mechanism = user_data;
+        GError *error = NULL;
+
+        g_spawn_close_pid (pid);
+        mechanism->priv->hwclock_pid = 0;
+
+        if (!g_spawn_check_exit_status (status, &error)) {
+                g_warning ("/sbin/hwclock --systohc failed: %s", error->message);
                 g_error_free (error);
+        }
 
-                return FALSE;
+        /* The system time changed again while hwclock was running */
+        if (mechanism->priv->hwclock_pending) {
+                mechanism->priv->hwclock_pending = FALSE;
+                _sync_hwclock (mechanism);
         }
 
-        if (!polkit_authorization_result_get_is_authorized (result)) {
-                error = g_error_new (MSD_DATETIME_MECHANISM_ERROR,
-                                     MSD_DATETIME_MECHANISM_ERROR_NOT_PRIVILEGED,
-                                     "Not Authorized for action %s", action);
-                dbus_g_method_return_error (context, error);
-                g_error_free (error);
-                g_object_unref (result);
+        release_killtimer ();
+}
 
-                return FALSE;
+/* Copies the system time to the RTC without holding up the caller.
+ * Requests that arrive while hwclock is still running are folded into
+ * a single rerun once it exits. */
+static void
+_sync_hwclock (MsdDatetimeMechanism *mechanism)
+{
+        char *argv[] = { "/sbin/hwclock", "--systohc", NULL };
+        GError *error;
+
+        if (mechanism->priv->hwclock_pid != 0) {
+                mechanism->priv->hwclock_pending = TRUE;
+                return;
         }
 
-        g_object_unref (result);
+        if (!g_file_test ("/sbin/hwclock",
+                          G_FILE_TEST_EXISTS | G_FILE_TEST_IS_REGULAR | G_FILE_TEST_IS_EXECUTABLE))
+                return;
 
-        return TRUE;
-}
+        error = NULL;
+        if (!g_spawn_async (NULL, argv, NULL,
+                            G_SPAWN_DO_NOT_REAP_CHILD,
+                            NULL, NULL,
+                            &mechanism->priv->hwclock_pid,
+                            &error)) {
+                g_warning ("Error spawning /sbin/hwclock: %s", error->message);
+                g_error_free (error);
+                mechanism->priv->hwclock_pid = 0;
+                return;
+        }
 
+        hold_killtimer ();
+        g_child_watch_add (mechanism->priv->hwclock_pid, hwclock_exited_cb, mechanism);
+}
 
+/* Applies every queued SetTime/AdjustTime in arrival order with a single
+ * settimeofday() and answers all of them with the same result. */
 static gboolean
-_set_time (MsdDatetimeMechanism  *mechanism,
-           const struct timeval  *tv,
-           DBusGMethodInvocation *context)
+_apply_time_requests (gpointer user_data)
 {
+        MsdDatetimeMechanism *mechanism = user_data;
+        struct timeval tv;
+        TimeRequest *request;
         GError *error;
+        GList *l;
 
-        if (!_check_polkit_for_action (mechanism, context, "org.mate.settingsdaemon.datetimemechanism.settime"))
-                return FALSE;
+        mechanism->priv->time_apply_id = 0;
 
-        if (settimeofday (tv, NULL) != 0) {
+        error = NULL;
+        if (gettimeofday (&tv, NULL) != 0) {
                 error = g_error_new (MSD_DATETIME_MECHANISM_ERROR,
                                      MSD_DATETIME_MECHANISM_ERROR_GENERAL,
-                                     "Error calling settimeofday({%ld,%ld}): %s",
-                                     (gint64) tv->tv_sec, (gint64) tv->tv_usec,
-                                     strerror (errno));
-                dbus_g_method_return_error (context, error);
-                g_error_free (error);
-                return FALSE;
-        }
-
-        if (g_file_test ("/sbin/hwclock",
-                         G_FILE_TEST_EXISTS | G_FILE_TEST_IS_REGULAR | G_FILE_TEST_IS_EXECUTABLE)) {
-                int exit_status;
-                if (!g_spawn_command_line_sync ("/sbin/hwclock --systohc", NULL, NULL, &exit_status, &error)) {
-                        GError *error2;
-                        error2 = g_error_new (MSD_DATETIME_MECHANISM_ERROR,
-                                              MSD_DATETIME_MECHANISM_ERROR_GENERAL,
-                                              "Error spawning /sbin/hwclock: %s", error->message);
-                        g_error_free (error);
-                        dbus_g_method_return_error (context, error2);
-                        g_error_free (error2);
-                        return FALSE;
+                                     "Error calling gettimeofday(): %s", strerror (errno));
+        } else {
+                for (l = mechanism->priv->time_requests.head; l != NULL; l = l->next) {
+                        request = l->data;
+
+                        if (request->relative) {
+                                tv.tv_sec += (time_t) request->seconds;
+                        } else {
+                                tv.tv_sec = (time_t) request->seconds;
+                                tv.tv_usec = 0;
+                        }
                 }
-                if (WEXITSTATUS (exit_status) != 0) {
+
+                g_debug ("Applying %u time request(s)", mechanism->priv->time_requests.length);
+
+                if (settimeofday (&tv, NULL) != 0) {
                         error = g_error_new (MSD_DATETIME_MECHANISM_ERROR,
                                              MSD_DATETIME_MECHANISM_ERROR_GENERAL,
-                                             "/sbin/hwclock returned %d", exit_status);
-                        dbus_g_method_return_error (context, error);
-                        g_error_free (error);
-                        return FALSE;
+                                             "Error calling settimeofday({%ld,%ld}): %s",
+                                             (gint64) tv.tv_sec, (gint64) tv.tv_usec,
+                                             strerror (errno));
                 }
         }
 
-        dbus_g_method_return (context);
+        while ((request = g_queue_pop_head (&mechanism->priv->time_requests)) != NULL) {
+                if (error != NULL)
+                        dbus_g_method_return_error (request->context, error);
+                else
+                        dbus_g_method_return (request->context);
+                g_free (request);
+        }
+
+        if (error != NULL)
+                g_error_free (error);
+        else
+                _sync_hwclock (mechanism);
+
+        release_killtimer ();
+
+        return FALSE;
+}
+
+static void
+_queue_time_request (MsdDatetimeMechanism  *mechanism,
+                     DBusGMethodInvocation *context,
+                     gpointer               data)
+{
+        g_queue_push_tail (&mechanism->priv->time_requests, data);
+
+        if (mechanism->priv->time_apply_id == 0) {
+                hold_killtimer ();
+                mechanism->priv->time_apply_id = g_idle_add (_apply_time_requests, mechanism);
+        }
+}
+
+static gboolean
+_set_time (MsdDatetimeMechanism  *mechanism,
+           gboolean               relative,
+           gint64                 seconds,
+           DBusGMethodInvocation *context)
+{
+        TimeRequest *request;
+
+        request = g_new0 (TimeRequest, 1);
+        request->context = context;
+        request->relative = relative;
+        request->seconds = seconds;
+
+        _check_polkit_for_action (mechanism, context, SETTIME_ACTION,
+                                  _queue_time_request, request, g_free);
+
         return TRUE;
 }
 
+/* Every writer of the system config files (the timezone worker and the
+ * hardware clock worker, which both touch /etc/sysconfig/clock) takes
+ * this lock, so concurrent calls cannot lose each other's update. */
+static GMutex config_lock;
+
 static gboolean
-_rh_update_etc_sysconfig_clock (DBusGMethodInvocation *context, const char *key, const char *value)
+_rh_update_etc_sysconfig_clock (const char *key, const char *value, GError **error)
 {
         /* On Red Hat / Fedora, the /etc/sysconfig/clock file needs to be kept in sync */
         if (g_file_test ("/etc/sysconfig/clock", G_FILE_TEST_EXISTS | G_FILE_TEST_IS_REGULAR)) {
@@ -328,17 +636,14 @@ _rh_update_etc_sysconfig_clock (DBusGMethodInvocation *context, const char *key,
                 gboolean replaced;
                 char *data;
                 gsize len;
-                GError *error;
+                GError *error2;
 
-                error = NULL;
+                error2 = NULL;
 
-                if (!g_file_get_contents ("/etc/sysconfig/clock", &data, &len, &error)) {
-                        GError *error2;
-                        error2 = g_error_new (MSD_DATETIME_MECHANISM_ERROR,
-                                              MSD_DATETIME_MECHANISM_ERROR_GENERAL,
-                                              "Error reading /etc/sysconfig/clock file: %s", error->message);
-                        g_error_free (error);
-                        dbus_g_method_return_error (context, error2);
+                if (!g_file_get_contents ("/etc/sysconfig/clock", &data, &len, &error2)) {
+                        g_set_error (error, MSD_DATETIME_MECHANISM_ERROR,
+                                     MSD_DATETIME_MECHANISM_ERROR_GENERAL,
+                                     "Error reading /etc/sysconfig/clock file: %s", error2->message);
                         g_error_free (error2);
                         return FALSE;
                 }
@@ -364,15 +669,13 @@ _rh_update_etc_sysconfig_clock (DBusGMethodInvocation *context, const char *key,
                         }
                         data = g_string_free (str, FALSE);
                         len = strlen (data);
-                        if (!g_file_set_contents ("/etc/sysconfig/clock", data, len, &error)) {
-                                GError *error2;
-                                error2 = g_error_new (MSD_DATETIME_MECHANISM_ERROR,
-                                                      MSD_DATETIME_MECHANISM_ERROR_GENERAL,
-                                                      "Error updating /etc/sysconfig/clock: %s", error->message);
-                                g_error_free (error);
-                                dbus_g_method_return_error (context, error2);
+                        if (!g_file_set_contents ("/etc/sysconfig/clock", data, len, &error2)) {
+                                g_set_error (error, MSD_DATETIME_MECHANISM_ERROR,
+                                             MSD_DATETIME_MECHANISM_ERROR_GENERAL,
+                                             "Error updating /etc/sysconfig/clock: %s", error2->message);
                                 g_error_free (error2);
                                 g_free (data);
+                                g_strfreev (lines);
                                 return FALSE;
                         }
                         g_free (data);
@@ -390,14 +693,10 @@ msd_datetime_mechanism_set_time (MsdDatetimeMechanism  *mechanism,
                                  gint64                 seconds_since_epoch,
                                  DBusGMethodInvocation *context)
 {
-        struct timeval tv;
-
         reset_killtimer ();
         g_debug ("SetTime(%ld) called", seconds_since_epoch);
 
-        tv.tv_sec = (time_t) seconds_since_epoch;
-        tv.tv_usec = 0;
-        return _set_time (mechanism, &tv, context);
+        return _set_time (mechanism, FALSE, seconds_since_epoch, context);
 }
 
 gboolean
@@ -405,42 +704,41 @@ msd_datetime_mechanism_adjust_time (MsdDatetimeMechanism  *mechanism,
                                     gint64                 seconds_to_add,
                                     DBusGMethodInvocation *context)
 {
-        struct timeval tv;
-
         reset_killtimer ();
         g_debug ("AdjustTime(%ld) called", seconds_to_add);
 
-        if (gettimeofday (&tv, NULL) != 0) {
-                GError *error;
-                error = g_error_new (MSD_DATETIME_MECHANISM_ERROR,
-                                     MSD_DATETIME_MECHANISM_ERROR_GENERAL,
-                                     "Error calling gettimeofday(): %s", strerror (errno));
-                dbus_g_method_return_error (context, error);
-                g_error_free (error);
-                return FALSE;
-        }
-
-        tv.tv_sec += (time_t) seconds_to_add;
-        return _set_time (mechanism, &tv, context);
+        return _set_time (mechanism, TRUE, seconds_to_add, context);
 }
 
-
-gboolean
-msd_datetime_mechanism_set_timezone (MsdDatetimeMechanism  *mechanism,
-                                     const char            *zone_file,
-                                     DBusGMethodInvocation *context)
+static void
+set_timezone_thread (GTask        *task,
+                     gpointer      source_object,
+                     gpointer      task_data,
+                     GCancellable *cancellable)
 {
-        GError *error;
+        const char *zone_file = task_data;
+        GError *error = NULL;
+        gboolean ret;
 
-        reset_killtimer ();
-        g_debug ("SetTimezone('%s') called", zone_file);
+        g_mutex_lock (&config_lock);
+        ret = system_timezone_set_from_file (zone_file, &error);
+        g_mutex_unlock (&config_lock);
 
-        if (!_check_polkit_for_action (mechanism, context, "org.mate.settingsdaemon.datetimemechanism.settimezone"))
-                return FALSE;
+        if (ret)
+                g_task_return_boolean (task, TRUE);
+        else
+                g_task_return_error (task, error);
+}
 
-        error = NULL;
+static void
+set_timezone_done_cb (GObject      *source,
+                      GAsyncResult *res,
+                      gpointer      user_data)
+{
+        DBusGMethodInvocation *context = user_data;
+        GError *error = NULL;
 
-        if (!system_timezone_set_from_file (zone_file, &error)) {
+        if (!g_task_propagate_boolean (G_TASK (res), &error)) {
                 GError *error2;
                 int     code;
 
@@ -456,11 +754,39 @@ msd_datetime_mechanism_set_timezone (MsdDatetimeMechanism  *mechanism,
 
                 dbus_g_method_return_error (context, error2);
                 g_error_free (error2);
-
-                return FALSE;
+        } else {
+                dbus_g_method_return (context);
         }
 
-        dbus_g_method_return (context);
+        release_killtimer ();
+}
+
+static void
+_set_timezone (MsdDatetimeMechanism  *mechanism,
+               DBusGMethodInvocation *context,
+               gpointer               data)
+{
+        GTask *task;
+
+        /* The config rewrites hit the disk; keep them off the bus thread */
+        hold_killtimer ();
+        task = g_task_new (mechanism, NULL, set_timezone_done_cb, context);
+        g_task_set_task_data (task, data, g_free);
+        g_task_run_in_thread (task, set_timezone_thread);
+        g_object_unref (task);
+}
+
+gboolean
+msd_datetime_mechanism_set_timezone (MsdDatetimeMechanism  *mechanism,
+                                     const char            *zone_file,
+                                     DBusGMethodInvocation *context)
+{
+        reset_killtimer ();
+        g_debug ("SetTimezone('%s') called", zone_file);
+
+        _check_polkit_for_action (mechanism, context, SETTIMEZONE_ACTION,
+                                  _set_timezone, g_strdup (zone_file), g_free);
+
         return TRUE;
 }
 
@@ -534,80 +860,116 @@ msd_datetime_mechanism_get_hardware_clock_using_utc (MsdDatetimeMechanism  *mech
         return TRUE;
 }
 
-gboolean
-msd_datetime_mechanism_set_hardware_clock_using_utc (MsdDatetimeMechanism  *mechanism,
-                                                     gboolean               using_utc,
-                                                     DBusGMethodInvocation *context)
+static void
+set_hardware_clock_thread (GTask        *task,
+                           gpointer      source_object,
+                           gpointer      task_data,
+                           GCancellable *cancellable)
 {
+        gboolean using_utc = GPOINTER_TO_INT (task_data);
         GError *error;
 
         error = NULL;
 
-        if (!_check_polkit_for_action (mechanism, context,
-                                       "org.mate.settingsdaemon.datetimemechanism.configurehwclock"))
-                return FALSE;
-
         if (g_file_test ("/sbin/hwclock",
                          G_FILE_TEST_EXISTS | G_FILE_TEST_IS_REGULAR | G_FILE_TEST_IS_EXECUTABLE)) {
                 int exit_status;
                 char *cmd;
+                gboolean ret;
+
                 cmd = g_strdup_printf ("/sbin/hwclock %s --systohc", using_utc ? "--utc" : "--localtime");
                 if (!g_spawn_command_line_sync (cmd, NULL, NULL, &exit_status, &error)) {
-                        GError *error2;
-                        error2 = g_error_new (MSD_DATETIME_MECHANISM_ERROR,
-                                              MSD_DATETIME_MECHANISM_ERROR_GENERAL,
-                                              "Error spawning /sbin/hwclock: %s", error->message);
+                        g_task_return_new_error (task, MSD_DATETIME_MECHANISM_ERROR,
+                                                 MSD_DATETIME_MECHANISM_ERROR_GENERAL,
+                                                 "Error spawning /sbin/hwclock: %s", error->message);
                         g_error_free (error);
-                        dbus_g_method_return_error (context, error2);
-                        g_error_free (error2);
                         g_free (cmd);
-                        return FALSE;
+                        return;
                 }
                 g_free (cmd);
                 if (WEXITSTATUS (exit_status) != 0) {
-                        error = g_error_new (MSD_DATETIME_MECHANISM_ERROR,
-                                             MSD_DATETIME_MECHANISM_ERROR_GENERAL,
-                                             "/sbin/hwclock returned %d", exit_status);
-                        dbus_g_method_return_error (context, error);
-                        g_error_free (error);
-                        return FALSE;
+                        g_task_return_new_error (task, MSD_DATETIME_MECHANISM_ERROR,
+                                                 MSD_DATETIME_MECHANISM_ERROR_GENERAL,
+                                                 "/sbin/hwclock returned %d", exit_status);
+                        return;
                 }
 
-                if (!_rh_update_etc_sysconfig_clock (context, "UTC=", using_utc ? "true" : "false"))
-                        return FALSE;
+                g_mutex_lock (&config_lock);
+                ret = _rh_update_etc_sysconfig_clock ("UTC=", using_utc ? "true" : "false", &error);
+                g_mutex_unlock (&config_lock);
+
+                if (!ret) {
+                        g_task_return_error (task, error);
+                        return;
+                }
+        }
+
+        g_task_return_boolean (task, TRUE);
+}
+
+static void
+set_hardware_clock_done_cb (GObject      *source,
+                            GAsyncResult *res,
+                            gpointer      user_data)
+{
+        DBusGMethodInvocation *context = user_data;
+        GError *error = NULL;
 
+        if (!g_task_propagate_boolean (G_TASK (res), &error)) {
+                dbus_g_method_return_error (context, error);
+                g_error_free (error);
+        } else {
+                dbus_g_method_return (context);
         }
-        dbus_g_method_return (context);
+
+        release_killtimer ();
+}
+
+static void
+_set_hardware_clock_using_utc (MsdDatetimeMechanism  *mechanism,
+                               DBusGMethodInvocation *context,
+                               gpointer               data)
+{
+        GTask *task;
+
+        /* hwclock talks to the RTC and can take a second or more */
+        hold_killtimer ();
+        task = g_task_new (mechanism, NULL, set_hardware_clock_done_cb, context);
+        g_task_set_task_data (task, data, NULL);
+        g_task_run_in_thread (task, set_hardware_clock_thread);
+        g_object_unref (task);
+}
+
+gboolean
+msd_datetime_mechanism_set_hardware_clock_using_utc (MsdDatetimeMechanism  *mechanism,
+                                                     gboolean               using_utc,
+                                                     DBusGMethodInvocation *context)
+{
+        reset_killtimer ();
+
+        _check_polkit_for_action (mechanism, context, CONFIGUREHWCLOCK_ACTION,
+                                  _set_hardware_clock_using_utc,
+                                  GINT_TO_POINTER (using_utc), NULL);
+
         return TRUE;
 }
 
 static void
-check_can_do (MsdDatetimeMechanism  *mechanism,
-              const char            *action,
-              DBusGMethodInvocation *context)
+check_can_do_cb (GObject      *source,
+                 GAsyncResult *res,
+                 gpointer      user_data)
 {
-        const char *sender;
-        PolkitSubject *subject;
+        DBusGMethodInvocation *context = user_data;
         PolkitAuthorizationResult *result;
         GError *error;
 
-        /* Check that caller is privileged */
-        sender = dbus_g_method_get_sender (context);
-        subject = polkit_system_bus_name_new (sender);
-
         error = NULL;
-        result = polkit_authority_check_authorization_sync (mechanism->priv->auth,
-                                                            subject,
-                                                            action,
-                                                            NULL,
-                                                            0,
-                                                            NULL,
-                                                            &error);
-        g_object_unref (subject);
+        result = polkit_authority_check_authorization_finish (POLKIT_AUTHORITY (source), res, &error);
 
         if (error) {
                 dbus_g_method_return_error (context, error);
                 g_error_free (error);
+                release_killtimer ();
                 return;
         }
 
@@ -622,6 +984,46 @@ check_can_do (MsdDatetimeMechanism  *mechanism,
         }
 
         g_object_unref (result);
+        release_killtimer ();
+}
+
+static void
+check_can_do (MsdDatetimeMechanism  *mechanism,
+              const char            *action,
+              DBusGMethodInvocation *context)
+{
+        char *sender;
+        char *key;
+        PolkitSubject *subject;
+
+        reset_killtimer ();
+
+        /* Check that caller is privileged */
+        sender = dbus_g_method_get_sender (context);
+
+        /* A caller that was just authorized can certainly do it */
+        key = auth_cache_key (sender, action);
+        if (auth_cache_lookup (mechanism, key)) {
+                dbus_g_method_return (context, 2);
+                g_free (key);
+                g_free (sender);
+                return;
+        }
+        g_free (key);
+
+        hold_killtimer ();
+
+        subject = polkit_system_bus_name_new (sender);
+        polkit_authority_check_authorization (mechanism->priv->auth,
+                                              subject,
+                                              action,
+                                              NULL,
+                                              0,
+                                              NULL,
+                                              check_can_do_cb,
+                                              context);
+        g_object_unref (subject);
+        g_free (sender);
 }
 
 
@@ -630,7 +1032,7 @@ msd_datetime_mechanism_can_set_time (MsdDatetimeMechanism  *mechanism,
                                      DBusGMethodInvocation *context)
 {
         check_can_do (mechanism,
-                      "org.mate.settingsdaemon.datetimemechanism.settime",
+                      SETTIME_ACTION,
                       context);
 
         return TRUE;
@@ -641,7 +1043,7 @@ msd_datetime_mechanism_can_set_timezone (MsdDatetimeMechanism  *mechanism,
                                          DBusGMethodInvocation *context)
 {
         check_can_do (mechanism,
-                      "org.mate.settingsdaemon.datetimemechanism.settimezone",
+                      SETTIMEZONE_ACTION,
                       context);
 
         return TRUE;
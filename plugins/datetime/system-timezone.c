@@ -45,6 +45,8 @@
  * in some cases: eg, in tzdata2008b, Asia/Calcutta got renamed to
  * Asia/Kolkata and the old name is not in zone.tab. */
 
+#include <errno.h>
+#include <fcntl.h>
 #include <string.h>
 #include <unistd.h>
 
@@ -341,35 +343,6 @@ system_timezone_read_etc_timezone (void)
         return NULL;
 }
 
-static gboolean
-system_timezone_write_etc_timezone (const char  *tz,
-                                    GError     **error)
-{
-        char     *content;
-        GError   *our_error;
-        gboolean  retval;
-
-        if (!g_file_test (ETC_TIMEZONE, G_FILE_TEST_IS_REGULAR))
-                return TRUE;
-
-        content = g_strdup_printf ("%s\n", tz);
-
-        our_error = NULL;
-        retval = g_file_set_contents (ETC_TIMEZONE, content, -1, &our_error);
-        g_free (content);
-
-        if (!retval) {
-                g_set_error (error, SYSTEM_TIMEZONE_ERROR,
-                             SYSTEM_TIMEZONE_ERROR_GENERAL,
-                             ETC_TIMEZONE" cannot be overwritten: %s",
-                             our_error->message);
-                g_error_free (our_error);
-        }
-
-        return retval;
-}
-
-
 /* Read a file that looks like a key-file (but there's no need for groups)
  * and get the last value for a specific key */
 static char *
@@ -429,87 +402,6 @@ system_timezone_read_key_file (const char *filename,
         return retval;
 }
 
-static gboolean
-system_timezone_write_key_file (const char  *filename,
-                                const char  *key,
-                                const char  *value,
-                                GError     **error)
-{
-        GError    *our_error;
-        char      *content;
-        gsize      len;
-        char      *key_eq;
-        char     **lines;
-        gboolean   replaced;
-        gboolean   retval;
-        int        n;
-
-        if (!g_file_test (filename, G_FILE_TEST_IS_REGULAR))
-                return TRUE;
-
-        our_error = NULL;
-
-        if (!g_file_get_contents (filename, &content, &len, &our_error)) {
-                g_set_error (error, SYSTEM_TIMEZONE_ERROR,
-                             SYSTEM_TIMEZONE_ERROR_GENERAL,
-                             "%s cannot be read: %s",
-                             filename, our_error->message);
-                g_error_free (our_error);
-                return FALSE;
-        }
-
-        lines = g_strsplit (content, "\n", 0);
-        g_free (content);
-
-        key_eq = g_strdup_printf ("%s=", key);
-        replaced = FALSE;
-
-        for (n = 0; lines[n] != NULL; n++) {
-                if (g_str_has_prefix (lines[n], key_eq)) {
-                        char     *old_value;
-                        gboolean  use_quotes;
-
-                        old_value = lines[n] + strlen (key_eq);
-                        g_strstrip (old_value);
-                        use_quotes = old_value[0] == '\"';
-
-                        g_free (lines[n]);
-
-                        if (use_quotes)
-                                lines[n] = g_strdup_printf ("%s\"%s\"",
-                                                            key_eq, value);
-                        else
-                                lines[n] = g_strdup_printf ("%s%s",
-                                                            key_eq, value);
-
-                        replaced = TRUE;
-                }
-        }
-
-        g_free (key_eq);
-
-        if (!replaced) {
-                g_strfreev (lines);
-                return TRUE;
-        }
-
-        content = g_strjoinv ("\n", lines);
-        g_strfreev (lines);
-
-        retval = g_file_set_contents (filename, content, -1, &our_error);
-        g_free (content);
-
-        if (!retval) {
-                g_set_error (error, SYSTEM_TIMEZONE_ERROR,
-                             SYSTEM_TIMEZONE_ERROR_GENERAL,
-                             "%s cannot be overwritten: %s",
-                             filename, our_error->message);
-                g_error_free (our_error);
-        }
-
-        return retval;
-}
-
 /* This works for Solaris/OpenSolaris */
 static char *
 system_timezone_read_etc_TIMEZONE (void)
@@ -518,14 +410,6 @@ system_timezone_read_etc_TIMEZONE (void)
                                               "TZ");
 }
 
-static gboolean
-system_timezone_write_etc_TIMEZONE (const char  *tz,
-                                    GError     **error)
-{
-        return system_timezone_write_key_file (ETC_TIMEZONE_MAJ,
-                                               "TZ", tz, error);
-}
-
 /* This works for Fedora and Mandriva */
 static char *
 system_timezone_read_etc_sysconfig_clock (void)
@@ -534,14 +418,6 @@ system_timezone_read_etc_sysconfig_clock (void)
                                               "ZONE");
 }
 
-static gboolean
-system_timezone_write_etc_sysconfig_clock (const char  *tz,
-                                           GError     **error)
-{
-        return system_timezone_write_key_file (ETC_SYSCONFIG_CLOCK,
-                                               "ZONE", tz, error);
-}
-
 /* This works for openSUSE */
 static char *
 system_timezone_read_etc_sysconfig_clock_alt (void)
@@ -550,14 +426,6 @@ system_timezone_read_etc_sysconfig_clock_alt (void)
                                               "TIMEZONE");
 }
 
-static gboolean
-system_timezone_write_etc_sysconfig_clock_alt (const char  *tz,
-                                               GError     **error)
-{
-        return system_timezone_write_key_file (ETC_SYSCONFIG_CLOCK,
-                                               "TIMEZONE", tz, error);
-}
-
 /* This works for old Gentoo */
 static char *
 system_timezone_read_etc_conf_d_clock (void)
@@ -566,14 +434,6 @@ system_timezone_read_etc_conf_d_clock (void)
                                               "TIMEZONE");
 }
 
-static gboolean
-system_timezone_write_etc_conf_d_clock (const char  *tz,
-                                        GError     **error)
-{
-        return system_timezone_write_key_file (ETC_CONF_D_CLOCK,
-                                               "TIMEZONE", tz, error);
-}
-
 /* This works for Arch Linux */
 static char *
 system_timezone_read_etc_rc_conf (void)
@@ -582,14 +442,6 @@ system_timezone_read_etc_rc_conf (void)
                                               "TIMEZONE");
 }
 
-static gboolean
-system_timezone_write_etc_rc_conf (const char  *tz,
-                                   GError     **error)
-{
-        return system_timezone_write_key_file (ETC_RC_CONF,
-                                               "TIMEZONE", tz, error);
-}
-
 /*
  *
  * First, getting the timezone.
@@ -908,31 +760,164 @@ system_timezone_is_zone_file_valid (const char  *zone_file,
         return TRUE;
 }
 
-static gboolean
-system_timezone_set_etc_timezone (const char  *zone_file,
-                                  GError     **error)
+/* Every config file that may carry the timezone, with the keys that hold
+ * it.  Files without keys contain nothing but the timezone name. */
+typedef struct {
+        const char *path;
+        const char *keys[3];
+} TimezoneBackend;
+
+static const TimezoneBackend timezone_backends[] = {
+        /* Debian and derivatives (including Ubuntu), new Gentoo */
+        { ETC_TIMEZONE,        { NULL } },
+        /* Fedora and Mandriva (ZONE), openSUSE (TIMEZONE) */
+        { ETC_SYSCONFIG_CLOCK, { "ZONE", "TIMEZONE", NULL } },
+        /* Solaris/OpenSolaris */
+        { ETC_TIMEZONE_MAJ,    { "TZ", NULL } },
+        /* Arch Linux */
+        { ETC_RC_CONF,         { "TIMEZONE", NULL } },
+        /* old Gentoo */
+        { ETC_CONF_D_CLOCK,    { "TIMEZONE", NULL } }
+};
+
+/* Which of the files above exist is a property of the installed system,
+ * so it is only probed once (or again after the root changes). */
+G_LOCK_DEFINE_STATIC (backends);
+static char     *backends_root = NULL;
+static gboolean  backends_probed = FALSE;
+static gboolean  backends_present[G_N_ELEMENTS (timezone_backends)];
+
+void
+system_timezone_set_root (const char *root)
+{
+        G_LOCK (backends);
+        g_free (backends_root);
+        backends_root = g_strdup (root);
+        backends_probed = FALSE;
+        G_UNLOCK (backends);
+}
+
+static char *
+system_timezone_root_path (const char *path)
+{
+        char *retval;
+
+        G_LOCK (backends);
+        if (backends_root)
+                retval = g_build_filename (backends_root, path, NULL);
+        else
+                retval = g_strdup (path);
+        G_UNLOCK (backends);
+
+        return retval;
+}
+
+static void
+system_timezone_probe_backends (gboolean *present)
 {
-        GError *our_error;
+        guint i;
+
+        G_LOCK (backends);
+
+        if (!backends_probed) {
+                for (i = 0; i < G_N_ELEMENTS (timezone_backends); i++) {
+                        char *path;
+
+                        if (backends_root)
+                                path = g_build_filename (backends_root,
+                                                         timezone_backends[i].path,
+                                                         NULL);
+                        else
+                                path = g_strdup (timezone_backends[i].path);
+
+                        backends_present[i] = g_file_test (path, G_FILE_TEST_IS_REGULAR);
+                        g_free (path);
+                }
+                backends_probed = TRUE;
+        }
+
+        memcpy (present, backends_present, sizeof (backends_present));
+
+        G_UNLOCK (backends);
+}
+
+/* A file to be replaced as part of one timezone change */
+typedef struct {
+        char   *path;
+        char   *tmp_path;
         char   *content;
         gsize   len;
+        char   *link_target;
+        mode_t  mode;
+        int     fd;
+} TimezoneWrite;
 
-        if (!system_timezone_is_zone_file_valid (zone_file, error))
-                return FALSE;
+static void
+timezone_write_free (gpointer data)
+{
+        TimezoneWrite *pending = data;
+
+        if (pending->fd >= 0)
+                close (pending->fd);
+        /* Still set if the transaction was abandoned before the rename */
+        if (pending->tmp_path) {
+                g_unlink (pending->tmp_path);
+                g_free (pending->tmp_path);
+        }
+        g_free (pending->path);
+        g_free (pending->content);
+        g_free (pending->link_target);
+        g_free (pending);
+}
 
-        /* If /etc/localtime is a symlink, write a symlink */
-        if (g_file_test (ETC_LOCALTIME, G_FILE_TEST_IS_SYMLINK)) {
-                if (g_unlink (ETC_LOCALTIME) == 0 &&
-                    symlink (zone_file, ETC_LOCALTIME) == 0)
-                        return TRUE;
+static TimezoneWrite *
+timezone_write_new (char *path,
+                    mode_t mode)
+{
+        TimezoneWrite *pending;
+
+        pending = g_new0 (TimezoneWrite, 1);
+        pending->path = path;
+        pending->mode = mode;
+        pending->fd = -1;
 
-                /* If we couldn't symlink the file, we'll just fallback on
-                 * copying it */
+        return pending;
+}
+
+static gboolean
+system_timezone_prepare_localtime (GPtrArray   *writes,
+                                   const char  *zone_file,
+                                   GError     **error)
+{
+        TimezoneWrite *pending;
+        GError        *our_error;
+        struct stat    buf;
+        char          *path;
+        mode_t         mode;
+
+        path = system_timezone_root_path (ETC_LOCALTIME);
+
+        /* If /etc/localtime is a symlink, write a symlink */
+        if (g_file_test (path, G_FILE_TEST_IS_SYMLINK)) {
+                pending = timezone_write_new (path, 0);
+                pending->link_target = g_strdup (zone_file);
+                g_ptr_array_add (writes, pending);
+                return TRUE;
         }
 
-        /* Else copy the file to /etc/localtime. We explicitly avoid doing
-         * hard links since they break with different partitions */
+        /* Else copy the file to /etc/localtime, keeping the mode of the
+         * one it replaces. We explicitly avoid doing hard links since they
+         * break with different partitions */
+        if (g_stat (path, &buf) == 0 && S_ISREG (buf.st_mode))
+                mode = buf.st_mode & 07777;
+        else
+                mode = 0644;
+
+        pending = timezone_write_new (path, mode);
+        g_ptr_array_add (writes, pending);
+
         our_error = NULL;
-        if (!g_file_get_contents (zone_file, &content, &len, &our_error)) {
+        if (!g_file_get_contents (zone_file, &pending->content, &pending->len, &our_error)) {
                 g_set_error (error, SYSTEM_TIMEZONE_ERROR,
                              SYSTEM_TIMEZONE_ERROR_GENERAL,
                              "Timezone file %s cannot be read: %s",
@@ -941,57 +926,289 @@ system_timezone_set_etc_timezone (const char  *zone_file,
                 return FALSE;
         }
 
-        if (!g_file_set_contents (ETC_LOCALTIME, content, len, &our_error)) {
+        return TRUE;
+}
+
+static gboolean
+system_timezone_edit_key (char       **lines,
+                          const char  *key,
+                          const char  *value)
+{
+        char     *key_eq;
+        gboolean  replaced;
+        int       n;
+
+        key_eq = g_strdup_printf ("%s=", key);
+        replaced = FALSE;
+
+        for (n = 0; lines[n] != NULL; n++) {
+                if (g_str_has_prefix (lines[n], key_eq)) {
+                        char     *old_value;
+                        gboolean  use_quotes;
+
+                        old_value = lines[n] + strlen (key_eq);
+                        g_strstrip (old_value);
+                        use_quotes = old_value[0] == '\"';
+
+                        g_free (lines[n]);
+
+                        if (use_quotes)
+                                lines[n] = g_strdup_printf ("%s\"%s\"",
+                                                            key_eq, value);
+                        else
+                                lines[n] = g_strdup_printf ("%s%s",
+                                                            key_eq, value);
+
+                        replaced = TRUE;
+                }
+        }
+
+        g_free (key_eq);
+
+        return replaced;
+}
+
+/* Reads a config file once, applies every key it carries, and queues the
+ * result if anything changed.  Files that don't already have the setting
+ * are left alone. */
+static gboolean
+system_timezone_prepare_config (GPtrArray              *writes,
+                                const TimezoneBackend  *backend,
+                                const char             *tz,
+                                GError                **error)
+{
+        TimezoneWrite *pending;
+        GError        *our_error;
+        struct stat    buf;
+        char          *path;
+        char          *content;
+        char          *new_content;
+        gsize          len;
+
+        path = system_timezone_root_path (backend->path);
+
+        /* The probe is cached; cope with the file having gone since */
+        if (g_stat (path, &buf) != 0 || !S_ISREG (buf.st_mode)) {
+                g_free (path);
+                return TRUE;
+        }
+
+        our_error = NULL;
+        if (!g_file_get_contents (path, &content, &len, &our_error)) {
                 g_set_error (error, SYSTEM_TIMEZONE_ERROR,
                              SYSTEM_TIMEZONE_ERROR_GENERAL,
-                             ETC_LOCALTIME" cannot be overwritten: %s",
-                             our_error->message);
+                             "%s cannot be read: %s",
+                             path, our_error->message);
                 g_error_free (our_error);
-                g_free (content);
+                g_free (path);
                 return FALSE;
         }
 
+        if (backend->keys[0] == NULL) {
+                new_content = g_strdup_printf ("%s\n", tz);
+        } else {
+                char     **lines;
+                gboolean   replaced;
+                int        i;
+
+                lines = g_strsplit (content, "\n", 0);
+                replaced = FALSE;
+
+                for (i = 0; backend->keys[i] != NULL; i++)
+                        replaced |= system_timezone_edit_key (lines, backend->keys[i], tz);
+
+                new_content = replaced ? g_strjoinv ("\n", lines) : NULL;
+                g_strfreev (lines);
+        }
+
+        if (new_content == NULL || strcmp (new_content, content) == 0) {
+                g_free (new_content);
+                g_free (content);
+                g_free (path);
+                return TRUE;
+        }
+
         g_free (content);
 
+        pending = timezone_write_new (path, buf.st_mode & 07777);
+        pending->content = new_content;
+        pending->len = strlen (new_content);
+        g_ptr_array_add (writes, pending);
+
         return TRUE;
 }
 
-typedef gboolean (*SetSystemTimezone) (const char  *tz,
-                                       GError     **error);
-/* The order here does not matter too much: we'll try to change all files
- * that already have a timezone configured. It matters in case of error,
- * since the process will be stopped and the last methods won't be called.
- * So we use the same order as in get_system_timezone_methods */
-static SetSystemTimezone set_system_timezone_methods[] = {
-        /* writing various config files if they exist and have the
-         * setting already present */
-        system_timezone_write_etc_timezone,
-        system_timezone_write_etc_sysconfig_clock,
-        system_timezone_write_etc_sysconfig_clock_alt,
-        system_timezone_write_etc_TIMEZONE,
-        system_timezone_write_etc_rc_conf,
-        /* writing deprecated config files if they exist and have the
-         * setting already present */
-        system_timezone_write_etc_conf_d_clock,
-        NULL
-};
-
 static gboolean
-system_timezone_update_config (const char  *tz,
-                               GError     **error)
+system_timezone_write_fd (int          fd,
+                          const char  *content,
+                          gsize        len)
 {
-        int i;
+        while (len > 0) {
+                gssize written;
 
-        for (i = 0; set_system_timezone_methods[i] != NULL; i++) {
-                if (!set_system_timezone_methods[i] (tz, error))
+                written = write (fd, content, len);
+                if (written < 0) {
+                        if (errno == EINTR)
+                                continue;
                         return FALSE;
-                /* FIXME: maybe continue to change all config files if
-                 * possible? */
+                }
+
+                content += written;
+                len -= written;
         }
 
         return TRUE;
 }
 
+static gboolean
+system_timezone_stage (TimezoneWrite  *pending,
+                       GError        **error)
+{
+        int saved_errno;
+
+        pending->tmp_path = g_strdup_printf ("%s.XXXXXX", pending->path);
+
+        if (pending->link_target) {
+                /* Reserve a unique name, then put the link in its place */
+                pending->fd = g_mkstemp_full (pending->tmp_path, O_RDWR, 0600);
+                if (pending->fd >= 0) {
+                        close (pending->fd);
+                        pending->fd = -1;
+                        g_unlink (pending->tmp_path);
+                        if (symlink (pending->link_target, pending->tmp_path) == 0)
+                                return TRUE;
+                }
+        } else {
+                pending->fd = g_mkstemp_full (pending->tmp_path, O_RDWR, pending->mode);
+                if (pending->fd >= 0 &&
+                    fchmod (pending->fd, pending->mode) == 0 &&
+                    system_timezone_write_fd (pending->fd, pending->content, pending->len))
+                        return TRUE;
+        }
+
+        saved_errno = errno;
+
+        if (pending->fd < 0) {
+                g_free (pending->tmp_path);
+                pending->tmp_path = NULL;
+        }
+
+        g_set_error (error, SYSTEM_TIMEZONE_ERROR,
+                     SYSTEM_TIMEZONE_ERROR_GENERAL,
+                     "%s cannot be overwritten: %s",
+                     pending->path, g_strerror (saved_errno));
+
+        return FALSE;
+}
+
+/* Installs all queued files: each one is staged next to its destination,
+ * the data is flushed in a single fsync pass, and only then are the files
+ * renamed into place.  A failure before the renames leaves the existing
+ * configuration untouched. */
+static gboolean
+system_timezone_commit (GPtrArray  *writes,
+                        GError    **error)
+{
+        GHashTable     *dirs;
+        GHashTableIter  iter;
+        gpointer        dir;
+        gboolean        retval;
+        guint           i;
+
+        for (i = 0; i < writes->len; i++) {
+                if (!system_timezone_stage (g_ptr_array_index (writes, i), error))
+                        return FALSE;
+        }
+
+        for (i = 0; i < writes->len; i++) {
+                TimezoneWrite *pending = g_ptr_array_index (writes, i);
+
+                if (pending->fd < 0)
+                        continue;
+
+                if (fsync (pending->fd) != 0) {
+                        g_set_error (error, SYSTEM_TIMEZONE_ERROR,
+                                     SYSTEM_TIMEZONE_ERROR_GENERAL,
+                                     "%s cannot be overwritten: %s",
+                                     pending->path, g_strerror (errno));
+                        return FALSE;
+                }
+
+                close (pending->fd);
+                pending->fd = -1;
+        }
+
+        dirs = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+        retval = TRUE;
+
+        for (i = 0; i < writes->len; i++) {
+                TimezoneWrite *pending = g_ptr_array_index (writes, i);
+
+                if (g_rename (pending->tmp_path, pending->path) != 0) {
+                        g_set_error (error, SYSTEM_TIMEZONE_ERROR,
+                                     SYSTEM_TIMEZONE_ERROR_GENERAL,
+                                     "%s cannot be overwritten: %s",
+                                     pending->path, g_strerror (errno));
+                        retval = FALSE;
+                        break;
+                }
+
+                g_free (pending->tmp_path);
+                pending->tmp_path = NULL;
+
+                g_hash_table_add (dirs, g_path_get_dirname (pending->path));
+        }
+
+        /* Make the renames themselves durable */
+        g_hash_table_iter_init (&iter, dirs);
+        while (g_hash_table_iter_next (&iter, &dir, NULL)) {
+                int fd;
+
+                fd = open (dir, O_RDONLY | O_DIRECTORY);
+                if (fd >= 0) {
+                        fsync (fd);
+                        close (fd);
+                }
+        }
+
+        g_hash_table_destroy (dirs);
+
+        return retval;
+}
+
+static gboolean
+system_timezone_set_internal (const char  *zone_file,
+                              const char  *tz,
+                              GError     **error)
+{
+        gboolean   present[G_N_ELEMENTS (timezone_backends)];
+        GPtrArray *writes;
+        gboolean   retval;
+        guint      i;
+
+        if (!system_timezone_is_zone_file_valid (zone_file, error))
+                return FALSE;
+
+        system_timezone_probe_backends (present);
+
+        writes = g_ptr_array_new_with_free_func (timezone_write_free);
+        retval = system_timezone_prepare_localtime (writes, zone_file, error);
+
+        for (i = 0; retval && i < G_N_ELEMENTS (timezone_backends); i++) {
+                if (present[i])
+                        retval = system_timezone_prepare_config (writes,
+                                                                 &timezone_backends[i],
+                                                                 tz, error);
+        }
+
+        if (retval)
+                retval = system_timezone_commit (writes, error);
+
+        g_ptr_array_unref (writes);
+
+        return retval;
+}
+
 gboolean
 system_timezone_set_from_file (const char  *zone_file,
                                GError     **error)
@@ -1002,10 +1219,7 @@ system_timezone_set_from_file (const char  *zone_file,
 
         tz = zone_file + strlen (SYSTEM_ZONEINFODIR"/");
 
-        /* FIXME: is it right to return FALSE even when /etc/localtime was
-         * changed but not the config files? */
-        return (system_timezone_set_etc_timezone (zone_file, error) &&
-                system_timezone_update_config (tz, error));
+        return system_timezone_set_internal (zone_file, tz, error);
 }
 
 gboolean
@@ -1018,12 +1232,7 @@ system_timezone_set (const char  *tz,
         g_return_val_if_fail (error == NULL || *error == NULL, FALSE);
 
         zone_file = g_build_filename (SYSTEM_ZONEINFODIR, tz, NULL);
-
-        /* FIXME: is it right to return FALSE even when /etc/localtime was
-         * changed but not the config files? */
-        retval = system_timezone_set_etc_timezone (zone_file, error) &&
-                 system_timezone_update_config (tz, error);
-
+        retval = system_timezone_set_internal (zone_file, tz, error);
         g_free (zone_file);
 
         return retval;
@@ -83,6 +83,9 @@ gboolean system_timezone_set_from_file (const char  *zone_file,
 gboolean system_timezone_set (const char  *tz,
                               GError     **error);
 
+/* Writes go below @root instead of / (NULL to reset); for testing */
+void system_timezone_set_root (const char *root);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,280 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*-
+ *
+ * Runs system_timezone_set() against a scratch root populated with every
+ * config file the writer knows about, checks what it wrote, and times it.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#include "config.h"
+
+#include <sys/stat.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "system-timezone.h"
+
+/* Exit status automake's test driver reads as "skipped" */
+#define EXIT_SKIP 77
+
+/* A copied /etc/localtime must keep this, not get a default mode */
+#define LOCALTIME_MODE 0600
+
+static const char *zones[] = { "Europe/Paris", "America/New_York" };
+
+static const struct {
+        const char *path;
+        const char *content;
+} fake_files[] = {
+        { "etc/timezone",        "UTC\n" },
+        { "etc/sysconfig/clock", "# hardware clock\nZONE=\"UTC\"\nTIMEZONE=\"UTC\"\nUTC=true\n" },
+        { "etc/TIMEZONE",        "TZ=UTC\nCMASK=022\n" },
+        { "etc/rc.conf",         "HOSTNAME=\"test\"\nTIMEZONE=\"UTC\"\n" },
+        { "etc/conf.d/clock",    "CLOCK=\"UTC\"\nTIMEZONE=\"UTC\"\n" }
+};
+
+static void
+populate_root (const char *root,
+               gboolean    symlink_localtime)
+{
+        GError *error = NULL;
+        char   *path;
+        char   *dir;
+        guint   i;
+        int     ret;
+
+        for (i = 0; i < G_N_ELEMENTS (fake_files); i++) {
+                path = g_build_filename (root, fake_files[i].path, NULL);
+                dir = g_path_get_dirname (path);
+                g_mkdir_with_parents (dir, 0755);
+                g_free (dir);
+
+                g_file_set_contents (path, fake_files[i].content, -1, &error);
+                g_assert_no_error (error);
+                g_free (path);
+        }
+
+        path = g_build_filename (root, "etc/localtime", NULL);
+        if (symlink_localtime) {
+                ret = symlink (SYSTEM_ZONEINFODIR "/UTC", path);
+                g_assert_cmpint (ret, ==, 0);
+        } else {
+                g_file_set_contents (path, "", 0, &error);
+                g_assert_no_error (error);
+                ret = g_chmod (path, LOCALTIME_MODE);
+                g_assert_cmpint (ret, ==, 0);
+        }
+        g_free (path);
+}
+
+static char *
+read_root_file (const char *root,
+                const char *name,
+                gsize      *len)
+{
+        GError *error = NULL;
+        char   *path;
+        char   *content;
+
+        path = g_build_filename (root, name, NULL);
+        g_file_get_contents (path, &content, len, &error);
+        g_assert_no_error (error);
+        g_free (path);
+
+        return content;
+}
+
+/* @expected is a line that must be in the file, and @kept one that the
+ * writer must have left alone */
+static void
+check_config (const char *root,
+              const char *name,
+              const char *expected,
+              const char *kept)
+{
+        char  *content;
+        char **lines;
+
+        content = read_root_file (root, name, NULL);
+        lines = g_strsplit (content, "\n", -1);
+
+        g_assert_true (g_strv_contains ((const char * const *) lines, expected));
+        if (kept != NULL)
+                g_assert_true (g_strv_contains ((const char * const *) lines, kept));
+
+        g_strfreev (lines);
+        g_free (content);
+}
+
+static void
+check_root (const char *root,
+            const char *tz,
+            gboolean    symlink_localtime)
+{
+        char        *expected;
+        char        *content;
+        char        *zone_file;
+        char        *path;
+        struct stat  st;
+
+        expected = g_strdup_printf ("%s\n", tz);
+        content = read_root_file (root, "etc/timezone", NULL);
+        g_assert_cmpstr (content, ==, expected);
+        g_free (content);
+        g_free (expected);
+
+        expected = g_strdup_printf ("ZONE=\"%s\"", tz);
+        check_config (root, "etc/sysconfig/clock", expected, "UTC=true");
+        g_free (expected);
+        expected = g_strdup_printf ("TIMEZONE=\"%s\"", tz);
+        check_config (root, "etc/sysconfig/clock", expected, "# hardware clock");
+        check_config (root, "etc/rc.conf", expected, "HOSTNAME=\"test\"");
+        check_config (root, "etc/conf.d/clock", expected, "CLOCK=\"UTC\"");
+        g_free (expected);
+        expected = g_strdup_printf ("TZ=%s", tz);
+        check_config (root, "etc/TIMEZONE", expected, "CMASK=022");
+        g_free (expected);
+
+        zone_file = g_build_filename (SYSTEM_ZONEINFODIR, tz, NULL);
+        path = g_build_filename (root, "etc/localtime", NULL);
+
+        if (symlink_localtime) {
+                char *target;
+
+                target = g_file_read_link (path, NULL);
+                g_assert_cmpstr (target, ==, zone_file);
+                g_free (target);
+        } else {
+                char  *zone_content;
+                gsize  len, zone_len;
+                int    ret;
+
+                content = read_root_file (root, "etc/localtime", &len);
+                g_file_get_contents (zone_file, &zone_content, &zone_len, NULL);
+                g_assert_nonnull (zone_content);
+                g_assert_cmpmem (content, len, zone_content, zone_len);
+                g_free (content);
+                g_free (zone_content);
+
+                ret = g_lstat (path, &st);
+                g_assert_cmpint (ret, ==, 0);
+                g_assert_true (S_ISREG (st.st_mode));
+                g_assert_cmpint (st.st_mode & 07777, ==, LOCALTIME_MODE);
+        }
+
+        g_free (path);
+        g_free (zone_file);
+}
+
+static void
+remove_tree (const char *path)
+{
+        GDir       *dir;
+        const char *name;
+
+        if (!g_file_test (path, G_FILE_TEST_IS_SYMLINK) &&
+            (dir = g_dir_open (path, 0, NULL)) != NULL) {
+                while ((name = g_dir_read_name (dir)) != NULL) {
+                        char *child;
+
+                        child = g_build_filename (path, name, NULL);
+                        remove_tree (child);
+                        g_free (child);
+                }
+                g_dir_close (dir);
+        }
+
+        g_remove (path);
+}
+
+static void
+run (int      iterations,
+     gboolean symlink_localtime)
+{
+        GError *error = NULL;
+        GTimer *timer;
+        char   *root;
+        int     i;
+
+        root = g_dir_make_tmp ("msd-timezone-XXXXXX", &error);
+        g_assert_no_error (error);
+
+        populate_root (root, symlink_localtime);
+        system_timezone_set_root (root);
+
+        timer = g_timer_new ();
+        for (i = 0; i < iterations; i++) {
+                system_timezone_set (zones[i % G_N_ELEMENTS (zones)], &error);
+                g_assert_no_error (error);
+        }
+        g_timer_stop (timer);
+
+        if (iterations > 0)
+                check_root (root, zones[(iterations - 1) % G_N_ELEMENTS (zones)], symlink_localtime);
+
+        g_print ("%s localtime: %d timezone changes in %.3f s (%.3f ms each)\n",
+                 symlink_localtime ? "symlinked" : "copied",
+                 iterations, g_timer_elapsed (timer, NULL),
+                 iterations > 0 ? g_timer_elapsed (timer, NULL) * 1000.0 / iterations : 0.0);
+        g_timer_destroy (timer);
+
+        system_timezone_set_root (NULL);
+        remove_tree (root);
+        g_free (root);
+}
+
+int
+main (int argc, char *argv[])
+{
+        static int       iterations = 100;
+        static GOptionEntry entries[] = {
+                { "iterations", 'n', 0, G_OPTION_ARG_INT, &iterations, "Number of timezone changes", "N" },
+                { NULL }
+        };
+        GOptionContext *context;
+        GError         *error = NULL;
+        guint           i;
+
+        context = g_option_context_new ("- check and time setting the system timezone");
+        g_option_context_add_main_entries (context, entries, NULL);
+        if (!g_option_context_parse (context, &argc, &argv, &error)) {
+                g_printerr ("%s\n", error->message);
+                g_error_free (error);
+                g_option_context_free (context);
+                return EXIT_FAILURE;
+        }
+        g_option_context_free (context);
+
+        for (i = 0; i < G_N_ELEMENTS (zones); i++) {
+                char *zone_file = g_build_filename (SYSTEM_ZONEINFODIR, zones[i], NULL);
+                gboolean found = g_file_test (zone_file, G_FILE_TEST_IS_REGULAR);
+
+                g_free (zone_file);
+                if (!found) {
+                        g_print ("No %s in " SYSTEM_ZONEINFODIR ", skipping\n", zones[i]);
+                        return EXIT_SKIP;
+                }
+        }
+
+        run (iterations, FALSE);
+        run (iterations, TRUE);
+
+        return EXIT_SUCCESS;
+}
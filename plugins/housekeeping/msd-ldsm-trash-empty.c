@@ -18,14 +18,26 @@
  * with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
 #include <glib/gi18n.h>
+#include <glib/gstdio.h>
 #include <gio/gio.h>
+#include <gio/gunixmounts.h>
 
 #include "msd-ldsm-trash-empty.h"
 
 #define CAJA_PREFS_SCHEMA "org.mate.caja.preferences"
 #define CAJA_CONFIRM_TRASH_KEY "confirm-trash"
 
+#define TRASH_EMPTY_MAX_WORKERS 4
+
 /* Some of this code has been borrowed from the trash-applet, courtesy of Ryan Lortie */
 
 static GtkWidget *trash_empty_confirm_dialog = NULL;
@@ -35,9 +47,11 @@ static GtkWidget *file_label;
 static GtkWidget *progressbar;
 
 static gsize trash_empty_total_files;
+static guint64 trash_empty_total_bytes;
 static gboolean trash_empty_update_pending = FALSE;
 static GFile *trash_empty_current_file = NULL;
 static gsize trash_empty_deleted_files;
+static guint64 trash_empty_deleted_bytes;
 static GTimer *timer = NULL;
 static gboolean trash_empty_actually_deleting;
 
@@ -58,6 +72,7 @@ static gboolean
 trash_empty_update_dialog (gpointer user_data)
 {
         gsize deleted, total;
+        guint64 deleted_bytes, total_bytes;
         GFile *file;
         gboolean actually_deleting;
 
@@ -65,6 +80,8 @@ trash_empty_update_dialog (gpointer user_data)
 
         deleted = trash_empty_deleted_files;
         total = trash_empty_total_files;
+        deleted_bytes = trash_empty_deleted_bytes;
+        total_bytes = trash_empty_total_bytes;
         file = trash_empty_current_file;
         actually_deleting = trash_empty_actually_deleting;
 
@@ -100,7 +117,11 @@ trash_empty_update_dialog (gpointer user_data)
 
                 g_free (text);
 
-                if (deleted > total)
+                /* Items can differ wildly in size, so go by bytes when known */
+                if (total_bytes > 0)
+                        gtk_progress_bar_set_fraction (GTK_PROGRESS_BAR (progressbar),
+                                                       MIN ((gdouble) deleted_bytes / (gdouble) total_bytes, 1.0));
+                else if (deleted > total)
                         gtk_progress_bar_set_fraction (GTK_PROGRESS_BAR (progressbar), 1.0);
                 else
                         gtk_progress_bar_set_fraction (GTK_PROGRESS_BAR (progressbar),
@@ -140,6 +161,7 @@ static void
 trash_empty_maybe_schedule_update (GIOSchedulerJob *job,
                                    GFile           *file,
                                    gsize            deleted,
+                                   guint64          deleted_bytes,
                                    gboolean         actually_deleting)
 {
         if (!trash_empty_update_pending) {
@@ -147,6 +169,7 @@ trash_empty_maybe_schedule_update (GIOSchedulerJob *job,
 
                 trash_empty_current_file = g_object_ref (file);
                 trash_empty_deleted_files = deleted;
+                trash_empty_deleted_bytes = deleted_bytes;
                 trash_empty_actually_deleting = actually_deleting;
 
                 trash_empty_update_pending = TRUE;
@@ -156,11 +179,12 @@ trash_empty_maybe_schedule_update (GIOSchedulerJob *job,
         }
 }
 
+/* Slow path through gvfs, for whatever the local pass could not reach.
+ * There is no count up front, so the progress bar just pulses. */
 static void
 trash_empty_delete_contents (GIOSchedulerJob *job,
                              GCancellable *cancellable,
                              GFile *file,
-                             gboolean actually_delete,
                              gsize *deleted)
 {
         GFileEnumerator *enumerator;
@@ -182,12 +206,10 @@ trash_empty_delete_contents (GIOSchedulerJob *job,
                         child = g_file_get_child (file, g_file_info_get_name (info));
 
                         if (g_file_info_get_file_type (info) == G_FILE_TYPE_DIRECTORY)
-                                trash_empty_delete_contents (job, cancellable, child,
-                                                             actually_delete, deleted);
+                                trash_empty_delete_contents (job, cancellable, child, deleted);
 
-                        trash_empty_maybe_schedule_update (job, child, *deleted, actually_delete);
-                        if (actually_delete)
-                                g_file_delete (child, cancellable, NULL);
+                        trash_empty_maybe_schedule_update (job, child, *deleted, 0, FALSE);
+                        g_file_delete (child, cancellable, NULL);
 
                         (*deleted)++;
 
@@ -202,6 +224,415 @@ trash_empty_delete_contents (GIOSchedulerJob *job,
         }
 }
 
+/* Local fast path: the trash directories are read and emptied directly
+ * with openat()/unlinkat() by a few worker threads, one trashed item
+ * per task, instead of one gvfsd-trash round trip per file. */
+
+typedef struct {
+        char       *path;
+        int         files_fd;
+        int         info_fd;
+        GHashTable *dir_sizes;          /* name -> guint64, from directorysizes */
+} TrashDir;
+
+typedef struct {
+        TrashDir *dir;
+        char     *name;
+        guint64   size;
+} TrashItem;
+
+typedef struct {
+        GCancellable *cancellable;
+        GMutex        lock;
+        GCond         cond;
+        guint         n_pending;
+        gsize         n_done;
+        guint64       bytes_done;
+        char         *current;          /* item being removed, for the dialog */
+} TrashEmptyLocal;
+
+static void
+trash_dir_free (TrashDir *dir)
+{
+        if (dir->files_fd >= 0)
+                close (dir->files_fd);
+        if (dir->info_fd >= 0)
+                close (dir->info_fd);
+        g_clear_pointer (&dir->dir_sizes, g_hash_table_destroy);
+        g_free (dir->path);
+        g_free (dir);
+}
+
+/* Each line of the cache is "<bytes> <mtime> <escaped directory name>" */
+static GHashTable *
+trash_dir_read_sizes (const char *path)
+{
+        GHashTable *sizes;
+        char       *filename;
+        char       *contents;
+        char      **lines;
+        gint        i;
+
+        sizes = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+
+        filename = g_build_filename (path, "directorysizes", NULL);
+        if (g_file_get_contents (filename, &contents, NULL, NULL)) {
+                lines = g_strsplit (contents, "\n", -1);
+                for (i = 0; lines[i] != NULL; i++) {
+                        char **fields = g_strsplit (lines[i], " ", 3);
+
+                        if (g_strv_length (fields) == 3) {
+                                char    *name = g_uri_unescape_string (fields[2], NULL);
+                                guint64 *size = g_new (guint64, 1);
+
+                                *size = g_ascii_strtoull (fields[0], NULL, 10);
+                                if (name != NULL)
+                                        g_hash_table_replace (sizes, name, size);
+                                else
+                                        g_free (size);
+                        }
+                        g_strfreev (fields);
+                }
+                g_strfreev (lines);
+                g_free (contents);
+        }
+        g_free (filename);
+
+        return sizes;
+}
+
+/* Opens @name below @parent_fd (or a full path with AT_FDCWD) as a
+ * trash directory: a real directory owned by us, never a symlink to
+ * something that would then be emptied */
+static int
+trash_dir_open_at (int          parent_fd,
+                   const char  *name,
+                   struct stat *st)
+{
+        int fd;
+
+        fd = openat (parent_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (fd < 0)
+                return -1;
+
+        if (fstat (fd, st) != 0 || !S_ISDIR (st->st_mode) || st->st_uid != getuid ()) {
+                close (fd);
+                return -1;
+        }
+
+        return fd;
+}
+
+/* Takes ownership of @path, which is @name below @parent_fd; files/
+ * and info/ are opened relative to the trash directory itself so that
+ * no component can be swapped for a symlink once it has been checked */
+static void
+trash_dir_add (GPtrArray  *dirs,
+               GHashTable *seen,
+               int         parent_fd,
+               const char *name,
+               char       *path)
+{
+        TrashDir   *dir;
+        struct stat st;
+        int         trash_fd;
+        char       *id;
+
+        trash_fd = trash_dir_open_at (parent_fd, name, &st);
+        if (trash_fd < 0) {
+                g_free (path);
+                return;
+        }
+
+        /* Bind mounts show the same trash more than once */
+        id = g_strdup_printf ("%" G_GUINT64_FORMAT ":%" G_GUINT64_FORMAT,
+                              (guint64) st.st_dev, (guint64) st.st_ino);
+        if (g_hash_table_contains (seen, id)) {
+                g_free (id);
+                close (trash_fd);
+                g_free (path);
+                return;
+        }
+        g_hash_table_add (seen, id);
+
+        dir = g_new0 (TrashDir, 1);
+        dir->path = path;
+        dir->files_fd = trash_dir_open_at (trash_fd, "files", &st);
+        dir->info_fd = trash_dir_open_at (trash_fd, "info", &st);
+        dir->dir_sizes = trash_dir_read_sizes (path);
+
+        close (trash_fd);
+
+        if (dir->files_fd < 0) {
+                trash_dir_free (dir);
+                return;
+        }
+
+        g_ptr_array_add (dirs, dir);
+}
+
+/* The shared $topdir/.Trash must be a sticky directory, not a symlink;
+ * returns it open, or -1 */
+static int
+trash_shared_dir_open (const char *mount_path)
+{
+        struct stat st;
+        char       *path;
+        int         fd;
+
+        path = g_build_filename (mount_path, ".Trash", NULL);
+        fd = open (path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        g_free (path);
+
+        if (fd >= 0 && (fstat (fd, &st) != 0 || !S_ISDIR (st.st_mode) || !(st.st_mode & S_ISVTX))) {
+                close (fd);
+                fd = -1;
+        }
+
+        return fd;
+}
+
+static GPtrArray *
+trash_find_local_dirs (void)
+{
+        GPtrArray  *dirs;
+        GHashTable *seen;
+        GList      *mounts, *l;
+        char       *path;
+        char       *uid;
+
+        dirs = g_ptr_array_new_with_free_func ((GDestroyNotify) trash_dir_free);
+        seen = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+        uid = g_strdup_printf ("%u", (guint) getuid ());
+
+        path = g_build_filename (g_get_user_data_dir (), "Trash", NULL);
+        trash_dir_add (dirs, seen, AT_FDCWD, path, path);
+
+        mounts = g_unix_mounts_get (NULL);
+        for (l = mounts; l != NULL; l = l->next) {
+                GUnixMountEntry *mount = l->data;
+                const char      *mount_path;
+                int              shared_fd;
+
+                if (g_unix_mount_is_system_internal (mount))
+                        continue;
+
+                mount_path = g_unix_mount_get_mount_path (mount);
+
+                shared_fd = trash_shared_dir_open (mount_path);
+                if (shared_fd >= 0) {
+                        trash_dir_add (dirs, seen, shared_fd, uid,
+                                       g_build_filename (mount_path, ".Trash", uid, NULL));
+                        close (shared_fd);
+                }
+
+                path = g_strdup_printf ("%s/.Trash-%s", mount_path, uid);
+                trash_dir_add (dirs, seen, AT_FDCWD, path, path);
+        }
+        g_list_free_full (mounts, (GDestroyNotify) g_unix_mount_free);
+
+        g_free (uid);
+        g_hash_table_destroy (seen);
+
+        return dirs;
+}
+
+/* Lists the top level of files/; sizes come from the directorysizes
+ * cache for directories and from the entry itself for anything else,
+ * so nothing is walked just to size the progress bar */
+static void
+trash_dir_list_items (TrashDir  *dir,
+                      GPtrArray *items,
+                      guint64   *total_bytes)
+{
+        DIR           *dirp;
+        struct dirent *de;
+        int            fd;
+
+        fd = dup (dir->files_fd);
+        if (fd < 0)
+                return;
+
+        dirp = fdopendir (fd);
+        if (dirp == NULL) {
+                close (fd);
+                return;
+        }
+
+        while ((de = readdir (dirp)) != NULL) {
+                TrashItem  *item;
+                struct stat st;
+                guint64    *cached;
+
+                if (strcmp (de->d_name, ".") == 0 || strcmp (de->d_name, "..") == 0)
+                        continue;
+
+                item = g_new0 (TrashItem, 1);
+                item->dir = dir;
+                item->name = g_strdup (de->d_name);
+
+                if (fstatat (dir->files_fd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0) {
+                        if (!S_ISDIR (st.st_mode))
+                                item->size = st.st_size;
+                        else if ((cached = g_hash_table_lookup (dir->dir_sizes, de->d_name)) != NULL)
+                                item->size = *cached;
+                }
+
+                *total_bytes += item->size;
+                g_ptr_array_add (items, item);
+        }
+
+        closedir (dirp);
+}
+
+/* Removes @name below @dirfd, recursing into directories */
+static gboolean
+trash_delete_at (int           dirfd,
+                 const char   *name,
+                 gboolean      is_dir,
+                 GCancellable *cancellable)
+{
+        DIR           *dirp;
+        struct dirent *de;
+        int            fd;
+
+        if (!is_dir) {
+                if (unlinkat (dirfd, name, 0) == 0 || errno == ENOENT)
+                        return TRUE;
+                /* EISDIR on Linux, EPERM elsewhere */
+                if (errno != EISDIR && errno != EPERM)
+                        return FALSE;
+        }
+
+        fd = openat (dirfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (fd < 0)
+                return FALSE;
+
+        dirp = fdopendir (fd);
+        if (dirp == NULL) {
+                close (fd);
+                return FALSE;
+        }
+
+        while ((de = readdir (dirp)) != NULL) {
+                if (strcmp (de->d_name, ".") == 0 || strcmp (de->d_name, "..") == 0)
+                        continue;
+
+                if (g_cancellable_is_cancelled (cancellable))
+                        break;
+
+                trash_delete_at (fd, de->d_name, de->d_type == DT_DIR, cancellable);
+        }
+
+        closedir (dirp);
+
+        return unlinkat (dirfd, name, AT_REMOVEDIR) == 0;
+}
+
+static void
+trash_empty_local_worker (gpointer data,
+                          gpointer user_data)
+{
+        TrashItem       *item = data;
+        TrashEmptyLocal *local = user_data;
+
+        if (!g_cancellable_is_cancelled (local->cancellable)) {
+                g_mutex_lock (&local->lock);
+                g_free (local->current);
+                local->current = g_build_filename (item->dir->path, "files", item->name, NULL);
+                g_mutex_unlock (&local->lock);
+
+                if (trash_delete_at (item->dir->files_fd, item->name, FALSE, local->cancellable) &&
+                    item->dir->info_fd >= 0) {
+                        char *info_name = g_strconcat (item->name, ".trashinfo", NULL);
+
+                        unlinkat (item->dir->info_fd, info_name, 0);
+                        g_free (info_name);
+                }
+        }
+
+        g_mutex_lock (&local->lock);
+        local->n_done++;
+        local->bytes_done += item->size;
+        local->n_pending--;
+        g_cond_signal (&local->cond);
+        g_mutex_unlock (&local->lock);
+
+        g_free (item->name);
+        g_free (item);
+}
+
+static void
+trash_empty_local (GIOSchedulerJob *job,
+                   GCancellable    *cancellable)
+{
+        TrashEmptyLocal local = { 0 };
+        GThreadPool    *pool;
+        GPtrArray      *dirs;
+        GPtrArray      *items;
+        guint64         total_bytes = 0;
+        guint           i;
+
+        dirs = trash_find_local_dirs ();
+        items = g_ptr_array_new ();
+
+        for (i = 0; i < dirs->len; i++)
+                trash_dir_list_items (g_ptr_array_index (dirs, i), items, &total_bytes);
+
+        if (items->len == 0)
+                goto out;
+
+        trash_empty_total_files = items->len;
+        trash_empty_total_bytes = total_bytes;
+
+        local.cancellable = cancellable;
+        local.n_pending = items->len;
+        g_mutex_init (&local.lock);
+        g_cond_init (&local.cond);
+
+        pool = g_thread_pool_new (trash_empty_local_worker, &local,
+                                  MIN (g_get_num_processors (), TRASH_EMPTY_MAX_WORKERS),
+                                  FALSE, NULL);
+        for (i = 0; i < items->len; i++)
+                g_thread_pool_push (pool, g_ptr_array_index (items, i), NULL);
+
+        g_mutex_lock (&local.lock);
+        while (local.n_pending > 0) {
+                g_cond_wait_until (&local.cond, &local.lock,
+                                   g_get_monotonic_time () + 100 * G_TIME_SPAN_MILLISECOND);
+
+                if (local.current != NULL) {
+                        GFile *file = g_file_new_for_path (local.current);
+
+                        trash_empty_maybe_schedule_update (job, file, local.n_done,
+                                                           local.bytes_done, TRUE);
+                        g_object_unref (file);
+                }
+        }
+        g_mutex_unlock (&local.lock);
+
+        g_thread_pool_free (pool, FALSE, TRUE);
+
+        /* The cached sizes describe directories that are gone now */
+        if (!g_cancellable_is_cancelled (cancellable)) {
+                for (i = 0; i < dirs->len; i++) {
+                        TrashDir *dir = g_ptr_array_index (dirs, i);
+                        char     *sizes = g_build_filename (dir->path, "directorysizes", NULL);
+
+                        g_unlink (sizes);
+                        g_free (sizes);
+                }
+        }
+
+        g_free (local.current);
+        g_mutex_clear (&local.lock);
+        g_cond_clear (&local.cond);
+
+out:
+        g_ptr_array_free (items, TRUE);
+        g_ptr_array_free (dirs, TRUE);
+}
+
 static gboolean
 trash_empty_job (GIOSchedulerJob *job,
                  GCancellable *cancellable,
@@ -210,19 +641,17 @@ trash_empty_job (GIOSchedulerJob *job,
         gsize deleted;
         GFile *trash;
 
-        trash = g_file_new_for_uri ("trash:///");
-
-        /* first do a dry run to count the number of files */
-        deleted = 0;
-        trash_empty_delete_contents (job, cancellable, trash, FALSE, &deleted);
-        trash_empty_total_files = deleted;
+        trash_empty_local (job, cancellable);
 
-        /* now do the real thing */
-        deleted = 0;
-        trash_empty_delete_contents (job, cancellable, trash, TRUE, &deleted);
+        /* Anything left is somewhere the local pass does not know about */
+        if (!g_cancellable_is_cancelled (cancellable)) {
+                trash = g_file_new_for_uri ("trash:///");
+                deleted = 0;
+                trash_empty_delete_contents (job, cancellable, trash, &deleted);
+                g_object_unref (trash);
+        }
 
         /* done */
-        g_object_unref (trash);
         g_io_scheduler_job_send_to_mainloop_async (job,
                                                    trash_empty_done,
                                                    NULL, NULL);
@@ -30,6 +30,12 @@
 
 #include <locale.h>
 
+#if defined(HAVE_SPAWN_H) && defined(HAVE_POSIX_SPAWN_FILE_ACTIONS_ADDCLOSEFROM_NP)
+#define USE_POSIX_SPAWN 1
+#include <spawn.h>
+#include <signal.h>
+#endif
+
 #include <glib.h>
 #include <glib/gi18n.h>
 #include <gdk/gdk.h>
@@ -40,6 +46,7 @@
 #include <dconf.h>
 
 #include "mate-settings-profile.h"
+#include "mate-settings-event-router.h"
 #include "msd-keybindings-manager.h"
 #include "dconf-util.h"
 
@@ -49,19 +56,55 @@
 #define GSETTINGS_KEYBINDINGS_DIR "/org/mate/desktop/keybindings/"
 #define CUSTOM_KEYBINDING_SCHEMA "org.mate.control-center.keybinding"
 
+#define MSD_DBUS_NAME "org.mate.SettingsDaemon"
+#define MSD_DBUS_PATH "/org/mate/SettingsDaemon"
+
+#define MSD_KEYBINDINGS_DBUS_NAME MSD_DBUS_NAME ".Keybindings"
+#define MSD_KEYBINDINGS_DBUS_PATH MSD_DBUS_PATH "/Keybindings"
+
+/* Launch latency is the time spent in the filter from matching the
+ * binding to the child having been started, in µs; the time the key
+ * press spent in the X and GDK queues before that is not included */
+static const gchar introspection_xml[] =
+"<node>"
+"  <interface name='org.mate.SettingsDaemon.Keybindings'>"
+"    <property name='LaunchCount' type='u' access='read'/>"
+"    <property name='LaunchTimeAverage' type='t' access='read'/>"
+"    <property name='LaunchTimeMax' type='t' access='read'/>"
+"  </interface>"
+"</node>";
+
 typedef struct {
         char *binding_str;
         char *action;
         char *settings_path;
         Key   key;
-        Key   previous_key;
+        /* What is currently grabbed for this binding, no keycodes if nothing */
+        Key   grabbed_key;
+        /* action, tokenized and resolved against PATH when loaded */
+        char **argv;
+        char  *program;
 } Binding;
 
 struct MsdKeybindingsManagerPrivate
 {
         DConfClient *client;
-        GSList      *binding_list;
+        GHashTable  *bindings;          /* settings path -> Binding */
+        GHashTable  *grabs;             /* keycode and modifiers -> Binding */
         GSList      *screens;
+        GHashTable  *exec_envs;         /* GdkScreen -> environment */
+        char       **exec_envs_source;  /* the environ entries they were built from */
+        guint        key_press_id;
+
+        /* Key press to child started, in µs */
+        guint        n_launches;
+        gint64       launch_time_total;
+        gint64       launch_time_max;
+
+        GDBusNodeInfo   *introspection_data;
+        GDBusConnection *connection;
+        GCancellable    *cancellable;
+        guint            name_id;
 };
 
 static void     msd_keybindings_manager_finalize    (GObject *object);
@@ -110,253 +153,299 @@ parse_binding (Binding *binding)
         return success;
 }
 
-static gint
-compare_bindings (gconstpointer a,
-                  gconstpointer b)
+static void
+binding_free (Binding *binding)
+{
+        g_free (binding->binding_str);
+        g_free (binding->action);
+        g_free (binding->settings_path);
+        g_free (binding->key.keycodes);
+        g_free (binding->grabbed_key.keycodes);
+        g_strfreev (binding->argv);
+        g_free (binding->program);
+        g_free (binding);
+}
+
+static void
+binding_prepare_command (Binding *binding)
 {
-        Binding *key_a = (Binding *) a;
-        char    *key_b = (char *) b;
+        g_strfreev (binding->argv);
+        binding->argv = NULL;
+        g_free (binding->program);
+        binding->program = NULL;
+
+        if (!g_shell_parse_argv (binding->action, NULL, &binding->argv, NULL))
+                return;
 
-        return g_strcmp0 (key_b, key_a->settings_path);
+        binding->program = g_find_program_in_path (binding->argv[0]);
+}
+
+static gint64
+grab_code (guint keycode,
+           guint state)
+{
+        return ((gint64) keycode << 32) | state;
 }
 
 static gboolean
-bindings_get_entry (MsdKeybindingsManager *manager,
-                    const char            *settings_path)
+same_key (const Key *key, const Key *other)
 {
-        GSettings *settings;
-        Binding   *new_binding;
-        GSList    *tmp_elem;
-        char      *action = NULL;
-        char      *key = NULL;
+        if (key->state == other->state) {
+                if (key->keycodes != NULL && other->keycodes != NULL) {
+                        guint *c1, *c2;
 
-        if (!settings_path) {
-                return FALSE;
-        }
+                        for (c1 = key->keycodes, c2 = other->keycodes;
+                             *c1 || *c2; ++c1, ++c2) {
+                                     if (*c1 != *c2)
+                                        return FALSE;
+                        }
+                } else if (key->keycodes != NULL || other->keycodes != NULL)
+                        return FALSE;
 
-        /* Get entries for this binding */
-        settings = g_settings_new_with_path (CUSTOM_KEYBINDING_SCHEMA, settings_path);
-        action = g_settings_get_string (settings, "action");
-        key = g_settings_get_string (settings, "binding");
-        g_object_unref (settings);
 
-        if (!action || !key) {
-                g_warning (_("Key binding (%s) is incomplete"), settings_path);
-                g_free (action);
-                g_free (key);
-                return FALSE;
+                return TRUE;
         }
 
-        g_debug ("keybindings: get entries from '%s' (action: '%s', key: '%s')", settings_path, action, key);
+        return FALSE;
+}
 
-        tmp_elem = g_slist_find_custom (manager->priv->binding_list,
-                                        settings_path,
-                                        compare_bindings);
+/* Grabs the binding's key unless another binding already holds one of
+ * its keycodes with the same modifiers */
+static gboolean
+binding_grab (MsdKeybindingsManager *manager,
+              Binding               *binding,
+              gboolean               warn)
+{
+        guint *c;
+        gint64 code;
+        guint  n;
 
-        if (!tmp_elem) {
-                new_binding = g_new0 (Binding, 1);
-        } else {
-                new_binding = (Binding *) tmp_elem->data;
-                g_free (new_binding->binding_str);
-                g_free (new_binding->action);
-                g_free (new_binding->settings_path);
-
-                new_binding->previous_key.keysym = new_binding->key.keysym;
-                new_binding->previous_key.state = new_binding->key.state;
-                new_binding->previous_key.keycodes = new_binding->key.keycodes;
-                new_binding->key.keycodes = NULL;
+        if (binding->key.keycodes == NULL || binding->grabbed_key.keycodes != NULL)
+                return FALSE;
+
+        for (c = binding->key.keycodes; *c; c++) {
+                code = grab_code (*c, binding->key.state);
+                if (g_hash_table_contains (manager->priv->grabs, &code)) {
+                        if (warn)
+                                g_warning ("Key binding (%s) is already in use", binding->binding_str);
+                        return FALSE;
+                }
         }
 
-        new_binding->binding_str = key;
-        new_binding->action = action;
-        new_binding->settings_path = g_strdup (settings_path);
+        for (c = binding->key.keycodes; *c; c++) {
+                gint64 *key = g_new (gint64, 1);
 
-        if (parse_binding (new_binding)) {
-                if (!tmp_elem)
-                        manager->priv->binding_list = g_slist_prepend (manager->priv->binding_list, new_binding);
-        } else {
-                g_free (new_binding->binding_str);
-                g_free (new_binding->action);
-                g_free (new_binding->settings_path);
-                g_free (new_binding->previous_key.keycodes);
-                g_free (new_binding);
-
-                if (tmp_elem)
-                        manager->priv->binding_list = g_slist_delete_link (manager->priv->binding_list, tmp_elem);
-                return FALSE;
+                *key = grab_code (*c, binding->key.state);
+                g_hash_table_insert (manager->priv->grabs, key, binding);
         }
+        n = c - binding->key.keycodes;
 
-        return TRUE;
-}
+        grab_key_unsafe (&binding->key, TRUE, manager->priv->screens);
 
-static void
-bindings_clear (MsdKeybindingsManager *manager)
-{
-        MsdKeybindingsManagerPrivate *p = manager->priv;
-        GSList *l;
-
-        if (p->binding_list != NULL)
-        {
-                for (l = p->binding_list; l; l = l->next) {
-                        Binding *b = l->data;
-                        g_free (b->binding_str);
-                        g_free (b->action);
-                        g_free (b->settings_path);
-                        g_free (b->previous_key.keycodes);
-                        g_free (b->key.keycodes);
-                        g_free (b);
-                }
-                g_slist_free (p->binding_list);
-                p->binding_list = NULL;
-        }
+        binding->grabbed_key.keysym = binding->key.keysym;
+        binding->grabbed_key.state = binding->key.state;
+        binding->grabbed_key.keycodes = g_new0 (guint, n + 1);
+        memcpy (binding->grabbed_key.keycodes, binding->key.keycodes, n * sizeof (guint));
+
+        return TRUE;
 }
 
-static void
-bindings_get_entries (MsdKeybindingsManager *manager)
+static gboolean
+binding_ungrab (MsdKeybindingsManager *manager,
+                Binding               *binding)
 {
-        gchar **custom_list = NULL;
-        gint i;
+        guint *c;
+        gint64 code;
 
-        bindings_clear (manager);
+        if (binding->grabbed_key.keycodes == NULL)
+                return FALSE;
 
-        custom_list = dconf_util_list_subdirs (GSETTINGS_KEYBINDINGS_DIR, FALSE);
+        grab_key_unsafe (&binding->grabbed_key, FALSE, manager->priv->screens);
 
-        if (custom_list != NULL)
-        {
-                for (i = 0; custom_list[i] != NULL; i++)
-                {
-                        gchar *settings_path;
-                        settings_path = g_strdup_printf("%s%s", GSETTINGS_KEYBINDINGS_DIR, custom_list[i]);
-                        bindings_get_entry (manager, settings_path);
-                        g_free (settings_path);
-                }
-                g_strfreev (custom_list);
+        for (c = binding->grabbed_key.keycodes; *c; c++) {
+                code = grab_code (*c, binding->grabbed_key.state);
+                if (g_hash_table_lookup (manager->priv->grabs, &code) == binding)
+                        g_hash_table_remove (manager->priv->grabs, &code);
         }
 
+        g_free (binding->grabbed_key.keycodes);
+        binding->grabbed_key.keycodes = NULL;
+        binding->grabbed_key.keysym = 0;
+        binding->grabbed_key.state = 0;
+
+        return TRUE;
 }
 
-static gboolean
-same_keycode (const Key *key, const Key *other)
+static char *
+read_string (DConfClient *client,
+             const char  *settings_path,
+             const char  *key)
 {
-        if (key->keycodes != NULL && other->keycodes != NULL) {
-                guint *c;
-
-                for (c = key->keycodes; *c; ++c) {
-                        if (key_uses_keycode (other, *c))
-                                return TRUE;
-                }
+        GVariant *value;
+        char     *path;
+        char     *str = NULL;
+
+        path = g_strconcat (settings_path, key, NULL);
+        value = dconf_client_read (client, path);
+        g_free (path);
+
+        if (value != NULL) {
+                if (g_variant_is_of_type (value, G_VARIANT_TYPE_STRING))
+                        str = g_variant_dup_string (value, NULL);
+                g_variant_unref (value);
         }
-        return FALSE;
+
+        return str;
 }
 
-static gboolean
-same_key (const Key *key, const Key *other)
+/* Re-reads one custom binding straight from dconf.  Keys are only
+ * re-grabbed when what they resolve to has changed. */
+static void
+binding_reload (MsdKeybindingsManager *manager,
+                const char            *settings_path,
+                gboolean              *ungrabbed,
+                gboolean              *grabbed)
 {
-        if (key->state == other->state) {
-                if (key->keycodes != NULL && other->keycodes != NULL) {
-                        guint *c1, *c2;
+        Binding *binding;
+        char    *action;
+        char    *key;
+
+        action = read_string (manager->priv->client, settings_path, "action");
+        key = read_string (manager->priv->client, settings_path, "binding");
+        binding = g_hash_table_lookup (manager->priv->bindings, settings_path);
+
+        if (action == NULL && key == NULL) {
+                if (binding != NULL) {
+                        g_debug ("keybindings: '%s' removed", settings_path);
+                        *ungrabbed |= binding_ungrab (manager, binding);
+                        g_hash_table_remove (manager->priv->bindings, settings_path);
+                }
+                return;
+        }
 
-                        for (c1 = key->keycodes, c2 = other->keycodes;
-                             *c1 || *c2; ++c1, ++c2) {
-                                     if (*c1 != *c2)
-                                        return FALSE;
-                        }
-                } else if (key->keycodes != NULL || other->keycodes != NULL)
-                        return FALSE;
+        /* Unset keys fall back to the schema defaults */
+        if (action == NULL)
+                action = g_strdup ("");
+        if (key == NULL)
+                key = g_strdup ("");
 
+        g_debug ("keybindings: get entries from '%s' (action: '%s', key: '%s')", settings_path, action, key);
 
-                return TRUE;
+        if (binding == NULL) {
+                binding = g_new0 (Binding, 1);
+                binding->settings_path = g_strdup (settings_path);
+                g_hash_table_insert (manager->priv->bindings, binding->settings_path, binding);
         }
 
-        return FALSE;
-}
+        if (g_strcmp0 (binding->action, action) != 0) {
+                g_free (binding->action);
+                binding->action = action;
+                binding_prepare_command (binding);
+        } else {
+                g_free (action);
+        }
 
-static gboolean
-key_already_used (MsdKeybindingsManager *manager,
-                  Binding               *binding)
-{
-        GSList *li;
+        if (g_strcmp0 (binding->binding_str, key) == 0) {
+                g_free (key);
+                return;
+        }
 
-        for (li = manager->priv->binding_list; li != NULL; li = li->next) {
-                Binding *tmp_binding =  (Binding*) li->data;
+        g_free (binding->binding_str);
+        binding->binding_str = key;
+        parse_binding (binding);
 
-                if (tmp_binding != binding &&
-                    same_keycode (&tmp_binding->key, &binding->key) &&
-                    tmp_binding->key.state == binding->key.state) {
-                        return TRUE;
-                }
+        if (binding->grabbed_key.keycodes != NULL &&
+            binding->key.keycodes != NULL &&
+            same_key (&binding->grabbed_key, &binding->key)) {
+                binding->grabbed_key.keysym = binding->key.keysym;
+                return;
         }
 
-        return FALSE;
+        *ungrabbed |= binding_ungrab (manager, binding);
+        *grabbed |= binding_grab (manager, binding, TRUE);
 }
 
 static void
-binding_unregister_keys (MsdKeybindingsManager *manager)
+bindings_update (MsdKeybindingsManager *manager,
+                 const char * const    *paths)
 {
-        GdkDisplay *dpy;
-        GSList *li;
-        gboolean need_flush = FALSE;
+        GdkDisplay    *dpy;
+        GHashTableIter iter;
+        Binding       *binding;
+        gboolean       ungrabbed = FALSE;
+        gboolean       grabbed = FALSE;
+        gint           i;
 
         dpy = gdk_display_get_default ();
         gdk_x11_display_error_trap_push (dpy);
 
-        for (li = manager->priv->binding_list; li != NULL; li = li->next) {
-                Binding *binding = (Binding *) li->data;
+        for (i = 0; paths[i] != NULL; i++)
+                binding_reload (manager, paths[i], &ungrabbed, &grabbed);
 
-                if (binding->key.keycodes) {
-                        need_flush = TRUE;
-                        grab_key_unsafe (&binding->key, FALSE, manager->priv->screens);
-                }
+        /* A released key may be free now for a binding that clashed */
+        if (ungrabbed) {
+                g_hash_table_iter_init (&iter, manager->priv->bindings);
+                while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &binding))
+                        grabbed |= binding_grab (manager, binding, FALSE);
         }
 
-        if (need_flush)
+        if (ungrabbed || grabbed)
                 gdk_display_flush (dpy);
+        if (gdk_x11_display_error_trap_pop (dpy))
+                g_warning ("Grab failed for some keys, another application may already have access the them.");
+}
 
-        gdk_x11_display_error_trap_pop_ignored (dpy);
+/* Reloads every binding in dconf as well as those we know about, so
+ * that removed ones get dropped */
+static void
+bindings_update_all (MsdKeybindingsManager *manager)
+{
+        GHashTable    *paths;
+        GHashTableIter iter;
+        const char    *path;
+        gpointer      *array;
+        gchar        **custom_list;
+        gint           i;
+
+        paths = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+        custom_list = dconf_util_list_subdirs (GSETTINGS_KEYBINDINGS_DIR, FALSE);
+        for (i = 0; custom_list != NULL && custom_list[i] != NULL; i++)
+                g_hash_table_add (paths, g_strconcat (GSETTINGS_KEYBINDINGS_DIR, custom_list[i], NULL));
+        g_strfreev (custom_list);
+
+        g_hash_table_iter_init (&iter, manager->priv->bindings);
+        while (g_hash_table_iter_next (&iter, (gpointer *) &path, NULL))
+                g_hash_table_add (paths, g_strdup (path));
+
+        array = g_hash_table_get_keys_as_array (paths, NULL);
+        bindings_update (manager, (const char * const *) array);
+        g_free (array);
+
+        g_hash_table_destroy (paths);
 }
 
 static void
-binding_register_keys (MsdKeybindingsManager *manager)
+bindings_clear (MsdKeybindingsManager *manager)
 {
-        GSList *li;
-        GdkDisplay *dpy;
-        gboolean need_flush = FALSE;
+        GdkDisplay    *dpy;
+        GHashTableIter iter;
+        Binding       *binding;
+        gboolean       need_flush = FALSE;
 
         dpy = gdk_display_get_default ();
         gdk_x11_display_error_trap_push (dpy);
 
-        /* Now check for changes and grab new key if not already used */
-        for (li = manager->priv->binding_list; li != NULL; li = li->next) {
-                Binding *binding = (Binding *) li->data;
-
-                if (!same_key (&binding->previous_key, &binding->key)) {
-                        /* Ungrab key if it changed and not clashing with previously set binding */
-                        if (!key_already_used (manager, binding)) {
-                                gint i;
-
-                                need_flush = TRUE;
-                                if (binding->previous_key.keycodes) {
-                                        grab_key_unsafe (&binding->previous_key, FALSE, manager->priv->screens);
-                                }
-                                grab_key_unsafe (&binding->key, TRUE, manager->priv->screens);
-
-                                binding->previous_key.keysym = binding->key.keysym;
-                                binding->previous_key.state = binding->key.state;
-                                g_free (binding->previous_key.keycodes);
-                                for (i = 0; binding->key.keycodes[i]; ++i);
-                                binding->previous_key.keycodes = g_new0 (guint, i);
-                                for (i = 0; binding->key.keycodes[i]; ++i)
-                                        binding->previous_key.keycodes[i] = binding->key.keycodes[i];
-                        } else
-                                g_warning ("Key binding (%s) is already in use", binding->binding_str);
-                }
-        }
+        g_hash_table_iter_init (&iter, manager->priv->bindings);
+        while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &binding))
+                need_flush |= binding_ungrab (manager, binding);
 
         if (need_flush)
                 gdk_display_flush (dpy);
-        if (gdk_x11_display_error_trap_pop (dpy))
-                g_warning ("Grab failed for some keys, another application may already have access the them.");
 
+        gdk_x11_display_error_trap_pop_ignored (dpy);
+
+        g_hash_table_remove_all (manager->priv->bindings);
 }
 
 extern char **environ;
@@ -399,17 +488,11 @@ screen_exec_display_string (GdkScreen *screen)
  * mate-panel/egg-screen-exec.c
  **/
 static char **
-get_exec_environment (XEvent *xevent)
+get_exec_environment (GdkScreen *screen)
 {
         char     **retval = NULL;
         int        i;
         int        display_index = -1;
-        GdkScreen *screen = NULL;
-        GdkWindow *window = gdk_x11_window_lookup_for_display (gdk_display_get_default (), xevent->xkey.root);
-
-        if (window) {
-                screen = gdk_window_get_screen (window);
-        }
 
         g_return_val_if_fail (GDK_IS_SCREEN (screen), NULL);
 
@@ -438,49 +521,181 @@ get_exec_environment (XEvent *xevent)
         return retval;
 }
 
-static GdkFilterReturn
-keybindings_filter (GdkXEvent             *gdk_xevent,
-                    GdkEvent              *event,
-                    MsdKeybindingsManager *manager)
+/* setenv() installs a new string for every variable it changes (other
+ * plugins set QT_SCALE_FACTOR and the like at runtime), so comparing the
+ * entries of environ by address tells whether the cached environments
+ * are stale without copying anything */
+static gboolean
+exec_environment_changed (MsdKeybindingsManager *manager)
+{
+        char **source = manager->priv->exec_envs_source;
+        int    i;
+
+        if (source == NULL)
+                return TRUE;
+
+        for (i = 0; environ [i] && source [i]; i++) {
+                if (environ [i] != source [i])
+                        return TRUE;
+        }
+
+        return environ [i] != source [i];
+}
+
+static void
+exec_environment_snapshot (MsdKeybindingsManager *manager)
+{
+        guint n;
+
+        g_free (manager->priv->exec_envs_source);
+
+        for (n = 0; environ [n]; n++)
+                ;
+        manager->priv->exec_envs_source = g_new (char *, n + 1);
+        memcpy (manager->priv->exec_envs_source, environ, (n + 1) * sizeof (char *));
+}
+
+/* The environment only depends on the screen and the daemon's own
+ * environment, so it is built once per screen and only rebuilt when the
+ * latter changes */
+static char **
+lookup_exec_environment (MsdKeybindingsManager *manager,
+                         XEvent                *xevent)
+{
+        GdkScreen *screen = NULL;
+        GdkWindow *window;
+        char     **envp;
+
+        if (exec_environment_changed (manager)) {
+                g_hash_table_remove_all (manager->priv->exec_envs);
+                exec_environment_snapshot (manager);
+        }
+
+        window = gdk_x11_window_lookup_for_display (gdk_display_get_default (), xevent->xkey.root);
+        if (window) {
+                screen = gdk_window_get_screen (window);
+        }
+
+        g_return_val_if_fail (GDK_IS_SCREEN (screen), NULL);
+
+        envp = g_hash_table_lookup (manager->priv->exec_envs, screen);
+        if (envp == NULL) {
+                envp = get_exec_environment (screen);
+                g_hash_table_insert (manager->priv->exec_envs, screen, envp);
+        }
+
+        return envp;
+}
+
+#ifdef USE_POSIX_SPAWN
+static void
+child_exited_cb (GPid     pid,
+                 gint     status G_GNUC_UNUSED,
+                 gpointer data G_GNUC_UNUSED)
 {
-        XEvent *xevent = (XEvent *) gdk_xevent;
-        GSList *li;
+        g_spawn_close_pid (pid);
+}
+#endif
+
+static gboolean
+launch_command (Binding  *binding,
+                char    **envp,
+                GError  **error)
+{
+#ifdef USE_POSIX_SPAWN
+        /* posix_spawn() uses vfork semantics, so launching does not pay
+         * for duplicating the daemon's address space */
+        if (binding->program == NULL)
+                binding->program = g_find_program_in_path (binding->argv[0]);
+
+        if (binding->program != NULL) {
+                posix_spawn_file_actions_t actions;
+                posix_spawnattr_t attr;
+                sigset_t          mask;
+                pid_t             pid;
+                int               res;
+
+                /* Like g_spawn_async(), keep the daemon's X, D-Bus and
+                 * other descriptors out of the launched command */
+                posix_spawn_file_actions_init (&actions);
+                posix_spawn_file_actions_addclosefrom_np (&actions, 3);
+
+                sigemptyset (&mask);
+                posix_spawnattr_init (&attr);
+                posix_spawnattr_setsigmask (&attr, &mask);
+                posix_spawnattr_setflags (&attr, POSIX_SPAWN_SETSIGMASK);
+
+                res = posix_spawn (&pid, binding->program, &actions, &attr, binding->argv,
+                                   envp != NULL ? envp : environ);
+                posix_spawnattr_destroy (&attr);
+                posix_spawn_file_actions_destroy (&actions);
+
+                if (res == 0) {
+                        g_child_watch_add (pid, child_exited_cb, NULL);
+                        return TRUE;
+                }
+
+                /* The program may have moved since the binding was
+                 * loaded; look it up again next time */
+                g_free (binding->program);
+                binding->program = NULL;
 
-        if (xevent->type != KeyPress) {
-                return GDK_FILTER_CONTINUE;
+                if (res != ENOENT && res != EACCES) {
+                        g_set_error_literal (error, G_SPAWN_ERROR, G_SPAWN_ERROR_FAILED,
+                                             g_strerror (res));
+                        return FALSE;
+                }
         }
+#endif
+
+        return g_spawn_async (NULL,
+                              binding->argv,
+                              envp,
+                              G_SPAWN_SEARCH_PATH,
+                              NULL,
+                              NULL,
+                              NULL,
+                              error);
+}
 
-        for (li = manager->priv->binding_list; li != NULL; li = li->next) {
-                Binding *binding = (Binding *) li->data;
+/* Only sees KeyPress events on the root window, see msd_keybindings_manager_start() */
+static GdkFilterReturn
+keybindings_filter (XEvent                *xevent,
+                    MsdKeybindingsManager *manager)
+{
+        MsdKeybindingsManagerPrivate *p = manager->priv;
+        GHashTableIter iter;
+        Binding       *binding;
+
+        g_hash_table_iter_init (&iter, p->bindings);
+        while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &binding)) {
+                /* Clashing bindings lose to the one holding the grab */
+                if (binding->grabbed_key.keycodes == NULL)
+                        continue;
 
                 if (match_key (&binding->key, xevent)) {
                         GError  *error = NULL;
                         gboolean retval;
-                        gchar  **argv = NULL;
-                        gchar  **envp = NULL;
-
-                        g_return_val_if_fail (binding->action != NULL, GDK_FILTER_CONTINUE);
+                        gint64   start;
+                        gint64   elapsed;
 
-                        if (!g_shell_parse_argv (binding->action,
-                                                 NULL, &argv,
-                                                 &error)) {
+                        if (binding->argv == NULL)
                                 return GDK_FILTER_CONTINUE;
-                        }
 
-                        envp = get_exec_environment (xevent);
+                        start = g_get_monotonic_time ();
+                        retval = launch_command (binding,
+                                                 lookup_exec_environment (manager, xevent),
+                                                 &error);
+                        elapsed = g_get_monotonic_time () - start;
 
-                        retval = g_spawn_async (NULL,
-                                                argv,
-                                                envp,
-                                                G_SPAWN_SEARCH_PATH,
-                                                NULL,
-                                                NULL,
-                                                NULL,
-                                                &error);
-                        g_strfreev (argv);
-                        g_strfreev (envp);
+                        if (retval) {
+                                p->n_launches++;
+                                p->launch_time_total += elapsed;
+                                p->launch_time_max = MAX (p->launch_time_max, elapsed);
 
-                        if (!retval) {
+                                g_debug ("keybindings: launched '%s' in %" G_GINT64_FORMAT " us",
+                                         binding->action, elapsed);
+                        } else {
                                 GtkWidget *dialog = gtk_message_dialog_new (NULL, 0, GTK_MESSAGE_WARNING,
                                                                             GTK_BUTTONS_CLOSE,
                                                                             _("Error while trying to run (%s)\n"\
@@ -492,6 +707,7 @@ keybindings_filter (GdkXEvent             *gdk_xevent,
                                                   G_CALLBACK (gtk_widget_destroy),
                                                   NULL);
                                 gtk_widget_show (dialog);
+                                g_error_free (error);
                         }
                         return GDK_FILTER_REMOVE;
                 }
@@ -501,18 +717,117 @@ keybindings_filter (GdkXEvent             *gdk_xevent,
 
 static void
 bindings_callback (DConfClient           *client G_GNUC_UNUSED,
-                   gchar                 *prefix G_GNUC_UNUSED,
-                   GStrv                  changes G_GNUC_UNUSED,
+                   gchar                 *prefix,
+                   GStrv                  changes,
                    gchar                 *tag G_GNUC_UNUSED,
                    MsdKeybindingsManager *manager)
 {
+        GHashTable *dirs;
+        gboolean    update_all = FALSE;
+        gint        i;
+
         g_debug ("keybindings: received 'changed' signal from dconf");
 
-        binding_unregister_keys (manager);
+        /* Reduce the change set to the binding directories it touches */
+        dirs = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+        for (i = 0; changes[i] != NULL; i++) {
+                char       *path;
+                const char *rest;
+                const char *slash;
+
+                path = g_strconcat (prefix, changes[i], NULL);
+
+                if (!g_str_has_prefix (path, GSETTINGS_KEYBINDINGS_DIR)) {
+                        /* a parent directory was reset */
+                        update_all = TRUE;
+                } else {
+                        rest = path + strlen (GSETTINGS_KEYBINDINGS_DIR);
+                        slash = strchr (rest, '/');
 
-        bindings_get_entries (manager);
+                        if (*rest == '\0')
+                                update_all = TRUE;
+                        else if (slash != NULL)
+                                g_hash_table_add (dirs, g_strndup (path, slash + 1 - path));
+                }
+
+                g_free (path);
+        }
+
+        if (update_all) {
+                bindings_update_all (manager);
+        } else if (g_hash_table_size (dirs) > 0) {
+                gpointer *paths;
+
+                paths = g_hash_table_get_keys_as_array (dirs, NULL);
+                bindings_update (manager, (const char * const *) paths);
+                g_free (paths);
+        }
 
-        binding_register_keys (manager);
+        g_hash_table_destroy (dirs);
+}
+
+static GVariant *
+handle_get_property (GDBusConnection *connection,
+                     const gchar     *sender,
+                     const gchar     *object_path,
+                     const gchar     *interface_name,
+                     const gchar     *property_name,
+                     GError         **error,
+                     gpointer         user_data)
+{
+        MsdKeybindingsManagerPrivate *p = MSD_KEYBINDINGS_MANAGER (user_data)->priv;
+
+        if (g_strcmp0 (property_name, "LaunchCount") == 0)
+                return g_variant_new_uint32 (p->n_launches);
+
+        if (g_strcmp0 (property_name, "LaunchTimeAverage") == 0)
+                return g_variant_new_uint64 (p->n_launches > 0 ? p->launch_time_total / p->n_launches : 0);
+
+        if (g_strcmp0 (property_name, "LaunchTimeMax") == 0)
+                return g_variant_new_uint64 (p->launch_time_max);
+
+        return NULL;
+}
+
+static const GDBusInterfaceVTable interface_vtable =
+{
+        NULL,
+        handle_get_property,
+        NULL
+};
+
+static void
+on_bus_gotten (GObject               *source_object,
+               GAsyncResult          *res,
+               MsdKeybindingsManager *manager)
+{
+        GDBusConnection *connection;
+        GError *error = NULL;
+
+        connection = g_bus_get_finish (res, &error);
+        if (connection == NULL) {
+                if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+                        g_warning ("Could not get session bus: %s", error->message);
+                g_error_free (error);
+                return;
+        }
+        manager->priv->connection = connection;
+
+        g_dbus_connection_register_object (connection,
+                                           MSD_KEYBINDINGS_DBUS_PATH,
+                                           manager->priv->introspection_data->interfaces[0],
+                                           &interface_vtable,
+                                           manager,
+                                           NULL,
+                                           NULL);
+
+        manager->priv->name_id = g_bus_own_name_on_connection (connection,
+                                                               MSD_KEYBINDINGS_DBUS_NAME,
+                                                               G_BUS_NAME_OWNER_FLAGS_NONE,
+                                                               NULL,
+                                                               NULL,
+                                                               NULL,
+                                                               NULL);
 }
 
 gboolean
@@ -536,9 +851,10 @@ msd_keybindings_manager_start (MsdKeybindingsManager *manager,
         window = gdk_screen_get_root_window (screen);
         xwindow = GDK_WINDOW_XID (window);
 
-        gdk_window_add_filter (window,
-                               (GdkFilterFunc) keybindings_filter,
-                               manager);
+        manager->priv->key_press_id =
+                mate_settings_event_router_add (MATE_SETTINGS_EVENT_X, KeyPress, xwindow,
+                                                (MateSettingsEventFunc) keybindings_filter,
+                                                manager, "keybindings");
 
         gdk_x11_display_error_trap_push (dpy);
         /* Add KeyPressMask to the currently reportable event masks */
@@ -548,14 +864,21 @@ msd_keybindings_manager_start (MsdKeybindingsManager *manager,
 
         manager->priv->screens = get_screens_list ();
 
-        manager->priv->binding_list = NULL;
-        bindings_get_entries (manager);
-        binding_register_keys (manager);
-
         manager->priv->client = dconf_client_new ();
+        bindings_update_all (manager);
+
         dconf_client_watch_fast (manager->priv->client, GSETTINGS_KEYBINDINGS_DIR);
         g_signal_connect (manager->priv->client, "changed", G_CALLBACK (bindings_callback), manager);
 
+        manager->priv->introspection_data = g_dbus_node_info_new_for_xml (introspection_xml, NULL);
+        g_assert (manager->priv->introspection_data != NULL);
+
+        manager->priv->cancellable = g_cancellable_new ();
+        g_bus_get (G_BUS_TYPE_SESSION,
+                   manager->priv->cancellable,
+                   (GAsyncReadyCallback) on_bus_gotten,
+                   manager);
+
         mate_settings_profile_end (NULL);
 
         return TRUE;
@@ -565,7 +888,6 @@ void
 msd_keybindings_manager_stop (MsdKeybindingsManager *manager)
 {
         MsdKeybindingsManagerPrivate *p = manager->priv;
-        GSList *l;
 
         g_debug ("Stopping keybindings manager");
 
@@ -574,15 +896,25 @@ msd_keybindings_manager_stop (MsdKeybindingsManager *manager)
                 p->client = NULL;
         }
 
-        for (l = p->screens; l; l = l->next) {
-                GdkScreen *screen = l->data;
-                gdk_window_remove_filter (gdk_screen_get_root_window (screen),
-                                          (GdkFilterFunc) keybindings_filter,
-                                          manager);
-        }
+        mate_settings_event_router_remove (p->key_press_id);
+        p->key_press_id = 0;
 
-        binding_unregister_keys (manager);
         bindings_clear (manager);
+        g_hash_table_remove_all (p->exec_envs);
+        g_clear_pointer (&p->exec_envs_source, g_free);
+
+        if (p->name_id != 0) {
+                g_bus_unown_name (p->name_id);
+                p->name_id = 0;
+        }
+
+        if (p->cancellable) {
+                g_cancellable_cancel (p->cancellable);
+                g_clear_object (&p->cancellable);
+        }
+
+        g_clear_object (&p->connection);
+        g_clear_pointer (&p->introspection_data, g_dbus_node_info_unref);
 
         g_slist_free (p->screens);
         p->screens = NULL;
@@ -600,6 +932,12 @@ static void
 msd_keybindings_manager_init (MsdKeybindingsManager *manager)
 {
         manager->priv = msd_keybindings_manager_get_instance_private (manager);
+        manager->priv->bindings = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                         NULL, (GDestroyNotify) binding_free);
+        manager->priv->grabs = g_hash_table_new_full (g_int64_hash, g_int64_equal,
+                                                      g_free, NULL);
+        manager->priv->exec_envs = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+                                                          NULL, (GDestroyNotify) g_strfreev);
 
 }
 
@@ -615,6 +953,10 @@ msd_keybindings_manager_finalize (GObject *object)
 
         g_return_if_fail (keybindings_manager->priv != NULL);
 
+        g_hash_table_destroy (keybindings_manager->priv->bindings);
+        g_hash_table_destroy (keybindings_manager->priv->grabs);
+        g_hash_table_destroy (keybindings_manager->priv->exec_envs);
+
         G_OBJECT_CLASS (msd_keybindings_manager_parent_class)->finalize (object);
 }
 
@@ -42,6 +42,7 @@
 #endif
 
 #include "mate-settings-profile.h"
+#include "mate-settings-event-router.h"
 #include "msd-keyboard-manager.h"
 
 #include "msd-keyboard-xkb.h"
@@ -64,6 +65,7 @@
 struct MsdKeyboardManagerPrivate {
 	gboolean    have_xkb;
 	gint        xkb_event_base;
+	guint       numlock_event_id;
 	GSettings  *settings;
 };
 
@@ -159,23 +161,18 @@ static void numlock_set_settings_state(GSettings *settings, NumLockState new_sta
 }
 
 static GdkFilterReturn
-numlock_xkb_callback (GdkXEvent *xev_,
-                      GdkEvent *gdkev_,
-                      gpointer xkb_event_code)
+numlock_xkb_callback (XEvent   *xev,
+                      gpointer  user_data)
 {
-        XEvent *xev = (XEvent *) xev_;
-
-        if (xev->type == GPOINTER_TO_INT (xkb_event_code)) {
-                XkbEvent *xkbev = (XkbEvent *)xev;
-                if (xkbev->any.xkb_type == XkbStateNotify)
-                if (xkbev->state.changed & XkbModifierLockMask) {
-                        unsigned num_mask = numlock_NumLock_modifier_mask ();
-                        unsigned locked_mods = xkbev->state.locked_mods;
-                        int numlock_state = !! (num_mask & locked_mods);
-                        GSettings *settings = g_settings_new (MSD_KEYBOARD_SCHEMA);
-                        numlock_set_settings_state (settings, numlock_state);
-                        g_object_unref (settings);
-                }
+        XkbEvent *xkbev = (XkbEvent *)xev;
+
+        if (xkbev->state.changed & XkbModifierLockMask) {
+                unsigned num_mask = numlock_NumLock_modifier_mask ();
+                unsigned locked_mods = xkbev->state.locked_mods;
+                int numlock_state = !! (num_mask & locked_mods);
+                GSettings *settings = g_settings_new (MSD_KEYBOARD_SCHEMA);
+                numlock_set_settings_state (settings, numlock_state);
+                g_object_unref (settings);
         }
         return GDK_FILTER_CONTINUE;
 }
@@ -186,9 +183,10 @@ numlock_install_xkb_callback (MsdKeyboardManager *manager)
         if (!manager->priv->have_xkb)
                 return;
 
-        gdk_window_add_filter (NULL,
-                               numlock_xkb_callback,
-                               GINT_TO_POINTER (manager->priv->xkb_event_base));
+        manager->priv->numlock_event_id =
+                mate_settings_event_router_add (MATE_SETTINGS_EVENT_XKB, XkbStateNotify, None,
+                                                numlock_xkb_callback, manager,
+                                                "keyboard: numlock");
 }
 
 #endif /* HAVE_X11_EXTENSIONS_XKB_H */
@@ -334,9 +332,8 @@ msd_keyboard_manager_stop (MsdKeyboardManager *manager)
 
 #if HAVE_X11_EXTENSIONS_XKB_H
         if (p->have_xkb) {
-                gdk_window_remove_filter (NULL,
-                                          numlock_xkb_callback,
-                                          GINT_TO_POINTER (p->xkb_event_base));
+                mate_settings_event_router_remove (p->numlock_event_id);
+                p->numlock_event_id = 0;
         }
 #endif /* HAVE_X11_EXTENSIONS_XKB_H */
 
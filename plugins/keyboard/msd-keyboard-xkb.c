@@ -26,6 +26,7 @@
 #include <time.h>
 
 #include <glib/gi18n.h>
+#include <glib/gstdio.h>
 #include <gdk/gdk.h>
 #include <gdk/gdkx.h>
 #include <gtk/gtk.h>
@@ -37,9 +38,12 @@
 #include <libmatekbd/matekbd-keyboard-config.h>
 #include <libmatekbd/matekbd-util.h>
 
+#include <X11/extensions/XIproto.h>
+
 #include "msd-keyboard-xkb.h"
 #include "delayed-dialog.h"
 #include "mate-settings-profile.h"
+#include "mate-settings-event-router.h"
 
 #define GTK_RESPONSE_PRINT 2
 
@@ -56,7 +60,15 @@ static GSettings* settings_desktop;
 static GSettings* settings_kbd;
 
 static XklEngine* xkl_engine;
-static XklConfigRegistry* xkl_registry = NULL;
+
+/* Event router subscriptions feeding xkl_engine_filter_events() */
+static GArray* evt_filter_ids = NULL;
+
+/* The core events libxklavier tracks windows and keymaps with */
+static const int xkl_core_events[] = {
+	FocusIn, FocusOut, PropertyNotify, CreateNotify, DestroyNotify,
+	UnmapNotify, MapNotify, GravityNotify, ReparentNotify, MappingNotify
+};
 
 static MatekbdDesktopConfig current_desktop_config;
 static MatekbdKeyboardConfig current_kbd_config;
@@ -380,52 +392,296 @@ try_activating_xkb_config_if_new (MatekbdKeyboardConfig *
 	return TRUE;
 }
 
+/* The XKB configuration registry is a few megabytes of XML.  All we need
+ * from it is the set of layout and variant names, so we keep those in a
+ * small GVariant file under the user's cache directory, keyed by the
+ * modification time of the xkeyboard-config rules.  The registry itself is
+ * only parsed when that cache is missing or out of date.
+ */
+#define XKB_REGISTRY_CACHE_VERSION 1
+#define XKB_REGISTRY_CACHE_TYPE "(uxa{sas})"
+
+/* layout name -> set of variant names */
+static GHashTable* xkb_layouts = NULL;
+static gint64 xkb_layouts_mtime = 0;
+
+/* layouts_variants joined with '\t' -> the same list after filtering */
+static GHashTable* validated_layouts = NULL;
+
+static guint apply_xkb_settings_id = 0;
+
+static gint64
+xkb_registry_data_mtime (void)
+{
+	gchar *rules_dir;
+	const gchar *name;
+	GDir *dir;
+	gint64 mtime = 0;
+
+	rules_dir = g_build_filename (XKB_BASE, "rules", NULL);
+	dir = g_dir_open (rules_dir, 0, NULL);
+	if (dir != NULL) {
+		while ((name = g_dir_read_name (dir)) != NULL) {
+			GStatBuf st;
+			gchar *path;
+
+			if (!g_str_has_suffix (name, ".xml"))
+				continue;
+
+			path = g_build_filename (rules_dir, name, NULL);
+			if (g_stat (path, &st) == 0)
+				mtime = MAX (mtime, (gint64) st.st_mtime);
+			g_free (path);
+		}
+		g_dir_close (dir);
+	}
+	g_free (rules_dir);
+
+	return mtime;
+}
+
+static gchar *
+xkb_registry_cache_filename (void)
+{
+	return g_build_filename (g_get_user_cache_dir (),
+				 "mate-settings-daemon",
+				 "xkb-registry", NULL);
+}
+
+static GHashTable *
+xkb_layouts_new (void)
+{
+	return g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+				      (GDestroyNotify) g_hash_table_destroy);
+}
+
+static GHashTable *
+xkb_layouts_add (GHashTable *layouts, const gchar *layout)
+{
+	GHashTable *variants;
+
+	variants = g_hash_table_lookup (layouts, layout);
+	if (variants == NULL) {
+		variants = g_hash_table_new_full (g_str_hash, g_str_equal,
+						  g_free, NULL);
+		g_hash_table_insert (layouts, g_strdup (layout), variants);
+	}
+
+	return variants;
+}
+
+static gboolean
+xkb_registry_cache_load (gint64 mtime)
+{
+	gchar *filename;
+	gchar *contents;
+	gsize length;
+	GBytes *bytes;
+	GVariant *cache;
+	GVariantIter *iter;
+	const gchar *layout;
+	const gchar **variants;
+	guint32 version;
+	gint64 stamp;
+
+	filename = xkb_registry_cache_filename ();
+	if (!g_file_get_contents (filename, &contents, &length, NULL)) {
+		g_free (filename);
+		return FALSE;
+	}
+	g_free (filename);
+
+	bytes = g_bytes_new_take (contents, length);
+	cache = g_variant_new_from_bytes (G_VARIANT_TYPE (XKB_REGISTRY_CACHE_TYPE),
+					  bytes, FALSE);
+	g_variant_ref_sink (cache);
+	g_bytes_unref (bytes);
+
+	g_variant_get (cache, "(uxa{sas})", &version, &stamp, &iter);
+	if (version != XKB_REGISTRY_CACHE_VERSION || stamp != mtime) {
+		g_variant_iter_free (iter);
+		g_variant_unref (cache);
+		return FALSE;
+	}
+
+	xkb_layouts = xkb_layouts_new ();
+	while (g_variant_iter_next (iter, "{&s^a&s}", &layout, &variants)) {
+		GHashTable *set = xkb_layouts_add (xkb_layouts, layout);
+		int i;
+
+		for (i = 0; variants[i] != NULL; i++)
+			g_hash_table_add (set, g_strdup (variants[i]));
+		g_free (variants);
+	}
+	g_variant_iter_free (iter);
+	g_variant_unref (cache);
+
+	xkl_debug (100, "Loaded %u layouts from the registry cache\n",
+		   g_hash_table_size (xkb_layouts));
+
+	return TRUE;
+}
+
+static void
+xkb_registry_cache_save (gint64 mtime)
+{
+	GVariantBuilder builder;
+	GHashTableIter iter;
+	gpointer layout, variants;
+	GVariant *cache;
+	gchar *filename;
+	gchar *dirname;
+	GError *error = NULL;
+
+	g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{sas}"));
+	g_hash_table_iter_init (&iter, xkb_layouts);
+	while (g_hash_table_iter_next (&iter, &layout, &variants)) {
+		gchar **names;
+
+		names = (gchar **) g_hash_table_get_keys_as_array (variants, NULL);
+		g_variant_builder_add (&builder, "{s^as}", layout, names);
+		g_free (names);
+	}
+
+	cache = g_variant_new ("(ux@a{sas})", XKB_REGISTRY_CACHE_VERSION,
+			       mtime, g_variant_builder_end (&builder));
+	g_variant_ref_sink (cache);
+
+	filename = xkb_registry_cache_filename ();
+	dirname = g_path_get_dirname (filename);
+	g_mkdir_with_parents (dirname, 0700);
+
+	if (!g_file_set_contents (filename,
+				  g_variant_get_data (cache),
+				  g_variant_get_size (cache), &error)) {
+		g_debug ("Could not write %s: %s", filename, error->message);
+		g_error_free (error);
+	}
+
+	g_free (dirname);
+	g_free (filename);
+	g_variant_unref (cache);
+}
+
+static void
+add_registry_variant (XklConfigRegistry *config G_GNUC_UNUSED,
+		      const XklConfigItem *item,
+		      gpointer data)
+{
+	g_hash_table_add (data, g_strdup (item->name));
+}
+
+static void
+add_registry_layout (XklConfigRegistry *config,
+		     const XklConfigItem *item,
+		     gpointer data G_GNUC_UNUSED)
+{
+	GHashTable *variants = xkb_layouts_add (xkb_layouts, item->name);
+
+	xkl_config_registry_foreach_layout_variant (config, item->name,
+						    add_registry_variant,
+						    variants);
+}
+
+static gboolean
+xkb_registry_load (void)
+{
+	XklConfigRegistry *registry;
+	gint64 mtime;
+
+	if (validated_layouts != NULL)
+		g_hash_table_remove_all (validated_layouts);
+	g_clear_pointer (&xkb_layouts, g_hash_table_destroy);
+
+	mtime = xkb_registry_data_mtime ();
+	xkb_layouts_mtime = mtime;
+
+	if (xkb_registry_cache_load (mtime))
+		return TRUE;
+
+	xkl_debug (100, "Building the registry cache\n");
+	mate_settings_profile_start ("xkl_config_registry_load");
+	registry = xkl_config_registry_get_instance (xkl_engine);
+	/* load all materials, unconditionally! */
+	if (!xkl_config_registry_load (registry, TRUE)) {
+		g_object_unref (registry);
+		mate_settings_profile_end ("xkl_config_registry_load");
+		return FALSE;
+	}
+
+	xkb_layouts = xkb_layouts_new ();
+	xkl_config_registry_foreach_layout (registry, add_registry_layout,
+					    NULL);
+	g_object_unref (registry);
+	mate_settings_profile_end ("xkl_config_registry_load");
+
+	xkb_registry_cache_save (mtime);
+
+	return TRUE;
+}
+
+static gboolean
+xkb_registry_has (const gchar *lname, const gchar *vname)
+{
+	GHashTable *variants;
+
+	variants = g_hash_table_lookup (xkb_layouts, lname);
+	if (variants == NULL) {
+		xkl_debug (100, "Bad layout [%s]\n", lname);
+		return FALSE;
+	}
+
+	if (vname != NULL && !g_hash_table_contains (variants, vname)) {
+		xkl_debug (100, "Bad variant [%s(%s)]\n", lname, vname);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
 static gboolean
 filter_xkb_config (void)
 {
-	XklConfigItem *item;
 	gchar *lname;
 	gchar *vname;
 	gchar **lv;
+	gchar *key;
+	const gchar *validated;
 	gboolean any_change = FALSE;
 
-	xkl_debug (100, "Filtering configuration against the registry\n");
-	if (!xkl_registry) {
-		xkl_registry =
-		    xkl_config_registry_get_instance (xkl_engine);
-		/* load all materials, unconditionally! */
-		if (!xkl_config_registry_load (xkl_registry, TRUE)) {
-			g_object_unref (xkl_registry);
-			xkl_registry = NULL;
+	/* A package upgrade may have changed what is valid; reloading also
+	 * forgets the lists filtered against the old data.  That costs a
+	 * stat of each rules file per apply, which is cheap next to the
+	 * apply itself. */
+	if (xkb_layouts == NULL ||
+	    xkb_registry_data_mtime () != xkb_layouts_mtime) {
+		if (!xkb_registry_load ())
+			return FALSE;
+	}
+
+	key = g_strjoinv ("\t", current_kbd_config.layouts_variants);
+
+	/* We have been through this exact list before */
+	validated = g_hash_table_lookup (validated_layouts, key);
+	if (validated != NULL) {
+		xkl_debug (100, "Using the filtered configuration from last time\n");
+		if (strcmp (validated, key) == 0) {
+			g_free (key);
 			return FALSE;
 		}
+		g_strfreev (current_kbd_config.layouts_variants);
+		current_kbd_config.layouts_variants =
+		    g_strsplit (validated, "\t", -1);
+		g_free (key);
+		return TRUE;
 	}
+
+	xkl_debug (100, "Filtering configuration against the registry\n");
 	lv = current_kbd_config.layouts_variants;
-	item = xkl_config_item_new ();
 	while (*lv) {
 		xkl_debug (100, "Checking [%s]\n", *lv);
 		if (matekbd_keyboard_config_split_items (*lv, &lname, &vname)) {
-			gboolean should_be_dropped = FALSE;
-			g_snprintf (item->name, sizeof (item->name), "%s",
-				    lname);
-			if (!xkl_config_registry_find_layout
-			    (xkl_registry, item)) {
-				xkl_debug (100, "Bad layout [%s]\n",
-					   lname);
-				should_be_dropped = TRUE;
-			} else if (vname) {
-				g_snprintf (item->name,
-					    sizeof (item->name), "%s",
-					    vname);
-				if (!xkl_config_registry_find_variant
-				    (xkl_registry, lname, item)) {
-					xkl_debug (100,
-						   "Bad variant [%s(%s)]\n",
-						   lname, vname);
-					should_be_dropped = TRUE;
-				}
-			}
-			if (should_be_dropped) {
+			if (!xkb_registry_has (lname, vname)) {
 				g_strv_behead (lv);
 				any_change = TRUE;
 				continue;
@@ -433,7 +689,10 @@ filter_xkb_config (void)
 		}
 		lv++;
 	}
-	g_object_unref (item);
+
+	g_hash_table_insert (validated_layouts, key,
+			     g_strjoinv ("\t", current_kbd_config.layouts_variants));
+
 	return any_change;
 }
 
@@ -474,12 +733,25 @@ apply_xkb_settings (void)
 	show_hide_icon ();
 }
 
+static gboolean
+apply_xkb_settings_idle_cb (gpointer user_data G_GNUC_UNUSED)
+{
+	apply_xkb_settings_id = 0;
+	apply_xkb_settings ();
+
+	return G_SOURCE_REMOVE;
+}
+
+/* Both libmatekbd and our own GSettings object report the same change,
+ * and writing several keys fires once per key: apply them all at once.
+ */
 static void
 apply_xkb_settings_cb (GSettings *settings G_GNUC_UNUSED,
                        gchar     *key G_GNUC_UNUSED,
                        gpointer   user_data G_GNUC_UNUSED)
 {
-    apply_xkb_settings ();
+	if (apply_xkb_settings_id == 0)
+		apply_xkb_settings_id = g_idle_add (apply_xkb_settings_idle_cb, NULL);
 }
 
 static void
@@ -502,13 +774,61 @@ msd_keyboard_xkb_set_post_activation_callback (PostActivationCallback fun,
 }
 
 static GdkFilterReturn
-msd_keyboard_xkb_evt_filter (GdkXEvent * xev, GdkEvent * event)
+msd_keyboard_xkb_evt_filter (XEvent * xevent, gpointer user_data)
 {
-	XEvent *xevent = (XEvent *) xev;
 	xkl_engine_filter_events (xkl_engine, xevent);
 	return GDK_FILTER_CONTINUE;
 }
 
+static void
+msd_keyboard_xkb_evt_subscribe (MateSettingsEventClass klass, int type)
+{
+	guint id;
+
+	id = mate_settings_event_router_add (klass, type, None,
+					     msd_keyboard_xkb_evt_filter,
+					     NULL, "keyboard-xkb");
+	g_array_append_val (evt_filter_ids, id);
+}
+
+static void
+msd_keyboard_xkb_evt_start (void)
+{
+	int opcode, event_base, error_base;
+	guint i;
+
+	evt_filter_ids = g_array_new (FALSE, FALSE, sizeof (guint));
+
+	msd_keyboard_xkb_evt_subscribe (MATE_SETTINGS_EVENT_XKB,
+					MATE_SETTINGS_EVENT_ANY_TYPE);
+	for (i = 0; i < G_N_ELEMENTS (xkl_core_events); i++)
+		msd_keyboard_xkb_evt_subscribe (MATE_SETTINGS_EVENT_X,
+						xkl_core_events[i]);
+
+	/* Device discovery relies on XInput presence events */
+	if ((xkl_engine_get_features (xkl_engine) & XKLF_DEVICE_DISCOVERY) &&
+	    XQueryExtension (GDK_DISPLAY_XDISPLAY (gdk_display_get_default ()),
+			     "XInputExtension",
+			     &opcode, &event_base, &error_base))
+		msd_keyboard_xkb_evt_subscribe (MATE_SETTINGS_EVENT_X,
+						event_base + XI_DevicePresenceNotify);
+}
+
+static void
+msd_keyboard_xkb_evt_stop (void)
+{
+	guint i;
+
+	if (evt_filter_ids == NULL)
+		return;
+
+	for (i = 0; i < evt_filter_ids->len; i++)
+		mate_settings_event_router_remove (g_array_index (evt_filter_ids, guint, i));
+
+	g_array_free (evt_filter_ids, TRUE);
+	evt_filter_ids = NULL;
+}
+
 /* When new Keyboard is plugged in - reload the settings */
 static void
 msd_keyboard_new_device (XklEngine * engine G_GNUC_UNUSED)
@@ -596,6 +916,10 @@ msd_keyboard_xkb_init (MsdKeyboardManager * kbd_manager)
 		settings_desktop = g_settings_new (MATEKBD_DESKTOP_SCHEMA);
 		settings_kbd = g_settings_new (MATEKBD_KBD_SCHEMA);
 
+		validated_layouts = g_hash_table_new_full (g_str_hash,
+							   g_str_equal,
+							   g_free, g_free);
+
 		matekbd_desktop_config_init (&current_desktop_config,
 		                             xkl_engine);
 		matekbd_keyboard_config_init (&current_kbd_config,
@@ -617,8 +941,7 @@ msd_keyboard_xkb_init (MsdKeyboardManager * kbd_manager)
 		g_signal_connect (settings_kbd, "changed",
 		                  G_CALLBACK (apply_xkb_settings_cb), NULL);
 
-		gdk_window_add_filter (NULL, (GdkFilterFunc)
-				       msd_keyboard_xkb_evt_filter, NULL);
+		msd_keyboard_xkb_evt_start ();
 
 		if (xkl_engine_get_features (xkl_engine) &
 		    XKLF_DEVICE_DISCOVERY)
@@ -671,8 +994,7 @@ msd_keyboard_xkb_shutdown (void)
 				XKLL_MANAGE_LAYOUTS |
 				XKLL_MANAGE_WINDOW_STATES);
 
-	gdk_window_remove_filter (NULL, (GdkFilterFunc)
-				  msd_keyboard_xkb_evt_filter, NULL);
+	msd_keyboard_xkb_evt_stop ();
 
 	if (settings_desktop != NULL) {
 		g_object_unref (settings_desktop);
@@ -682,10 +1004,14 @@ msd_keyboard_xkb_shutdown (void)
 		g_object_unref (settings_kbd);
 	}
 
-	if (xkl_registry) {
-		g_object_unref (xkl_registry);
+	if (apply_xkb_settings_id != 0) {
+		g_source_remove (apply_xkb_settings_id);
+		apply_xkb_settings_id = 0;
 	}
 
+	g_clear_pointer (&xkb_layouts, g_hash_table_destroy);
+	g_clear_pointer (&validated_layouts, g_hash_table_destroy);
+
 	g_object_unref (xkl_engine);
 
 	xkl_engine = NULL;
@@ -41,6 +41,7 @@
 #endif
 
 #include "mate-settings-profile.h"
+#include "mate-settings-event-router.h"
 #include "msd-marshal.h"
 #include "msd-media-keys-manager.h"
 #include "msd-media-keys-manager-glue.h"
@@ -80,6 +81,7 @@ struct _MsdMediaKeysManagerPrivate
         /* Multihead stuff */
         GdkScreen        *current_screen;
         GSList           *screens;
+        GSList           *key_press_ids;
 
         /* RFKill stuff */
         guint            rfkill_watch_id;
@@ -1338,20 +1340,14 @@ acme_get_screen_from_event (MsdMediaKeysManager *manager,
         return NULL;
 }
 
+/* Only sees KeyPress events on the root windows */
 static GdkFilterReturn
-acme_filter_events (GdkXEvent           *xevent,
-                    GdkEvent            *event,
+acme_filter_events (XEvent              *xev,
                     MsdMediaKeysManager *manager)
 {
-        XEvent    *xev = (XEvent *) xevent;
-        XAnyEvent *xany = (XAnyEvent *) xevent;
+        XAnyEvent *xany = (XAnyEvent *) xev;
         int        i;
 
-        /* verify we have a key event */
-        if (xev->type != KeyPress) {
-                return GDK_FILTER_CONTINUE;
-        }
-
         for (i = 0; i < HANDLED_KEYS; i++) {
                 if (match_key (keys[i].key, xev)) {
                         switch (keys[i].key_type) {
@@ -1433,6 +1429,7 @@ start_media_keys_idle_cb (MsdMediaKeysManager *manager)
                 GdkWindow *window;
                 Window xwindow;
                 XWindowAttributes atts;
+                guint id;
 
                 mate_settings_profile_start ("gdk_window_add_filter");
 
@@ -1442,9 +1439,11 @@ start_media_keys_idle_cb (MsdMediaKeysManager *manager)
                 g_debug ("adding key filter for screen: %d",
                          gdk_x11_screen_get_screen_number (l->data));
 
-                gdk_window_add_filter (window,
-                                       (GdkFilterFunc)acme_filter_events,
-                                       manager);
+                id = mate_settings_event_router_add (MATE_SETTINGS_EVENT_X, KeyPress, xwindow,
+                                                     (MateSettingsEventFunc) acme_filter_events,
+                                                     manager, "media-keys");
+                manager->priv->key_press_ids = g_slist_prepend (manager->priv->key_press_ids,
+                                                                GUINT_TO_POINTER (id));
 
                 gdk_x11_display_error_trap_push (dpy);
                 /* Add KeyPressMask to the currently reportable event masks */
@@ -1462,6 +1461,12 @@ start_media_keys_idle_cb (MsdMediaKeysManager *manager)
                                                            NULL,
                                                            manager, NULL);
 
+        /* Warm up the OSD icons so the first key press doesn't lag */
+        mate_settings_profile_start ("preload_icons");
+        dialog_init (manager);
+        msd_media_keys_window_preload_icons (MSD_MEDIA_KEYS_WINDOW (manager->priv->dialog));
+        mate_settings_profile_end ("preload_icons");
+
         mate_settings_profile_end (NULL);
 
         return FALSE;
@@ -1519,11 +1524,11 @@ msd_media_keys_manager_stop (MsdMediaKeysManager *manager)
 
         g_debug ("Stopping media_keys manager");
 
-        for (ls = priv->screens; ls != NULL; ls = ls->next) {
-                gdk_window_remove_filter (gdk_screen_get_root_window (ls->data),
-                                          (GdkFilterFunc) acme_filter_events,
-                                          manager);
+        for (ls = priv->key_press_ids; ls != NULL; ls = ls->next) {
+                mate_settings_event_router_remove (GPOINTER_TO_UINT (ls->data));
         }
+        g_slist_free (priv->key_press_ids);
+        priv->key_press_ids = NULL;
 
         if (manager->priv->rfkill_watch_id > 0) {
                 g_bus_unwatch_name (manager->priv->rfkill_watch_id);
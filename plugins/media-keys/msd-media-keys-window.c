@@ -34,6 +34,21 @@
 
 #define ICON_SCALE 0.55           /* size of the icon compared to the whole OSD */
 
+/* Rendered icons, attached to the (per-screen) icon theme */
+#define ICON_CACHE_KEY "msd-media-keys-icon-cache"
+
+static const char *volume_icon_names[] = {
+        "audio-volume-muted",
+        "audio-volume-low",
+        "audio-volume-medium",
+        "audio-volume-high",
+        "microphone-sensitivity-muted",
+        "microphone-sensitivity-low",
+        "microphone-sensitivity-medium",
+        "microphone-sensitivity-high",
+        NULL
+};
+
 struct MsdMediaKeysWindowPrivate
 {
         MsdMediaKeysWindowAction action;
@@ -122,12 +137,14 @@ action_changed (MsdMediaKeysWindow *window)
                 }
         }
 
+        msd_osd_window_invalidate_content (MSD_OSD_WINDOW (window));
         msd_osd_window_update_and_hide (MSD_OSD_WINDOW (window));
 }
 
 static void
 volume_level_changed (MsdMediaKeysWindow *window)
 {
+        msd_osd_window_invalidate_content (MSD_OSD_WINDOW (window));
         msd_osd_window_update_and_hide (MSD_OSD_WINDOW (window));
 
         if (!msd_osd_window_is_composited (MSD_OSD_WINDOW (window)) && window->priv->progress != NULL) {
@@ -143,6 +160,7 @@ volume_level_changed (MsdMediaKeysWindow *window)
 static void
 volume_muted_changed (MsdMediaKeysWindow *window)
 {
+        msd_osd_window_invalidate_content (MSD_OSD_WINDOW (window));
         msd_osd_window_update_and_hide (MSD_OSD_WINDOW (window));
 
         if (!msd_osd_window_is_composited (MSD_OSD_WINDOW (window))) {
@@ -157,6 +175,7 @@ volume_muted_changed (MsdMediaKeysWindow *window)
 static void
 mic_muted_changed (MsdMediaKeysWindow *window)
 {
+        msd_osd_window_invalidate_content (MSD_OSD_WINDOW (window));
         msd_osd_window_update_and_hide (MSD_OSD_WINDOW (window));
 
         if (!msd_osd_window_is_composited (MSD_OSD_WINDOW (window))) {
@@ -226,7 +245,11 @@ msd_media_keys_window_set_volume_muted (MsdMediaKeysWindow *window,
                 window->priv->volume_muted = muted;
                 volume_muted_changed (window);
         }
-        window->priv->is_mic = FALSE;
+        if (window->priv->is_mic) {
+                /* The speaker icon replaces the microphone one */
+                window->priv->is_mic = FALSE;
+                msd_osd_window_invalidate_content (MSD_OSD_WINDOW (window));
+        }
 }
 
 void
@@ -239,7 +262,11 @@ msd_media_keys_window_set_mic_muted (MsdMediaKeysWindow *window,
                 window->priv->mic_muted = muted;
                 mic_muted_changed (window);
         }
-        window->priv->is_mic = TRUE;
+        if (!window->priv->is_mic) {
+                /* The microphone icon replaces the speaker one */
+                window->priv->is_mic = TRUE;
+                msd_osd_window_invalidate_content (MSD_OSD_WINDOW (window));
+        }
 }
 
 void
@@ -254,13 +281,47 @@ msd_media_keys_window_set_volume_level (MsdMediaKeysWindow *window,
         }
 }
 
-static GdkPixbuf *
-load_pixbuf (MsdMediaKeysWindow *window,
-             const char         *name,
-             int                 icon_size)
+static void
+icon_theme_changed (GtkIconTheme *theme,
+                    GHashTable   *cache)
+{
+        g_debug ("Icon theme changed, dropping %u cached OSD icons",
+                 g_hash_table_size (cache));
+        g_hash_table_remove_all (cache);
+}
+
+static GHashTable *
+get_icon_cache (GtkIconTheme *theme)
+{
+        GHashTable *cache;
+
+        cache = g_object_get_data (G_OBJECT (theme), ICON_CACHE_KEY);
+        if (cache == NULL) {
+                cache = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                               g_free,
+                                               (GDestroyNotify) cairo_surface_destroy);
+                g_object_set_data_full (G_OBJECT (theme), ICON_CACHE_KEY, cache,
+                                        (GDestroyNotify) g_hash_table_destroy);
+                g_signal_connect (theme, "changed",
+                                  G_CALLBACK (icon_theme_changed), cache);
+        }
+
+        return cache;
+}
+
+/* Returns a surface owned by the cache, or NULL if the theme has no such
+ * icon. Misses are cached too, so the -rtl/-ltr fallbacks stay cheap. */
+static cairo_surface_t *
+load_icon_surface (MsdMediaKeysWindow *window,
+                   const char         *name,
+                   int                 icon_size)
 {
-        GtkIconTheme *theme;
-        GdkPixbuf    *pixbuf;
+        GtkIconTheme    *theme;
+        GHashTable      *cache;
+        GdkPixbuf       *pixbuf;
+        cairo_surface_t *surface;
+        char            *key;
+        int              scale;
 
         if (window != NULL && gtk_widget_has_screen (GTK_WIDGET (window))) {
                 theme = gtk_icon_theme_get_for_screen (gtk_widget_get_screen (GTK_WIDGET (window)));
@@ -268,13 +329,43 @@ load_pixbuf (MsdMediaKeysWindow *window,
                 theme = gtk_icon_theme_get_default ();
         }
 
-        pixbuf = gtk_icon_theme_load_icon (theme,
-                                           name,
-                                           icon_size,
-                                           GTK_ICON_LOOKUP_FORCE_SIZE,
-                                           NULL);
+        scale = window != NULL ? gtk_widget_get_scale_factor (GTK_WIDGET (window)) : 1;
+
+        cache = get_icon_cache (theme);
+        key = g_strdup_printf ("%s/%d@%d", name, icon_size, scale);
+
+        if (g_hash_table_lookup_extended (cache, key, NULL, (gpointer *) &surface)) {
+                g_free (key);
+                return surface;
+        }
+
+        pixbuf = gtk_icon_theme_load_icon_for_scale (theme,
+                                                     name,
+                                                     icon_size,
+                                                     scale,
+                                                     GTK_ICON_LOOKUP_FORCE_SIZE,
+                                                     NULL);
+
+        surface = NULL;
+        if (pixbuf != NULL) {
+                surface = gdk_cairo_surface_create_from_pixbuf (pixbuf, scale, NULL);
+                g_object_unref (pixbuf);
+        }
+
+        g_hash_table_insert (cache, key, surface);
+
+        return surface;
+}
+
+static int
+get_icon_size (MsdMediaKeysWindow *window)
+{
+        int window_width;
+        int window_height;
+
+        gtk_window_get_size (GTK_WINDOW (window), &window_width, &window_height);
 
-        return pixbuf;
+        return (int) round (window_width * ICON_SCALE);
 }
 
 static void
@@ -416,20 +507,10 @@ render_speaker (MsdMediaKeysWindow *window,
                 double              width,
                 double              height)
 {
-        GdkPixbuf         *pixbuf;
+        cairo_surface_t   *surface;
         int                icon_size;
         int                n;
-        static const char *icon_names[] = {
-                "audio-volume-muted",
-                "audio-volume-low",
-                "audio-volume-medium",
-                "audio-volume-high",
-                "microphone-sensitivity-muted",
-                "microphone-sensitivity-low",
-                "microphone-sensitivity-medium",
-                "microphone-sensitivity-high",
-                NULL
-        };
+
         if (!window->priv->is_mic) {
                 if (window->priv->volume_muted) {
                         n = 0;
@@ -458,17 +539,15 @@ render_speaker (MsdMediaKeysWindow *window,
 
         icon_size = (int)width;
 
-        pixbuf = load_pixbuf (window, icon_names[n], icon_size);
+        surface = load_icon_surface (window, volume_icon_names[n], icon_size);
 
-        if (pixbuf == NULL) {
+        if (surface == NULL) {
                 return FALSE;
         }
 
-        gdk_cairo_set_source_pixbuf (cr, pixbuf, _x0, _y0);
+        cairo_set_source_surface (cr, surface, _x0, _y0);
         cairo_paint_with_alpha (cr, MSD_OSD_WINDOW_FG_ALPHA);
 
-        g_object_unref (pixbuf);
-
         return TRUE;
 }
 
@@ -638,30 +717,28 @@ render_custom (MsdMediaKeysWindow *window,
                double              width,
                double              height)
 {
-        GdkPixbuf         *pixbuf;
+        cairo_surface_t   *surface;
         int                icon_size;
 
         icon_size = (int)width;
 
-        pixbuf = load_pixbuf (window, window->priv->icon_name, icon_size);
+        surface = load_icon_surface (window, window->priv->icon_name, icon_size);
 
-        if (pixbuf == NULL) {
+        if (surface == NULL) {
                 char *name;
                 if (gtk_widget_get_direction (GTK_WIDGET (window)) == GTK_TEXT_DIR_RTL)
                         name = g_strdup_printf ("%s-rtl", window->priv->icon_name);
                 else
                         name = g_strdup_printf ("%s-ltr", window->priv->icon_name);
-                pixbuf = load_pixbuf (window, name, icon_size);
+                surface = load_icon_surface (window, name, icon_size);
                 g_free (name);
-                if (pixbuf == NULL)
+                if (surface == NULL)
                         return FALSE;
         }
 
-        gdk_cairo_set_source_pixbuf (cr, pixbuf, _x0, _y0);
+        cairo_set_source_surface (cr, surface, _x0, _y0);
         cairo_paint_with_alpha (cr, MSD_OSD_WINDOW_FG_ALPHA);
 
-        g_object_unref (pixbuf);
-
         return TRUE;
 }
 
@@ -786,3 +863,29 @@ msd_media_keys_window_new (void)
 {
         return g_object_new (MSD_TYPE_MEDIA_KEYS_WINDOW, NULL);
 }
+
+/**
+ * msd_media_keys_window_preload_icons:
+ * @window: a #MsdMediaKeysWindow
+ *
+ * Renders the volume, microphone and eject icons at the size @window
+ * will draw them, so the first key press does not have to walk the icon
+ * theme.  Does nothing for non-composited windows, which use GtkImage.
+ */
+void
+msd_media_keys_window_preload_icons (MsdMediaKeysWindow *window)
+{
+        int icon_size;
+        int i;
+
+        g_return_if_fail (MSD_IS_MEDIA_KEYS_WINDOW (window));
+
+        if (!msd_osd_window_is_composited (MSD_OSD_WINDOW (window)))
+                return;
+
+        icon_size = get_icon_size (window);
+
+        for (i = 0; volume_icon_names[i] != NULL; i++)
+                load_icon_surface (window, volume_icon_names[i], icon_size);
+        load_icon_surface (window, "media-eject", icon_size);
+}
@@ -72,6 +72,7 @@ void                  msd_media_keys_window_set_volume_muted  (MsdMediaKeysWindo
 void                  msd_media_keys_window_set_volume_level  (MsdMediaKeysWindow      *window,
                                                                int                      level);
 gboolean              msd_media_keys_window_is_valid          (MsdMediaKeysWindow      *window);
+void                  msd_media_keys_window_preload_icons     (MsdMediaKeysWindow      *window);
 
 #ifdef __cplusplus
 }
@@ -37,6 +37,10 @@
 #define CIRCLES_PROGRESS_INTERVAL (0.5 / N_CIRCLES)
 #define CIRCLE_PROGRESS(p) (MIN (1., ((gdouble) (p) * 2.)))
 
+/* Without a compositor the shape only changes once per circle interval,
+ * so there is one precomputed shape for each of those steps */
+#define N_SHAPES (2 * N_CIRCLES + 1)
+
 typedef struct MsdLocatePointerData MsdLocatePointerData;
 
 struct MsdLocatePointerData
@@ -46,6 +50,8 @@ struct MsdLocatePointerData
   GdkWindow *window;
 
   gdouble progress;
+
+  cairo_region_t *shapes[N_SHAPES];
 };
 
 static MsdLocatePointerData *data = NULL;
@@ -53,18 +59,17 @@ static MsdLocatePointerData *data = NULL;
 static void
 locate_pointer_paint (MsdLocatePointerData *data,
 		      cairo_t              *cr,
+		      gdouble               progress,
 		      gboolean              composited)
 {
   GdkRGBA color;
-  gdouble progress, circle_progress;
+  gdouble circle_progress;
   gint width, height, i;
   GtkStyleContext *style;
 
   color.red = color.green = color.blue = 0.7;
   color.alpha = 0.;
 
-  progress = data->progress;
-
   width = gdk_window_get_width (data->window);
   height = gdk_window_get_height (data->window);
 
@@ -142,27 +147,49 @@ locate_pointer_paint (MsdLocatePointerData *data,
 }
 
 static void
-update_shape (MsdLocatePointerData *data)
+clear_shapes (MsdLocatePointerData *data)
+{
+  gint i;
+
+  for (i = 0; i < N_SHAPES; i++)
+    g_clear_pointer (&data->shapes[i], cairo_region_destroy);
+}
+
+static cairo_region_t *
+get_shape (MsdLocatePointerData *data,
+	   gdouble               progress)
 {
   cairo_t *cr;
   cairo_surface_t *mask;
-  cairo_region_t *region;
+  gint step;
 
-  mask = gdk_window_create_similar_image_surface (data->window,
-                                                  CAIRO_FORMAT_A1,
-                                                  WINDOW_SIZE,
-                                                  WINDOW_SIZE,
-                                                  0);
-  cr = cairo_create (mask);
-  locate_pointer_paint (data, cr, FALSE);
+  step = CLAMP ((gint) (progress / CIRCLES_PROGRESS_INTERVAL + 0.5), 0, N_SHAPES - 1);
 
-  region = gdk_cairo_region_create_from_surface (mask);
+  if (data->shapes[step] == NULL)
+    {
+      mask = gdk_window_create_similar_image_surface (data->window,
+                                                      CAIRO_FORMAT_A1,
+                                                      WINDOW_SIZE,
+                                                      WINDOW_SIZE,
+                                                      0);
+      cr = cairo_create (mask);
+      locate_pointer_paint (data, cr, step * CIRCLES_PROGRESS_INTERVAL, FALSE);
+
+      data->shapes[step] = gdk_cairo_region_create_from_surface (mask);
+
+      cairo_destroy (cr);
+      cairo_surface_destroy (mask);
+    }
 
-  gdk_window_shape_combine_region (data->window, region, 0, 0);
+  return data->shapes[step];
+}
 
-  cairo_region_destroy (region);
-  cairo_destroy (cr);
-  cairo_surface_destroy (mask);
+static void
+update_shape (MsdLocatePointerData *data)
+{
+  gdk_window_shape_combine_region (data->window,
+                                   get_shape (data, data->progress),
+                                   0, 0);
 }
 
 static void
@@ -269,6 +296,9 @@ static void
 locate_pointer_unrealize_cb (GtkWidget            *widget G_GNUC_UNUSED,
                              MsdLocatePointerData *data)
 {
+  /* Shapes depend on the window's scale, build them again for the next one */
+  clear_shapes (data);
+
   if (data->window != NULL)
     {
       gtk_widget_unregister_window (GTK_WIDGET (data->widget),
@@ -330,7 +360,8 @@ locate_pointer_draw_cb (GtkWidget      *widget G_GNUC_UNUSED,
 
   if (gtk_cairo_should_draw_window (cr, data->window))
     {
-      locate_pointer_paint (data, cr, gdk_screen_is_composited (screen));
+      locate_pointer_paint (data, cr, data->progress,
+                            gdk_screen_is_composited (screen));
     }
 
   return TRUE;
@@ -432,6 +463,9 @@ msd_locate_pointer (GdkDisplay *display)
   composited_changed (screen, data);
   gtk_widget_show (GTK_WIDGET (data->widget));
 
+  /* Pace the animation to the window's refresh */
+  msd_timeline_set_frame_clock (data->timeline,
+                                gdk_window_get_frame_clock (data->window));
   msd_timeline_start (data->timeline);
 }
 
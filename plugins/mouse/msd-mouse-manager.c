@@ -45,6 +45,7 @@
 #include <gio/gio.h>
 
 #include "mate-settings-profile.h"
+#include "mate-settings-event-router.h"
 #include "msd-mouse-manager.h"
 #include "msd-input-helper.h"
 
@@ -82,6 +83,36 @@
 #define KEY_MOUSE_A11Y_DELAY_ENABLE      "delay-enable"
 #endif
 
+/* Pointer speed, kept once for mice and once for touchpads */
+typedef struct {
+        gdouble  acceleration;
+        gint     threshold;
+        gint     accel_profile;
+} PointerMotion;
+
+/* What the settings ask of a pointer device; which half applies, and
+ * how it is written, depends on the device's driver */
+typedef struct {
+        PointerMotion mouse_motion;
+        PointerMotion touchpad_motion;
+        gboolean mouse_left_handed;
+        gboolean touchpad_left_handed;
+        gboolean middle_button;
+        gboolean disable_w_typing;
+        gboolean tap_to_click;
+        gint     one_finger_tap;
+        gint     two_finger_tap;
+        gint     three_finger_tap;
+        gint     two_finger_click;
+        gint     three_finger_click;
+        gboolean vert_edge_scroll;
+        gboolean horiz_edge_scroll;
+        gboolean vert_two_finger_scroll;
+        gboolean horiz_two_finger_scroll;
+        gboolean natural_scroll;
+        gboolean touchpad_enabled;
+} InputProfile;
+
 struct MsdMouseManagerPrivate
 {
         GSettings *settings_mouse;
@@ -94,6 +125,11 @@ struct MsdMouseManagerPrivate
         GPid syndaemon_pid;
         gboolean locate_pointer_spawned;
         GPid locate_pointer_pid;
+        guint devicepresence_id;
+
+        /* Read from GSettings once, kept until a key changes */
+        InputProfile profile;
+        gboolean profile_valid;
 };
 
 typedef enum {
@@ -110,6 +146,9 @@ typedef enum {
 
 static void     msd_mouse_manager_finalize    (GObject              *object);
 static void     set_mouse_settings            (MsdMouseManager      *manager);
+static void     set_device_settings           (MsdMouseManager      *manager,
+                                               XID                   device_id);
+static const InputProfile *get_input_profile (MsdMouseManager *manager);
 static void     set_tap_to_click_synaptics    (XDeviceInfo          *device_info,
                                                gboolean              state,
                                                gboolean              left_handed,
@@ -273,14 +312,10 @@ change_property (XDevice     *device,
 
         display = gdk_display_get_default ();
 
-        gdk_x11_display_error_trap_push (display);
-
         XChangeDeviceProperty (GDK_DISPLAY_XDISPLAY (display), device,
                                property_atom, type, format,
                                PropModeReplace, data, nitems);
 
-        gdk_x11_display_error_trap_pop_ignored (display);
-
         XFree (data_ret);
 }
 
@@ -315,43 +350,8 @@ touchpad_has_single_button (XDevice *device)
         return is_single_button;
 }
 
-static gboolean
-property_exists_on_device (XDeviceInfo *device_info,
-                           const char  *property_name)
-{
-        XDevice *device;
-        int rc;
-        Atom type, prop;
-        GdkDisplay  *display;
-        int format;
-        unsigned long nitems, bytes_after;
-        unsigned char *data;
-
-        prop = property_from_name (property_name);
-        if (!prop)
-                return FALSE;
-
-        display = gdk_display_get_default ();
-
-        gdk_x11_display_error_trap_push (display);
-        device = XOpenDevice (GDK_DISPLAY_XDISPLAY (display), device_info->id);
-        if ((gdk_x11_display_error_trap_pop (display) != 0) || (device == NULL))
-                return FALSE;
-
-        gdk_x11_display_error_trap_push (display);
-        rc = XGetDeviceProperty (GDK_DISPLAY_XDISPLAY (display),
-                                 device, prop, 0, 1, False, XA_INTEGER, &type, &format,
-                                 &nitems, &bytes_after, &data);
-
-        if (rc == Success)
-                XFree (data);
-
-        XCloseDevice (GDK_DISPLAY_XDISPLAY (display), device);
-        gdk_x11_display_error_trap_pop_ignored (display);
-
-        return rc == Success;
-}
-
+/* Like the other property writers, this runs inside the error trap of
+ * whoever applies the settings, which reports any failure once */
 static void
 property_set_bool (XDeviceInfo *device_info,
                    XDevice     *device,
@@ -372,7 +372,6 @@ property_set_bool (XDeviceInfo *device_info,
 
         display = gdk_display_get_default ();
 
-        gdk_x11_display_error_trap_push (display);
         rc = XGetDeviceProperty (GDK_DISPLAY_XDISPLAY (display), device,
                                  property, 0, 1, False,
                                  XA_INTEGER, &act_type, &act_format, &nitems,
@@ -387,10 +386,6 @@ property_set_bool (XDeviceInfo *device_info,
 
         if (rc == Success)
                 XFree (data);
-
-        if (gdk_x11_display_error_trap_pop (display)) {
-                g_warning ("Error while setting %s on \"%s\"", property_name, device_info->name);
-        }
 }
 
 static void
@@ -402,6 +397,9 @@ touchpad_set_bool (XDeviceInfo *device_info,
         XDevice    *device;
         GdkDisplay *display;
 
+        if (!device_info_has_property (device_info, property_name))
+                return;
+
         device = device_is_touchpad (device_info);
         if (device == NULL) {
                 return;
@@ -464,8 +462,8 @@ set_left_handed_legacy_driver (MsdMouseManager *manager,
         gdk_x11_display_error_trap_push (display);
 
         device = XOpenDevice (GDK_DISPLAY_XDISPLAY (display), device_info->id);
-        if ((gdk_x11_display_error_trap_pop (display) != 0) ||
-            (device == NULL))
+        gdk_x11_display_error_trap_pop_ignored (display);
+        if (device == NULL)
                 return;
 
         buttons = g_new (guchar, buttons_capacity);
@@ -507,7 +505,8 @@ set_left_handed_libinput (XDeviceInfo *device_info,
         if (device == NULL) {
                 gdk_x11_display_error_trap_push (display);
                 device = XOpenDevice (GDK_DISPLAY_XDISPLAY (display), device_info->id);
-                if ((gdk_x11_display_error_trap_pop (display) != 0) || (device == NULL))
+                gdk_x11_display_error_trap_pop_ignored (display);
+                if (device == NULL)
                         return;
 
                 want_lefthanded = mouse_left_handed;
@@ -532,7 +531,7 @@ set_left_handed (MsdMouseManager *manager,
                  gboolean         mouse_left_handed,
                  gboolean         touchpad_left_handed)
 {
-        if (property_exists_on_device (device_info, "libinput Left Handed Enabled"))
+        if (device_info_has_property (device_info, "libinput Left Handed Enabled"))
                 set_left_handed_libinput (device_info, mouse_left_handed, touchpad_left_handed);
         else
                 set_left_handed_legacy_driver (manager, device_info, mouse_left_handed, touchpad_left_handed);
@@ -558,22 +557,14 @@ set_left_handed_all (MsdMouseManager *manager,
 }
 
 static GdkFilterReturn
-devicepresence_filter (GdkXEvent *xevent,
-                       GdkEvent  *event,
-                       gpointer   data)
+devicepresence_filter (XEvent   *xev,
+                       gpointer  data)
 {
-        XEvent *xev = (XEvent *) xevent;
-        G_GNUC_UNUSED XEventClass class_presence;
-        int xi_presence;
+        XDevicePresenceNotifyEvent *dpn = (XDevicePresenceNotifyEvent *) xev;
 
-        DevicePresence (gdk_x11_get_default_xdisplay (), xi_presence, class_presence);
-
-        if (xev->type == xi_presence)
-        {
-                XDevicePresenceNotifyEvent *dpn = (XDevicePresenceNotifyEvent *) xev;
-                if (dpn->devchange == DeviceEnabled)
-                        set_mouse_settings ((MsdMouseManager *) data);
-        }
+        /* Only the device that came up needs configuring */
+        if (dpn->devchange == DeviceEnabled)
+                set_device_settings ((MsdMouseManager *) data, dpn->deviceid);
 
         return GDK_FILTER_CONTINUE;
 }
@@ -584,7 +575,7 @@ set_devicepresence_handler (MsdMouseManager *manager)
         GdkDisplay    *gdk_display;
         Display       *display;
         XEventClass    class_presence;
-        G_GNUC_UNUSED  int xi_presence;
+        int            xi_presence;
 
         gdk_display = gdk_display_get_default ();
         display = gdk_x11_get_default_xdisplay ();
@@ -597,19 +588,22 @@ set_devicepresence_handler (MsdMouseManager *manager)
 
         gdk_display_flush (gdk_display);
         if (!gdk_x11_display_error_trap_pop (gdk_display))
-                gdk_window_add_filter (NULL, devicepresence_filter, manager);
+                manager->priv->devicepresence_id =
+                        mate_settings_event_router_add (MATE_SETTINGS_EVENT_X, xi_presence, None,
+                                                        devicepresence_filter, manager,
+                                                        "mouse: device presence");
 }
 
 static void
-set_motion_legacy_driver (MsdMouseManager *manager,
-                          XDeviceInfo     *device_info)
+set_motion_legacy_driver (const InputProfile *profile,
+                          XDeviceInfo        *device_info)
 {
         XDevice *device;
         GdkDisplay *display;
         XPtrFeedbackControl feedback;
         XFeedbackState *states, *state;
         gint num_feedbacks, i;
-        GSettings *settings;
+        const PointerMotion *motion;
         gdouble motion_acceleration;
         gint motion_threshold;
         gint numerator, denominator;
@@ -618,18 +612,19 @@ set_motion_legacy_driver (MsdMouseManager *manager,
         display = gdk_display_get_default ();
 
         if (device != NULL) {
-                settings = manager->priv->settings_touchpad;
+                motion = &profile->touchpad_motion;
         } else {
                 gdk_x11_display_error_trap_push (display);
                 device = XOpenDevice (GDK_DISPLAY_XDISPLAY (display), device_info->id);
-                if ((gdk_x11_display_error_trap_pop (display) != 0) || (device == NULL))
+                gdk_x11_display_error_trap_pop_ignored (display);
+                if (device == NULL)
                         return;
 
-                settings = manager->priv->settings_mouse;
+                motion = &profile->mouse_motion;
         }
 
         /* Calculate acceleration */
-        motion_acceleration = g_settings_get_double (settings, KEY_MOTION_ACCELERATION);
+        motion_acceleration = motion->acceleration;
         if (motion_acceleration >= 1.0) {
                 /* we want to get the acceleration, with a resolution of 0.5
                  */
@@ -656,7 +651,7 @@ set_motion_legacy_driver (MsdMouseManager *manager,
         }
 
         /* And threshold */
-        motion_threshold = g_settings_get_int (settings, KEY_MOTION_THRESHOLD);
+        motion_threshold = motion->threshold;
 
         /* Get the list of feedbacks for the device */
         states = XGetFeedbackControl (GDK_DISPLAY_XDISPLAY (display), device, &num_feedbacks);
@@ -694,8 +689,8 @@ set_motion_legacy_driver (MsdMouseManager *manager,
 }
 
 static void
-set_motion_libinput (MsdMouseManager *manager,
-                     XDeviceInfo     *device_info)
+set_motion_libinput (const InputProfile *profile,
+                     XDeviceInfo        *device_info)
 {
         XDevice *device;
         GdkDisplay *display;
@@ -704,7 +699,7 @@ set_motion_libinput (MsdMouseManager *manager,
         Atom float_type;
         int format, rc;
         unsigned long nitems, bytes_after;
-        GSettings *settings;
+        const PointerMotion *motion;
         union {
                 unsigned char *c;
                 long *l;
@@ -725,18 +720,19 @@ set_motion_libinput (MsdMouseManager *manager,
         display = gdk_display_get_default ();
 
         if (device != NULL) {
-                settings = manager->priv->settings_touchpad;
+                motion = &profile->touchpad_motion;
         } else {
                 gdk_x11_display_error_trap_push (display);
                 device = XOpenDevice (GDK_DISPLAY_XDISPLAY (display), device_info->id);
-                if ((gdk_x11_display_error_trap_pop (display) != 0) || (device == NULL))
+                gdk_x11_display_error_trap_pop_ignored (display);
+                if (device == NULL)
                         return;
 
-                settings = manager->priv->settings_mouse;
+                motion = &profile->mouse_motion;
         }
 
         /* Calculate acceleration */
-        motion_acceleration = g_settings_get_double (settings, KEY_MOTION_ACCELERATION);
+        motion_acceleration = motion->acceleration;
 
         /* panel gives us a range of 1.0-10.0, map to libinput's [-1, 1]
          *
@@ -751,7 +747,6 @@ set_motion_libinput (MsdMouseManager *manager,
         else
                 accel = (motion_acceleration - 1.0) * 2.0 / 9.0 - 1;
 
-        gdk_x11_display_error_trap_push (display);
         rc = XGetDeviceProperty (GDK_DISPLAY_XDISPLAY (display),
                                  device, prop, 0, 1, False, float_type, &type, &format,
                                  &nitems, &bytes_after, &data.c);
@@ -767,19 +762,16 @@ set_motion_libinput (MsdMouseManager *manager,
         }
 
         XCloseDevice (GDK_DISPLAY_XDISPLAY (display), device);
-        if (gdk_x11_display_error_trap_pop (display)) {
-                g_warning ("Error while setting accel speed on \"%s\"", device_info->name);
-        }
 }
 
 static void
-set_motion (MsdMouseManager *manager,
-            XDeviceInfo     *device_info)
+set_motion (const InputProfile *profile,
+            XDeviceInfo        *device_info)
 {
-        if (property_exists_on_device (device_info, "libinput Accel Speed"))
-                set_motion_libinput (manager, device_info);
+        if (device_info_has_property (device_info, "libinput Accel Speed"))
+                set_motion_libinput (profile, device_info);
         else
-                set_motion_legacy_driver (manager, device_info);
+                set_motion_legacy_driver (profile, device_info);
 }
 
 static void
@@ -792,7 +784,7 @@ set_motion_all (MsdMouseManager *manager)
         device_info = XListInputDevices (GDK_DISPLAY_XDISPLAY (gdk_display_get_default ()), &n_devices);
 
         for (i = 0; i < n_devices; i++) {
-                set_motion (manager, &device_info[i]);
+                set_motion (get_input_profile (manager), &device_info[i]);
         }
 
         if (device_info != NULL)
@@ -821,11 +813,10 @@ set_middle_button_evdev (XDeviceInfo *device_info,
         gdk_x11_display_error_trap_push (display);
 
         device = XOpenDevice (GDK_DISPLAY_XDISPLAY (display), device_info->id);
-        if ((gdk_x11_display_error_trap_pop (display) != 0) ||
-            (device == NULL))
+        gdk_x11_display_error_trap_pop_ignored (display);
+        if (device == NULL)
                 return;
 
-        gdk_x11_display_error_trap_push (display);
         rc = XGetDeviceProperty (GDK_DISPLAY_XDISPLAY (display),
                                  device, prop, 0, 1, False, XA_INTEGER, &type, &format,
                                  &nitems, &bytes_after, &data);
@@ -840,9 +831,6 @@ set_middle_button_evdev (XDeviceInfo *device_info,
                 XFree (data);
 
         XCloseDevice (GDK_DISPLAY_XDISPLAY (display), device);
-        if (gdk_x11_display_error_trap_pop (display)) {
-                g_warning ("Error in setting middle button emulation on \"%s\"", device_info->name);
-        }
 }
 
 static void
@@ -855,19 +843,15 @@ set_middle_button_libinput (XDeviceInfo *device_info,
         /* touchpad devices are excluded as the old code
          * only applies to evdev devices
          */
-        device = device_is_touchpad (device_info);
-        display = gdk_display_get_default ();
-
-        if (device != NULL) {
-                gdk_x11_display_error_trap_push (display);
-                XCloseDevice (GDK_DISPLAY_XDISPLAY (display), device);
-                gdk_x11_display_error_trap_pop_ignored (display);
+        if (device_info_is_touchpad (device_info))
                 return;
-        }
+
+        display = gdk_display_get_default ();
 
         gdk_x11_display_error_trap_push (display);
         device = XOpenDevice (GDK_DISPLAY_XDISPLAY (display), device_info->id);
-        if ((gdk_x11_display_error_trap_pop (display) != 0) || (device == NULL))
+        gdk_x11_display_error_trap_pop_ignored (display);
+        if (device == NULL)
                 return;
 
         property_set_bool (device_info, device, "libinput Middle Emulation Enabled", 0, middle_button);
@@ -990,12 +974,12 @@ set_disable_w_typing (MsdMouseManager *manager,
 }
 
 static void
-set_accel_profile_libinput (MsdMouseManager *manager,
-                            XDeviceInfo     *device_info)
+set_accel_profile_libinput (const InputProfile *profile,
+                            XDeviceInfo        *device_info)
 {
         XDevice *device;
         GdkDisplay *display;
-        GSettings *settings;
+        const PointerMotion *motion;
         guchar *available, *defaults, *values;
 
         display = gdk_display_get_default ();
@@ -1003,14 +987,15 @@ set_accel_profile_libinput (MsdMouseManager *manager,
         device = device_is_touchpad (device_info);
 
         if (device != NULL) {
-                settings = manager->priv->settings_touchpad;
+                motion = &profile->touchpad_motion;
         } else {
                 gdk_x11_display_error_trap_push (display);
                 device = XOpenDevice (GDK_DISPLAY_XDISPLAY (display), device_info->id);
-                if ((gdk_x11_display_error_trap_pop (display) != 0) || (device == NULL))
+                gdk_x11_display_error_trap_pop_ignored (display);
+                if (device == NULL)
                         return;
 
-                settings = manager->priv->settings_mouse;
+                motion = &profile->mouse_motion;
         }
 
         available = get_property (device, "libinput Accel Profiles Available", XA_INTEGER, 8, 2);
@@ -1029,7 +1014,7 @@ set_accel_profile_libinput (MsdMouseManager *manager,
         }
 
         /* 2 boolean values (8 bit, 0 or 1), in order "adaptive", "flat". */
-        switch (g_settings_get_enum (settings, KEY_ACCEL_PROFILE)) {
+        switch (motion->accel_profile) {
                 case ACCEL_PROFILE_ADAPTIVE:
                         values[0] = 1; /* enable adaptive */
                         values[1] = 0; /* disable flat */
@@ -1054,11 +1039,11 @@ set_accel_profile_libinput (MsdMouseManager *manager,
 }
 
 static void
-set_accel_profile (MsdMouseManager *manager,
-                   XDeviceInfo     *device_info)
+set_accel_profile (const InputProfile *profile,
+                   XDeviceInfo        *device_info)
 {
-        if (property_exists_on_device (device_info, "libinput Accel Profile Enabled"))
-                set_accel_profile_libinput (manager, device_info);
+        if (device_info_has_property (device_info, "libinput Accel Profile Enabled"))
+                set_accel_profile_libinput (profile, device_info);
 
         /* TODO: Add acceleration profiles for synaptics/legacy drivers */
 }
@@ -1073,7 +1058,7 @@ set_accel_profile_all (MsdMouseManager *manager)
                 return;
 
         for (i = 0; i < numdevices; i++) {
-                set_accel_profile (manager, &devicelist[i]);
+                set_accel_profile (get_input_profile (manager), &devicelist[i]);
         }
 
         XFreeDeviceList (devicelist);
@@ -1112,7 +1097,7 @@ set_tap_to_click_synaptics (XDeviceInfo *device_info,
 
         prop = property_from_name ("Synaptics Tap Action");
 
-        if (!prop)
+        if (!prop || !device_info_has_property (device_info, "Synaptics Tap Action"))
                 return;
 
         device = device_is_touchpad (device_info);
@@ -1122,7 +1107,6 @@ set_tap_to_click_synaptics (XDeviceInfo *device_info,
 
         display = gdk_display_get_default ();
 
-        gdk_x11_display_error_trap_push (display);
         rc = XGetDeviceProperty (GDK_DISPLAY_XDISPLAY (display), device, prop, 0, 2,
                                  False, XA_INTEGER, &type, &format, &nitems,
                                  &bytes_after, &data);
@@ -1148,9 +1132,6 @@ set_tap_to_click_synaptics (XDeviceInfo *device_info,
                 XFree (data);
 
         XCloseDevice (GDK_DISPLAY_XDISPLAY (display), device);
-        if (gdk_x11_display_error_trap_pop (display)) {
-                g_warning ("Error in setting tap to click on \"%s\"", device_info->name);
-        }
 }
 
 static void
@@ -1211,7 +1192,7 @@ set_click_actions_synaptics (XDeviceInfo *device_info,
         GdkDisplay *display;
 
         prop = property_from_name ("Synaptics Click Action");
-        if (!prop)
+        if (!prop || !device_info_has_property (device_info, "Synaptics Click Action"))
                 return;
 
         device = device_is_touchpad (device_info);
@@ -1223,7 +1204,6 @@ set_click_actions_synaptics (XDeviceInfo *device_info,
 
         display = gdk_display_get_default ();
 
-        gdk_x11_display_error_trap_push (display);
         rc = XGetDeviceProperty (GDK_DISPLAY_XDISPLAY (display), device, prop, 0, 2,
                                  False, XA_INTEGER, &type, &format, &nitems,
                                  &bytes_after, &data);
@@ -1240,9 +1220,6 @@ set_click_actions_synaptics (XDeviceInfo *device_info,
                 XFree (data);
 
         XCloseDevice (GDK_DISPLAY_XDISPLAY (display), device);
-        if (gdk_x11_display_error_trap_pop (display)) {
-                g_warning ("Error in setting click actions on \"%s\"", device_info->name);
-        }
 }
 
 static void
@@ -1260,7 +1237,7 @@ set_click_actions_libinput (XDeviceInfo *device_info,
         GdkDisplay *display;
 
         prop = property_from_name ("libinput Click Method Enabled");
-        if (!prop)
+        if (!prop || !device_info_has_property (device_info, "libinput Click Method Enabled"))
                 return;
 
         device = device_is_touchpad (device_info);
@@ -1275,7 +1252,6 @@ set_click_actions_libinput (XDeviceInfo *device_info,
 
         display = gdk_display_get_default ();
 
-        gdk_x11_display_error_trap_push (display);
         rc = XGetDeviceProperty (GDK_DISPLAY_XDISPLAY (display), device, prop, 0, 2,
                                  False, XA_INTEGER, &type, &format, &nitems,
                                  &bytes_after, &data);
@@ -1291,9 +1267,6 @@ set_click_actions_libinput (XDeviceInfo *device_info,
                 XFree (data);
 
         XCloseDevice (GDK_DISPLAY_XDISPLAY (display), device);
-        if (gdk_x11_display_error_trap_pop (display)) {
-                g_warning ("Error in setting click actions on \"%s\"", device_info->name);
-        }
 }
 
 static void
@@ -1340,7 +1313,7 @@ set_natural_scroll_synaptics (XDeviceInfo *device_info,
         GdkDisplay *display;
 
         prop = property_from_name ("Synaptics Scrolling Distance");
-        if (!prop)
+        if (!prop || !device_info_has_property (device_info, "Synaptics Scrolling Distance"))
                 return;
 
         device = device_is_touchpad (device_info);
@@ -1352,7 +1325,6 @@ set_natural_scroll_synaptics (XDeviceInfo *device_info,
 
         display = gdk_display_get_default ();
 
-        gdk_x11_display_error_trap_push (display);
         rc = XGetDeviceProperty (GDK_DISPLAY_XDISPLAY (display), device, prop, 0, 2,
                                  False, XA_INTEGER, &type, &format, &nitems,
                                  &bytes_after, &data);
@@ -1375,9 +1347,6 @@ set_natural_scroll_synaptics (XDeviceInfo *device_info,
                 XFree (data);
 
         XCloseDevice (GDK_DISPLAY_XDISPLAY (display), device);
-        if (gdk_x11_display_error_trap_pop (display)) {
-                g_warning ("Error in setting natural scroll on \"%s\"", device_info->name);
-        }
 }
 
 static void
@@ -1419,18 +1388,18 @@ set_natural_scroll_all (MsdMouseManager *manager)
 }
 
 static void
-set_scrolling_synaptics (XDeviceInfo *device_info,
-                         GSettings   *settings)
+set_scrolling_synaptics (XDeviceInfo        *device_info,
+                         const InputProfile *profile)
 {
-        touchpad_set_bool (device_info, "Synaptics Edge Scrolling", 0, g_settings_get_boolean (settings, KEY_VERT_EDGE_SCROLL));
-        touchpad_set_bool (device_info, "Synaptics Edge Scrolling", 1, g_settings_get_boolean (settings, KEY_HORIZ_EDGE_SCROLL));
-        touchpad_set_bool (device_info, "Synaptics Two-Finger Scrolling", 0, g_settings_get_boolean (settings, KEY_VERT_TWO_FINGER_SCROLL));
-        touchpad_set_bool (device_info, "Synaptics Two-Finger Scrolling", 1, g_settings_get_boolean (settings, KEY_HORIZ_TWO_FINGER_SCROLL));
+        touchpad_set_bool (device_info, "Synaptics Edge Scrolling", 0, profile->vert_edge_scroll);
+        touchpad_set_bool (device_info, "Synaptics Edge Scrolling", 1, profile->horiz_edge_scroll);
+        touchpad_set_bool (device_info, "Synaptics Two-Finger Scrolling", 0, profile->vert_two_finger_scroll);
+        touchpad_set_bool (device_info, "Synaptics Two-Finger Scrolling", 1, profile->horiz_two_finger_scroll);
 }
 
 static void
-set_scrolling_libinput (XDeviceInfo *device_info,
-                        GSettings   *settings)
+set_scrolling_libinput (XDeviceInfo        *device_info,
+                        const InputProfile *profile)
 {
         XDevice *device;
         int format, rc;
@@ -1442,7 +1411,7 @@ set_scrolling_libinput (XDeviceInfo *device_info,
         gboolean want_horiz;
 
         prop = property_from_name ("libinput Scroll Method Enabled");
-        if (!prop)
+        if (!prop || !device_info_has_property (device_info, "libinput Scroll Method Enabled"))
                 return;
 
         device = device_is_touchpad (device_info);
@@ -1450,8 +1419,8 @@ set_scrolling_libinput (XDeviceInfo *device_info,
                 return;
         }
 
-        want_2fg = g_settings_get_boolean (settings, KEY_VERT_TWO_FINGER_SCROLL);
-        want_edge = g_settings_get_boolean (settings, KEY_VERT_EDGE_SCROLL);
+        want_2fg = profile->vert_two_finger_scroll;
+        want_edge = profile->vert_edge_scroll;
 
         /* libinput only allows for one scroll method at a time.
          * If both are set, pick 2fg scrolling.
@@ -1463,7 +1432,6 @@ set_scrolling_libinput (XDeviceInfo *device_info,
 
         display = gdk_display_get_default ();
 
-        gdk_x11_display_error_trap_push (display);
         rc = XGetDeviceProperty (GDK_DISPLAY_XDISPLAY (display), device, prop, 0, 2,
                                  False, XA_INTEGER, &type, &format, &nitems,
                                  &bytes_after, &data);
@@ -1479,18 +1447,15 @@ set_scrolling_libinput (XDeviceInfo *device_info,
                 XFree (data);
 
         XCloseDevice (GDK_DISPLAY_XDISPLAY (display), device);
-        if (gdk_x11_display_error_trap_pop (display)) {
-                g_warning ("Error in setting scroll method on \"%s\"", device_info->name);
-        }
 
         /* Horizontal scrolling is handled by xf86-input-libinput and
          * there's only one bool. Pick the one matching the scroll method
          * we picked above.
          */
         if (want_2fg)
-                want_horiz = g_settings_get_boolean (settings, KEY_HORIZ_TWO_FINGER_SCROLL);
+                want_horiz = profile->horiz_two_finger_scroll;
         else if (want_edge)
-                want_horiz = g_settings_get_boolean (settings, KEY_HORIZ_EDGE_SCROLL);
+                want_horiz = profile->horiz_edge_scroll;
         else
                 return;
 
@@ -1498,18 +1463,18 @@ set_scrolling_libinput (XDeviceInfo *device_info,
 }
 
 static void
-set_scrolling (XDeviceInfo *device_info,
-               GSettings   *settings)
+set_scrolling (XDeviceInfo        *device_info,
+               const InputProfile *profile)
 {
         if (property_from_name ("Synaptics Edge Scrolling"))
-                set_scrolling_synaptics (device_info, settings);
+                set_scrolling_synaptics (device_info, profile);
 
         if (property_from_name ("libinput Scroll Method Enabled"))
-                set_scrolling_libinput (device_info, settings);
+                set_scrolling_libinput (device_info, profile);
 }
 
 static void
-set_scrolling_all (GSettings *settings)
+set_scrolling_all (MsdMouseManager *manager)
 {
         int numdevices, i;
         XDeviceInfo *devicelist = XListInputDevices (GDK_DISPLAY_XDISPLAY (gdk_display_get_default ()), &numdevices);
@@ -1518,7 +1483,7 @@ set_scrolling_all (GSettings *settings)
                 return;
 
         for (i = 0; i < numdevices; i++) {
-                set_scrolling (&devicelist[i], settings);
+                set_scrolling (&devicelist[i], get_input_profile (manager));
         }
 
         XFreeDeviceList (devicelist);
@@ -1544,18 +1509,11 @@ set_touchpad_enabled (XDeviceInfo *device_info,
 
         display = gdk_display_get_default ();
 
-        gdk_x11_display_error_trap_push (display);
         XChangeDeviceProperty (GDK_DISPLAY_XDISPLAY (display), device,
                                prop_enabled, XA_INTEGER, 8,
                                PropModeReplace, &data, 1);
 
         XCloseDevice (GDK_DISPLAY_XDISPLAY (display), device);
-        gdk_display_flush (display);
-        if (gdk_x11_display_error_trap_pop (display)) {
-                g_warning ("Error %s device \"%s\"",
-                           (state) ? "enabling" : "disabling",
-                           device_info->name);
-        }
 }
 
 static void
@@ -1664,24 +1622,143 @@ set_mousetweaks_daemon (MsdMouseManager *manager,
 }
 #endif  /* set_mousetweaks_daemon */
 
+static void
+get_pointer_motion (GSettings     *settings,
+                    PointerMotion *motion)
+{
+        motion->acceleration = g_settings_get_double (settings, KEY_MOTION_ACCELERATION);
+        motion->threshold = g_settings_get_int (settings, KEY_MOTION_THRESHOLD);
+        motion->accel_profile = g_settings_get_enum (settings, KEY_ACCEL_PROFILE);
+}
+
+static const InputProfile *
+get_input_profile (MsdMouseManager *manager)
+{
+        MsdMouseManagerPrivate *p = manager->priv;
+        InputProfile *profile = &p->profile;
+
+        if (p->profile_valid)
+                return profile;
+
+        profile->mouse_left_handed = g_settings_get_boolean (p->settings_mouse, KEY_LEFT_HANDED);
+        profile->touchpad_left_handed = get_touchpad_handedness (manager, profile->mouse_left_handed);
+        profile->middle_button = g_settings_get_boolean (p->settings_mouse, KEY_MIDDLE_BUTTON_EMULATION);
+        profile->disable_w_typing = g_settings_get_boolean (p->settings_touchpad, KEY_TOUCHPAD_DISABLE_W_TYPING);
+        profile->tap_to_click = g_settings_get_boolean (p->settings_touchpad, KEY_TOUCHPAD_TAP_TO_CLICK);
+        profile->one_finger_tap = g_settings_get_int (p->settings_touchpad, KEY_TOUCHPAD_ONE_FINGER_TAP);
+        profile->two_finger_tap = g_settings_get_int (p->settings_touchpad, KEY_TOUCHPAD_TWO_FINGER_TAP);
+        profile->three_finger_tap = g_settings_get_int (p->settings_touchpad, KEY_TOUCHPAD_THREE_FINGER_TAP);
+        profile->two_finger_click = g_settings_get_int (p->settings_touchpad, KEY_TOUCHPAD_TWO_FINGER_CLICK);
+        profile->three_finger_click = g_settings_get_int (p->settings_touchpad, KEY_TOUCHPAD_THREE_FINGER_CLICK);
+        profile->natural_scroll = g_settings_get_boolean (p->settings_touchpad, KEY_TOUCHPAD_NATURAL_SCROLL);
+        profile->touchpad_enabled = g_settings_get_boolean (p->settings_touchpad, KEY_TOUCHPAD_ENABLED);
+        profile->vert_edge_scroll = g_settings_get_boolean (p->settings_touchpad, KEY_VERT_EDGE_SCROLL);
+        profile->horiz_edge_scroll = g_settings_get_boolean (p->settings_touchpad, KEY_HORIZ_EDGE_SCROLL);
+        profile->vert_two_finger_scroll = g_settings_get_boolean (p->settings_touchpad, KEY_VERT_TWO_FINGER_SCROLL);
+        profile->horiz_two_finger_scroll = g_settings_get_boolean (p->settings_touchpad, KEY_HORIZ_TWO_FINGER_SCROLL);
+        get_pointer_motion (p->settings_mouse, &profile->mouse_motion);
+        get_pointer_motion (p->settings_touchpad, &profile->touchpad_motion);
+
+        p->profile_valid = TRUE;
+
+        return profile;
+}
+
+/* Every per-device setting; the setters each pick the code path for
+ * the device's driver and skip what does not apply to it */
+static void
+apply_input_profile (MsdMouseManager    *manager,
+                     const InputProfile *profile,
+                     XDeviceInfo        *device_info)
+{
+        set_left_handed (manager, device_info, profile->mouse_left_handed, profile->touchpad_left_handed);
+        set_motion (profile, device_info);
+        set_middle_button (device_info, profile->middle_button);
+
+        if (property_from_name ("libinput Disable While Typing Enabled"))
+                touchpad_set_bool (device_info, "libinput Disable While Typing Enabled", 0, profile->disable_w_typing);
+
+        set_tap_to_click (device_info, profile->tap_to_click, profile->touchpad_left_handed,
+                          profile->one_finger_tap, profile->two_finger_tap, profile->three_finger_tap);
+        set_click_actions (device_info, profile->two_finger_click, profile->three_finger_click);
+        set_scrolling (device_info, profile);
+        set_natural_scroll (device_info, profile->natural_scroll);
+        set_touchpad_enabled (device_info, profile->touchpad_enabled);
+        set_accel_profile (profile, device_info);
+}
+
 static void
 set_mouse_settings (MsdMouseManager *manager)
 {
-        gboolean mouse_left_handed = g_settings_get_boolean (manager->priv->settings_mouse, KEY_LEFT_HANDED);
-        gboolean touchpad_left_handed = get_touchpad_handedness (manager, mouse_left_handed);
-        set_left_handed_all (manager, mouse_left_handed, touchpad_left_handed);
+        const InputProfile *profile;
+        GdkDisplay *display;
+        XDeviceInfo *device_info;
+        gint n_devices;
+        gint i;
+
+        profile = get_input_profile (manager);
+        display = gdk_display_get_default ();
+
+        /* syndaemon covers every synaptics touchpad at once */
+        if (property_from_name ("Synaptics Off"))
+                set_disable_w_typing_synaptics (manager, profile->disable_w_typing);
+
+        device_info = XListInputDevices (GDK_DISPLAY_XDISPLAY (display), &n_devices);
+        if (device_info == NULL)
+                return;
+
+        gdk_x11_display_error_trap_push (display);
+
+        for (i = 0; i < n_devices; i++)
+                apply_input_profile (manager, profile, &device_info[i]);
+
+        gdk_display_flush (display);
+        if (gdk_x11_display_error_trap_pop (display))
+                g_warning ("Error while applying mouse and touchpad settings");
+
+        XFreeDeviceList (device_info);
+}
+
+static void
+set_device_settings (MsdMouseManager *manager,
+                     XID              device_id)
+{
+        const InputProfile *profile;
+        GdkDisplay *display;
+        XDeviceInfo *device_info;
+        gint n_devices;
+        gint i;
 
-        set_motion_all (manager);
-        set_middle_button_all (g_settings_get_boolean (manager->priv->settings_mouse, KEY_MIDDLE_BUTTON_EMULATION));
+        profile = get_input_profile (manager);
+        display = gdk_display_get_default ();
+
+        device_info = XListInputDevices (GDK_DISPLAY_XDISPLAY (display), &n_devices);
+        if (device_info == NULL)
+                return;
 
-        set_disable_w_typing (manager, g_settings_get_boolean (manager->priv->settings_touchpad, KEY_TOUCHPAD_DISABLE_W_TYPING));
+        for (i = 0; i < n_devices; i++) {
+                if (device_info[i].id != device_id)
+                        continue;
+
+                g_debug ("Applying settings to new device \"%s\"", device_info[i].name);
+
+                gdk_x11_display_error_trap_push (display);
 
-        set_tap_to_click_all (manager);
-        set_click_actions_all (manager);
-        set_scrolling_all (manager->priv->settings_touchpad);
-        set_natural_scroll_all (manager);
-        set_touchpad_enabled_all (g_settings_get_boolean (manager->priv->settings_touchpad, KEY_TOUCHPAD_ENABLED));
-        set_accel_profile_all (manager);
+                apply_input_profile (manager, profile, &device_info[i]);
+
+                /* A first synaptics touchpad may need syndaemon started */
+                if (device_info_is_touchpad (&device_info[i]) &&
+                    device_info_get_driver (&device_info[i]) == MSD_INPUT_DRIVER_SYNAPTICS)
+                        set_disable_w_typing_synaptics (manager, profile->disable_w_typing);
+
+                gdk_display_flush (display);
+                if (gdk_x11_display_error_trap_pop (display))
+                        g_warning ("Error while applying settings to \"%s\"", device_info[i].name);
+
+                break;
+        }
+
+        XFreeDeviceList (device_info);
 }
 
 static void
@@ -1689,6 +1766,14 @@ mouse_callback (GSettings          *settings,
                 const gchar        *key,
                 MsdMouseManager    *manager)
 {
+        GdkDisplay *display = gdk_display_get_default ();
+
+        manager->priv->profile_valid = FALSE;
+
+        /* The setters leave error checking to this one trap, so the
+         * server is synced once per change rather than per property */
+        gdk_x11_display_error_trap_push (display);
+
         if (g_strcmp0 (key, KEY_LEFT_HANDED) == 0) {
                 gboolean mouse_left_handed = g_settings_get_boolean (settings, key);
                 gboolean touchpad_left_handed = get_touchpad_handedness (manager, mouse_left_handed);
@@ -1714,6 +1799,10 @@ mouse_callback (GSettings          *settings,
                                         g_settings_get_boolean (settings, key));
 #endif
         }
+
+        gdk_display_flush (display);
+        if (gdk_x11_display_error_trap_pop (display))
+                g_warning ("Error while applying mouse setting \"%s\"", key);
 }
 
 static void
@@ -1721,6 +1810,12 @@ touchpad_callback (GSettings          *settings,
                    const gchar        *key,
                    MsdMouseManager    *manager)
 {
+        GdkDisplay *display = gdk_display_get_default ();
+
+        manager->priv->profile_valid = FALSE;
+
+        gdk_x11_display_error_trap_push (display);
+
         if (g_strcmp0 (key, KEY_TOUCHPAD_DISABLE_W_TYPING) == 0) {
                 set_disable_w_typing (manager, g_settings_get_boolean (settings, key));
         } else if (g_strcmp0 (key, KEY_LEFT_HANDED) == 0) {
@@ -1739,7 +1834,7 @@ touchpad_callback (GSettings          *settings,
                 || (g_strcmp0 (key, KEY_HORIZ_EDGE_SCROLL) == 0)
                 || (g_strcmp0 (key, KEY_VERT_TWO_FINGER_SCROLL) == 0)
                 || (g_strcmp0 (key, KEY_HORIZ_TWO_FINGER_SCROLL) == 0)) {
-                set_scrolling_all (manager->priv->settings_touchpad);
+                set_scrolling_all (manager);
         } else if (g_strcmp0 (key, KEY_TOUCHPAD_NATURAL_SCROLL) == 0) {
                 set_natural_scroll_all (manager);
         } else if (g_strcmp0 (key, KEY_TOUCHPAD_ENABLED) == 0) {
@@ -1750,6 +1845,10 @@ touchpad_callback (GSettings          *settings,
         } else if (g_strcmp0 (key, KEY_ACCEL_PROFILE) == 0) {
                 set_accel_profile_all (manager);
         }
+
+        gdk_display_flush (display);
+        if (gdk_x11_display_error_trap_pop (display))
+                g_warning ("Error while applying touchpad setting \"%s\"", key);
 }
 
 static void
@@ -1826,9 +1925,12 @@ msd_mouse_manager_stop (MsdMouseManager *manager)
                 p->settings_touchpad = NULL;
         }
 
+        p->profile_valid = FALSE;
+
         set_locate_pointer (manager, FALSE);
 
-        gdk_window_remove_filter (NULL, devicepresence_filter, manager);
+        mate_settings_event_router_remove (p->devicepresence_id);
+        p->devicepresence_id = 0;
 }
 
 static void
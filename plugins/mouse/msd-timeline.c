@@ -36,6 +36,14 @@ struct _MsdTimelinePrivate
 
   GTimer *timer;
 
+  /* When set, frames are emitted from the clock's ::update instead
+   * of a timeout, so they line up with the display refresh */
+  GdkFrameClock *frame_clock;
+  gulong update_id;
+  gint64 last_frame_time;
+  guint n_frames;
+  guint n_dropped_frames;
+
   GdkScreen *screen;
   MsdTimelineProgressType progress_type;
   MsdTimelineProgressFunc progress_func;
@@ -52,6 +60,7 @@ enum {
   PROP_DIRECTION,
   PROP_SCREEN,
   PROP_PROGRESS_TYPE,
+  PROP_FRAME_CLOCK,
 };
 
 enum {
@@ -74,6 +83,7 @@ static void  msd_timeline_get_property  (GObject         *object,
 					 GValue          *value,
 					 GParamSpec      *pspec);
 static void  msd_timeline_finalize      (GObject *object);
+static void  msd_timeline_stop_frames   (MsdTimeline     *timeline);
 
 G_DEFINE_TYPE_WITH_PRIVATE (MsdTimeline, msd_timeline, G_TYPE_OBJECT)
 
@@ -173,6 +183,13 @@ msd_timeline_class_init (MsdTimelineClass *class)
 							"Screen to get the settings from",
 							GDK_TYPE_SCREEN,
 							G_PARAM_READWRITE));
+  g_object_class_install_property (object_class,
+				   PROP_FRAME_CLOCK,
+				   g_param_spec_object ("frame-clock",
+							"Frame clock",
+							"Frame clock driving the timeline, or NULL to use a timeout",
+							GDK_TYPE_FRAME_CLOCK,
+							G_PARAM_READWRITE));
 
   signals[STARTED] =
     g_signal_new ("started",
@@ -256,6 +273,10 @@ msd_timeline_set_property (GObject      *object,
     case PROP_PROGRESS_TYPE:
       msd_timeline_set_progress_type (timeline, g_value_get_enum (value));
       break;
+    case PROP_FRAME_CLOCK:
+      msd_timeline_set_frame_clock (timeline,
+				    GDK_FRAME_CLOCK (g_value_get_object (value)));
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
     }
@@ -293,6 +314,9 @@ msd_timeline_get_property (GObject    *object,
     case PROP_PROGRESS_TYPE:
       g_value_set_enum (value, priv->progress_type);
       break;
+    case PROP_FRAME_CLOCK:
+      g_value_set_object (value, priv->frame_clock);
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
     }
@@ -305,11 +329,8 @@ msd_timeline_finalize (GObject *object)
 
   priv = msd_timeline_get_instance_private (MSD_TIMELINE (object));
 
-  if (priv->source_id)
-    {
-      g_source_remove (priv->source_id);
-      priv->source_id = 0;
-    }
+  msd_timeline_stop_frames (MSD_TIMELINE (object));
+  g_clear_object (&priv->frame_clock);
 
   if (priv->timer)
       g_timer_destroy (priv->timer);
@@ -384,11 +405,7 @@ msd_timeline_run_frame (MsdTimeline *timeline,
     {
       if (!priv->loop)
 	{
-	  if (priv->source_id)
-	    {
-	      g_source_remove (priv->source_id);
-	      priv->source_id = 0;
-	    }
+	  msd_timeline_stop_frames (timeline);
 
 	  g_signal_emit (timeline, signals [FINISHED], 0);
 	  return FALSE;
@@ -406,6 +423,85 @@ msd_timeline_frame_idle_func (MsdTimeline *timeline)
   return msd_timeline_run_frame (timeline, TRUE);
 }
 
+static void
+msd_timeline_frame_clock_update (GdkFrameClock *frame_clock,
+				 MsdTimeline   *timeline)
+{
+  MsdTimelinePrivate *priv;
+  gint64 frame_time;
+  gint64 refresh_interval;
+
+  priv = msd_timeline_get_instance_private (timeline);
+
+  frame_time = gdk_frame_clock_get_frame_time (frame_clock);
+  gdk_frame_clock_get_refresh_info (frame_clock, frame_time,
+				    &refresh_interval, NULL);
+  if (refresh_interval <= 0)
+    refresh_interval = G_USEC_PER_SEC / priv->fps;
+
+  /* Count the refresh cycles we slept through since the last frame */
+  if (priv->last_frame_time > 0)
+    {
+      gint64 interval = frame_time - priv->last_frame_time;
+
+      if (interval > refresh_interval + refresh_interval / 2)
+	priv->n_dropped_frames += (interval + refresh_interval / 2) / refresh_interval - 1;
+    }
+
+  priv->last_frame_time = frame_time;
+  priv->n_frames++;
+
+  msd_timeline_run_frame (timeline, TRUE);
+}
+
+static void
+msd_timeline_start_frames (MsdTimeline *timeline)
+{
+  MsdTimelinePrivate *priv;
+
+  priv = msd_timeline_get_instance_private (timeline);
+
+  if (priv->frame_clock)
+    {
+      priv->last_frame_time = 0;
+      priv->update_id = g_signal_connect (priv->frame_clock, "update",
+					  G_CALLBACK (msd_timeline_frame_clock_update),
+					  timeline);
+      gdk_frame_clock_begin_updating (priv->frame_clock);
+    }
+  else
+    {
+      priv->source_id = gdk_threads_add_timeout (FRAME_INTERVAL (priv->fps),
+						 (GSourceFunc) msd_timeline_frame_idle_func,
+						 timeline);
+    }
+}
+
+static void
+msd_timeline_stop_frames (MsdTimeline *timeline)
+{
+  MsdTimelinePrivate *priv;
+
+  priv = msd_timeline_get_instance_private (timeline);
+
+  if (priv->source_id)
+    {
+      g_source_remove (priv->source_id);
+      priv->source_id = 0;
+    }
+
+  if (priv->update_id)
+    {
+      g_signal_handler_disconnect (priv->frame_clock, priv->update_id);
+      gdk_frame_clock_end_updating (priv->frame_clock);
+      priv->update_id = 0;
+
+      if (priv->n_dropped_frames > 0)
+	g_debug ("Timeline ran %u frames, dropped %u",
+		 priv->n_frames, priv->n_dropped_frames);
+    }
+}
+
 /**
  * msd_timeline_new:
  * @duration: duration in milliseconds for the timeline
@@ -457,7 +553,7 @@ msd_timeline_start (MsdTimeline *timeline)
 
   if (enable_animations)
     {
-      if (!priv->source_id)
+      if (!msd_timeline_is_running (timeline))
 	{
 	  if (priv->timer)
 	    g_timer_continue (priv->timer);
@@ -469,9 +565,7 @@ msd_timeline_start (MsdTimeline *timeline)
 
 	  g_signal_emit (timeline, signals [STARTED], 0);
 
-	  priv->source_id = gdk_threads_add_timeout (FRAME_INTERVAL (priv->fps),
-						     (GSourceFunc) msd_timeline_frame_idle_func,
-						     timeline);
+	  msd_timeline_start_frames (timeline);
 	}
     }
   else
@@ -502,10 +596,9 @@ msd_timeline_pause (MsdTimeline *timeline)
 
   priv = msd_timeline_get_instance_private (timeline);
 
-  if (priv->source_id)
+  if (msd_timeline_is_running (timeline))
     {
-      g_source_remove (priv->source_id);
-      priv->source_id = 0;
+      msd_timeline_stop_frames (timeline);
       g_timer_stop (priv->timer);
       g_signal_emit (timeline, signals [PAUSED], 0);
     }
@@ -526,6 +619,9 @@ msd_timeline_rewind (MsdTimeline *timeline)
 
   priv = msd_timeline_get_instance_private (timeline);
 
+  priv->n_frames = 0;
+  priv->n_dropped_frames = 0;
+
   /* destroy and re-create timer if neccesary  */
   if (priv->timer)
     {
@@ -555,7 +651,7 @@ msd_timeline_is_running (MsdTimeline *timeline)
 
   priv = msd_timeline_get_instance_private (timeline);
 
-  return (priv->source_id != 0);
+  return (priv->source_id != 0 || priv->update_id != 0);
 }
 
 /**
@@ -598,11 +694,12 @@ msd_timeline_set_fps (MsdTimeline *timeline,
 
   priv->fps = fps;
 
-  if (msd_timeline_is_running (timeline))
+  /* The frame clock sets its own pace, only the timeout needs re-arming */
+  if (priv->source_id)
     {
       g_source_remove (priv->source_id);
       priv->source_id = gdk_threads_add_timeout (FRAME_INTERVAL (priv->fps),
-						 (GSourceFunc) msd_timeline_run_frame,
+						 (GSourceFunc) msd_timeline_frame_idle_func,
 						 timeline);
     }
 
@@ -748,6 +845,76 @@ msd_timeline_set_screen (MsdTimeline *timeline,
   g_object_notify (G_OBJECT (timeline), "screen");
 }
 
+/**
+ * msd_timeline_set_frame_clock:
+ * @timeline: A #MsdTimeline
+ * @frame_clock: (allow-none): the #GdkFrameClock of the animated window
+ *
+ * Makes the timeline emit ::frame from @frame_clock, once per refresh
+ * cycle, instead of from a timeout at #MsdTimeline:fps. Passing %NULL
+ * goes back to the timeout.
+ **/
+void
+msd_timeline_set_frame_clock (MsdTimeline   *timeline,
+			      GdkFrameClock *frame_clock)
+{
+  MsdTimelinePrivate *priv;
+  gboolean running;
+
+  g_return_if_fail (MSD_IS_TIMELINE (timeline));
+  g_return_if_fail (frame_clock == NULL || GDK_IS_FRAME_CLOCK (frame_clock));
+
+  priv = msd_timeline_get_instance_private (timeline);
+
+  if (priv->frame_clock == frame_clock)
+    return;
+
+  running = msd_timeline_is_running (timeline);
+  if (running)
+    msd_timeline_stop_frames (timeline);
+
+  g_clear_object (&priv->frame_clock);
+  if (frame_clock)
+    priv->frame_clock = g_object_ref (frame_clock);
+
+  if (running)
+    msd_timeline_start_frames (timeline);
+
+  g_object_notify (G_OBJECT (timeline), "frame-clock");
+}
+
+GdkFrameClock *
+msd_timeline_get_frame_clock (MsdTimeline *timeline)
+{
+  MsdTimelinePrivate *priv;
+
+  g_return_val_if_fail (MSD_IS_TIMELINE (timeline), NULL);
+
+  priv = msd_timeline_get_instance_private (timeline);
+  return priv->frame_clock;
+}
+
+/**
+ * msd_timeline_get_dropped_frames:
+ * @timeline: A #MsdTimeline
+ *
+ * Returns how many refresh cycles were missed while the timeline
+ * was driven by a frame clock, since the last call to msd_timeline_start()
+ * from a rewound state.
+ *
+ * Return Value: number of dropped frames
+ **/
+guint
+msd_timeline_get_dropped_frames (MsdTimeline *timeline)
+{
+  MsdTimelinePrivate *priv;
+
+  g_return_val_if_fail (MSD_IS_TIMELINE (timeline), 0);
+
+  priv = msd_timeline_get_instance_private (timeline);
+  return priv->n_dropped_frames;
+}
+
 void
 msd_timeline_set_progress_type (MsdTimeline             *timeline,
 				MsdTimelineProgressType  type)
@@ -105,6 +105,11 @@ GdkScreen              *msd_timeline_get_screen         (MsdTimeline
 void                    msd_timeline_set_screen         (MsdTimeline             *timeline,
 							 GdkScreen               *screen);
 
+GdkFrameClock          *msd_timeline_get_frame_clock    (MsdTimeline             *timeline);
+void                    msd_timeline_set_frame_clock    (MsdTimeline             *timeline,
+							 GdkFrameClock           *frame_clock);
+guint                   msd_timeline_get_dropped_frames (MsdTimeline             *timeline);
+
 MsdTimelineDirection    msd_timeline_get_direction      (MsdTimeline             *timeline);
 void                    msd_timeline_set_direction      (MsdTimeline             *timeline,
 							 MsdTimelineDirection     direction);
@@ -31,6 +31,27 @@
 #include "rfkill-glib.h"
 #include "mate-settings-bus.h"
 
+enum {
+        PROP_AIRPLANE_MODE,
+        PROP_HARDWARE_AIRPLANE_MODE,
+        PROP_HAS_AIRPLANE_MODE,
+        PROP_SHOULD_SHOW_AIRPLANE_MODE,
+        PROP_BLUETOOTH_AIRPLANE_MODE,
+        PROP_BLUETOOTH_HARDWARE_AIRPLANE_MODE,
+        PROP_BLUETOOTH_HAS_AIRPLANE_MODE,
+        N_PROPS
+};
+
+static const char *prop_names[N_PROPS] = {
+        "AirplaneMode",
+        "HardwareAirplaneMode",
+        "HasAirplaneMode",
+        "ShouldShowAirplaneMode",
+        "BluetoothAirplaneMode",
+        "BluetoothHardwareAirplaneMode",
+        "BluetoothHasAirplaneMode"
+};
+
 struct MsdRfkillManagerPrivate
 {
         GDBusNodeInfo           *introspection_data;
@@ -39,8 +60,9 @@ struct MsdRfkillManagerPrivate
         GCancellable            *cancellable;
 
         CcRfkillGlib            *rfkill;
-        GHashTable              *killswitches;
-        GHashTable              *bt_killswitches;
+
+        /* Property values last sent with PropertiesChanged */
+        gboolean                 props[N_PROPS];
 
         /* In addition to using the rfkill kernel subsystem
            (which is exposed by wlan, wimax, bluetooth, nfc,
@@ -98,105 +120,48 @@ msd_rfkill_manager_init (MsdRfkillManager *manager)
         manager->priv = msd_rfkill_manager_get_instance_private (manager);
 }
 
-static gboolean
-engine_get_airplane_mode_helper (GHashTable *killswitches)
-{
-	GHashTableIter iter;
-	gpointer key, value;
-
-	if (g_hash_table_size (killswitches) == 0)
-		return FALSE;
-
-	g_hash_table_iter_init (&iter, killswitches);
-	while (g_hash_table_iter_next (&iter, &key, &value)) {
-		int state;
-
-		state = GPOINTER_TO_INT (value);
-
-		/* A single rfkill switch that's unblocked? Airplane mode is off */
-		if (state == RFKILL_STATE_UNBLOCKED)
-			return FALSE;
-	}
-
-	return TRUE;
-}
-
 static gboolean
 engine_get_bluetooth_airplane_mode (MsdRfkillManager *manager)
 {
-	return engine_get_airplane_mode_helper (manager->priv->bt_killswitches);
+	return cc_rfkill_glib_get_airplane_mode (manager->priv->rfkill, RFKILL_TYPE_BLUETOOTH);
 }
 
 static gboolean
 engine_get_bluetooth_hardware_airplane_mode (MsdRfkillManager *manager)
 {
-	GHashTableIter iter;
-	gpointer key, value;
-
-	/* If we have no killswitches, hw airplane mode is off. */
-	if (g_hash_table_size (manager->priv->bt_killswitches) == 0)
-		return FALSE;
-
-	g_hash_table_iter_init (&iter, manager->priv->bt_killswitches);
-	while (g_hash_table_iter_next (&iter, &key, &value)) {
-		int state;
-
-		state = GPOINTER_TO_INT (value);
-
-		/* A single rfkill switch that's not hw blocked? Hw airplane mode is off */
-		if (state != RFKILL_STATE_HARD_BLOCKED) {
-			return FALSE;
-		}
-	}
-
-	return TRUE;
+	return cc_rfkill_glib_get_hardware_airplane_mode (manager->priv->rfkill, RFKILL_TYPE_BLUETOOTH);
 }
 
 static gboolean
 engine_get_has_bluetooth_airplane_mode (MsdRfkillManager *manager)
 {
-	return (g_hash_table_size (manager->priv->bt_killswitches) > 0);
+	return cc_rfkill_glib_get_n_killswitches (manager->priv->rfkill, RFKILL_TYPE_BLUETOOTH) > 0;
 }
 
 static gboolean
 engine_get_airplane_mode (MsdRfkillManager *manager)
 {
+	gboolean airplane_mode;
+
+	airplane_mode = cc_rfkill_glib_get_airplane_mode (manager->priv->rfkill, RFKILL_TYPE_ALL);
 	if (!manager->priv->wwan_interesting)
-		return engine_get_airplane_mode_helper (manager->priv->killswitches);
+		return airplane_mode;
         /* wwan enabled? then airplane mode is off (because an USB modem
            could be on in this state) */
-	return engine_get_airplane_mode_helper (manager->priv->killswitches) && !manager->priv->wwan_enabled;
+	return airplane_mode && !manager->priv->wwan_enabled;
 }
 
 static gboolean
 engine_get_hardware_airplane_mode (MsdRfkillManager *manager)
 {
-	GHashTableIter iter;
-	gpointer key, value;
-
         /* If we have no killswitches, hw airplane mode is off. */
-        if (g_hash_table_size (manager->priv->killswitches) == 0)
-                return FALSE;
-
-	g_hash_table_iter_init (&iter, manager->priv->killswitches);
-	while (g_hash_table_iter_next (&iter, &key, &value)) {
-		int state;
-
-		state = GPOINTER_TO_INT (value);
-
-		/* A single rfkill switch that's not hw blocked? Hw airplane mode is off */
-		if (state != RFKILL_STATE_HARD_BLOCKED) {
-                        return FALSE;
-                }
-	}
-
-        return TRUE;
+        return cc_rfkill_glib_get_hardware_airplane_mode (manager->priv->rfkill, RFKILL_TYPE_ALL);
 }
 
 static gboolean
 engine_get_has_airplane_mode (MsdRfkillManager *manager)
 {
-        return (g_hash_table_size (manager->priv->killswitches) > 0) ||
+        return (cc_rfkill_glib_get_n_killswitches (manager->priv->rfkill, RFKILL_TYPE_ALL) > 0) ||
                 manager->priv->wwan_interesting;
 }
 
@@ -209,32 +174,51 @@ engine_get_should_show_airplane_mode (MsdRfkillManager *manager)
                 (g_strcmp0 (manager->priv->chassis_type, "container") != 0);
 }
 
+static void
+engine_get_properties (MsdRfkillManager *manager,
+                       gboolean         *props)
+{
+        props[PROP_AIRPLANE_MODE] = engine_get_airplane_mode (manager);
+        props[PROP_HARDWARE_AIRPLANE_MODE] = engine_get_hardware_airplane_mode (manager);
+        props[PROP_HAS_AIRPLANE_MODE] = engine_get_has_airplane_mode (manager);
+        props[PROP_SHOULD_SHOW_AIRPLANE_MODE] = engine_get_should_show_airplane_mode (manager);
+        props[PROP_BLUETOOTH_AIRPLANE_MODE] = engine_get_bluetooth_airplane_mode (manager);
+        props[PROP_BLUETOOTH_HARDWARE_AIRPLANE_MODE] = engine_get_bluetooth_hardware_airplane_mode (manager);
+        props[PROP_BLUETOOTH_HAS_AIRPLANE_MODE] = engine_get_has_bluetooth_airplane_mode (manager);
+}
+
 static void
 engine_properties_changed (MsdRfkillManager *manager)
 {
         GVariantBuilder props_builder;
         GVariant *props_changed = NULL;
+        gboolean props[N_PROPS];
+        gboolean changed = FALSE;
+        guint i;
 
         /* not yet connected to the session bus */
         if (manager->priv->connection == NULL)
                 return;
 
+        engine_get_properties (manager, props);
+
         g_variant_builder_init (&props_builder, G_VARIANT_TYPE ("a{sv}"));
 
-        g_variant_builder_add (&props_builder, "{sv}", "AirplaneMode",
-                               g_variant_new_boolean (engine_get_airplane_mode (manager)));
-        g_variant_builder_add (&props_builder, "{sv}", "HardwareAirplaneMode",
-                               g_variant_new_boolean (engine_get_hardware_airplane_mode (manager)));
-        g_variant_builder_add (&props_builder, "{sv}", "HasAirplaneMode",
-                               g_variant_new_boolean (engine_get_has_airplane_mode (manager)));
-        g_variant_builder_add (&props_builder, "{sv}", "ShouldShowAirplaneMode",
-                               g_variant_new_boolean (engine_get_should_show_airplane_mode (manager)));
-        g_variant_builder_add (&props_builder, "{sv}", "BluetoothAirplaneMode",
-                               g_variant_new_boolean (engine_get_bluetooth_airplane_mode (manager)));
-        g_variant_builder_add (&props_builder, "{sv}", "BluetoothHardwareAirplaneMode",
-                               g_variant_new_boolean (engine_get_bluetooth_hardware_airplane_mode (manager)));
-        g_variant_builder_add (&props_builder, "{sv}", "BluetoothHasAirplaneMode",
-                               g_variant_new_boolean (engine_get_has_bluetooth_airplane_mode (manager)));
+        /* Only send what flipped since the last emission */
+        for (i = 0; i < N_PROPS; i++) {
+                if (props[i] == manager->priv->props[i])
+                        continue;
+
+                g_variant_builder_add (&props_builder, "{sv}", prop_names[i],
+                                       g_variant_new_boolean (props[i]));
+                manager->priv->props[i] = props[i];
+                changed = TRUE;
+        }
+
+        if (!changed) {
+                g_variant_builder_clear (&props_builder);
+                return;
+        }
 
         props_changed = g_variant_new ("(s@a{sv}@as)", MSD_RFKILL_DBUS_NAME,
                                        g_variant_builder_end (&props_builder),
@@ -250,49 +234,8 @@ engine_properties_changed (MsdRfkillManager *manager)
 
 static void
 rfkill_changed (CcRfkillGlib     *rfkill G_GNUC_UNUSED,
-                GList            *events,
                 MsdRfkillManager *manager)
 {
-	GList *l;
-        int value;
-
-	for (l = events; l != NULL; l = l->next) {
-		struct rfkill_event *event = l->data;
-
-                switch (event->op) {
-                case RFKILL_OP_ADD:
-                case RFKILL_OP_CHANGE:
-                        if (event->hard)
-                                value = RFKILL_STATE_HARD_BLOCKED;
-                        else if (event->soft)
-                                value = RFKILL_STATE_SOFT_BLOCKED;
-                        else
-                                value = RFKILL_STATE_UNBLOCKED;
-
-                        g_hash_table_insert (manager->priv->killswitches,
-                                             GINT_TO_POINTER (event->idx),
-                                             GINT_TO_POINTER (value));
-                        if (event->type == RFKILL_TYPE_BLUETOOTH)
-				g_hash_table_insert (manager->priv->bt_killswitches,
-						     GINT_TO_POINTER (event->idx),
-						     GINT_TO_POINTER (value));
-			g_debug ("%s %srfkill with ID %d",
-				 event->op == RFKILL_OP_ADD ? "Added" : "Changed",
-				 event->type == RFKILL_TYPE_BLUETOOTH ? "Bluetooth " : "",
-				 event->idx);
-                        break;
-                case RFKILL_OP_DEL:
-			g_hash_table_remove (manager->priv->killswitches,
-					     GINT_TO_POINTER (event->idx));
-			if (event->type == RFKILL_TYPE_BLUETOOTH)
-				g_hash_table_remove (manager->priv->bt_killswitches,
-						     GINT_TO_POINTER (event->idx));
-			g_debug ("Removed %srfkill with ID %d", event->type == RFKILL_TYPE_BLUETOOTH ? "Bluetooth " : "",
-				 event->idx);
-                        break;
-                }
-	}
-
         engine_properties_changed (manager);
 }
 
@@ -481,6 +424,9 @@ on_bus_gotten (GObject               *source_object,
         }
         manager->priv->connection = connection;
 
+        /* Nobody has seen any value yet, so start from the current state */
+        engine_get_properties (manager, manager->priv->props);
+
         g_dbus_connection_register_object (connection,
                                            MSD_RFKILL_DBUS_PATH,
                                            manager->priv->introspection_data->interfaces[0],
@@ -631,8 +577,6 @@ msd_rfkill_manager_start (MsdRfkillManager *manager,
         manager->priv->introspection_data = g_dbus_node_info_new_for_xml (introspection_xml, NULL);
         g_assert (manager->priv->introspection_data != NULL);
 
-        manager->priv->killswitches = g_hash_table_new (g_direct_hash, g_direct_equal);
-        manager->priv->bt_killswitches = g_hash_table_new (g_direct_hash, g_direct_equal);
         manager->priv->rfkill = cc_rfkill_glib_new ();
         g_signal_connect (G_OBJECT (manager->priv->rfkill), "changed",
                           G_CALLBACK (rfkill_changed), manager);
@@ -685,8 +629,6 @@ msd_rfkill_manager_stop (MsdRfkillManager *manager)
         g_clear_pointer (&p->introspection_data, g_dbus_node_info_unref);
         g_clear_object (&p->connection);
         g_clear_object (&p->rfkill);
-        g_clear_pointer (&p->killswitches, g_hash_table_destroy);
-        g_clear_pointer (&p->bt_killswitches, g_hash_table_destroy);
 
         if (p->cancellable) {
                 g_cancellable_cancel (p->cancellable);
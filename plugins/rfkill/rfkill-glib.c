@@ -45,11 +45,33 @@ enum {
 
 static int signals[LAST_SIGNAL] = { 0 };
 
+/* Number of events pulled off /dev/rfkill before they get applied */
+#define RFKILL_EVENT_BATCH 32
+
+/* One slot per kernel rfkill index; idx values are small and handed
+ * out sequentially, so a flat array beats a hash table here. */
+typedef struct {
+	guint8 present;
+	guint8 type;
+	guint8 state;
+} CcRfkillSwitch;
+
+typedef struct {
+	guint n_switches;
+	guint n_unblocked;
+	guint n_hard_blocked;
+} CcRfkillCounts;
+
 struct CcRfkillGlibPrivate {
 	GOutputStream *stream;
 	GIOChannel *channel;
 	guint watch_id;
 
+	/* Killswitch state, indexed by rfkill idx */
+	GArray *switches;
+	/* Per-type totals, RFKILL_TYPE_ALL counts every switch */
+	CcRfkillCounts counts[NUM_RFKILL_TYPES];
+
 	/* Pending Bluetooth enablement */
 	guint change_all_timeout_id;
 	struct rfkill_event *event;
@@ -288,91 +310,172 @@ print_event (struct rfkill_event *event)
 		 event->soft, event->hard);
 }
 
-static gboolean
-got_change_event (GList *events)
+static void
+counts_update (CcRfkillGlibPrivate *priv,
+	       guint                type,
+	       guint                state,
+	       int                  delta)
 {
-	GList *l;
+	guint types[2] = { RFKILL_TYPE_ALL, type };
+	guint i;
 
-	g_assert (events != NULL);
+	for (i = 0; i < G_N_ELEMENTS (types); i++) {
+		CcRfkillCounts *counts;
 
-	for (l = events ; l != NULL; l = l->next) {
-		struct rfkill_event *event = l->data;
+		/* Unknown types only show up in the global totals */
+		if (i > 0 && (type == RFKILL_TYPE_ALL || type >= NUM_RFKILL_TYPES))
+			break;
 
-		if (event->op == RFKILL_OP_CHANGE)
-			return TRUE;
+		counts = &priv->counts[types[i]];
+		counts->n_switches += delta;
+		if (state == RFKILL_STATE_UNBLOCKED)
+			counts->n_unblocked += delta;
+		else if (state == RFKILL_STATE_HARD_BLOCKED)
+			counts->n_hard_blocked += delta;
 	}
+}
+
+/* Returns %TRUE if the state table was modified */
+static gboolean
+apply_event (CcRfkillGlib              *rfkill,
+	     const struct rfkill_event *event)
+{
+	CcRfkillGlibPrivate *priv = rfkill->priv;
+	CcRfkillSwitch *sw;
+	guint state;
+
+	switch (event->op) {
+	case RFKILL_OP_ADD:
+	case RFKILL_OP_CHANGE:
+		if (event->hard)
+			state = RFKILL_STATE_HARD_BLOCKED;
+		else if (event->soft)
+			state = RFKILL_STATE_SOFT_BLOCKED;
+		else
+			state = RFKILL_STATE_UNBLOCKED;
+
+		if (event->idx >= priv->switches->len)
+			g_array_set_size (priv->switches, event->idx + 1);
+
+		sw = &g_array_index (priv->switches, CcRfkillSwitch, event->idx);
+		if (sw->present && sw->type == event->type && sw->state == state)
+			return FALSE;
+
+		if (sw->present)
+			counts_update (priv, sw->type, sw->state, -1);
+		sw->present = TRUE;
+		sw->type = event->type;
+		sw->state = state;
+		counts_update (priv, sw->type, sw->state, 1);
+		return TRUE;
 
-	return FALSE;
+	case RFKILL_OP_DEL:
+		if (event->idx >= priv->switches->len)
+			return FALSE;
+
+		sw = &g_array_index (priv->switches, CcRfkillSwitch, event->idx);
+		if (!sw->present)
+			return FALSE;
+
+		counts_update (priv, sw->type, sw->state, -1);
+		sw->present = FALSE;
+		return TRUE;
+
+	default:
+		return FALSE;
+	}
 }
 
-static void
-emit_changed_signal_and_free (CcRfkillGlib *rfkill,
-			      GList        *events)
+/* The kernel hands out a single event per read(), so drain the
+ * non-blocking fd into @events until it runs dry or the batch is full. */
+static guint
+read_events (int                  fd,
+	     struct rfkill_event *events,
+	     guint                max_events)
 {
-	if (events == NULL)
-		return;
+	guint n_events = 0;
 
-	g_signal_emit (G_OBJECT (rfkill),
-		       signals[CHANGED],
-		       0, events);
+	while (n_events < max_events) {
+		ssize_t len;
 
-	if (rfkill->priv->change_all_timeout_id > 0 &&
-	    got_change_event (events)) {
-		g_debug ("Received a change event after a RFKILL_OP_CHANGE_ALL event, re-sending RFKILL_OP_CHANGE_ALL");
+		len = read (fd, &events[n_events], sizeof(struct rfkill_event));
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN)
+				g_debug ("Reading of RFKILL events failed");
+			break;
+		}
+		if (len == 0)
+			break;
 
-		g_output_stream_write_async (rfkill->priv->stream,
-					     rfkill->priv->event, sizeof(struct rfkill_event),
-					     G_PRIORITY_DEFAULT,
-					     rfkill->priv->cancellable, write_change_all_again_done_cb, rfkill);
+		if (len != RFKILL_EVENT_SIZE_V1) {
+			g_warning ("Wrong size of RFKILL event\n");
+			continue;
+		}
 
-		g_source_remove (rfkill->priv->change_all_timeout_id);
-		rfkill->priv->change_all_timeout_id = 0;
+		n_events++;
 	}
 
-	g_list_free_full (events, g_free);
+	return n_events;
 }
 
+/* Applies everything waiting on @fd to the state table. Returns %TRUE
+ * if the table changed; @got_change is set when a RFKILL_OP_CHANGE was seen. */
 static gboolean
-event_cb (GIOChannel   *source,
-	  GIOCondition  condition,
-	  CcRfkillGlib   *rfkill)
+process_events (CcRfkillGlib *rfkill,
+		int           fd,
+		gboolean     *got_change)
 {
-	GList *events;
+	struct rfkill_event events[RFKILL_EVENT_BATCH];
+	gboolean changed = FALSE;
+	guint n_events;
 
-	events = NULL;
+	*got_change = FALSE;
 
-	if (condition & G_IO_IN) {
-		GIOStatus status;
-		struct rfkill_event event;
-		gsize read;
+	do {
+		guint i;
 
-		status = g_io_channel_read_chars (source,
-						  (char *) &event,
-						  sizeof(event),
-						  &read,
-						  NULL);
+		n_events = read_events (fd, events, G_N_ELEMENTS (events));
+		for (i = 0; i < n_events; i++) {
+			print_event (&events[i]);
 
-		while (status == G_IO_STATUS_NORMAL && read == sizeof(event)) {
-			struct rfkill_event *event_ptr;
+			if (events[i].op == RFKILL_OP_CHANGE)
+				*got_change = TRUE;
+			if (apply_event (rfkill, &events[i]))
+				changed = TRUE;
+		}
+	} while (n_events == G_N_ELEMENTS (events));
 
-			print_event (&event);
+	return changed;
+}
 
-			event_ptr = g_memdup (&event, sizeof(event));
-			events = g_list_prepend (events, event_ptr);
+static gboolean
+event_cb (GIOChannel   *source,
+	  GIOCondition  condition,
+	  CcRfkillGlib   *rfkill)
+{
+	gboolean got_change;
 
-			status = g_io_channel_read_chars (source,
-							  (char *) &event,
-							  sizeof(event),
-							  &read,
-							  NULL);
-		}
-		events = g_list_reverse (events);
-	} else {
+	if (!(condition & G_IO_IN)) {
 		g_debug ("Something unexpected happened on rfkill fd");
 		return FALSE;
 	}
 
-	emit_changed_signal_and_free (rfkill, events);
+	if (process_events (rfkill, g_io_channel_unix_get_fd (source), &got_change))
+		g_signal_emit (G_OBJECT (rfkill), signals[CHANGED], 0);
+
+	if (rfkill->priv->change_all_timeout_id > 0 && got_change) {
+		g_debug ("Received a change event after a RFKILL_OP_CHANGE_ALL event, re-sending RFKILL_OP_CHANGE_ALL");
+
+		g_output_stream_write_async (rfkill->priv->stream,
+					     rfkill->priv->event, sizeof(struct rfkill_event),
+					     G_PRIORITY_DEFAULT,
+					     rfkill->priv->cancellable, write_change_all_again_done_cb, rfkill);
+
+		g_source_remove (rfkill->priv->change_all_timeout_id);
+		rfkill->priv->change_all_timeout_id = 0;
+	}
 
 	return TRUE;
 }
@@ -384,6 +487,8 @@ cc_rfkill_glib_init (CcRfkillGlib *rfkill)
 
 	priv = cc_rfkill_glib_get_instance_private (rfkill);
 	rfkill->priv = priv;
+
+	priv->switches = g_array_new (FALSE, TRUE, sizeof (CcRfkillSwitch));
 }
 
 int
@@ -392,7 +497,7 @@ cc_rfkill_glib_open (CcRfkillGlib *rfkill)
 	CcRfkillGlibPrivate *priv;
 	int fd;
 	int ret;
-	GList *events;
+	gboolean got_change;
 
 	g_return_val_if_fail (RFKILL_IS_GLIB (rfkill), -1);
 	g_return_val_if_fail (rfkill->priv->stream == NULL, -1);
@@ -413,37 +518,6 @@ cc_rfkill_glib_open (CcRfkillGlib *rfkill)
 		return ret;
 	}
 
-	events = NULL;
-
-	while (1) {
-		struct rfkill_event event;
-		struct rfkill_event *event_ptr;
-		ssize_t len;
-
-		len = read(fd, &event, sizeof(event));
-		if (len < 0) {
-			if (errno == EAGAIN)
-				break;
-			g_debug ("Reading of RFKILL events failed");
-			break;
-		}
-
-		if (len != RFKILL_EVENT_SIZE_V1) {
-			g_warning ("Wrong size of RFKILL event\n");
-			continue;
-		}
-
-		if (event.op != RFKILL_OP_ADD)
-			continue;
-
-		g_debug ("Read killswitch of type '%s' (idx=%d): soft %d hard %d",
-			 type_to_string (event.type),
-			 event.idx, event.soft, event.hard);
-
-		event_ptr = g_memdup (&event, sizeof(event));
-		events = g_list_prepend (events, event_ptr);
-	}
-
 	/* Setup monitoring */
 	priv->channel = g_io_channel_unix_new (fd);
 	priv->watch_id = g_io_add_watch (priv->channel,
@@ -451,12 +525,10 @@ cc_rfkill_glib_open (CcRfkillGlib *rfkill)
 					 (GIOFunc) event_cb,
 					 rfkill);
 
-	if (events) {
-		events = g_list_reverse (events);
-		emit_changed_signal_and_free (rfkill, events);
-	} else {
+	if (process_events (rfkill, fd, &got_change))
+		g_signal_emit (G_OBJECT (rfkill), signals[CHANGED], 0);
+	else
 		g_debug ("No rfkill device available on startup");
-	}
 
 	/* Setup write stream */
 	priv->stream = g_unix_output_stream_new (fd, TRUE);
@@ -484,6 +556,7 @@ cc_rfkill_glib_finalize (GObject *object)
 		g_io_channel_unref (priv->channel);
 	}
 	g_clear_object (&priv->stream);
+	g_clear_pointer (&priv->switches, g_array_unref);
 
 	G_OBJECT_CLASS(cc_rfkill_glib_parent_class)->finalize(object);
 }
@@ -502,7 +575,7 @@ cc_rfkill_glib_class_init(CcRfkillGlibClass *klass)
 			      G_STRUCT_OFFSET (CcRfkillGlibClass, changed),
 			      NULL, NULL,
 			      NULL,
-			      G_TYPE_NONE, 1, G_TYPE_POINTER);
+			      G_TYPE_NONE, 0);
 
 }
 
@@ -511,3 +584,41 @@ cc_rfkill_glib_new (void)
 {
 	return CC_RFKILL_GLIB (g_object_new (CC_RFKILL_TYPE_GLIB, NULL));
 }
+
+guint
+cc_rfkill_glib_get_n_killswitches (CcRfkillGlib *rfkill,
+				   guint         rfkill_type)
+{
+	g_return_val_if_fail (RFKILL_IS_GLIB (rfkill), 0);
+	g_return_val_if_fail (rfkill_type < NUM_RFKILL_TYPES, 0);
+
+	return rfkill->priv->counts[rfkill_type].n_switches;
+}
+
+gboolean
+cc_rfkill_glib_get_airplane_mode (CcRfkillGlib *rfkill,
+				  guint         rfkill_type)
+{
+	CcRfkillCounts *counts;
+
+	g_return_val_if_fail (RFKILL_IS_GLIB (rfkill), FALSE);
+	g_return_val_if_fail (rfkill_type < NUM_RFKILL_TYPES, FALSE);
+
+	/* A single rfkill switch that's unblocked? Airplane mode is off */
+	counts = &rfkill->priv->counts[rfkill_type];
+	return counts->n_switches > 0 && counts->n_unblocked == 0;
+}
+
+gboolean
+cc_rfkill_glib_get_hardware_airplane_mode (CcRfkillGlib *rfkill,
+					   guint         rfkill_type)
+{
+	CcRfkillCounts *counts;
+
+	g_return_val_if_fail (RFKILL_IS_GLIB (rfkill), FALSE);
+	g_return_val_if_fail (rfkill_type < NUM_RFKILL_TYPES, FALSE);
+
+	/* A single rfkill switch that's not hw blocked? Hw airplane mode is off */
+	counts = &rfkill->priv->counts[rfkill_type];
+	return counts->n_switches > 0 && counts->n_hard_blocked == counts->n_switches;
+}
@@ -52,7 +52,7 @@ typedef struct _CcRfkillGlib {
 typedef struct _CcRfkillGlibClass {
 	GObjectClass parent_class;
 
-	void (*changed) (CcRfkillGlib *rfkill, GList *events);
+	void (*changed) (CcRfkillGlib *rfkill);
 } CcRfkillGlibClass;
 
 GType         cc_rfkill_glib_get_type          (void);
@@ -80,6 +80,13 @@ gboolean      cc_rfkill_glib_send_change_all_event_finish (CcRfkillGlib        *
 							   GAsyncResult        *res,
 							   GError             **error);
 
+guint         cc_rfkill_glib_get_n_killswitches         (CcRfkillGlib *rfkill,
+							 guint         rfkill_type);
+gboolean      cc_rfkill_glib_get_airplane_mode          (CcRfkillGlib *rfkill,
+							 guint         rfkill_type);
+gboolean      cc_rfkill_glib_get_hardware_airplane_mode (CcRfkillGlib *rfkill,
+							 guint         rfkill_type);
+
 G_END_DECLS
 
 #endif /* __CC_RFKILL_GLIB_H */
@@ -40,6 +40,10 @@
 #include <sys/wait.h>
 #include <unistd.h>
 
+#ifdef HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h>
+#endif
+
 #include <glib.h>
 #include <glib/gi18n.h>
 
@@ -55,6 +59,8 @@
 
 typedef enum _MsdSmartcardManagerState MsdSmartcardManagerState;
 typedef struct _MsdSmartcardManagerWorker MsdSmartcardManagerWorker;
+typedef struct _MsdSmartcardEvent MsdSmartcardEvent;
+typedef struct _MsdSmartcardEventQueue MsdSmartcardEventQueue;
 
 enum _MsdSmartcardManagerState {
         MSD_SMARTCARD_MANAGER_STATE_STOPPED = 0,
@@ -72,6 +78,8 @@ struct _MsdSmartcardManagerPrivate {
         GPid smartcard_event_watcher_pid;
         GHashTable *smartcards;
 
+        MsdSmartcardEventQueue *event_queue;
+
         GThread    *worker_thread;
 
         guint poll_timeout_id;
@@ -83,11 +91,29 @@ struct _MsdSmartcardManagerPrivate {
 struct _MsdSmartcardManagerWorker {
         SECMODModule *module;
         GHashTable *smartcards;
-        int write_fd;
+        MsdSmartcardEventQueue *event_queue;
 
         guint32 nss_is_loaded : 1;
 };
 
+/* Card events travel from the worker thread to the main loop through a
+ * lock-free list: the worker pushes onto its head and only wakes the main
+ * loop when the list was empty, the main loop takes the whole list at once.
+ */
+struct _MsdSmartcardEvent {
+        MsdSmartcardEvent *next;
+        char               type;        /* 'I'nserted, 'R'emoved or 'E'rror */
+        MsdSmartcard      *card;
+};
+
+struct _MsdSmartcardEventQueue {
+        volatile gint  ref_count;
+        gpointer       events;          /* MsdSmartcardEvent *, newest first */
+        int            read_fd;         /* an eventfd, or both ends of a pipe */
+        int            write_fd;
+        volatile gint  is_stopping;
+};
+
 static void msd_smartcard_manager_finalize (GObject *object);
 static void msd_smartcard_manager_class_install_signals (MsdSmartcardManagerClass *service_class);
 static void msd_smartcard_manager_class_install_properties (MsdSmartcardManagerClass *service_class);
@@ -109,15 +135,15 @@ static gboolean msd_smartcard_manager_stop_now (MsdSmartcardManager *manager);
 static void msd_smartcard_manager_queue_stop (MsdSmartcardManager *manager);
 
 static gboolean msd_smartcard_manager_create_worker (MsdSmartcardManager *manager,
-                                                     int *worker_fd, GThread **worker_thread);
+                                                     GThread **worker_thread);
 
-static MsdSmartcardManagerWorker * msd_smartcard_manager_worker_new (int write_fd);
+static MsdSmartcardManagerWorker * msd_smartcard_manager_worker_new (MsdSmartcardEventQueue *event_queue);
 static void msd_smartcard_manager_worker_free (MsdSmartcardManagerWorker *worker);
-static gboolean open_pipe (int *write_fd, int *read_fd);
-static gboolean read_bytes (int fd, gpointer bytes, gsize num_bytes);
-static gboolean write_bytes (int fd, gconstpointer bytes, gsize num_bytes);
-static MsdSmartcard *read_smartcard (int fd, SECMODModule *module);
-static gboolean write_smartcard (int fd, MsdSmartcard *card);
+static MsdSmartcardEventQueue *msd_smartcard_event_queue_new (void);
+static MsdSmartcardEventQueue *msd_smartcard_event_queue_ref (MsdSmartcardEventQueue *queue);
+static void msd_smartcard_event_queue_unref (MsdSmartcardEventQueue *queue);
+static MsdSmartcardEvent *msd_smartcard_event_queue_pop_all (MsdSmartcardEventQueue *queue);
+static void msd_smartcard_event_free (MsdSmartcardEvent *event);
 
 enum {
         PROP_0 = 0,
@@ -410,17 +436,14 @@ msd_smartcard_manager_emit_smartcard_removed (MsdSmartcardManager *manager,
 }
 
 static gboolean
-msd_smartcard_manager_check_for_and_process_events (GIOChannel          *io_channel,
+msd_smartcard_manager_check_for_and_process_events (GIOChannel          *io_channel G_GNUC_UNUSED,
                                                     GIOCondition         condition,
                                                     MsdSmartcardManager *manager)
 {
-        MsdSmartcard *card;
+        MsdSmartcardEvent *events, *event;
         gboolean should_stop;
-        gchar event_type;
         char *card_name;
-        int fd;
 
-        card = NULL;
         should_stop = (condition & G_IO_HUP) || (condition & G_IO_ERR);
 
         if (should_stop) {
@@ -436,50 +459,43 @@ msd_smartcard_manager_check_for_and_process_events (GIOChannel          *io_chan
                 goto out;
         }
 
-        fd = g_io_channel_unix_get_fd (io_channel);
-
-        event_type = '\0';
-        if (!read_bytes (fd, &event_type, 1)) {
-                should_stop = TRUE;
-                goto out;
-        }
+        events = msd_smartcard_event_queue_pop_all (manager->priv->event_queue);
 
-        card = read_smartcard (fd, manager->priv->module);
+        while (events != NULL) {
+                event = events;
+                events = event->next;
 
-        if (card == NULL) {
-                should_stop = TRUE;
-                goto out;
-        }
-
-        card_name = msd_smartcard_get_name (card);
-
-        switch (event_type) {
-                case 'I':
-                        g_hash_table_replace (manager->priv->smartcards,
-                                              card_name, card);
-                        card_name = NULL;
-
-                        msd_smartcard_manager_emit_smartcard_inserted (manager, card);
-                        card = NULL;
-                        break;
+                if (should_stop) {
+                        msd_smartcard_event_free (event);
+                        continue;
+                }
 
-                case 'R':
-                        msd_smartcard_manager_emit_smartcard_removed (manager, card);
-                        if (!g_hash_table_remove (manager->priv->smartcards, card_name)) {
-                                g_debug ("got removal event of unknown card!");
-                        }
-                        g_free (card_name);
-                        card_name = NULL;
-                        card = NULL;
-                        break;
+                switch (event->type) {
+                        case 'I':
+                                card_name = msd_smartcard_get_name (event->card);
+                                g_hash_table_replace (manager->priv->smartcards,
+                                                      card_name, g_object_ref (event->card));
+                                card_name = NULL;
+
+                                msd_smartcard_manager_emit_smartcard_inserted (manager, event->card);
+                                break;
+
+                        case 'R':
+                                card_name = msd_smartcard_get_name (event->card);
+                                msd_smartcard_manager_emit_smartcard_removed (manager, event->card);
+                                if (!g_hash_table_remove (manager->priv->smartcards, card_name)) {
+                                        g_debug ("got removal event of unknown card!");
+                                }
+                                g_free (card_name);
+                                card_name = NULL;
+                                break;
 
-                default:
-                        g_free (card_name);
-                        card_name = NULL;
-                        g_object_unref (card);
+                        default:
+                                should_stop = TRUE;
+                                break;
+                }
 
-                        should_stop = TRUE;
-                        break;
+                msd_smartcard_event_free (event);
         }
 
 out:
@@ -488,7 +504,9 @@ out:
 
                 error = g_error_new (MSD_SMARTCARD_MANAGER_ERROR,
                                      MSD_SMARTCARD_MANAGER_ERROR_WATCHING_FOR_EVENTS,
-                                     "%s", (condition & G_IO_IN) ? g_strerror (errno) : _("received error or hang up from event source"));
+                                     "%s", (condition & G_IO_IN) ? _("encountered unexpected error while "
+                                                                     "waiting for smartcard events")
+                                                                 : _("received error or hang up from event source"));
 
                 msd_smartcard_manager_emit_error (manager, error);
                 g_error_free (error);
@@ -506,6 +524,7 @@ msd_smartcard_manager_event_processing_stopped_handler (MsdSmartcardManager *man
         msd_smartcard_manager_stop_now (manager);
 }
 
+#ifndef HAVE_SYS_EVENTFD_H
 static gboolean
 open_pipe (int *write_fd,
                   int *read_fd)
@@ -519,13 +538,10 @@ open_pipe (int *write_fd,
                 return FALSE;
         }
 
-        if (fcntl (pipe_fds[0], F_SETFD, FD_CLOEXEC) < 0) {
-                close (pipe_fds[0]);
-                close (pipe_fds[1]);
-                return FALSE;
-        }
-
-        if (fcntl (pipe_fds[1], F_SETFD, FD_CLOEXEC) < 0) {
+        if (fcntl (pipe_fds[0], F_SETFD, FD_CLOEXEC) < 0 ||
+            fcntl (pipe_fds[1], F_SETFD, FD_CLOEXEC) < 0 ||
+            fcntl (pipe_fds[0], F_SETFL, O_NONBLOCK) < 0 ||
+            fcntl (pipe_fds[1], F_SETFL, O_NONBLOCK) < 0) {
                 close (pipe_fds[0]);
                 close (pipe_fds[1]);
                 return FALSE;
@@ -536,6 +552,148 @@ open_pipe (int *write_fd,
 
         return TRUE;
 }
+#endif
+
+static MsdSmartcardEventQueue *
+msd_smartcard_event_queue_new (void)
+{
+        MsdSmartcardEventQueue *queue;
+
+        queue = g_slice_new0 (MsdSmartcardEventQueue);
+        queue->ref_count = 1;
+
+#ifdef HAVE_SYS_EVENTFD_H
+        queue->read_fd = eventfd (0, EFD_CLOEXEC | EFD_NONBLOCK);
+        queue->write_fd = queue->read_fd;
+        if (queue->read_fd < 0) {
+#else
+        if (!open_pipe (&queue->write_fd, &queue->read_fd)) {
+#endif
+                g_slice_free (MsdSmartcardEventQueue, queue);
+                return NULL;
+        }
+
+        return queue;
+}
+
+static MsdSmartcardEventQueue *
+msd_smartcard_event_queue_ref (MsdSmartcardEventQueue *queue)
+{
+        g_atomic_int_inc (&queue->ref_count);
+
+        return queue;
+}
+
+static void
+msd_smartcard_event_free (MsdSmartcardEvent *event)
+{
+        if (event->card != NULL) {
+                g_object_unref (event->card);
+        }
+
+        g_slice_free (MsdSmartcardEvent, event);
+}
+
+static void
+msd_smartcard_event_queue_unref (MsdSmartcardEventQueue *queue)
+{
+        MsdSmartcardEvent *events;
+
+        if (!g_atomic_int_dec_and_test (&queue->ref_count)) {
+                return;
+        }
+
+        events = queue->events;
+        while (events != NULL) {
+                MsdSmartcardEvent *event = events;
+
+                events = event->next;
+                msd_smartcard_event_free (event);
+        }
+
+        if (queue->write_fd != queue->read_fd) {
+                close (queue->write_fd);
+        }
+        close (queue->read_fd);
+
+        g_slice_free (MsdSmartcardEventQueue, queue);
+}
+
+/* Called from the worker thread */
+static gboolean
+msd_smartcard_event_queue_push (MsdSmartcardEventQueue *queue,
+                                char                    type,
+                                MsdSmartcard           *card)
+{
+        MsdSmartcardEvent *event;
+        gpointer head;
+
+        event = g_slice_new0 (MsdSmartcardEvent);
+        event->type = type;
+        event->card = card != NULL ? g_object_ref (card) : NULL;
+
+        do {
+                head = g_atomic_pointer_get (&queue->events);
+                event->next = head;
+        } while (!g_atomic_pointer_compare_and_exchange (&queue->events, head, event));
+
+        /* the main loop has not seen the previous events yet, so it will
+         * pick this one up with them */
+        if (head != NULL) {
+                return TRUE;
+        }
+
+        for (;;) {
+#ifdef HAVE_SYS_EVENTFD_H
+                if (eventfd_write (queue->write_fd, 1) == 0) {
+#else
+                if (write (queue->write_fd, "", 1) == 1) {
+#endif
+                        return TRUE;
+                }
+
+                /* EAGAIN: a wakeup is already pending */
+                if (errno != EINTR) {
+                        return errno == EAGAIN;
+                }
+        }
+}
+
+/* Called from the main loop; returns the pending events, oldest first */
+static MsdSmartcardEvent *
+msd_smartcard_event_queue_pop_all (MsdSmartcardEventQueue *queue)
+{
+        MsdSmartcardEvent *events, *reversed;
+        gpointer head;
+
+        /* drain the wakeup before taking the list, so that a push onto the
+         * list we are about to empty always wakes us up again */
+#ifdef HAVE_SYS_EVENTFD_H
+        eventfd_t value;
+
+        while (eventfd_read (queue->read_fd, &value) < 0 && errno == EINTR);
+#else
+        char buf[64];
+
+        while (read (queue->read_fd, buf, sizeof (buf)) > 0 || errno == EINTR);
+#endif
+
+        do {
+                head = g_atomic_pointer_get (&queue->events);
+        } while (!g_atomic_pointer_compare_and_exchange (&queue->events, head, NULL));
+
+        reversed = NULL;
+        events = head;
+        while (events != NULL) {
+                MsdSmartcardEvent *event = events;
+
+                events = event->next;
+                event->next = reversed;
+                reversed = event;
+        }
+
+        return reversed;
+}
 
 static void
 msd_smartcard_manager_stop_watching_for_events (MsdSmartcardManager  *manager)
@@ -545,10 +703,19 @@ msd_smartcard_manager_stop_watching_for_events (MsdSmartcardManager  *manager)
                 manager->priv->smartcard_event_source = NULL;
         }
 
+        /* The worker must be out of the module before the caller
+         * destroys it */
         if (manager->priv->worker_thread != NULL) {
+                g_atomic_int_set (&manager->priv->event_queue->is_stopping, TRUE);
                 SECMOD_CancelWait (manager->priv->module);
+                g_thread_join (manager->priv->worker_thread);
                 manager->priv->worker_thread = NULL;
         }
+
+        if (manager->priv->event_queue != NULL) {
+                msd_smartcard_event_queue_unref (manager->priv->event_queue);
+                manager->priv->event_queue = NULL;
+        }
 }
 
 static gboolean
@@ -716,7 +883,6 @@ gboolean
 msd_smartcard_manager_start (MsdSmartcardManager  *manager,
                              GError              **error)
 {
-        int worker_fd;
         GIOChannel *io_channel;
         GSource *source;
         GError *nss_error;
@@ -728,8 +894,6 @@ msd_smartcard_manager_start (MsdSmartcardManager  *manager,
 
         manager->priv->state = MSD_SMARTCARD_MANAGER_STATE_STARTING;
 
-        worker_fd = -1;
-
         nss_error = NULL;
         if (!manager->priv->nss_is_loaded && !load_nss (&nss_error)) {
                 g_propagate_error (error, nss_error);
@@ -746,7 +910,7 @@ msd_smartcard_manager_start (MsdSmartcardManager  *manager,
                 goto out;
         }
 
-        if (!msd_smartcard_manager_create_worker (manager, &worker_fd, &manager->priv->worker_thread)) {
+        if (!msd_smartcard_manager_create_worker (manager, &manager->priv->worker_thread)) {
                 g_set_error (error,
                              MSD_SMARTCARD_MANAGER_ERROR,
                              MSD_SMARTCARD_MANAGER_ERROR_WATCHING_FOR_EVENTS,
@@ -756,7 +920,7 @@ msd_smartcard_manager_start (MsdSmartcardManager  *manager,
                 goto out;
         }
 
-        io_channel = g_io_channel_unix_new (worker_fd);
+        io_channel = g_io_channel_unix_new (manager->priv->event_queue->read_fd);
 
         source = g_io_create_watch (io_channel, G_IO_IN | G_IO_HUP);
         g_io_channel_unref (io_channel);
@@ -869,12 +1033,12 @@ msd_smartcard_manager_login_card_is_inserted (MsdSmartcardManager *manager)
 }
 
 static MsdSmartcardManagerWorker *
-msd_smartcard_manager_worker_new (int write_fd)
+msd_smartcard_manager_worker_new (MsdSmartcardEventQueue *event_queue)
 {
         MsdSmartcardManagerWorker *worker;
 
         worker = g_slice_new0 (MsdSmartcardManagerWorker);
-        worker->write_fd = write_fd;
+        worker->event_queue = msd_smartcard_event_queue_ref (event_queue);
         worker->module = NULL;
 
         worker->smartcards =
@@ -894,129 +1058,9 @@ msd_smartcard_manager_worker_free (MsdSmartcardManagerWorker *worker)
                 worker->smartcards = NULL;
         }
 
-        g_slice_free (MsdSmartcardManagerWorker, worker);
-}
-
-static gboolean
-read_bytes (int      fd,
-            gpointer bytes,
-            gsize    num_bytes)
-{
-        size_t bytes_left;
-        size_t total_bytes_read;
-        ssize_t bytes_read;
-
-        bytes_left = (size_t) num_bytes;
-        total_bytes_read = 0;
-
-        do {
-                bytes_read = read (fd,
-                                   (char *) bytes + total_bytes_read,
-                                   bytes_left);
-                g_assert (bytes_read <= (ssize_t) bytes_left);
-
-                if (bytes_read <= 0) {
-                        if ((bytes_read < 0) && (errno == EINTR || errno == EAGAIN)) {
-                                continue;
-                        }
-
-                        bytes_left = 0;
-                } else {
-                        bytes_left -= bytes_read;
-                        total_bytes_read += bytes_read;
-                }
-        } while (bytes_left > 0);
-
-        if (total_bytes_read <  (size_t) num_bytes) {
-                return FALSE;
-        }
-
-        return TRUE;
-}
-
-static gboolean
-write_bytes (int           fd,
-             gconstpointer bytes,
-             gsize         num_bytes)
-{
-        size_t bytes_left;
-        size_t total_bytes_written;
-        ssize_t bytes_written;
-
-        bytes_left = (size_t) num_bytes;
-        total_bytes_written = 0;
-
-        do {
-                bytes_written = write (fd,
-                                       (char *) bytes + total_bytes_written,
-                                       bytes_left);
-                g_assert (bytes_written <= (ssize_t) bytes_left);
+        msd_smartcard_event_queue_unref (worker->event_queue);
 
-                if (bytes_written <= 0) {
-                        if ((bytes_written < 0) && (errno == EINTR || errno == EAGAIN)) {
-                                continue;
-                        }
-
-                        bytes_left = 0;
-                } else {
-                        bytes_left -= bytes_written;
-                        total_bytes_written += bytes_written;
-                }
-        } while (bytes_left > 0);
-
-        if (total_bytes_written <  (size_t) num_bytes) {
-                return FALSE;
-        }
-
-        return TRUE;
-}
-
-static MsdSmartcard *
-read_smartcard (int           fd,
-                SECMODModule *module)
-{
-        MsdSmartcard *card;
-        char *card_name;
-        gsize card_name_size;
-
-        card_name_size = 0;
-        if (!read_bytes (fd, &card_name_size, sizeof (card_name_size))) {
-                return NULL;
-        }
-
-        card_name = g_slice_alloc0 (card_name_size);
-        if (!read_bytes (fd, card_name, card_name_size)) {
-                g_slice_free1 (card_name_size, card_name);
-                return NULL;
-        }
-        card = _msd_smartcard_new_from_name (module, card_name);
-        g_slice_free1 (card_name_size, card_name);
-
-        return card;
-}
-
-static gboolean
-write_smartcard (int           fd,
-                 MsdSmartcard *card)
-{
-        gsize card_name_size;
-        char *card_name;
-
-        card_name = msd_smartcard_get_name (card);
-        card_name_size = strlen (card_name) + 1;
-
-        if (!write_bytes (fd, &card_name_size, sizeof (card_name_size))) {
-                g_free (card_name);
-                return FALSE;
-        }
-
-        if (!write_bytes (fd, card_name, card_name_size)) {
-                g_free (card_name);
-                return FALSE;
-        }
-        g_free (card_name);
-
-        return TRUE;
+        g_slice_free (MsdSmartcardManagerWorker, worker);
 }
 
 static gboolean
@@ -1026,21 +1070,14 @@ msd_smartcard_manager_worker_emit_smartcard_removed (MsdSmartcardManagerWorker
 {
         g_debug ("card '%s' removed!", msd_smartcard_get_name (card));
 
-        if (!write_bytes (worker->write_fd, "R", 1)) {
-                goto error_out;
-        }
-
-        if (!write_smartcard (worker->write_fd, card)) {
-                goto error_out;
+        if (!msd_smartcard_event_queue_push (worker->event_queue, 'R', card)) {
+                g_set_error (error, MSD_SMARTCARD_MANAGER_ERROR,
+                             MSD_SMARTCARD_MANAGER_ERROR_REPORTING_EVENTS,
+                             "%s", g_strerror (errno));
+                return FALSE;
         }
 
         return TRUE;
-
-error_out:
-        g_set_error (error, MSD_SMARTCARD_MANAGER_ERROR,
-                     MSD_SMARTCARD_MANAGER_ERROR_REPORTING_EVENTS,
-                     "%s", g_strerror (errno));
-        return FALSE;
 }
 
 static gboolean
@@ -1049,21 +1086,15 @@ msd_smartcard_manager_worker_emit_smartcard_inserted (MsdSmartcardManagerWorker
                                                       GError                    **error)
 {
         g_debug ("card '%s' inserted!", msd_smartcard_get_name (card));
-        if (!write_bytes (worker->write_fd, "I", 1)) {
-                goto error_out;
-        }
 
-        if (!write_smartcard (worker->write_fd, card)) {
-                goto error_out;
+        if (!msd_smartcard_event_queue_push (worker->event_queue, 'I', card)) {
+                g_set_error (error, MSD_SMARTCARD_MANAGER_ERROR,
+                             MSD_SMARTCARD_MANAGER_ERROR_REPORTING_EVENTS,
+                             "%s", g_strerror (errno));
+                return FALSE;
         }
 
         return TRUE;
-
-error_out:
-        g_set_error (error, MSD_SMARTCARD_MANAGER_ERROR,
-                     MSD_SMARTCARD_MANAGER_ERROR_REPORTING_EVENTS,
-                     "%s", g_strerror (errno));
-        return FALSE;
 }
 
 static gboolean
@@ -1080,9 +1111,25 @@ msd_smartcard_manager_worker_watch_for_and_process_event (MsdSmartcardManagerWor
         g_debug ("waiting for card event");
         ret = FALSE;
 
+        /* This returns only on a card or reader event, or once the wait
+         * is cancelled; the latency is not a timeout.  Modules with
+         * C_WaitForSlotEvent ignore it and block in the module.  For the
+         * others NSS polls the slots itself, sleeping for the latency
+         * between polls, and PR_INTERVAL_NO_TIMEOUT there would be a sleep
+         * that neither an event nor SECMOD_CancelWait() ends; one second
+         * bounds both how late a card is seen and how long stopping takes.
+         */
         slot = SECMOD_WaitForAnyTokenEvent (worker->module, 0, PR_SecondsToInterval (1));
         processing_error = NULL;
 
+        if (g_atomic_int_get (&worker->event_queue->is_stopping)) {
+                g_debug ("stopped waiting for card events");
+                if (slot != NULL) {
+                        PK11_FreeSlot (slot);
+                }
+                return FALSE;
+        }
+
         if (slot == NULL) {
                 int error_code;
 
@@ -1102,6 +1149,9 @@ msd_smartcard_manager_worker_watch_for_and_process_event (MsdSmartcardManagerWor
                 goto out;
         }
 
+        /* a reader may have been plugged in; make NSS list its slots */
+        SECMOD_UpdateSlotList (worker->module);
+
         /* the slot id and series together uniquely identify a card.
          * You can never have two cards with the same slot id at the
          * same time, however (I think), so we can key off of it.
@@ -1197,7 +1247,9 @@ msd_smartcard_manager_worker_watch_for_and_process_event (MsdSmartcardManagerWor
 
 out:
         g_free (key);
-        PK11_FreeSlot (slot);
+        if (slot != NULL) {
+                PK11_FreeSlot (slot);
+        }
 
         return ret;
 }
@@ -1215,6 +1267,9 @@ msd_smartcard_manager_worker_run (MsdSmartcardManagerWorker *worker)
         if (error != NULL)  {
                 g_debug ("could not process card event - %s", error->message);
                 g_error_free (error);
+
+                /* let the main loop know we are gone */
+                msd_smartcard_event_queue_push (worker->event_queue, 'E', NULL);
         }
 
         msd_smartcard_manager_worker_free (worker);
@@ -1222,19 +1277,16 @@ msd_smartcard_manager_worker_run (MsdSmartcardManagerWorker *worker)
 
 static gboolean
 msd_smartcard_manager_create_worker (MsdSmartcardManager  *manager,
-                                     int                  *worker_fd,
                                      GThread             **worker_thread)
 {
         MsdSmartcardManagerWorker *worker;
-        int write_fd, read_fd;
 
-        write_fd = -1;
-        read_fd = -1;
-        if (!open_pipe (&write_fd, &read_fd)) {
+        manager->priv->event_queue = msd_smartcard_event_queue_new ();
+        if (manager->priv->event_queue == NULL) {
                 return FALSE;
         }
 
-        worker = msd_smartcard_manager_worker_new (write_fd);
+        worker = msd_smartcard_manager_worker_new (manager->priv->event_queue);
         worker->module = manager->priv->module;
 
         *worker_thread = g_thread_new ("MsdSmartcardManagerWorker", (GThreadFunc)
@@ -1246,10 +1298,6 @@ msd_smartcard_manager_create_worker (MsdSmartcardManager  *manager,
                 return FALSE;
         }
 
-        if (worker_fd) {
-                *worker_fd = read_fd;
-        }
-
         return TRUE;
 }
 
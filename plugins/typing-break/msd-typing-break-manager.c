@@ -38,11 +38,49 @@
 #include <gtk/gtk.h>
 #include <gio/gio.h>
 
+#ifdef HAVE_X11_EXTENSIONS_SYNC_H
+#include <X11/Xlib.h>
+#include <X11/extensions/sync.h>
+#endif
+
 #include "mate-settings-profile.h"
+#include "mate-settings-event-router.h"
 #include "msd-typing-break-manager.h"
 
 #define MATE_BREAK_SCHEMA "org.mate.typing-break"
 
+#define MSD_DBUS_NAME "org.mate.SettingsDaemon"
+#define MSD_DBUS_PATH "/org/mate/SettingsDaemon"
+
+#define MSD_TYPING_BREAK_DBUS_NAME MSD_DBUS_NAME ".TypingBreak"
+#define MSD_TYPING_BREAK_DBUS_PATH MSD_DBUS_PATH "/TypingBreak"
+
+static const gchar introspection_xml[] =
+"<node>"
+"  <interface name='org.mate.SettingsDaemon.TypingBreak'>"
+"    <property name='State' type='s' access='read'/>"
+"    <property name='SecondsUntilBreak' type='u' access='read'/>"
+"    <property name='TypeTime' type='u' access='read'/>"
+"    <property name='BreakTime' type='u' access='read'/>"
+"    <signal name='BreakDue'/>"
+"    <signal name='BreakTaken'/>"
+"  </interface>"
+"</node>";
+
+typedef enum {
+        TYPING_BREAK_STATE_DISABLED,
+        TYPING_BREAK_STATE_TYPING,
+        TYPING_BREAK_STATE_IDLE,
+        TYPING_BREAK_STATE_BREAK_DUE
+} TypingBreakState;
+
+static const char *state_names[] = {
+        "disabled",
+        "typing",
+        "idle",
+        "break-due"
+};
+
 struct MsdTypingBreakManagerPrivate
 {
         GPid  typing_monitor_pid;
@@ -50,6 +88,27 @@ struct MsdTypingBreakManagerPrivate
         guint child_watch_id;
         guint setup_id;
         GSettings *settings;
+
+        /* In-process tracker, used when the X server has IDLETIME */
+        gboolean          tracking;
+        TypingBreakState  state;
+        gint64            period_start;
+        guint             type_time;
+        guint             break_time;
+        guint             break_due_id;
+#ifdef HAVE_X11_EXTENSIONS_SYNC_H
+        Display          *xdisplay;
+        int               sync_event_base;
+        XSyncCounter      idle_counter;
+        XSyncAlarm        idle_alarm;
+        XSyncAlarm        active_alarm;
+        guint             alarm_event_id;
+#endif
+
+        GDBusNodeInfo    *introspection_data;
+        GDBusConnection  *connection;
+        GCancellable     *cancellable;
+        guint             name_id;
 };
 
 static void msd_typing_break_manager_finalize (GObject *object);
@@ -77,56 +136,391 @@ child_watch (GPid                   pid,
 {
         if (pid == manager->priv->typing_monitor_pid) {
                 manager->priv->typing_monitor_pid = 0;
+                manager->priv->child_watch_id = 0;
                 g_spawn_close_pid (pid);
         }
 }
 
 static void
-setup_typing_break (MsdTypingBreakManager *manager,
-                    gboolean               enabled)
+reap_typing_monitor (GPid     pid,
+                     int      status,
+                     gpointer data)
 {
-        mate_settings_profile_start (NULL);
+        g_spawn_close_pid (pid);
+}
 
-        if (! enabled) {
-                if (manager->priv->typing_monitor_pid != 0) {
-                        manager->priv->typing_monitor_idle_id = g_timeout_add_seconds (3, (GSourceFunc) typing_break_timeout, manager);
-                }
+/* Signals the monitor and forgets it; a watch that does not refer to
+ * the manager reaps it whenever it exits */
+static void
+stop_typing_monitor (MsdTypingBreakManager *manager,
+                     int                    sig)
+{
+        GPid pid = manager->priv->typing_monitor_pid;
+
+        if (manager->priv->typing_monitor_idle_id != 0) {
+                g_source_remove (manager->priv->typing_monitor_idle_id);
+                manager->priv->typing_monitor_idle_id = 0;
+        }
+
+        if (pid <= 0)
                 return;
+
+        if (manager->priv->child_watch_id != 0) {
+                g_source_remove (manager->priv->child_watch_id);
+                manager->priv->child_watch_id = 0;
         }
 
+        kill (pid, sig);
+        g_child_watch_add (pid, reap_typing_monitor, NULL);
+        manager->priv->typing_monitor_pid = 0;
+}
+
+static void
+spawn_typing_monitor (MsdTypingBreakManager *manager)
+{
+        GError  *error;
+        char    *argv[] = { "mate-typing-monitor", "-n", NULL };
+        gboolean res;
+
         if (manager->priv->typing_monitor_idle_id != 0) {
                 g_source_remove (manager->priv->typing_monitor_idle_id);
                 manager->priv->typing_monitor_idle_id = 0;
         }
 
-        if (manager->priv->typing_monitor_pid == 0) {
-                GError  *error;
-                char    *argv[] = { "mate-typing-monitor", "-n", NULL };
-                gboolean res;
-
-                error = NULL;
-                res = g_spawn_async ("/",
-                                     argv,
-                                     NULL,
-                                     G_SPAWN_STDOUT_TO_DEV_NULL
-                                     | G_SPAWN_STDERR_TO_DEV_NULL
-                                     | G_SPAWN_SEARCH_PATH
-                                     | G_SPAWN_DO_NOT_REAP_CHILD,
-                                     NULL,
-                                     NULL,
-                                     &manager->priv->typing_monitor_pid,
-                                     &error);
-                if (! res) {
-                        /* FIXME: put up a warning */
-                        g_warning ("failed: %s\n", error->message);
-                        g_error_free (error);
-                        manager->priv->typing_monitor_pid = 0;
-                        return;
+        if (manager->priv->typing_monitor_pid != 0)
+                return;
+
+        error = NULL;
+        res = g_spawn_async ("/",
+                             argv,
+                             NULL,
+                             G_SPAWN_STDOUT_TO_DEV_NULL
+                             | G_SPAWN_STDERR_TO_DEV_NULL
+                             | G_SPAWN_SEARCH_PATH
+                             | G_SPAWN_DO_NOT_REAP_CHILD,
+                             NULL,
+                             NULL,
+                             &manager->priv->typing_monitor_pid,
+                             &error);
+        if (! res) {
+                /* FIXME: put up a warning */
+                g_warning ("failed: %s\n", error->message);
+                g_error_free (error);
+                manager->priv->typing_monitor_pid = 0;
+                return;
+        }
+
+        manager->priv->child_watch_id = g_child_watch_add (manager->priv->typing_monitor_pid,
+                                                           (GChildWatchFunc)child_watch,
+                                                           manager);
+}
+
+static void
+emit_signal (MsdTypingBreakManager *manager,
+             const char            *signal_name)
+{
+        if (manager->priv->connection == NULL)
+                return;
+
+        g_dbus_connection_emit_signal (manager->priv->connection,
+                                       NULL,
+                                       MSD_TYPING_BREAK_DBUS_PATH,
+                                       MSD_TYPING_BREAK_DBUS_NAME,
+                                       signal_name,
+                                       NULL, NULL);
+}
+
+static void
+set_state (MsdTypingBreakManager *manager,
+           TypingBreakState       state)
+{
+        static const char *invalidated[] = { "SecondsUntilBreak", NULL };
+        GVariantBuilder props_builder;
+        GVariant *props_changed;
+
+        if (manager->priv->state == state)
+                return;
+
+        g_debug ("Typing break state: %s -> %s",
+                 state_names[manager->priv->state], state_names[state]);
+        manager->priv->state = state;
+
+        /* not yet connected to the session bus */
+        if (manager->priv->connection == NULL)
+                return;
+
+        g_variant_builder_init (&props_builder, G_VARIANT_TYPE ("a{sv}"));
+        g_variant_builder_add (&props_builder, "{sv}", "State",
+                               g_variant_new_string (state_names[state]));
+
+        /* SecondsUntilBreak changes continuously and is only invalidated */
+        props_changed = g_variant_new ("(s@a{sv}@as)", MSD_TYPING_BREAK_DBUS_NAME,
+                                       g_variant_builder_end (&props_builder),
+                                       g_variant_new_strv (invalidated, -1));
+
+        g_dbus_connection_emit_signal (manager->priv->connection,
+                                       NULL,
+                                       MSD_TYPING_BREAK_DBUS_PATH,
+                                       "org.freedesktop.DBus.Properties",
+                                       "PropertiesChanged",
+                                       props_changed, NULL);
+}
+
+static guint
+get_seconds_until_break (MsdTypingBreakManager *manager)
+{
+        gint64 elapsed;
+
+        if (manager->priv->state != TYPING_BREAK_STATE_TYPING)
+                return 0;
+
+        elapsed = (g_get_monotonic_time () - manager->priv->period_start) / G_USEC_PER_SEC;
+        if (elapsed >= manager->priv->type_time)
+                return 0;
+
+        return manager->priv->type_time - (guint) elapsed;
+}
+
+static gboolean
+break_due_cb (MsdTypingBreakManager *manager)
+{
+        manager->priv->break_due_id = 0;
+
+        set_state (manager, TYPING_BREAK_STATE_BREAK_DUE);
+        emit_signal (manager, "BreakDue");
+
+        /* The break window is the only thing left to the external UI;
+         * it runs until the break has been taken */
+        spawn_typing_monitor (manager);
+
+        return FALSE;
+}
+
+static void
+start_typing_period (MsdTypingBreakManager *manager)
+{
+        if (manager->priv->break_due_id != 0)
+                g_source_remove (manager->priv->break_due_id);
+
+        manager->priv->period_start = g_get_monotonic_time ();
+        manager->priv->break_due_id = g_timeout_add_seconds (manager->priv->type_time,
+                                                             (GSourceFunc) break_due_cb,
+                                                             manager);
+
+        set_state (manager, TYPING_BREAK_STATE_TYPING);
+}
+
+#ifdef HAVE_X11_EXTENSIONS_SYNC_H
+static XSyncAlarm
+create_idle_alarm (MsdTypingBreakManager *manager,
+                   gint64                 msec,
+                   XSyncTestType          test_type)
+{
+        XSyncAlarmAttributes attr;
+        XSyncValue           delta;
+        guint                flags;
+
+        flags = XSyncCACounter | XSyncCAValueType | XSyncCATestType |
+                XSyncCAValue | XSyncCADelta | XSyncCAEvents;
+
+        XSyncIntToValue (&delta, 0);
+        attr.trigger.counter = manager->priv->idle_counter;
+        attr.trigger.value_type = XSyncAbsolute;
+        attr.trigger.test_type = test_type;
+        XSyncIntsToValue (&attr.trigger.wait_value, (guint) msec, (int) (msec >> 32));
+        attr.delta = delta;
+        attr.events = True;
+
+        return XSyncCreateAlarm (manager->priv->xdisplay, flags, &attr);
+}
+
+static void
+destroy_idle_alarm (MsdTypingBreakManager *manager,
+                    XSyncAlarm            *alarm)
+{
+        if (*alarm == None)
+                return;
+
+        XSyncDestroyAlarm (manager->priv->xdisplay, *alarm);
+        *alarm = None;
+}
+
+/* The user has been idle for a full break: whatever was due is satisfied,
+ * and the next typing period starts on the next input event. */
+static void
+on_user_idle (MsdTypingBreakManager *manager)
+{
+        gboolean was_due;
+
+        if (manager->priv->break_due_id != 0) {
+                g_source_remove (manager->priv->break_due_id);
+                manager->priv->break_due_id = 0;
+        }
+
+        was_due = manager->priv->state == TYPING_BREAK_STATE_BREAK_DUE;
+        set_state (manager, TYPING_BREAK_STATE_IDLE);
+        if (was_due)
+                emit_signal (manager, "BreakTaken");
+
+        /* The break is over, and its window with it */
+        stop_typing_monitor (manager, SIGTERM);
+
+        destroy_idle_alarm (manager, &manager->priv->active_alarm);
+        manager->priv->active_alarm = create_idle_alarm (manager,
+                                                         (gint64) manager->priv->break_time * 1000,
+                                                         XSyncNegativeTransition);
+}
+
+static void
+on_user_active (MsdTypingBreakManager *manager)
+{
+        destroy_idle_alarm (manager, &manager->priv->active_alarm);
+        start_typing_period (manager);
+}
+
+static GdkFilterReturn
+sync_event_filter (XEvent                *xev,
+                   MsdTypingBreakManager *manager)
+{
+        XSyncAlarmNotifyEvent *alarm_event = (XSyncAlarmNotifyEvent *) xev;
+
+        if (alarm_event->alarm == manager->priv->idle_alarm)
+                on_user_idle (manager);
+        else if (alarm_event->alarm == manager->priv->active_alarm)
+                on_user_active (manager);
+
+        return GDK_FILTER_CONTINUE;
+}
+
+static gboolean
+find_idle_counter (MsdTypingBreakManager *manager)
+{
+        XSyncSystemCounter *counters;
+        int                 sync_error_base;
+        int                 major, minor;
+        int                 n_counters;
+        int                 i;
+
+        if (manager->priv->idle_counter != None)
+                return TRUE;
+
+        manager->priv->xdisplay = GDK_DISPLAY_XDISPLAY (gdk_display_get_default ());
+
+        if (!XSyncQueryExtension (manager->priv->xdisplay,
+                                  &manager->priv->sync_event_base,
+                                  &sync_error_base) ||
+            !XSyncInitialize (manager->priv->xdisplay, &major, &minor))
+                return FALSE;
+
+        counters = XSyncListSystemCounters (manager->priv->xdisplay, &n_counters);
+        for (i = 0; i < n_counters; i++) {
+                if (counters[i].name != NULL && strcmp (counters[i].name, "IDLETIME") == 0) {
+                        manager->priv->idle_counter = counters[i].counter;
+                        break;
+                }
+        }
+        if (counters != NULL)
+                XSyncFreeSystemCounterList (counters);
+
+        return manager->priv->idle_counter != None;
+}
+#endif /* HAVE_X11_EXTENSIONS_SYNC_H */
+
+static void
+clear_tracking (MsdTypingBreakManager *manager)
+{
+        if (manager->priv->break_due_id != 0) {
+                g_source_remove (manager->priv->break_due_id);
+                manager->priv->break_due_id = 0;
+        }
+
+#ifdef HAVE_X11_EXTENSIONS_SYNC_H
+        mate_settings_event_router_remove (manager->priv->alarm_event_id);
+        manager->priv->alarm_event_id = 0;
+        destroy_idle_alarm (manager, &manager->priv->idle_alarm);
+        destroy_idle_alarm (manager, &manager->priv->active_alarm);
+#endif
+
+        manager->priv->tracking = FALSE;
+}
+
+static void
+stop_tracking (MsdTypingBreakManager *manager)
+{
+        if (!manager->priv->tracking)
+                return;
+
+        clear_tracking (manager);
+        set_state (manager, TYPING_BREAK_STATE_DISABLED);
+}
+
+static void
+load_break_times (MsdTypingBreakManager *manager)
+{
+        /* Both keys are in minutes */
+        manager->priv->type_time = MAX (g_settings_get_int (manager->priv->settings, "type-time"), 1) * 60;
+        manager->priv->break_time = MAX (g_settings_get_int (manager->priv->settings, "break-time"), 1) * 60;
+}
+
+/* Tracks typing periods in the daemon from the X server's IDLETIME
+ * counter.  Returns FALSE if the server cannot provide it. */
+static gboolean
+start_tracking (MsdTypingBreakManager *manager)
+{
+#ifdef HAVE_X11_EXTENSIONS_SYNC_H
+        GdkDisplay *display;
+
+        if (!find_idle_counter (manager))
+                return FALSE;
+
+        clear_tracking (manager);
+        load_break_times (manager);
+
+        display = gdk_display_get_default ();
+        gdk_x11_display_error_trap_push (display);
+        manager->priv->idle_alarm = create_idle_alarm (manager,
+                                                       (gint64) manager->priv->break_time * 1000,
+                                                       XSyncPositiveTransition);
+        if (gdk_x11_display_error_trap_pop (display) != 0) {
+                manager->priv->idle_alarm = None;
+                set_state (manager, TYPING_BREAK_STATE_DISABLED);
+                return FALSE;
+        }
+
+        manager->priv->alarm_event_id =
+                mate_settings_event_router_add (MATE_SETTINGS_EVENT_X,
+                                                manager->priv->sync_event_base + XSyncAlarmNotify,
+                                                None,
+                                                (MateSettingsEventFunc) sync_event_filter,
+                                                manager, "typing-break: idle alarms");
+        manager->priv->tracking = TRUE;
+
+        start_typing_period (manager);
+
+        return TRUE;
+#else
+        return FALSE;
+#endif
+}
+
+static void
+setup_typing_break (MsdTypingBreakManager *manager,
+                    gboolean               enabled)
+{
+        mate_settings_profile_start (NULL);
+
+        if (! enabled) {
+                stop_tracking (manager);
+                if (manager->priv->typing_monitor_pid != 0) {
+                        manager->priv->typing_monitor_idle_id = g_timeout_add_seconds (3, (GSourceFunc) typing_break_timeout, manager);
                 }
+                return;
+        }
 
-                manager->priv->child_watch_id = g_child_watch_add (manager->priv->typing_monitor_pid,
-                                                                   (GChildWatchFunc)child_watch,
-                                                                   manager);
+        if (! start_tracking (manager)) {
+                /* No idle counter: let mate-typing-monitor do the timing */
+                g_debug ("IDLETIME counter unavailable, running mate-typing-monitor");
+                spawn_typing_monitor (manager);
         }
 
         mate_settings_profile_end (NULL);
@@ -140,6 +534,15 @@ typing_break_enabled_callback (GSettings             *settings,
         setup_typing_break (manager, g_settings_get_boolean (settings, key));
 }
 
+static void
+typing_break_times_callback (GSettings             *settings,
+                             gchar                 *key,
+                             MsdTypingBreakManager *manager)
+{
+        if (manager->priv->tracking)
+                start_tracking (manager);
+}
+
 static gboolean
 really_setup_typing_break (MsdTypingBreakManager *manager)
 {
@@ -148,6 +551,73 @@ really_setup_typing_break (MsdTypingBreakManager *manager)
         return FALSE;
 }
 
+static GVariant *
+handle_get_property (GDBusConnection *connection,
+                     const gchar     *sender,
+                     const gchar     *object_path,
+                     const gchar     *interface_name,
+                     const gchar     *property_name,
+                     GError         **error,
+                     gpointer         user_data)
+{
+        MsdTypingBreakManager *manager = MSD_TYPING_BREAK_MANAGER (user_data);
+
+        if (g_strcmp0 (property_name, "State") == 0)
+                return g_variant_new_string (state_names[manager->priv->state]);
+
+        if (g_strcmp0 (property_name, "SecondsUntilBreak") == 0)
+                return g_variant_new_uint32 (get_seconds_until_break (manager));
+
+        if (g_strcmp0 (property_name, "TypeTime") == 0)
+                return g_variant_new_uint32 (manager->priv->type_time);
+
+        if (g_strcmp0 (property_name, "BreakTime") == 0)
+                return g_variant_new_uint32 (manager->priv->break_time);
+
+        return NULL;
+}
+
+static const GDBusInterfaceVTable interface_vtable =
+{
+        NULL,
+        handle_get_property,
+        NULL
+};
+
+static void
+on_bus_gotten (GObject               *source_object,
+               GAsyncResult          *res,
+               MsdTypingBreakManager *manager)
+{
+        GDBusConnection *connection;
+        GError *error = NULL;
+
+        connection = g_bus_get_finish (res, &error);
+        if (connection == NULL) {
+                if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+                        g_warning ("Could not get session bus: %s", error->message);
+                g_error_free (error);
+                return;
+        }
+        manager->priv->connection = connection;
+
+        g_dbus_connection_register_object (connection,
+                                           MSD_TYPING_BREAK_DBUS_PATH,
+                                           manager->priv->introspection_data->interfaces[0],
+                                           &interface_vtable,
+                                           manager,
+                                           NULL,
+                                           NULL);
+
+        manager->priv->name_id = g_bus_own_name_on_connection (connection,
+                                                               MSD_TYPING_BREAK_DBUS_NAME,
+                                                               G_BUS_NAME_OWNER_FLAGS_NONE,
+                                                               NULL,
+                                                               NULL,
+                                                               NULL,
+                                                               NULL);
+}
+
 gboolean
 msd_typing_break_manager_start (MsdTypingBreakManager *manager,
                                 GError               **error)
@@ -163,6 +633,23 @@ msd_typing_break_manager_start (MsdTypingBreakManager *manager,
                           "changed::enabled",
                           G_CALLBACK (typing_break_enabled_callback),
                           manager);
+        g_signal_connect (manager->priv->settings,
+                          "changed::type-time",
+                          G_CALLBACK (typing_break_times_callback),
+                          manager);
+        g_signal_connect (manager->priv->settings,
+                          "changed::break-time",
+                          G_CALLBACK (typing_break_times_callback),
+                          manager);
+
+        manager->priv->introspection_data = g_dbus_node_info_new_for_xml (introspection_xml, NULL);
+        g_assert (manager->priv->introspection_data != NULL);
+
+        manager->priv->cancellable = g_cancellable_new ();
+        g_bus_get (G_BUS_TYPE_SESSION,
+                   manager->priv->cancellable,
+                   (GAsyncReadyCallback) on_bus_gotten,
+                   manager);
 
         enabled = g_settings_get_boolean (manager->priv->settings, "enabled");
 
@@ -190,24 +677,26 @@ msd_typing_break_manager_stop (MsdTypingBreakManager *manager)
                 p->setup_id = 0;
         }
 
-        if (p->child_watch_id != 0) {
-                g_source_remove (p->child_watch_id);
-                p->child_watch_id = 0;
-        }
+        stop_tracking (manager);
 
-        if (p->typing_monitor_idle_id != 0) {
-                g_source_remove (p->typing_monitor_idle_id);
-                p->typing_monitor_idle_id = 0;
+        if (p->name_id != 0) {
+                g_bus_unown_name (p->name_id);
+                p->name_id = 0;
         }
 
-        if (p->typing_monitor_pid > 0) {
-                kill (p->typing_monitor_pid, SIGKILL);
-                g_spawn_close_pid (p->typing_monitor_pid);
-                p->typing_monitor_pid = 0;
+        if (p->cancellable) {
+                g_cancellable_cancel (p->cancellable);
+                g_clear_object (&p->cancellable);
         }
 
+        g_clear_object (&p->connection);
+        g_clear_pointer (&p->introspection_data, g_dbus_node_info_unref);
+
+        stop_typing_monitor (manager, SIGKILL);
+
         if (p->settings != NULL) {
                 g_object_unref (p->settings);
+                p->settings = NULL;
         }
 }
 
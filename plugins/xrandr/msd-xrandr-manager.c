@@ -51,6 +51,7 @@
 #endif
 
 #include "mate-settings-profile.h"
+#include "mate-settings-event-router.h"
 #include "msd-xrandr-manager.h"
 
 #define CONF_SCHEMA                                    "org.mate.SettingsDaemon.plugins.xrandr"
@@ -91,6 +92,7 @@ struct MsdXrandrManagerPrivate
 
         MateRRScreen *rw_screen;
         gboolean running;
+        guint key_press_id;
 
         GtkStatusIcon *status_icon;
         GtkWidget *popup_menu;
@@ -130,51 +132,307 @@ G_DEFINE_TYPE_WITH_PRIVATE (MsdXrandrManager, msd_xrandr_manager, G_TYPE_OBJECT)
 
 static gpointer manager_object = NULL;
 
-static FILE *log_file;
+/* Diagnostic log of RANDR decisions.
+ *
+ * Every RANDR event, XF86Display keypress and plugin start/stop becomes one
+ * LogEntry in a small in-memory ring: when it happened, the RANDR timestamps
+ * involved, which configuration was chosen, whether we had to fall back to
+ * our own layout, and how long each step took.  Nothing is recorded unless
+ * ~/msd-debug-randr existed when the plugin started (or logging was turned on
+ * over D-Bus), so the disabled case costs a single boolean test.
+ *
+ * When ~/msd-debug-randr exists, finished entries are also appended to
+ * ~/msd-debug-randr.log.  That happens on a worker thread, at most once every
+ * LOG_FLUSH_INTERVAL seconds, so that handling a hotplug never waits on the
+ * home directory, which is often on NFS.
+ */
+#define LOG_RING_SIZE           64
+#define LOG_FLUSH_INTERVAL      5       /* seconds */
+
+typedef struct {
+        gint64   timestamp;             /* wall-clock time the entry was opened, in µs */
+        gint64   start_time;            /* monotonic time the entry was opened */
+        gint64   step_time;             /* monotonic time of the previous step */
+        gint64   duration;              /* µs from open to close */
+        char    *event;
+        guint32  change_timestamp;
+        guint32  config_timestamp;
+        char    *outcome;               /* the configuration that ended up applied */
+        gboolean fallback;              /* TRUE if we generated a configuration ourselves */
+        GString *steps;
+        GString *details;
+} LogEntry;
+
+typedef struct {
+        char *filename;
+        char *text;
+} LogFlushData;
+
+static gboolean  log_enabled;
+static gboolean  log_to_file;
+static char     *log_filename;
+static LogEntry *log_current;
+static int       log_depth;
+static LogEntry *log_ring[LOG_RING_SIZE];
+static guint     log_ring_next;
+static GString  *log_pending;
+static guint     log_flush_id;
+static gboolean  log_flush_running;
 
 static void
-log_open (void)
+log_entry_free (LogEntry *entry)
 {
-        char *toggle_filename;
-        char *log_filename;
-        struct stat st;
+        g_free (entry->event);
+        g_free (entry->outcome);
+        g_string_free (entry->steps, TRUE);
+        g_string_free (entry->details, TRUE);
+        g_free (entry);
+}
+
+static char *
+log_entry_to_string (LogEntry *entry)
+{
+        GDateTime *time;
+        char *date;
+        char *str;
+
+        time = g_date_time_new_from_unix_local (entry->timestamp / G_USEC_PER_SEC);
+        date = g_date_time_format (time, "%F %T");
+        g_date_time_unref (time);
+
+        str = g_strdup_printf ("[%s.%06d] %s change=%u config=%u outcome=%s fallback=%s total=%" G_GINT64_FORMAT "us steps:%s\n%s",
+                               date,
+                               (int) (entry->timestamp % G_USEC_PER_SEC),
+                               entry->event,
+                               entry->change_timestamp,
+                               entry->config_timestamp,
+                               entry->outcome ? entry->outcome : "none",
+                               entry->fallback ? "yes" : "no",
+                               entry->duration,
+                               entry->steps->len > 0 ? entry->steps->str : " none",
+                               entry->details->str);
+        g_free (date);
+
+        return str;
+}
+
+static void
+log_flush_thread (GTask        *task,
+                  gpointer      source_object G_GNUC_UNUSED,
+                  gpointer      task_data,
+                  GCancellable *cancellable G_GNUC_UNUSED)
+{
+        LogFlushData *data = task_data;
+        FILE *file;
+
+        file = fopen (data->filename, "a");
+        if (file == NULL) {
+                g_task_return_boolean (task, FALSE);
+                return;
+        }
+
+        if (ftell (file) == 0)
+                fprintf (file, "To keep this log from being created, please rm ~/msd-debug-randr\n");
+
+        fputs (data->text, file);
+        fclose (file);
+
+        g_task_return_boolean (task, TRUE);
+}
+
+static void
+log_flush_data_free (LogFlushData *data)
+{
+        g_free (data->filename);
+        g_free (data->text);
+        g_free (data);
+}
+
+static void log_schedule_flush (void);
+
+static void
+log_flush_done (GObject      *source_object G_GNUC_UNUSED,
+                GAsyncResult *result G_GNUC_UNUSED,
+                gpointer      user_data G_GNUC_UNUSED)
+{
+        log_flush_running = FALSE;
+
+        /* More entries may have arrived while we were writing */
+        if (log_pending != NULL)
+                log_schedule_flush ();
+}
+
+static void
+log_flush (void)
+{
+        LogFlushData *data;
+        GTask *task;
 
-        if (log_file)
+        if (log_pending == NULL || log_flush_running)
                 return;
 
+        data = g_new0 (LogFlushData, 1);
+        data->filename = g_strdup (log_filename);
+        data->text = g_string_free (log_pending, FALSE);
+        log_pending = NULL;
+
+        log_flush_running = TRUE;
+
+        task = g_task_new (NULL, NULL, log_flush_done, NULL);
+        g_task_set_task_data (task, data, (GDestroyNotify) log_flush_data_free);
+        g_task_run_in_thread (task, log_flush_thread);
+        g_object_unref (task);
+}
+
+static gboolean
+log_flush_timeout (gpointer data G_GNUC_UNUSED)
+{
+        log_flush_id = 0;
+        log_flush ();
+
+        return G_SOURCE_REMOVE;
+}
+
+static void
+log_schedule_flush (void)
+{
+        if (log_flush_id != 0 || log_flush_running)
+                return;
+
+        log_flush_id = g_timeout_add_seconds (LOG_FLUSH_INTERVAL, log_flush_timeout, NULL);
+}
+
+/* Called once at plugin start; this is the only place we touch the home
+ * directory on the main thread.
+ */
+static void
+log_init (void)
+{
+        char *toggle_filename;
+
         toggle_filename = g_build_filename (g_get_home_dir (), "msd-debug-randr", NULL);
+
+        log_to_file = g_file_test (toggle_filename, G_FILE_TEST_EXISTS);
+        log_enabled = log_enabled || log_to_file;
+
+        g_free (log_filename);
         log_filename = g_build_filename (g_get_home_dir (), "msd-debug-randr.log", NULL);
 
-        if (stat (toggle_filename, &st) != 0)
-                goto out;
+        g_free (toggle_filename);
+}
 
-        log_file = fopen (log_filename, "a");
+/* Stops the rate limiting and hands whatever is left to the writer thread */
+static void
+log_shutdown (void)
+{
+        if (log_flush_id != 0) {
+                g_source_remove (log_flush_id);
+                log_flush_id = 0;
+        }
 
-        if (log_file && ftell (log_file) == 0)
-                fprintf (log_file, "To keep this log from being created, please rm ~/msd-debug-randr\n");
+        log_flush ();
+}
 
-out:
-        g_free (toggle_filename);
-        g_free (log_filename);
+static void
+log_open (const char *event)
+{
+        gint64 now;
+
+        if (!log_enabled)
+                return;
+
+        if (log_depth++ > 0) {
+                /* e.g. a RANDR event emitted while we apply a configuration */
+                g_string_append_printf (log_current->details, "  (nested %s)\n", event);
+                return;
+        }
+
+        now = g_get_monotonic_time ();
+
+        log_current = g_new0 (LogEntry, 1);
+        log_current->timestamp = g_get_real_time ();
+        log_current->start_time = now;
+        log_current->step_time = now;
+        log_current->event = g_strdup (event);
+        log_current->steps = g_string_new (NULL);
+        log_current->details = g_string_new (NULL);
 }
 
 static void
 log_close (void)
 {
-        if (log_file) {
-                fclose (log_file);
-                log_file = NULL;
-        }
+        LogEntry *entry;
+        char *str;
+
+        if (log_current == NULL || --log_depth > 0)
+                return;
+
+        entry = log_current;
+        log_current = NULL;
+
+        entry->duration = g_get_monotonic_time () - entry->start_time;
+
+        if (log_ring[log_ring_next] != NULL)
+                log_entry_free (log_ring[log_ring_next]);
+        log_ring[log_ring_next] = entry;
+        log_ring_next = (log_ring_next + 1) % LOG_RING_SIZE;
+
+        if (!log_to_file)
+                return;
+
+        if (log_pending == NULL)
+                log_pending = g_string_new (NULL);
+
+        str = log_entry_to_string (entry);
+        g_string_append (log_pending, str);
+        g_free (str);
+
+        log_schedule_flush ();
+}
+
+/* Records the time spent since the previous step (or since log_open()) */
+static void
+log_step (const char *name)
+{
+        gint64 now;
+
+        if (log_current == NULL)
+                return;
+
+        now = g_get_monotonic_time ();
+        g_string_append_printf (log_current->steps, " %s=%" G_GINT64_FORMAT "us", name, now - log_current->step_time);
+        log_current->step_time = now;
+}
+
+static void
+log_timestamps (guint32 change_timestamp, guint32 config_timestamp)
+{
+        if (log_current == NULL)
+                return;
+
+        log_current->change_timestamp = change_timestamp;
+        log_current->config_timestamp = config_timestamp;
+}
+
+static void
+log_outcome (const char *outcome, gboolean fallback)
+{
+        if (log_current == NULL)
+                return;
+
+        g_free (log_current->outcome);
+        log_current->outcome = g_strdup (outcome);
+        log_current->fallback = fallback;
 }
 
 static void
 log_msg (const char *format, ...)
 {
-        if (log_file) {
+        if (log_current) {
                 va_list args;
 
                 va_start (args, format);
-                vfprintf (log_file, format, args);
+                g_string_append_vprintf (log_current->details, format, args);
                 va_end (args);
         }
 }
@@ -215,7 +473,12 @@ static void
 log_configuration (MateRRConfig *config)
 {
         int i;
-        MateRROutputInfo **outputs = mate_rr_config_get_outputs (config);
+        MateRROutputInfo **outputs;
+
+        if (log_current == NULL)
+                return;
+
+        outputs = mate_rr_config_get_outputs (config);
 
         log_msg ("        cloned: %s\n", mate_rr_config_get_clone (config) ? "yes" : "no");
 
@@ -244,7 +507,7 @@ log_screen (MateRRScreen *screen)
         int min_w, min_h, max_w, max_h;
         guint32 change_timestamp, config_timestamp;
 
-        if (!log_file)
+        if (log_current == NULL)
                 return;
 
         config = mate_rr_config_new_current (screen, NULL);
@@ -268,6 +531,9 @@ log_configurations (MateRRConfig **configs)
 {
         int i;
 
+        if (log_current == NULL)
+                return;
+
         if (!configs) {
                 log_msg ("    No configurations\n");
                 return;
@@ -627,6 +893,43 @@ msd_xrandr_manager_2_apply_configuration (MsdXrandrManager *manager,
         return result;
 }
 
+/* DBus method for org.mate.SettingsDaemon.XRANDR_2 GetDiagnosticLog; see msd-xrandr-manager.xml for the interface definition */
+static gboolean
+msd_xrandr_manager_2_get_diagnostic_log (MsdXrandrManager *manager G_GNUC_UNUSED,
+                                         char           ***entries,
+                                         GError          **error G_GNUC_UNUSED)
+{
+        GPtrArray *array;
+        guint i;
+
+        array = g_ptr_array_new ();
+
+        /* oldest first */
+        for (i = 0; i < LOG_RING_SIZE; i++) {
+                LogEntry *entry = log_ring[(log_ring_next + i) % LOG_RING_SIZE];
+
+                if (entry != NULL)
+                        g_ptr_array_add (array, log_entry_to_string (entry));
+        }
+
+        g_ptr_array_add (array, NULL);
+        *entries = (char **) g_ptr_array_free (array, FALSE);
+
+        return TRUE;
+}
+
+/* DBus method for org.mate.SettingsDaemon.XRANDR_2 SetDiagnosticLogging; see msd-xrandr-manager.xml for the interface definition */
+static gboolean
+msd_xrandr_manager_2_set_diagnostic_logging (MsdXrandrManager *manager G_GNUC_UNUSED,
+                                             gboolean          enabled,
+                                             GError          **error G_GNUC_UNUSED)
+{
+        /* ~/msd-debug-randr always wins, so that the log file keeps its entries */
+        log_enabled = enabled || log_to_file;
+
+        return TRUE;
+}
+
 /* We include this after the definition of msd_xrandr_manager_apply_configuration() so the prototype will already exist */
 #include "msd-xrandr-manager-glue.h"
 
@@ -1168,7 +1471,7 @@ handle_fn_f7 (MsdXrandrManager *mgr, guint32 timestamp)
          */
         g_debug ("Handling fn-f7");
 
-        log_open ();
+        log_open ("fn-f7");
         log_msg ("Handling XF86Display hotkey - timestamp %u\n", timestamp);
 
         error = NULL;
@@ -1182,6 +1485,7 @@ handle_fn_f7 (MsdXrandrManager *mgr, guint32 timestamp)
                 error_message (mgr, str, NULL, _("Trying to switch the monitor configuration anyway."));
                 g_free (str);
         }
+        log_step ("refresh");
 
         if (!priv->fn_f7_configs) {
                 log_msg ("Generating stock configurations:\n");
@@ -1203,6 +1507,7 @@ handle_fn_f7 (MsdXrandrManager *mgr, guint32 timestamp)
             }
 
         g_object_unref (current);
+        log_step ("generate");
 
         if (priv->fn_f7_configs) {
                 guint32 server_timestamp;
@@ -1236,14 +1541,23 @@ handle_fn_f7 (MsdXrandrManager *mgr, guint32 timestamp)
                         timestamp = server_timestamp;
 
                 success = apply_configuration_and_display_error (mgr, priv->fn_f7_configs[mgr->priv->current_fn_f7_config], timestamp);
+                log_step ("apply");
 
                 if (success) {
+                        char *outcome;
+
+                        outcome = g_strdup_printf ("stock configuration %d", mgr->priv->current_fn_f7_config);
+                        log_outcome (outcome, TRUE);
+                        g_free (outcome);
+
                         log_msg ("Successfully switched to configuration (timestamp %u):\n", timestamp);
                         log_configuration (priv->fn_f7_configs[mgr->priv->current_fn_f7_config]);
-                }
+                } else
+                        log_outcome ("failed", TRUE);
         }
         else {
                 g_debug ("no configurations generated");
+                log_outcome ("no configurations", FALSE);
         }
 
         log_close ();
@@ -1357,28 +1671,18 @@ out:
 }
 
 static GdkFilterReturn
-event_filter (GdkXEvent           *xevent,
-              GdkEvent            *event,
-              gpointer             data)
+event_filter (XEvent   *xev,
+              gpointer  data)
 {
         MsdXrandrManager *manager = data;
-        XEvent *xev = (XEvent *) xevent;
 
         if (!manager->priv->running)
                 return GDK_FILTER_CONTINUE;
 
-        /* verify we have a key event */
-        if (xev->xany.type != KeyPress && xev->xany.type != KeyRelease)
-                return GDK_FILTER_CONTINUE;
-
-        if (xev->xany.type == KeyPress) {
-                if (xev->xkey.keycode == manager->priv->switch_video_mode_keycode)
-                        handle_fn_f7 (manager, xev->xkey.time);
-                else if (xev->xkey.keycode == manager->priv->rotate_windows_keycode)
-                        handle_rotate_windows (manager, xev->xkey.time);
-
-                return GDK_FILTER_CONTINUE;
-        }
+        if (xev->xkey.keycode == manager->priv->switch_video_mode_keycode)
+                handle_fn_f7 (manager, xev->xkey.time);
+        else if (xev->xkey.keycode == manager->priv->rotate_windows_keycode)
+                handle_rotate_windows (manager, xev->xkey.time);
 
         return GDK_FILTER_CONTINUE;
 }
@@ -1572,7 +1876,8 @@ on_randr_event (MateRRScreen *screen, gpointer data)
 
         mate_rr_screen_get_timestamps (screen, &change_timestamp, &config_timestamp);
 
-        log_open ();
+        log_open ("randr-event");
+        log_timestamps (change_timestamp, config_timestamp);
         log_msg ("Got RANDR event with timestamps change=%u %c config=%u\n",
                  change_timestamp,
                  timestamp_relationship (change_timestamp, config_timestamp),
@@ -1588,6 +1893,7 @@ on_randr_event (MateRRScreen *screen, gpointer data)
                  */
                 show_timestamps_dialog (manager, "ignoring since change > config");
                 log_msg ("  Ignoring event since change >= config\n");
+                log_outcome ("ignored", FALSE);
         } else {
                 /* Here, config_timestamp > change_timestamp.  This means that
                  * the screen got reconfigured because of hotplug/unplug; the X
@@ -1606,6 +1912,7 @@ on_randr_event (MateRRScreen *screen, gpointer data)
                 error = NULL;
                 success = apply_configuration_from_filename (manager, intended_filename, TRUE, config_timestamp, &error);
                 g_free (intended_filename);
+                log_step ("stored-configuration");
 
                 if (!success) {
                         /* We don't bother checking the error type.
@@ -1629,17 +1936,25 @@ on_randr_event (MateRRScreen *screen, gpointer data)
                         if (config_timestamp != priv->last_config_timestamp) {
                                 priv->last_config_timestamp = config_timestamp;
                                 auto_configure_outputs (manager, config_timestamp);
+                                log_step ("auto-configure");
                                 log_msg ("  Automatically configured outputs to deal with event\n");
-                        } else
+                                log_outcome ("automatic layout", TRUE);
+                        } else {
                                 log_msg ("  Ignored event as old and new config timestamps are the same\n");
-                } else
+                                log_outcome ("ignored", TRUE);
+                        }
+                } else {
                         log_msg ("Applied stored configuration to deal with event\n");
+                        log_outcome ("stored configuration", FALSE);
+                }
         }
 
         /* poke mate-color-manager */
         apply_color_profiles ();
+        log_step ("color-profiles");
 
         refresh_tray_icon_menu_if_active (manager, MAX (change_timestamp, config_timestamp));
+        log_step ("tray-menu");
 
         log_close ();
 }
@@ -2537,7 +2852,8 @@ msd_xrandr_manager_start (MsdXrandrManager *manager,
         g_debug ("Starting xrandr manager");
         mate_settings_profile_start (NULL);
 
-        log_open ();
+        log_init ();
+        log_open ("startup");
         log_msg ("------------------------------------------------------------\nSTARTING XRANDR PLUGIN\n");
 
         manager->priv->rw_screen = mate_rr_screen_new (gdk_screen_get_default (), error);
@@ -2546,7 +2862,9 @@ msd_xrandr_manager_start (MsdXrandrManager *manager,
                 log_msg ("Could not initialize the RANDR plugin%s%s\n",
                          (error && *error) ? ": " : "",
                          (error && *error) ? (*error)->message : "");
+                log_outcome ("failed", FALSE);
                 log_close ();
+                log_shutdown ();
                 return FALSE;
         }
 
@@ -2590,17 +2908,26 @@ msd_xrandr_manager_start (MsdXrandrManager *manager,
         }
 
         show_timestamps_dialog (manager, "Startup");
-        if (!apply_stored_configuration_at_startup (manager, GDK_CURRENT_TIME)) /* we don't have a real timestamp at startup anyway */
-                if (!apply_default_configuration_from_file (manager, GDK_CURRENT_TIME))
-                        if (!g_settings_get_boolean (manager->priv->settings, CONF_KEY_USE_XORG_MONITOR_SETTINGS))
-                                apply_default_boot_configuration (manager, GDK_CURRENT_TIME);
+        log_step ("init");
+        if (apply_stored_configuration_at_startup (manager, GDK_CURRENT_TIME)) /* we don't have a real timestamp at startup anyway */
+                log_outcome ("stored configuration", FALSE);
+        else if (apply_default_configuration_from_file (manager, GDK_CURRENT_TIME))
+                log_outcome ("default configuration file", FALSE);
+        else if (!g_settings_get_boolean (manager->priv->settings, CONF_KEY_USE_XORG_MONITOR_SETTINGS)) {
+                apply_default_boot_configuration (manager, GDK_CURRENT_TIME);
+                log_outcome ("default boot layout", TRUE);
+        } else
+                log_outcome ("xorg settings", FALSE);
+        log_step ("apply");
 
         log_msg ("State of screen after initial configuration:\n");
         log_screen (manager->priv->rw_screen);
 
-        gdk_window_add_filter (gdk_get_default_root_window(),
-                               (GdkFilterFunc)event_filter,
-                               manager);
+        manager->priv->key_press_id =
+                mate_settings_event_router_add (MATE_SETTINGS_EVENT_X, KeyPress,
+                                                gdk_x11_get_default_root_xwindow (),
+                                                event_filter, manager,
+                                                "xrandr: keys");
 
         start_or_stop_icon (manager);
 
@@ -2642,9 +2969,8 @@ msd_xrandr_manager_stop (MsdXrandrManager *manager)
                 gdk_x11_display_error_trap_pop_ignored (display);
         }
 
-        gdk_window_remove_filter (gdk_get_default_root_window (),
-                                  (GdkFilterFunc) event_filter,
-                                  manager);
+        mate_settings_event_router_remove (manager->priv->key_press_id);
+        manager->priv->key_press_id = 0;
 
         if (manager->priv->settings != NULL) {
                 g_object_unref (manager->priv->settings);
@@ -2663,9 +2989,10 @@ msd_xrandr_manager_stop (MsdXrandrManager *manager)
 
         status_icon_stop (manager);
 
-        log_open ();
+        log_open ("stop");
         log_msg ("STOPPING XRANDR PLUGIN\n------------------------------------------------------------\n");
         log_close ();
+        log_shutdown ();
 }
 
 static void
@@ -19,19 +19,47 @@
  * Author:  Behdad Esfahbod, Red Hat, Inc.
  */
 
+#include "config.h"
+
 #include "fontconfig-monitor.h"
 
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
 #include <gio/gio.h>
 #include <fontconfig/fontconfig.h>
 
+#ifdef HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#include <glib-unix.h>
+#endif
+
 #define TIMEOUT_SECONDS 2
 
-static void
-stuff_changed (GFileMonitor *monitor,
-               GFile *file,
-               GFile *other_file,
-               GFileMonitorEvent event_type,
-               gpointer handle);
+struct _fontconfig_monitor_handle {
+#ifdef HAVE_SYS_INOTIFY_H
+        /* All config and font directories share one inotify instance */
+        int         inotify_fd;
+        guint       inotify_source;
+        GHashTable *watches;            /* wd -> WatchedDir */
+        GHashTable *watched_paths;      /* path -> wd */
+#else
+        GPtrArray *monitors;
+#endif
+
+        guint timeout;
+
+        /* Reinitialization runs on a worker thread */
+        gboolean updating;
+        gboolean changed_while_updating;
+        gboolean stopped;
+
+        GFunc    notify_callback;
+        gpointer notify_data;
+};
+
+static void stuff_changed (fontconfig_monitor_handle_t *handle);
 
 void
 fontconfig_cache_init (void)
@@ -45,6 +73,206 @@ fontconfig_cache_update (void)
         return !FcConfigUptoDate (NULL) && FcInitReinitialize ();
 }
 
+#ifdef HAVE_SYS_INOTIFY_H
+
+#define WATCH_MASK (IN_CREATE | IN_DELETE | IN_CLOSE_WRITE | IN_ATTRIB | \
+                    IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | \
+                    IN_ONLYDIR)
+
+typedef struct {
+        char    *path;
+        gboolean recursive;     /* font directory: follow new subdirectories */
+} WatchedDir;
+
+static void
+watched_dir_free (WatchedDir *dir)
+{
+        g_free (dir->path);
+        g_free (dir);
+}
+
+static void
+watch_dir (fontconfig_monitor_handle_t *handle,
+           const char                  *path,
+           gboolean                     recursive)
+{
+        WatchedDir *dir;
+        int wd;
+
+        if (g_hash_table_contains (handle->watched_paths, path))
+                return;
+
+        wd = inotify_add_watch (handle->inotify_fd, path, WATCH_MASK);
+        if (wd < 0) {
+                /* ENOENT for configured directories that don't exist is normal */
+                g_debug ("Could not watch %s: %s", path, g_strerror (errno));
+                return;
+        }
+
+        dir = g_new0 (WatchedDir, 1);
+        dir->path = g_strdup (path);
+        dir->recursive = recursive;
+
+        g_hash_table_replace (handle->watches, GINT_TO_POINTER (wd), dir);
+        g_hash_table_insert (handle->watched_paths, g_strdup (path), GINT_TO_POINTER (wd));
+}
+
+/* fontconfig already lists the subdirectories of the font directories it
+ * knows about, so this is only needed for directories created later on.
+ */
+static void
+watch_dir_recursive (fontconfig_monitor_handle_t *handle,
+                     const char                  *path)
+{
+        GDir *gdir;
+        const char *name;
+
+        watch_dir (handle, path, TRUE);
+
+        gdir = g_dir_open (path, 0, NULL);
+        if (gdir == NULL)
+                return;
+
+        while ((name = g_dir_read_name (gdir)) != NULL) {
+                char *child;
+
+                child = g_build_filename (path, name, NULL);
+                if (g_file_test (child, G_FILE_TEST_IS_DIR) &&
+                    !g_file_test (child, G_FILE_TEST_IS_SYMLINK))
+                        watch_dir_recursive (handle, child);
+                g_free (child);
+        }
+
+        g_dir_close (gdir);
+}
+
+static gboolean
+inotify_cb (gint         fd,
+            GIOCondition condition G_GNUC_UNUSED,
+            gpointer     data)
+{
+        fontconfig_monitor_handle_t *handle = data;
+        char buf[4096] __attribute__ ((aligned (__alignof__ (struct inotify_event))));
+        gboolean changed = FALSE;
+        ssize_t len;
+
+        while ((len = read (fd, buf, sizeof (buf))) > 0) {
+                char *p = buf;
+
+                while (p < buf + len) {
+                        struct inotify_event *event = (struct inotify_event *) p;
+                        WatchedDir *dir;
+
+                        p += sizeof (struct inotify_event) + event->len;
+                        changed = TRUE;
+
+                        if (event->mask & IN_IGNORED) {
+                                dir = g_hash_table_lookup (handle->watches, GINT_TO_POINTER (event->wd));
+                                if (dir != NULL) {
+                                        g_hash_table_remove (handle->watched_paths, dir->path);
+                                        g_hash_table_remove (handle->watches, GINT_TO_POINTER (event->wd));
+                                }
+                                continue;
+                        }
+
+                        if (!(event->mask & IN_ISDIR) ||
+                            !(event->mask & (IN_CREATE | IN_MOVED_TO)) ||
+                            event->len == 0)
+                                continue;
+
+                        dir = g_hash_table_lookup (handle->watches, GINT_TO_POINTER (event->wd));
+                        if (dir != NULL && dir->recursive) {
+                                char *child;
+
+                                child = g_build_filename (dir->path, event->name, NULL);
+                                watch_dir_recursive (handle, child);
+                                g_free (child);
+                        }
+                }
+        }
+
+        if (changed)
+                stuff_changed (handle);
+
+        return G_SOURCE_CONTINUE;
+}
+
+static void
+watch_files (fontconfig_monitor_handle_t *handle,
+             FcStrList                   *list,
+             gboolean                     font_dirs)
+{
+        const char *str;
+
+        while ((str = (const char *) FcStrListNext (list))) {
+                char *dirname;
+
+                /* Watch the directory holding a config file rather than the
+                 * file itself: editors replace files by renaming over them,
+                 * and all the files in /etc/fonts share one watch this way.
+                 */
+                if (font_dirs || g_file_test (str, G_FILE_TEST_IS_DIR))
+                        dirname = g_strdup (str);
+                else
+                        dirname = g_path_get_dirname (str);
+
+                watch_dir (handle, dirname, font_dirs);
+                g_free (dirname);
+        }
+
+        FcStrListDone (list);
+}
+
+static void
+monitors_create (fontconfig_monitor_handle_t *handle)
+{
+        handle->inotify_fd = inotify_init1 (IN_NONBLOCK | IN_CLOEXEC);
+        if (handle->inotify_fd < 0) {
+                g_warning ("Could not monitor fontconfig files: %s", g_strerror (errno));
+                return;
+        }
+
+        handle->watches = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+                                                 NULL, (GDestroyNotify) watched_dir_free);
+        handle->watched_paths = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                       g_free, NULL);
+
+        watch_files (handle, FcConfigGetConfigFiles (NULL), FALSE);
+        watch_files (handle, FcConfigGetFontDirs (NULL), TRUE);
+
+        handle->inotify_source = g_unix_fd_add (handle->inotify_fd, G_IO_IN, inotify_cb, handle);
+}
+
+static void
+monitors_free (fontconfig_monitor_handle_t *handle)
+{
+        if (handle->inotify_source) {
+                g_source_remove (handle->inotify_source);
+                handle->inotify_source = 0;
+        }
+
+        /* closing the instance drops all of its watches at once */
+        if (handle->inotify_fd >= 0) {
+                close (handle->inotify_fd);
+                handle->inotify_fd = -1;
+        }
+
+        g_clear_pointer (&handle->watches, g_hash_table_destroy);
+        g_clear_pointer (&handle->watched_paths, g_hash_table_destroy);
+}
+
+#else /* !HAVE_SYS_INOTIFY_H */
+
+static void
+file_changed (GFileMonitor      *monitor G_GNUC_UNUSED,
+              GFile             *file G_GNUC_UNUSED,
+              GFile             *other_file G_GNUC_UNUSED,
+              GFileMonitorEvent  event_type G_GNUC_UNUSED,
+              gpointer           data)
+{
+        stuff_changed (data);
+}
+
 static void
 monitor_files (GPtrArray *monitors,
                FcStrList *list,
@@ -65,7 +293,7 @@ monitor_files (GPtrArray *monitors,
                 if (!monitor)
                         continue;
 
-                g_signal_connect (monitor, "changed", G_CALLBACK (stuff_changed), data);
+                g_signal_connect (monitor, "changed", G_CALLBACK (file_changed), data);
 
                 g_ptr_array_add (monitors, monitor);
         }
@@ -73,74 +301,131 @@ monitor_files (GPtrArray *monitors,
         FcStrListDone (list);
 }
 
+static void
+monitors_create (fontconfig_monitor_handle_t *handle)
+{
+        handle->monitors = g_ptr_array_new ();
 
-struct _fontconfig_monitor_handle {
-        GPtrArray *monitors;
-
-        guint timeout;
-
-        GFunc    notify_callback;
-        gpointer notify_data;
-};
+        monitor_files (handle->monitors, FcConfigGetConfigFiles (NULL), handle);
+        monitor_files (handle->monitors, FcConfigGetFontDirs (NULL), handle);
+}
 
-static GPtrArray *
-monitors_create (gpointer data)
+static void
+monitors_free (fontconfig_monitor_handle_t *handle)
 {
-        GPtrArray *monitors = g_ptr_array_new ();
+        if (!handle->monitors)
+                return;
 
-        monitor_files (monitors, FcConfigGetConfigFiles (NULL), data);
-        monitor_files (monitors, FcConfigGetFontDirs (NULL)   , data);
+        g_ptr_array_foreach (handle->monitors, (GFunc) g_object_unref, NULL);
+        g_ptr_array_free (handle->monitors, TRUE);
+        handle->monitors = NULL;
+}
 
-        return monitors;
+#endif /* HAVE_SYS_INOTIFY_H */
+
+static void
+handle_free (fontconfig_monitor_handle_t *handle)
+{
+        g_slice_free (fontconfig_monitor_handle_t, handle);
 }
 
+/* Runs in a worker thread: this is where all the font scanning happens */
 static void
-monitors_free (GPtrArray *monitors)
+update_thread (GTask        *task,
+               gpointer      source_object G_GNUC_UNUSED,
+               gpointer      task_data G_GNUC_UNUSED,
+               GCancellable *cancellable G_GNUC_UNUSED)
 {
-        if (!monitors)
-                return;
+        FcConfig *config = NULL;
+
+        if (!FcConfigUptoDate (NULL))
+                config = FcInitLoadConfigAndFonts ();
 
-        g_ptr_array_foreach (monitors, (GFunc) g_object_unref, NULL);
-        g_ptr_array_free (monitors, TRUE);
+        g_task_return_pointer (task, config, (GDestroyNotify) FcConfigDestroy);
 }
 
-static gboolean
-update (gpointer data)
+static gboolean update (gpointer data);
+
+static void
+update_done (GObject      *source_object G_GNUC_UNUSED,
+             GAsyncResult *result,
+             gpointer      data)
 {
         fontconfig_monitor_handle_t *handle = data;
+        FcConfig *config;
         gboolean notify = FALSE;
 
-        handle->timeout = 0;
+        config = g_task_propagate_pointer (G_TASK (result), NULL);
+
+        handle->updating = FALSE;
+
+        if (handle->stopped) {
+                if (config)
+                        FcConfigDestroy (config);
+                handle_free (handle);
+                return;
+        }
 
-        if (fontconfig_cache_update ()) {
+        /* Swapping in the freshly built configuration is cheap; this is the
+         * same thing FcInitReinitialize() does once it has loaded the fonts.
+         */
+        if (config && FcConfigSetCurrent (config)) {
                 notify = TRUE;
-                monitors_free (handle->monitors);
-                handle->monitors = monitors_create (data);
+                monitors_free (handle);
+                monitors_create (handle);
+        }
+
+#if FC_VERSION >= 21300
+        /* FcConfigSetCurrent() took its own reference */
+        if (config)
+                FcConfigDestroy (config);
+#else
+        if (config && !notify)
+                FcConfigDestroy (config);
+#endif
+
+        if (handle->changed_while_updating) {
+                handle->changed_while_updating = FALSE;
+                stuff_changed (handle);
         }
 
         /* we finish modifying handle before calling the notify callback,
-         * allowing the callback to free the monitor if it decides to. */
+         * allowing the callback to stop the monitor if it decides to. */
 
         if (notify && handle->notify_callback)
                 handle->notify_callback (data, handle->notify_data);
+}
+
+static gboolean
+update (gpointer data)
+{
+        fontconfig_monitor_handle_t *handle = data;
+        GTask *task;
+
+        handle->timeout = 0;
+        handle->updating = TRUE;
+
+        task = g_task_new (NULL, NULL, update_done, handle);
+        g_task_run_in_thread (task, update_thread);
+        g_object_unref (task);
 
         return FALSE;
 }
 
 static void
-stuff_changed (GFileMonitor *monitor G_GNUC_UNUSED,
-               GFile *file G_GNUC_UNUSED,
-               GFile *other_file G_GNUC_UNUSED,
-               GFileMonitorEvent event_type G_GNUC_UNUSED,
-               gpointer data)
+stuff_changed (fontconfig_monitor_handle_t *handle)
 {
-        fontconfig_monitor_handle_t *handle = data;
+        /* a single rescan picks up whatever else changes meanwhile */
+        if (handle->updating) {
+                handle->changed_while_updating = TRUE;
+                return;
+        }
 
         /* wait for quiescence */
         if (handle->timeout)
                 g_source_remove (handle->timeout);
 
-        handle->timeout = g_timeout_add_seconds (TIMEOUT_SECONDS, update, data);
+        handle->timeout = g_timeout_add_seconds (TIMEOUT_SECONDS, update, handle);
 }
 
 
@@ -152,7 +437,10 @@ fontconfig_monitor_start (GFunc    notify_callback,
 
         handle->notify_callback = notify_callback;
         handle->notify_data = notify_data;
-        handle->monitors = monitors_create (handle);
+#ifdef HAVE_SYS_INOTIFY_H
+        handle->inotify_fd = -1;
+#endif
+        monitors_create (handle);
 
         return handle;
 }
@@ -164,8 +452,13 @@ fontconfig_monitor_stop  (fontconfig_monitor_handle_t *handle)
           g_source_remove (handle->timeout);
         handle->timeout = 0;
 
-        monitors_free (handle->monitors);
-        handle->monitors = NULL;
+        monitors_free (handle);
+
+        /* a running update frees the handle once it is done */
+        if (handle->updating)
+                handle->stopped = TRUE;
+        else
+                handle_free (handle);
 }
 
 #ifdef FONTCONFIG_MONITOR_TEST
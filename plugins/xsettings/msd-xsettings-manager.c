@@ -44,6 +44,7 @@
 #include "xsettings-manager.h"
 #include "fontconfig-monitor.h"
 #include "wm-common.h"
+#include "msd-display-metrics.h"
 
 #define MOUSE_SCHEMA          "org.mate.peripherals-mouse"
 #define INTERFACE_SCHEMA      "org.mate.interface"
@@ -60,28 +61,10 @@
 #define FONT_RGBA_ORDER_KEY   "rgba-order"
 #define FONT_DPI_KEY          "dpi"
 
-/* X servers sometimes lie about the screen's physical dimensions, so we cannot
- * compute an accurate DPI value.  When this happens, the user gets fonts that
- * are too huge or too tiny.  So, we see what the server returns:  if it reports
- * something outside of the range [DPI_LOW_REASONABLE_VALUE,
- * DPI_HIGH_REASONABLE_VALUE], then we assume that it is lying and we use
- * DPI_FALLBACK instead.
- *
- * See get_dpi_from_gsettings_or_server() below, and also
- * https://bugzilla.novell.com/show_bug.cgi?id=217790
- */
-#define DPI_FALLBACK 96
+/* Range the final (scaled) DPI is clamped to */
 #define DPI_LOW_REASONABLE_VALUE 50
 #define DPI_HIGH_REASONABLE_VALUE 500
 
-/* The minimum resolution at which we turn on a window-scale of 2 */
-#define HIDPI_LIMIT (DPI_FALLBACK * 2)
-
-/* The minimum screen height at which we turn on a window-scale of 2;
- * below this there just isn't enough vertical real estate for GNOME
- * apps to work, and it's better to just be tiny */
-#define HIDPI_MIN_HEIGHT 1500
-
 typedef struct _TranslationEntry TranslationEntry;
 typedef void (* TranslationFunc) (MateXSettingsManager  *manager,
                                   TranslationEntry      *trans,
@@ -102,6 +85,7 @@ struct MateXSettingsManagerPrivate
         GSettings *gsettings_font;
         fontconfig_monitor_handle_t *fontconfig_handle;
         gint window_scale;
+        guint metrics_watch;
 };
 
 #define MSD_XSETTINGS_ERROR msd_xsettings_error_quark ()
@@ -223,53 +207,6 @@ translate_bool_int },
         { SOUND_SCHEMA, "input-feedback-sounds",      "Net/EnableInputFeedbackSounds", translate_bool_int }
 };
 
-/* Auto-detect the most appropriate scale factor for the primary monitor.
- * A lot of this code is shamelessly copied and adapted from Linux Mint/Cinnamon.
- */
-static int
-get_window_scale_auto (void)
-{
-        GdkDisplay   *display;
-        GdkMonitor   *monitor;
-        GdkRectangle  rect;
-        int width_mm, height_mm;
-        int monitor_scale, window_scale;
-
-        display = gdk_display_get_default ();
-        monitor = gdk_display_get_primary_monitor (display);
-
-        /* Use current value as the default */
-        window_scale = 1;
-
-        gdk_monitor_get_geometry (monitor, &rect);
-        width_mm = gdk_monitor_get_width_mm (monitor);
-        height_mm = gdk_monitor_get_height_mm (monitor);
-        monitor_scale = gdk_monitor_get_scale_factor (monitor);
-
-        if (rect.height * monitor_scale < HIDPI_MIN_HEIGHT)
-                return 1;
-
-        /* Some monitors/TV encode the aspect ratio (16/9 or 16/10) instead of the physical size */
-        if ((width_mm == 160 && height_mm == 90) ||
-            (width_mm == 160 && height_mm == 100) ||
-            (width_mm == 16 && height_mm == 9) ||
-            (width_mm == 16 && height_mm == 10))
-                return 1;
-
-        if (width_mm > 0 && height_mm > 0) {
-                double dpi_x, dpi_y;
-
-                dpi_x = (double)rect.width * monitor_scale / (width_mm / 25.4);
-                dpi_y = (double)rect.height * monitor_scale / (height_mm / 25.4);
-                /* We don't completely trust these values so both must be high, and never pick
-                 * higher ratio than 2 automatically */
-                if (dpi_x > HIDPI_LIMIT && dpi_y > HIDPI_LIMIT)
-                        window_scale = 2;
-        }
-
-        return window_scale;
-}
-
 static int
 get_window_scale (MateXSettingsManager *manager)
 {
@@ -282,55 +219,11 @@ get_window_scale (MateXSettingsManager *manager)
 
         /* Auto-detect */
         if (scale == 0)
-                scale = get_window_scale_auto ();
+                scale = msd_display_metrics_get_auto_window_scale ();
 
         return scale;
 }
 
-static double
-dpi_from_pixels_and_mm (int pixels,
-                        int mm)
-{
-        double dpi;
-
-        if (mm >= 1)
-                dpi = pixels / (mm / 25.4);
-        else
-                dpi = 0;
-
-        return dpi;
-}
-
-static double
-get_dpi_from_x_server (void)
-{
-        GdkScreen *screen;
-        double     dpi;
-
-        screen = gdk_screen_get_default ();
-        if (screen != NULL) {
-                double width_dpi, height_dpi;
-
-                Screen *xscreen = gdk_x11_screen_get_xscreen (screen);
-
-                width_dpi = dpi_from_pixels_and_mm (WidthOfScreen (xscreen), WidthMMOfScreen (xscreen));
-                height_dpi = dpi_from_pixels_and_mm (HeightOfScreen (xscreen), HeightMMOfScreen (xscreen));
-
-                if (width_dpi < DPI_LOW_REASONABLE_VALUE || width_dpi > DPI_HIGH_REASONABLE_VALUE
-                    || height_dpi < DPI_LOW_REASONABLE_VALUE || height_dpi > DPI_HIGH_REASONABLE_VALUE) {
-                        dpi = DPI_FALLBACK;
-                } else {
-                        dpi = (width_dpi + height_dpi) / 2.0;
-                }
-        } else {
-                /* Huh!?  No screen? */
-
-                dpi = DPI_FALLBACK;
-        }
-
-        return dpi;
-}
-
 static double
 get_dpi_from_gsettings_or_x_server (GSettings *gsettings, gint scale)
 {
@@ -345,7 +238,7 @@ get_dpi_from_gsettings_or_x_server (GSettings *gsettings, gint scale)
          */
 
         if (dpi == 0)
-                dpi = get_dpi_from_x_server ();
+                dpi = msd_display_metrics_get_x_dpi ();
 
         dpi *= (double)scale;
         dpi = CLAMP(dpi, DPI_LOW_REASONABLE_VALUE, DPI_HIGH_REASONABLE_VALUE);
@@ -704,8 +597,7 @@ update_xft_settings (MateXSettingsManager *manager)
 }
 
 static void
-recalculate_scale_callback (GdkScreen            *screen G_GNUC_UNUSED,
-                            MateXSettingsManager *manager)
+recalculate_scale_callback (MateXSettingsManager *manager)
 {
         int i;
         int new_scale = get_window_scale (manager);
@@ -791,25 +683,74 @@ process_value (MateXSettingsManager *manager,
         (* trans->translate) (manager, trans, value);
 }
 
-static TranslationEntry *
-find_translation_entry (GSettings *gsettings, const char *key)
+/* Change notifications are looked up by (schema, key) quark pair.  The
+ * schema quark is attached to each GSettings when it is created, so a
+ * lookup neither copies the schema name nor scans the table. */
+static GHashTable *translation_index = NULL;
+
+static GQuark
+schema_quark_key (void)
+{
+        return g_quark_from_static_string ("msd-xsettings-schema");
+}
+
+static gint64
+translation_index_key (GQuark schema,
+                       GQuark key)
+{
+        return ((gint64) schema << 32) | (gint64) key;
+}
+
+static void
+translation_index_init (void)
 {
         guint i;
-        char *schema;
 
-        g_object_get (gsettings, "schema", &schema, NULL);
+        if (translation_index != NULL)
+                return;
+
+        translation_index = g_hash_table_new_full (g_int64_hash, g_int64_equal, g_free, NULL);
 
         for (i = 0; i < G_N_ELEMENTS (translations); i++) {
-                if (g_str_equal (schema, translations[i].gsettings_schema) &&
-                    g_str_equal (key, translations[i].gsettings_key)) {
-                            g_free (schema);
-                        return &translations[i];
-                }
+                gint64 *key = g_new (gint64, 1);
+
+                *key = translation_index_key (g_quark_from_static_string (translations[i].gsettings_schema),
+                                              g_quark_from_static_string (translations[i].gsettings_key));
+                g_hash_table_insert (translation_index, key, &translations[i]);
         }
+}
+
+static TranslationEntry *
+find_translation_entry (GSettings *gsettings, const char *key)
+{
+        GQuark schema;
+        GQuark key_quark;
+        gint64 index_key;
+
+        schema = GPOINTER_TO_UINT (g_object_get_qdata (G_OBJECT (gsettings), schema_quark_key ()));
 
-        g_free (schema);
+        /* Keys that were never interned cannot be in the table */
+        key_quark = g_quark_try_string (key);
+        if (schema == 0 || key_quark == 0)
+                return NULL;
 
-        return NULL;
+        index_key = translation_index_key (schema, key_quark);
+
+        return g_hash_table_lookup (translation_index, &index_key);
+}
+
+static GSettings *
+xsettings_settings_new (MateXSettingsManager *manager,
+                        const char           *schema)
+{
+        GSettings *gsettings;
+
+        gsettings = g_settings_new (schema);
+        g_object_set_qdata (G_OBJECT (gsettings), schema_quark_key (),
+                            GUINT_TO_POINTER (g_quark_from_static_string (schema)));
+        g_hash_table_insert (manager->priv->gsettings, (gpointer) schema, gsettings);
+
+        return gsettings;
 }
 
 static void
@@ -906,7 +847,6 @@ mate_xsettings_manager_start (MateXSettingsManager *manager,
 {
         guint        i;
         GList       *list, *l;
-        GdkScreen   *screen;
 
         g_debug ("Starting xsettings manager");
         mate_settings_profile_start (NULL);
@@ -921,12 +861,9 @@ mate_xsettings_manager_start (MateXSettingsManager *manager,
         manager->priv->gsettings = g_hash_table_new_full (g_str_hash, g_str_equal,
                                                          NULL, (GDestroyNotify) g_object_unref);
 
-        g_hash_table_insert (manager->priv->gsettings,
-                             MOUSE_SCHEMA, g_settings_new (MOUSE_SCHEMA));
-        g_hash_table_insert (manager->priv->gsettings,
-                             INTERFACE_SCHEMA, g_settings_new (INTERFACE_SCHEMA));
-        g_hash_table_insert (manager->priv->gsettings,
-                             SOUND_SCHEMA, g_settings_new (SOUND_SCHEMA));
+        xsettings_settings_new (manager, MOUSE_SCHEMA);
+        xsettings_settings_new (manager, INTERFACE_SCHEMA);
+        xsettings_settings_new (manager, SOUND_SCHEMA);
 
         list = g_hash_table_get_values (manager->priv->gsettings);
         for (l = list; l != NULL; l = l->next) {
@@ -955,9 +892,8 @@ mate_xsettings_manager_start (MateXSettingsManager *manager,
         }
 
         /* Detect changes in screen resolution */
-        screen = gdk_screen_get_default();
-        g_signal_connect(screen, "size-changed", G_CALLBACK (recalculate_scale_callback), manager);
-        g_signal_connect(screen, "monitors-changed", G_CALLBACK (recalculate_scale_callback), manager);
+        manager->priv->metrics_watch = msd_display_metrics_add_watch ((MsdDisplayMetricsFunc) recalculate_scale_callback,
+                                                                      manager);
 
         manager->priv->gsettings_font = g_settings_new (FONT_RENDER_SCHEMA);
         g_signal_connect (manager->priv->gsettings_font, "changed", G_CALLBACK (xft_callback), manager);
@@ -987,6 +923,9 @@ mate_xsettings_manager_stop (MateXSettingsManager *manager)
 
         g_debug ("Stopping xsettings manager");
 
+        msd_display_metrics_remove_watch (p->metrics_watch);
+        p->metrics_watch = 0;
+
         if (p->managers != NULL) {
                 for (i = 0; p->managers [i]; ++i)
                         xsettings_manager_destroy (p->managers [i]);
@@ -1015,6 +954,8 @@ mate_xsettings_manager_class_init (MateXSettingsManagerClass *klass)
         GObjectClass *object_class = G_OBJECT_CLASS (klass);
 
         object_class->finalize = mate_xsettings_manager_finalize;
+
+        translation_index_init ();
 }
 
 static void